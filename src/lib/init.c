@@ -42,22 +42,53 @@ struct {
     const char *family;
     const char *model;
     const tag_create_function tag_constructor;
+    const tag_prewarm_function tag_prewarm;
 } tag_type_map[] = {
     /* System tags */
-    {NULL, "system", "library", NULL, system_tag_create},
+    {NULL, "system", "library", NULL, system_tag_create, NULL},
     /* Allen-Bradley PLCs */
-    {"ab-eip", NULL, NULL, NULL, ab_tag_create},
-    {"ab_eip", NULL, NULL, NULL, ab_tag_create}
+    {"ab-eip", NULL, NULL, NULL, ab_tag_create, ab_prewarm},
+    {"ab_eip", NULL, NULL, NULL, ab_tag_create, ab_prewarm}
 };
 
 static lock_t library_initialization_lock = LOCK_INIT;
 static volatile int library_initialized = 0;
 
+static int find_tag_type(attr attributes);
+
 
 /*
  * find_tag_create_func()
  *
- * Find an appropriate tag creation function.  This scans through the array
+ * Find an appropriate tag creation function.
+ */
+
+tag_create_function find_tag_create_func(attr attributes)
+{
+    int i = find_tag_type(attributes);
+
+    return (i < 0 ? NULL : tag_type_map[i].tag_constructor);
+}
+
+
+/*
+ * find_tag_prewarm_func()
+ *
+ * Find the function that opens connections ahead of tag creation.
+ */
+
+tag_prewarm_function find_tag_prewarm_func(attr attributes)
+{
+    int i = find_tag_type(attributes);
+
+    return (i < 0 ? NULL : tag_type_map[i].tag_prewarm);
+}
+
+
+/*
+ * find_tag_type()
+ *
+ * Find the entry for the tag type in the table above.  This scans through the array
  * above to find a matching tag creation type.  The first match is returned.
  * A passed set of options will match when all non-null entries in the list
  * match.  This means that matches must be ordered from most to least general.
@@ -66,7 +97,7 @@ static volatile int library_initialized = 0;
  * model will be used.
  */
 
-tag_create_function find_tag_create_func(attr attributes)
+int find_tag_type(attr attributes)
 {
     int i = 0;
     const char *protocol = attr_get_str(attributes, "protocol", NULL);
@@ -80,7 +111,7 @@ tag_create_function find_tag_create_func(attr attributes)
         for(i=0; i < num_entries; i++) {
             if(tag_type_map[i].protocol && str_cmp(tag_type_map[i].protocol, protocol) == 0) {
                 pdebug(DEBUG_INFO,"Matched protocol=%s", protocol);
-                return tag_type_map[i].tag_constructor;
+                return i;
             }
         }
     } else {
@@ -94,25 +125,25 @@ tag_create_function find_tag_create_func(attr attributes)
                         if(tag_type_map[i].model) {
                             if(model && str_cmp_i(tag_type_map[i].model, model) == 0) {
                                 pdebug(DEBUG_INFO, "Matched make=%s family=%s model=%s", make, family, model);
-                                return tag_type_map[i].tag_constructor;
+                                return i;
                             }
                         } else {
                             /* matches until a NULL */
                             pdebug(DEBUG_INFO, "Matched make=%s family=%s model=NULL", make, family);
-                            return tag_type_map[i].tag_constructor;
+                            return i;
                         }
                     }
                 } else {
                     /* matched until a NULL, so we matched */
                     pdebug(DEBUG_INFO, "Matched make=%s family=NULL model=NULL", make);
-                    return tag_type_map[i].tag_constructor;
+                    return i;
                 }
             }
         }
     }
 
     /* no match */
-    return NULL;
+    return -1;
 }
 
 
@@ -125,9 +156,13 @@ tag_create_function find_tag_create_func(attr attributes)
 
 void destroy_modules(void)
 {
-    ab_teardown();
-
+    /*
+     * stop the tickler first.  It can hold the last reference to a tag
+     * and would otherwise destroy it after its session is gone.
+     */
     lib_teardown();
+
+    ab_teardown();
 }
 
 
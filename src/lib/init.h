@@ -29,4 +29,7 @@ extern int initialize_modules(void);
 typedef plc_tag_p (*tag_create_function)(attr attributes);
 extern tag_create_function find_tag_create_func(attr attributes);
 
+typedef int (*tag_prewarm_function)(attr attributes, int timeout);
+extern tag_prewarm_function find_tag_prewarm_func(attr attributes);
+
 #endif
@@ -70,6 +70,7 @@ static thread_p tag_tickler_thread = NULL;
 static plc_tag_p lookup_tag(int32_t id);
 static int add_tag_lookup(plc_tag_p tag);
 static int tag_id_inc(int id);
+static void tag_destroy(void *tag_arg);
 static THREAD_FUNC(tag_tickler_func);
 //static int to_tag_index(int id);
 
@@ -297,6 +298,10 @@ LIB_EXPORT const char *plc_tag_decode_error(int rc)
         return "PLCTAG_ERR_WRITE";
     case PLCTAG_ERR_PARTIAL:
         return "PLCTAG_ERR_PARTIAL";
+    case PLCTAG_ERR_BACKOFF:
+        return "PLCTAG_ERR_BACKOFF";
+    case PLCTAG_ERR_QUEUE_FULL:
+        return "PLCTAG_ERR_QUEUE_FULL";
 
     default:
         return "Unknown error.";
@@ -386,6 +391,13 @@ LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
         return PLCTAG_ERR_CREATE;
     }
 
+    rc = cond_create(&(tag->tag_cond_wait));
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN,"Unable to create tag condition variable!");
+        rc_dec(tag);
+        return PLCTAG_ERR_CREATE;
+    }
+
     /* set up the read cache config. */
     read_cache_ms = attr_get_int(attribs,"read_cache_ms",0);
     if(read_cache_ms < 0) {
@@ -433,7 +445,12 @@ LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
                 break;
             }
 
-            sleep_ms(1); /* MAGIC */
+            /*
+             * the tag is not mapped yet so nothing can wake it by ID.
+             * Creation is driven by the tickler calls in this loop, so
+             * only wait a short time.
+             */
+            cond_wait(tag->tag_cond_wait, 1); /* MAGIC */
         }
 
         /*
@@ -482,6 +499,65 @@ LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout)
 
 
 
+/*
+ * plc_tag_prewarm
+ *
+ * Start connecting to a PLC ahead of tag creation.  The protocol does
+ * the work, including any waiting.
+ */
+
+LIB_EXPORT int plc_tag_prewarm(const char *attrib_str, int timeout)
+{
+    attr attribs = NULL;
+    int rc = PLCTAG_STATUS_OK;
+    tag_prewarm_function prewarm;
+
+    pdebug(DEBUG_INFO,"Starting");
+
+    if((rc = initialize_modules()) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR,"Unable to initialize the internal library state!");
+        return rc;
+    }
+
+    if(!attrib_str || str_length(attrib_str) == 0) {
+        pdebug(DEBUG_WARN,"Attribute string is null or zero length!");
+        return PLCTAG_ERR_TOO_SMALL;
+    }
+
+    if(timeout < 0) {
+        pdebug(DEBUG_WARN,"Timeout must not be negative!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    attribs = attr_create_from_str(attrib_str);
+    if(!attribs) {
+        pdebug(DEBUG_WARN,"Unable to parse attribute string!");
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    /* set debug level */
+    set_debug_level(attr_get_int(attribs, "debug", DEBUG_NONE));
+
+    prewarm = find_tag_prewarm_func(attribs);
+
+    if(!prewarm) {
+        pdebug(DEBUG_WARN,"Protocol does not support opening connections ahead of tags!");
+        attr_destroy(attribs);
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    rc = prewarm(attribs, timeout);
+
+    attr_destroy(attribs);
+
+    pdebug(DEBUG_INFO,"Done.");
+
+    return rc;
+}
+
+
+
+
 /*
  * plc_tag_lock
  *
@@ -674,11 +750,21 @@ LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
             break;
         }
 
-        /* the protocol implementation does not do the timeout. */
+        /*
+         * the protocol implementation does not do the timeout, but it can
+         * drop requests that are still queued when nobody waits any more.
+         */
+        tag->op_deadline = (timeout ? time_ms() + timeout : 0);
         rc = tag->vtable->read(tag);
 
+        /* a blocking caller waits for room in a full queue, holding only this tag's mutex. */
+        while(rc == PLCTAG_ERR_QUEUE_FULL && timeout && tag->vtable->wait_for_room && tag->vtable->wait_for_room(tag) == PLCTAG_STATUS_OK) {
+            rc = tag->vtable->read(tag);
+        }
+
         /* if error, return now */
         if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+            tag->op_deadline = 0;
             break;
         }
 
@@ -709,7 +795,23 @@ LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
                     break;
                 }
 
-                sleep_ms(1); /* MAGIC */
+                /* the next piece of the operation may be waiting for room in the queue. */
+                if(tag->vtable->wait_for_room) {
+                    rc = tag->vtable->wait_for_room(tag);
+
+                    if(rc == PLCTAG_STATUS_OK) {
+                        /* go around to queue it. */
+                        rc = PLCTAG_STATUS_PENDING;
+                        continue;
+                    }
+
+                    if(rc != PLCTAG_STATUS_PENDING) {
+                        break;
+                    }
+                }
+
+                /* sleep until the protocol signals progress or we time out. */
+                cond_wait(tag->tag_cond_wait, (int)(timeout_time - time_ms()));
             }
 
             /*
@@ -733,6 +835,9 @@ LIB_EXPORT int plc_tag_read(int32_t id, int timeout)
 
             pdebug(DEBUG_INFO,"elapsed time %ldms",(time_ms()-start_time));
         }
+
+        /* nobody waits for the rest of the operation, if any. */
+        tag->op_deadline = 0;
     } /* end of api mutex block */
 
     rc_dec(tag);
@@ -813,12 +918,22 @@ LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
     }
 
     critical_block(tag->api_mutex) {
-        /* the protocol implementation does not do the timeout. */
+        /*
+         * the protocol implementation does not do the timeout, but it can
+         * drop requests that are still queued when nobody waits any more.
+         */
+        tag->op_deadline = (timeout ? time_ms() + timeout : 0);
         rc = tag->vtable->write(tag);
 
+        /* a blocking caller waits for room in a full queue, holding only this tag's mutex. */
+        while(rc == PLCTAG_ERR_QUEUE_FULL && timeout && tag->vtable->wait_for_room && tag->vtable->wait_for_room(tag) == PLCTAG_STATUS_OK) {
+            rc = tag->vtable->write(tag);
+        }
+
         /* if error, return now */
         if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
             pdebug(DEBUG_WARN,"Response from write command is not OK!");
+            tag->op_deadline = 0;
             break;
         }
 
@@ -846,7 +961,23 @@ LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
                     break;
                 }
 
-                sleep_ms(1); /* MAGIC */
+                /* the next piece of the operation may be waiting for room in the queue. */
+                if(tag->vtable->wait_for_room) {
+                    rc = tag->vtable->wait_for_room(tag);
+
+                    if(rc == PLCTAG_STATUS_OK) {
+                        /* go around to queue it. */
+                        rc = PLCTAG_STATUS_PENDING;
+                        continue;
+                    }
+
+                    if(rc != PLCTAG_STATUS_PENDING) {
+                        break;
+                    }
+                }
+
+                /* sleep until the protocol signals progress or we time out. */
+                cond_wait(tag->tag_cond_wait, (int)(timeout_time - time_ms()));
             }
 
             /*
@@ -870,6 +1001,9 @@ LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
 
             pdebug(DEBUG_INFO,"elapsed time %lldms",(time_ms()-start_time));
         }
+
+        /* nobody waits for the rest of the operation, if any. */
+        tag->op_deadline = 0;
     } /* end of api mutex block */
 
     rc_dec(tag);
@@ -883,6 +1017,44 @@ LIB_EXPORT int plc_tag_write(int32_t id, int timeout)
 
 
 
+/*
+ * plc_tag_get_queue_depth()
+ *
+ * Return how many requests are waiting to be sent on the tag's
+ * connections.  This does not take the API mutex so that it can be
+ * called while another thread waits in a read or write on the tag.
+ */
+
+LIB_EXPORT int plc_tag_get_queue_depth(int32_t id)
+{
+    int rc = PLCTAG_STATUS_OK;
+    plc_tag_p tag = lookup_tag(id);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!tag) {
+        pdebug(DEBUG_WARN,"Tag not found.");
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    if(tag->vtable->queue_depth) {
+        rc = tag->vtable->queue_depth(tag);
+    } else {
+        pdebug(DEBUG_DETAIL, "Tag type does not queue requests.");
+        rc = PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    rc_dec(tag);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+
+
+
 /*
  * Tag data accessors.
  */
@@ -1763,6 +1935,57 @@ LIB_EXPORT int plc_tag_set_float32(int32_t id, int offset, float fval)
  ****************************************************************************************************/
 
 
+
+/*
+ * plc_tag_alloc
+ *
+ * Protocols allocate their tags here.  When the last reference goes away,
+ * the protocol's destroy function is called first and then the library
+ * releases what plc_tag_create() set up.
+ */
+
+plc_tag_p plc_tag_alloc(int size, tag_destroy_func destroy)
+{
+    plc_tag_p tag = (plc_tag_p)rc_alloc(size, tag_destroy);
+
+    if(tag) {
+        tag->destroy = destroy;
+    }
+
+    return tag;
+}
+
+
+
+void tag_destroy(void *tag_arg)
+{
+    plc_tag_p tag = (plc_tag_p)tag_arg;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(tag->destroy) {
+        tag->destroy(tag);
+    }
+
+    if(tag->ext_mutex) {
+        mutex_destroy(&(tag->ext_mutex));
+        tag->ext_mutex = NULL;
+    }
+
+    if(tag->api_mutex) {
+        mutex_destroy(&(tag->api_mutex));
+        tag->api_mutex = NULL;
+    }
+
+    if(tag->tag_cond_wait) {
+        cond_destroy(&(tag->tag_cond_wait));
+        tag->tag_cond_wait = NULL;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+}
+
+
 plc_tag_p lookup_tag(int32_t tag_id)
 {
     plc_tag_p tag = NULL;
@@ -1791,6 +2014,39 @@ plc_tag_p lookup_tag(int32_t tag_id)
 
 
 
+/*
+ * plc_tag_wake
+ *
+ * Wake up any thread blocked waiting on the tag with the passed ID.  This
+ * is called by protocol implementations from their I/O threads when some
+ * part of an operation completes.  The tag lookup mutex is held while
+ * signalling so the tag cannot be destroyed underneath us.
+ *
+ * Unlike lookup_tag() a missing tag is not an error here.  The tag may have
+ * been destroyed while its request was still in flight.
+ */
+
+int plc_tag_wake(int32_t tag_id)
+{
+    int rc = PLCTAG_ERR_NOT_FOUND;
+
+    if(tag_id <= 0) {
+        return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    critical_block(tag_lookup_mutex) {
+        plc_tag_p tag = hashtable_get(tags, (int64_t)tag_id);
+
+        if(tag && tag->tag_id == tag_id && tag->tag_cond_wait) {
+            rc = cond_signal(tag->tag_cond_wait);
+        }
+    }
+
+    return rc;
+}
+
+
+
 int tag_id_inc(int id)
 {
     if(id <= 0) {
@@ -109,6 +109,8 @@ extern "C" {
     #define PLCTAG_ERR_WINSOCK          (-36)
     #define PLCTAG_ERR_WRITE            (-37)
     #define PLCTAG_ERR_PARTIAL          (-38)
+    #define PLCTAG_ERR_BACKOFF          (-39)
+    #define PLCTAG_ERR_QUEUE_FULL       (-40)
 
 
 
@@ -156,6 +158,24 @@ extern "C" {
     LIB_EXPORT int32_t plc_tag_create(const char *attrib_str, int timeout);
 
 
+    /*
+     * plc_tag_prewarm
+     *
+     * Open the connection to a PLC before any tags are created for it.  The
+     * attributes are the same as for a tag, less the tag name and data details:
+     * protocol, gateway, path, cpu and any connection options.  Tags created
+     * later with the same gateway and path use the connection that is already
+     * up.  The connection is kept until the library shuts down.
+     *
+     * If timeout is zero, return PLCTAG_STATUS_PENDING right away.  Calling this
+     * for each PLC with a zero timeout connects to all of them in parallel.
+     * Otherwise wait up to timeout milliseconds for the connection.  On timeout
+     * the connection attempts keep going.
+     */
+
+    LIB_EXPORT int plc_tag_prewarm(const char *attrib_str, int timeout);
+
+
     /*
      * plc_tag_lock
      *
@@ -265,6 +285,26 @@ extern "C" {
 
 
 
+    /*
+     * plc_tag_get_queue_depth
+     *
+     * Return the number of requests waiting to be sent on the connections
+     * the tag uses, counting the requests of all tags that share them.
+     * This can be used to slow down polling before the queues fill.  It
+     * does not wait for operations in progress on the tag.
+     *
+     * The queues can be limited with the max_queued_requests attribute.
+     * When a queue is full, the queue_full attribute says what happens to
+     * new requests: reject (the default) fails them with
+     * PLCTAG_ERR_QUEUE_FULL, coalesce only lets in reads that are the
+     * same as one already queued, and block waits for room until the
+     * read or write times out.
+     */
+    LIB_EXPORT int plc_tag_get_queue_depth(int32_t tag);
+
+
+
+
     /*
      * Tag data accessors.
      */
@@ -54,6 +54,9 @@ typedef struct plc_tag_t *plc_tag_p;
 
 typedef int (*tag_vtable_func)(plc_tag_p tag);
 
+/* releases what the protocol set up, the library releases the rest. */
+typedef void (*tag_destroy_func)(plc_tag_p tag);
+
 /* we'll need to set these per protocol type. */
 struct tag_vtable_t {
     tag_vtable_func abort;
@@ -61,6 +64,8 @@ struct tag_vtable_t {
     tag_vtable_func status;
     tag_vtable_func tickler;
     tag_vtable_func write;
+    tag_vtable_func queue_depth;
+    tag_vtable_func wait_for_room;
 };
 
 typedef struct tag_vtable_t *tag_vtable_p;
@@ -71,16 +76,25 @@ typedef struct tag_vtable_t *tag_vtable_p;
  * by the protocol-specific implementations.
  *
  * The base type only has a vtable for operations.
+ *
+ * op_deadline is the time in milliseconds when the caller of the current
+ * read or write stops waiting for it, zero if it is not waiting.
+ *
+ * Tags are allocated with plc_tag_alloc().  The mutexes and the condition
+ * variable are created by the library and released by it after destroy.
  */
 
 #define TAG_BASE_STRUCT tag_vtable_p vtable; \
+                        tag_destroy_func destroy; \
                         mutex_p ext_mutex; \
                         mutex_p api_mutex; \
+                        cond_p tag_cond_wait; \
                         int status; \
                         int endian; \
                         int tag_id; \
                         int64_t read_cache_expire; \
                         int64_t read_cache_ms; \
+                        int64_t op_deadline; \
                         int size; \
                         uint8_t *data
 
@@ -96,11 +110,13 @@ struct plc_tag_t {
 
 
 /* the following may need to be used where the tag is already mapped or is not yet mapped */
+extern plc_tag_p plc_tag_alloc(int size, tag_destroy_func destroy);
 extern int lib_init(void);
 extern void lib_teardown(void);
 extern int plc_tag_abort_mapped(plc_tag_p tag);
 extern int plc_tag_destroy_mapped(plc_tag_p tag);
 extern int plc_tag_status_mapped(plc_tag_p tag);
+extern int plc_tag_wake(int32_t tag_id);
 
 
 
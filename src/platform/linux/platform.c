@@ -41,10 +41,15 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <time.h>
 
 #include <lib/libplctag.h>
@@ -58,6 +63,9 @@
 
 
 
+/* count of heap allocations, used to check that hot paths do not allocate. */
+static volatile uint32_t mem_alloc_counter = 0;
+
 /*
  * mem_alloc
  *
@@ -70,6 +78,8 @@ extern void *mem_alloc(int size)
 {
     void *res = calloc((size_t)size, 1);
 
+    __sync_fetch_and_add(&mem_alloc_counter, 1);
+
     return res;
 }
 
@@ -84,11 +94,26 @@ extern void *mem_alloc(int size)
  */
 extern void *mem_realloc(void *orig, int size)
 {
+    __sync_fetch_and_add(&mem_alloc_counter, 1);
+
     return realloc(orig, (size_t)size);
 }
 
 
 
+/*
+ * mem_alloc_count
+ *
+ * Returns the number of allocations and reallocations done so far.  The
+ * count wraps.
+ */
+extern uint32_t mem_alloc_count(void)
+{
+    return (uint32_t)mem_alloc_counter;
+}
+
+
+
 /*
  * mem_free
  *
@@ -546,6 +571,162 @@ int mutex_destroy(mutex_p *m)
 
 
 
+/***************************************************************************
+ ***************************** Conditions **********************************
+ **************************************************************************/
+
+/*
+ * A cond is an auto-reset event.  A signal that arrives when nobody is
+ * waiting is remembered and consumed by the next wait, so a waiter that
+ * checks status and then waits cannot miss a wake up.
+ */
+
+struct cond_t {
+    pthread_mutex_t p_mutex;
+    pthread_cond_t p_cond;
+    int signalled;
+};
+
+int cond_create(cond_p *c)
+{
+    pthread_condattr_t attr;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null cond pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *c = (struct cond_t *)mem_alloc(sizeof(struct cond_t));
+
+    if(! *c) {
+        pdebug(DEBUG_ERROR,"Unable to allocate cond.");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    if(pthread_mutex_init(&((*c)->p_mutex),NULL)) {
+        mem_free(*c);
+        *c = NULL;
+        pdebug(DEBUG_ERROR,"Error initializing cond mutex.");
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    /* use the monotonic clock so that wall clock changes do not affect timeouts. */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    if(pthread_cond_init(&((*c)->p_cond), &attr)) {
+        pthread_condattr_destroy(&attr);
+        pthread_mutex_destroy(&((*c)->p_mutex));
+        mem_free(*c);
+        *c = NULL;
+        pdebug(DEBUG_ERROR,"Error initializing cond.");
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    pthread_condattr_destroy(&attr);
+
+    (*c)->signalled = 0;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * Wait until the cond is signalled or timeout_ms passes.  Returns
+ * PLCTAG_STATUS_OK if signalled and PLCTAG_ERR_TIMEOUT otherwise.
+ */
+int cond_wait(cond_p c, int timeout_ms)
+{
+    struct timespec deadline;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!c) {
+        pdebug(DEBUG_WARN, "null cond pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&(c->p_mutex));
+
+    while(!c->signalled) {
+        int err = pthread_cond_timedwait(&(c->p_cond), &(c->p_mutex), &deadline);
+
+        if(err == ETIMEDOUT) {
+            break;
+        } else if(err && err != EINTR) {
+            pdebug(DEBUG_WARN, "Error %d waiting on cond.", err);
+            break;
+        }
+    }
+
+    if(c->signalled) {
+        c->signalled = 0;
+    } else {
+        rc = PLCTAG_ERR_TIMEOUT;
+    }
+
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    return rc;
+}
+
+
+int cond_signal(cond_p c)
+{
+    if(!c) {
+        pdebug(DEBUG_WARN, "null cond pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_mutex_lock(&(c->p_mutex));
+    c->signalled = 1;
+    pthread_cond_signal(&(c->p_cond));
+    pthread_mutex_unlock(&(c->p_mutex));
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_destroy(cond_p *c)
+{
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!c || !*c) {
+        pdebug(DEBUG_WARN, "null cond pointer.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    pthread_cond_destroy(&((*c)->p_cond));
+    pthread_mutex_destroy(&((*c)->p_mutex));
+
+    mem_free(*c);
+
+    *c = NULL;
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
 
 
 
@@ -744,14 +925,86 @@ extern void lock_release(lock_t *lock)
  ******************************* Sockets ***********************************
  **************************************************************************/
 
+#define MAX_IPS (8)
+#define SOCKET_CONNECT_TIMEOUT_MS (10000)
+
+/*
+ * TCP keepalive probing of idle connections.  A peer that went away
+ * without closing the connection is found in about 16 seconds instead
+ * of the system default of more than two hours.
+ */
+#define SOCKET_KEEPALIVE_IDLE_S (10)
+#define SOCKET_KEEPALIVE_INTERVAL_S (2)
+#define SOCKET_KEEPALIVE_COUNT (3)
+
+/*
+ * when a host has more than one address, the next one is tried if the
+ * attempts already started have not finished within this time.  Those
+ * are kept going and whichever connects first is used.
+ */
+#define SOCKET_CONNECT_STAGGER_MS (250)
+
+/* resolved host names are remembered for this long. */
+#define ADDR_CACHE_SIZE (32)
+#define ADDR_CACHE_MAX_HOST (256)
+#define ADDR_CACHE_TTL_MS (300000)
+
 struct sock_t {
     int fd;
     int port;
     int is_open;
+
+    /* the host and addresses to try while connecting. */
+    char *host;
+    struct in_addr ips[MAX_IPS];
+    int num_ips;
+    int next_ip;
+
+    /*
+     * connection attempts in progress.  The oldest one is also in fd
+     * so that it looks like any other socket to the poller.
+     */
+    struct {
+        int fd;
+        int ip_index;
+        int polled;
+    } attempts[MAX_IPS];
+    int num_attempts;
+    int64_t next_attempt_time;
+
+    /* what the poller has been told about this socket. */
+    int poll_fd;
+    int poll_events;
 };
 
 
-#define MAX_IPS (8)
+struct socket_poller_t {
+    int epoll_fd;
+    int wake_fd;
+};
+
+
+/* host name lookups shared by all sockets in the process. */
+struct addr_cache_entry_t {
+    char host[ADDR_CACHE_MAX_HOST];
+    struct in_addr ips[MAX_IPS];
+    int num_ips;
+    int64_t expire_time;
+};
+
+static lock_t addr_cache_lock = LOCK_INIT;
+static struct addr_cache_entry_t addr_cache[ADDR_CACHE_SIZE];
+
+
+static int addr_cache_lookup(const char *host, struct in_addr *ips);
+static void addr_cache_store(const char *host, struct in_addr *ips, int num_ips);
+static void addr_cache_forget(const char *host);
+static void addr_cache_prefer(const char *host, struct in_addr ip);
+static int socket_open_fd(void);
+static int socket_connect_next_ip(sock_p s);
+static void socket_connect_drop_attempt(sock_p s, int index);
+static void socket_connect_use_attempt(sock_p s, int index);
+
 
 extern int socket_create(sock_p *s)
 {
@@ -769,198 +1022,633 @@ extern int socket_create(sock_p *s)
         return PLCTAG_ERR_NO_MEM;
     }
 
+    (*s)->fd = -1;
+    (*s)->poll_fd = -1;
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
 }
 
 
+/*
+ * socket_connect_tcp
+ *
+ * Connect to the host and wait until the connection is up or
+ * has failed.
+ */
 extern int socket_connect_tcp(sock_p s, const char *host, int port)
 {
-    struct in_addr ips[MAX_IPS];
-    int num_ips = 0;
-    struct sockaddr_in gw_addr;
-    int sock_opt = 1;
-    int i = 0;
-    int done = 0;
-    int fd;
-    int flags;
-    struct timeval timeout; /* used for timing out connections etc. */
-    struct linger so_linger; /* used to set up short/no lingering after connections are close()ed. */
+    int rc = PLCTAG_STATUS_OK;
+    int64_t timeout_time = time_ms() + SOCKET_CONNECT_TIMEOUT_MS;
 
     pdebug(DEBUG_DETAIL,"Starting.");
 
-    /* Open a socket for communication with the gateway. */
-    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    rc = socket_connect_tcp_start(s, host, port);
 
-    /* check for errors */
-    if(fd < 0) {
-        pdebug(DEBUG_ERROR,"Socket creation failed, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
+    while(rc == PLCTAG_STATUS_PENDING) {
+        struct pollfd pfds[MAX_IPS];
+        int64_t now = time_ms();
+        int64_t wake_time = socket_connect_tcp_next_time(s);
 
-    /* set up our socket to allow reuse if we crash suddenly. */
-    sock_opt = 1;
+        if(now >= timeout_time) {
+            pdebug(DEBUG_WARN, "Timed out connecting to %s!", host);
+            socket_close(s);
+            return PLCTAG_ERR_TIMEOUT;
+        }
 
-    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Error setting socket reuse option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
+        if(!wake_time || wake_time > timeout_time) {
+            wake_time = timeout_time;
+        }
 
-#ifdef SO_NOSIGPIPE
-    /* On *BSD and macOS, set the socket option to prevent SIGPIPE. */
-    if(setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (char*)&sock_opt, sizeof(sock_opt))) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Error setting socket SIGPIPE suppression option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
-#endif
+        for(int i=0; i < s->num_attempts; i++) {
+            pfds[i].fd = s->attempts[i].fd;
+            pfds[i].events = POLLOUT;
+            pfds[i].revents = 0;
+        }
 
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+        poll(pfds, (nfds_t)s->num_attempts, (wake_time > now ? (int)(wake_time - now) : 0));
 
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
-        close(fd);
-        pdebug(DEBUG_ERROR,"Error setting socket receive timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+        rc = socket_connect_tcp_check(s);
     }
 
-    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Error setting socket set timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+/*
+ * socket_connect_tcp_start
+ *
+ * Start connecting to the host without blocking.  Returns
+ * PLCTAG_STATUS_PENDING if the connection is in progress.  Call
+ * socket_connect_tcp_check() when the socket becomes writable and
+ * at the time returned by socket_connect_tcp_next_time().
+ */
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port)
+{
+    pdebug(DEBUG_DETAIL,"Starting.");
+
+    if(!s || !host) {
+        pdebug(DEBUG_WARN, "Null socket or host pointer!");
+        return PLCTAG_ERR_NULL_PTR;
     }
 
-    /* abort the connection immediately upon close. */
-    so_linger.l_onoff = 1;
-    so_linger.l_linger = 0;
+    /* drop any previous connection. */
+    socket_close(s);
 
-    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
-        close(fd);
-        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+    if(s->host) {
+        mem_free(s->host);
+    }
+
+    s->host = str_dup(host);
+    if(!s->host) {
+        pdebug(DEBUG_ERROR, "Unable to copy host name!");
+        return PLCTAG_ERR_NO_MEM;
     }
 
     /* figure out what address we are connecting to. */
+    mem_set(s->ips, 0, sizeof(s->ips));
+    s->num_ips = 0;
+    s->next_ip = 0;
+    s->port = port;
 
     /* try a numeric IP address conversion first. */
-    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
+    if(inet_pton(AF_INET,host,(struct in_addr *)s->ips) > 0) {
         pdebug(DEBUG_DETAIL, "Found numeric IP address: %s",host);
-        num_ips = 1;
+        s->num_ips = 1;
+    } else if((s->num_ips = addr_cache_lookup(host, s->ips)) > 0) {
+        pdebug(DEBUG_DETAIL, "Found %d cached addresses for %s.", s->num_ips, host);
     } else {
         struct addrinfo hints;
-        struct addrinfo *res=NULL;
+        struct addrinfo *res_head = NULL;
+        struct addrinfo *res = NULL;
         int rc = 0;
 
-        mem_set(&ips, 0, sizeof(ips));
         mem_set(&hints, 0, sizeof(hints));
 
         hints.ai_socktype = SOCK_STREAM; /* TCP */
         hints.ai_family = AF_INET; /* IP V4 only */
 
-        if ((rc = getaddrinfo(host, NULL, &hints, &res)) != 0) {
+        if ((rc = getaddrinfo(host, NULL, &hints, &res_head)) != 0) {
             pdebug(DEBUG_WARN,"Error looking up PLC IP address %s, error = %d\n", host, rc);
 
-            if(res) {
-                freeaddrinfo(res);
+            if(res_head) {
+                freeaddrinfo(res_head);
             }
 
             return PLCTAG_ERR_BAD_GATEWAY;
         }
 
-        for(num_ips = 0; res && num_ips < MAX_IPS; num_ips++) {
-            ips[num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
-            res = res->ai_next;
+        for(res = res_head; res && s->num_ips < MAX_IPS; res = res->ai_next) {
+            s->ips[s->num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
+            s->num_ips++;
         }
 
-        freeaddrinfo(res);
+        freeaddrinfo(res_head);
+
+        addr_cache_store(host, s->ips, s->num_ips);
     }
 
+    pdebug(DEBUG_DETAIL, "Done.");
 
-    /* now try to connect to the remote gateway.  We may need to
-     * try several of the IPs we have.
-     */
+    return socket_connect_next_ip(s);
+}
 
-    i = 0;
-    done = 0;
 
-    memset((void *)&gw_addr,0, sizeof(gw_addr));
-    gw_addr.sin_family = AF_INET ;
-    gw_addr.sin_port = htons((uint16_t)port);
+/*
+ * socket_connect_tcp_check
+ *
+ * See if a connection started with socket_connect_tcp_start() has
+ * finished.  The first attempt to connect wins and the others are
+ * dropped.  If the attempts in progress are slow or have all failed,
+ * the next address is tried.
+ */
+extern int socket_connect_tcp_check(sock_p s)
+{
+    struct pollfd pfds[MAX_IPS];
+    int num_pfds = 0;
 
-    do {
-        int rc;
-        /* try each IP until we run out or get a connection. */
-        gw_addr.sin_addr.s_addr = ips[i].s_addr;
+    if(!s) {
+        pdebug(DEBUG_WARN, "Null socket pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
 
-        pdebug(DEBUG_DETAIL, "Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&ips[i])));
+    if(s->is_open) {
+        return PLCTAG_STATUS_OK;
+    }
 
-        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+    if(s->num_attempts == 0) {
+        pdebug(DEBUG_WARN, "Socket is not connecting!");
+        return PLCTAG_ERR_OPEN;
+    }
 
-        if( rc == 0) {
-            pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&ips[i])));
-            done = 1;
-        } else {
-            pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&ips[i])),errno);
-            i++;
-        }
-    } while(!done && i < num_ips);
+    num_pfds = s->num_attempts;
 
-    if(!done) {
-        close(fd);
-        pdebug(DEBUG_ERROR, "Unable to connect to any gateway host IP address!");
+    /* the attempts always fit in the poll array, but say so for the compiler. */
+    if(num_pfds < 0 || num_pfds > MAX_IPS) {
+        pdebug(DEBUG_WARN, "Bad number of connection attempts, %d!", num_pfds);
         return PLCTAG_ERR_OPEN;
     }
 
+    for(int i=0; i < num_pfds; i++) {
+        pfds[i].fd = s->attempts[i].fd;
+        pfds[i].events = POLLOUT;
+        pfds[i].revents = 0;
+    }
+
+    if(poll(pfds, (nfds_t)num_pfds, 0) > 0) {
+        /* index walks the attempts, which move down as failed ones are dropped. */
+        for(int i=0, index=0; i < num_pfds; i++) {
+            int sock_err = 0;
+            socklen_t sock_err_len = sizeof(sock_err);
 
-    /* FIXME
-     * connect() is a little easier to handle in blocking mode, for now
-     * we make the socket non-blocking here, after connect(). */
-    flags=fcntl(fd,F_GETFL,0);
+            if(!pfds[i].revents) {
+                index++;
+                continue;
+            }
 
-    if(flags<0) {
-        pdebug(DEBUG_ERROR, "Error getting socket options, errno: %d", errno);
-        close(fd);
-        return PLCTAG_ERR_OPEN;
+            if(getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &sock_err, &sock_err_len) || sock_err) {
+                pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(s->ips[s->attempts[index].ip_index]), sock_err);
+                socket_connect_drop_attempt(s, index);
+            } else {
+                socket_connect_use_attempt(s, index);
+                return PLCTAG_STATUS_OK;
+            }
+        }
     }
 
-    flags |= O_NONBLOCK;
+    if(s->next_ip < s->num_ips && (s->num_attempts == 0 || time_ms() >= s->next_attempt_time)) {
+        return socket_connect_next_ip(s);
+    }
 
-    if(fcntl(fd,F_SETFL,flags)<0) {
-        pdebug(DEBUG_ERROR, "Error setting socket to non-blocking, errno: %d", errno);
-        close(fd);
+    if(s->num_attempts == 0) {
+        pdebug(DEBUG_ERROR, "Unable to connect to any gateway host IP address!");
+        addr_cache_forget(s->host);
         return PLCTAG_ERR_OPEN;
     }
 
-    /* save the values */
-    s->fd = fd;
-    s->port = port;
-    s->is_open = 1;
-
-    pdebug(DEBUG_DETAIL, "Done.");
-
-    return PLCTAG_STATUS_OK;
+    return PLCTAG_STATUS_PENDING;
 }
 
 
-
-
-extern int socket_read(sock_p s, uint8_t *buf, int size)
+/*
+ * socket_connect_tcp_next_time
+ *
+ * When socket_connect_tcp_check() should be called to start on the
+ * next address if nothing else happens first.  Zero if there are no
+ * more addresses to try.
+ */
+extern int64_t socket_connect_tcp_next_time(sock_p s)
 {
-    int rc;
-
-    if(!s || !buf) {
-        return PLCTAG_ERR_NULL_PTR;
+    if(!s || s->is_open || s->next_ip >= s->num_ips) {
+        return 0;
     }
 
-    if(!s->is_open) {
-        pdebug(DEBUG_WARN, "Socket is not open!");
-        return PLCTAG_ERR_READ;
-    }
+    return s->next_attempt_time;
+}
 
-    /* The socket is non-blocking. */
-    rc = (int)read(s->fd,buf,(size_t)size);
+
+
+/*
+ * socket_open_fd
+ *
+ * Create a non-blocking TCP socket with the options we want.
+ */
+int socket_open_fd(void)
+{
+    int sock_opt = 1;
+    int fd;
+    int flags;
+    struct timeval timeout; /* used for timing out connections etc. */
+    struct linger so_linger; /* used to set up short/no lingering after connections are close()ed. */
+
+    /* Open a socket for communication with the gateway. */
+    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+    /* check for errors */
+    if(fd < 0) {
+        pdebug(DEBUG_ERROR,"Socket creation failed, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* set up our socket to allow reuse if we crash suddenly. */
+    sock_opt = 1;
+
+    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket reuse option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+#ifdef SO_NOSIGPIPE
+    /* On *BSD and macOS, set the socket option to prevent SIGPIPE. */
+    if(setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket SIGPIPE suppression option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+#endif
+
+    timeout.tv_sec = 10;
+    timeout.tv_usec = 0;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
+        close(fd);
+        pdebug(DEBUG_ERROR,"Error setting socket receive timeout option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket set timeout option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* find out about dead peers on idle connections. */
+    if(setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket keepalive option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+#ifdef TCP_KEEPIDLE
+    sock_opt = SOCKET_KEEPALIVE_IDLE_S;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket keepalive idle time, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+#elif defined(TCP_KEEPALIVE)
+    /* macOS calls it this. */
+    sock_opt = SOCKET_KEEPALIVE_IDLE_S;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket keepalive idle time, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+#endif
+
+#ifdef TCP_KEEPINTVL
+    sock_opt = SOCKET_KEEPALIVE_INTERVAL_S;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket keepalive interval, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+#endif
+
+#ifdef TCP_KEEPCNT
+    sock_opt = SOCKET_KEEPALIVE_COUNT;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket keepalive probe count, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+#endif
+
+#ifdef TCP_USER_TIMEOUT
+    /* keepalives do not run while data is unacknowledged, bound that too. */
+    sock_opt = (SOCKET_KEEPALIVE_IDLE_S + SOCKET_KEEPALIVE_INTERVAL_S * SOCKET_KEEPALIVE_COUNT) * 1000;
+
+    if(setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, (char*)&sock_opt, sizeof(sock_opt))) {
+        close(fd);
+        pdebug(DEBUG_ERROR, "Error setting socket user timeout, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+#endif
+
+    /* abort the connection immediately upon close. */
+    so_linger.l_onoff = 1;
+    so_linger.l_linger = 0;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
+        close(fd);
+        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    /* connect() does not block, we wait for the socket to become writable. */
+    flags=fcntl(fd,F_GETFL,0);
+
+    if(flags<0) {
+        pdebug(DEBUG_ERROR, "Error getting socket options, errno: %d", errno);
+        close(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    flags |= O_NONBLOCK;
+
+    if(fcntl(fd,F_SETFL,flags)<0) {
+        pdebug(DEBUG_ERROR, "Error setting socket to non-blocking, errno: %d", errno);
+        close(fd);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    return fd;
+}
+
+
+/*
+ * socket_connect_next_ip
+ *
+ * Start a connection to the next address we have not tried yet.  The
+ * attempts already in progress keep going.
+ */
+int socket_connect_next_ip(sock_p s)
+{
+    struct sockaddr_in gw_addr;
+
+    memset((void *)&gw_addr,0, sizeof(gw_addr));
+    gw_addr.sin_family = AF_INET ;
+    gw_addr.sin_port = htons((uint16_t)s->port);
+
+    /* try each IP until we run out or get a connection started. */
+    while(s->next_ip < s->num_ips) {
+        int rc;
+        int fd = socket_open_fd();
+
+        if(fd < 0) {
+            return fd;
+        }
+
+        gw_addr.sin_addr.s_addr = s->ips[s->next_ip].s_addr;
+
+        s->attempts[s->num_attempts].fd = fd;
+        s->attempts[s->num_attempts].ip_index = s->next_ip;
+        s->attempts[s->num_attempts].polled = 0;
+        s->num_attempts++;
+        s->fd = s->attempts[0].fd;
+
+        s->next_ip++;
+
+        pdebug(DEBUG_DETAIL, "Attempting to connect to %s",inet_ntoa(gw_addr.sin_addr));
+
+        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+
+        if(rc == 0) {
+            socket_connect_use_attempt(s, s->num_attempts - 1);
+            return PLCTAG_STATUS_OK;
+        } else if(errno == EINPROGRESS) {
+            pdebug(DEBUG_DETAIL, "Connection to %s in progress.",inet_ntoa(gw_addr.sin_addr));
+            s->next_attempt_time = time_ms() + SOCKET_CONNECT_STAGGER_MS;
+            return PLCTAG_STATUS_PENDING;
+        } else {
+            pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(gw_addr.sin_addr),errno);
+            socket_connect_drop_attempt(s, s->num_attempts - 1);
+        }
+    }
+
+    if(s->num_attempts > 0) {
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    pdebug(DEBUG_ERROR, "Unable to connect to any gateway host IP address!");
+
+    addr_cache_forget(s->host);
+
+    return PLCTAG_ERR_OPEN;
+}
+
+
+/*
+ * socket_connect_drop_attempt
+ *
+ * Close a failed connection attempt.
+ */
+void socket_connect_drop_attempt(sock_p s, int index)
+{
+    /* closing it took it out of the poller, the number may be reused. */
+    if(s->poll_fd == s->attempts[index].fd) {
+        s->poll_fd = -1;
+        s->poll_events = 0;
+    }
+
+    close(s->attempts[index].fd);
+
+    for(int i=index; i+1 < s->num_attempts; i++) {
+        s->attempts[i] = s->attempts[i+1];
+    }
+
+    s->num_attempts--;
+    s->fd = (s->num_attempts > 0 ? s->attempts[0].fd : -1);
+}
+
+
+/*
+ * socket_connect_use_attempt
+ *
+ * The connection attempt worked.  It becomes the socket and the
+ * rest are closed.
+ */
+void socket_connect_use_attempt(sock_p s, int index)
+{
+    int fd = s->attempts[index].fd;
+
+    pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(s->ips[s->attempts[index].ip_index]));
+
+    for(int i=0; i < s->num_attempts; i++) {
+        if(i != index) {
+            if(s->poll_fd == s->attempts[i].fd) {
+                s->poll_fd = -1;
+                s->poll_events = 0;
+            }
+
+            close(s->attempts[i].fd);
+        }
+    }
+
+    /* try this address first next time. */
+    if(s->attempts[index].ip_index > 0) {
+        addr_cache_prefer(s->host, s->ips[s->attempts[index].ip_index]);
+    }
+
+    s->num_attempts = 0;
+    s->fd = fd;
+    s->is_open = 1;
+}
+
+
+/*
+ * addr_cache_lookup
+ *
+ * Copy the addresses of the host into ips if they were looked up
+ * recently.  Returns the number of addresses, zero if none.
+ */
+int addr_cache_lookup(const char *host, struct in_addr *ips)
+{
+    int64_t now = time_ms();
+    int num_ips = 0;
+
+    spin_block(&addr_cache_lock) {
+        for(int i=0; i < ADDR_CACHE_SIZE; i++) {
+            struct addr_cache_entry_t *entry = &addr_cache[i];
+
+            if(entry->num_ips > 0 && entry->expire_time > now && str_cmp_i(entry->host, host) == 0) {
+                mem_copy(ips, entry->ips, (int)sizeof(entry->ips[0]) * entry->num_ips);
+                num_ips = entry->num_ips;
+                break;
+            }
+        }
+    }
+
+    return num_ips;
+}
+
+
+/*
+ * addr_cache_store
+ *
+ * Remember the addresses of the host.  The entry for the same host, an
+ * unused one or the one closest to expiring is replaced.
+ */
+void addr_cache_store(const char *host, struct in_addr *ips, int num_ips)
+{
+    int64_t now = time_ms();
+
+    if(num_ips <= 0 || str_length(host) >= ADDR_CACHE_MAX_HOST) {
+        return;
+    }
+
+    spin_block(&addr_cache_lock) {
+        struct addr_cache_entry_t *entry = &addr_cache[0];
+
+        for(int i=0; i < ADDR_CACHE_SIZE; i++) {
+            if(addr_cache[i].num_ips > 0 && str_cmp_i(addr_cache[i].host, host) == 0) {
+                entry = &addr_cache[i];
+                break;
+            }
+
+            if(addr_cache[i].expire_time < entry->expire_time) {
+                entry = &addr_cache[i];
+            }
+        }
+
+        /* the length was checked above, leave room for the terminator. */
+        str_copy(entry->host, ADDR_CACHE_MAX_HOST - 1, host);
+        entry->host[ADDR_CACHE_MAX_HOST - 1] = 0;
+        mem_copy(entry->ips, ips, (int)sizeof(ips[0]) * num_ips);
+        entry->num_ips = num_ips;
+        entry->expire_time = now + ADDR_CACHE_TTL_MS;
+    }
+}
+
+
+/*
+ * addr_cache_forget
+ *
+ * None of the addresses worked, look the host up again next time.
+ */
+void addr_cache_forget(const char *host)
+{
+    if(!host) {
+        return;
+    }
+
+    spin_block(&addr_cache_lock) {
+        for(int i=0; i < ADDR_CACHE_SIZE; i++) {
+            if(addr_cache[i].num_ips > 0 && str_cmp_i(addr_cache[i].host, host) == 0) {
+                addr_cache[i].num_ips = 0;
+                addr_cache[i].expire_time = 0;
+            }
+        }
+    }
+}
+
+
+/*
+ * addr_cache_prefer
+ *
+ * Swap the address that worked to the front of the host's list.
+ */
+void addr_cache_prefer(const char *host, struct in_addr ip)
+{
+    if(!host) {
+        return;
+    }
+
+    spin_block(&addr_cache_lock) {
+        for(int i=0; i < ADDR_CACHE_SIZE; i++) {
+            struct addr_cache_entry_t *entry = &addr_cache[i];
+
+            if(entry->num_ips > 0 && str_cmp_i(entry->host, host) == 0) {
+                for(int j=1; j < entry->num_ips; j++) {
+                    if(entry->ips[j].s_addr == ip.s_addr) {
+                        entry->ips[j] = entry->ips[0];
+                        entry->ips[0] = ip;
+                        break;
+                    }
+                }
+
+                break;
+            }
+        }
+    }
+}
+
+
+
+
+extern int socket_read(sock_p s, uint8_t *buf, int size)
+{
+    int rc;
+
+    if(!s || !buf) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!s->is_open) {
+        pdebug(DEBUG_WARN, "Socket is not open!");
+        return PLCTAG_ERR_READ;
+    }
+
+    /* The socket is non-blocking. */
+    rc = (int)read(s->fd,buf,(size_t)size);
 
     if(rc < 0) {
         if(errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -971,6 +1659,12 @@ extern int socket_read(sock_p s, uint8_t *buf, int size)
         }
     }
 
+    /* a zero-length read on a readable socket means the other end closed it. */
+    if(rc == 0 && size > 0) {
+        pdebug(DEBUG_WARN, "Socket closed by remote end!");
+        return PLCTAG_ERR_READ;
+    }
+
     return rc;
 }
 
@@ -1011,22 +1705,90 @@ extern int socket_write(sock_p s, uint8_t *buf, int size)
 
 
 
+/*
+ * socket_write_vec
+ *
+ * Write the pieces in iov out as one stream without copying them
+ * together first.  At most SOCKET_MAX_IOVEC pieces are used.  Returns the
+ * number of bytes written, which may be less than the total.
+ */
+extern int socket_write_vec(sock_p s, socket_iovec_t *iov, int iov_count)
+{
+    struct iovec vec[SOCKET_MAX_IOVEC];
+    struct msghdr msg;
+    int rc;
+
+    if(!s || !iov) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!s->is_open) {
+        pdebug(DEBUG_WARN, "Socket is not open!");
+        return PLCTAG_ERR_WRITE;
+    }
+
+    if(iov_count > SOCKET_MAX_IOVEC) {
+        iov_count = SOCKET_MAX_IOVEC;
+    }
+
+    for(int i=0; i < iov_count; i++) {
+        vec[i].iov_base = iov[i].data;
+        vec[i].iov_len = (size_t)iov[i].size;
+    }
+
+    mem_set(&msg, 0, sizeof(msg));
+    msg.msg_iov = vec;
+    msg.msg_iovlen = (size_t)iov_count;
+
+    /* The socket is non-blocking. */
+#ifdef SO_NOSIGPIPE
+    /* On *BSD and macOS, the socket option is set to prevent SIGPIPE. */
+    rc = (int)sendmsg(s->fd, &msg, 0);
+#else
+    /* on Linux, we use MSG_NOSIGNAL */
+    rc = (int)sendmsg(s->fd, &msg, MSG_NOSIGNAL);
+#endif
+
+    if(rc < 0) {
+        if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return PLCTAG_ERR_NO_DATA;
+        } else {
+            pdebug(DEBUG_WARN, "Socket write error: rc=%d, errno=%d", rc, errno);
+            return PLCTAG_ERR_WRITE;
+        }
+    }
+
+    return rc;
+}
+
+
+
 extern int socket_close(sock_p s)
 {
     if(!s) {
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    if(!s->is_open) {
+    if(s->fd < 0) {
         return PLCTAG_STATUS_OK;
     }
 
-    if(!close(s->fd)) {
+    /* stop any other connection attempts, the first one is the fd. */
+    for(int i=1; i < s->num_attempts; i++) {
+        close(s->attempts[i].fd);
+    }
+
+    s->num_attempts = 0;
+
+    /* closing the fd also takes it out of any epoll set. */
+    if(close(s->fd)) {
         return PLCTAG_ERR_CLOSE;
     }
 
-    s->fd = 0;
+    s->fd = -1;
     s->is_open = 0;
+    s->poll_fd = -1;
+    s->poll_events = 0;
 
     return PLCTAG_STATUS_OK;
 }
@@ -1039,6 +1801,10 @@ extern int socket_destroy(sock_p *s)
 
     socket_close(*s);
 
+    if((*s)->host) {
+        mem_free((*s)->host);
+    }
+
     mem_free(*s);
 
     *s = 0;
@@ -1048,7 +1814,400 @@ extern int socket_destroy(sock_p *s)
 
 
 
+/*
+ * Socket pollers wait for any of a set of sockets to become ready.
+ * This is an epoll set plus an eventfd so that other threads can
+ * wake up the thread waiting on the poller.
+ */
+
+extern int socket_poller_create(socket_poller_p *p)
+{
+    struct epoll_event event;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!p) {
+        pdebug(DEBUG_WARN, "Null poller pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *p = (socket_poller_p)mem_alloc(sizeof(struct socket_poller_t));
+    if(! *p) {
+        pdebug(DEBUG_ERROR, "Failed to allocate memory for socket poller.");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    (*p)->wake_fd = -1;
+
+    (*p)->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if((*p)->epoll_fd < 0) {
+        pdebug(DEBUG_ERROR, "Unable to create epoll set, errno: %d", errno);
+        socket_poller_destroy(p);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    (*p)->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if((*p)->wake_fd < 0) {
+        pdebug(DEBUG_ERROR, "Unable to create wake up eventfd, errno: %d", errno);
+        socket_poller_destroy(p);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    mem_set(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL; /* marks the wake up fd */
+
+    if(epoll_ctl((*p)->epoll_fd, EPOLL_CTL_ADD, (*p)->wake_fd, &event)) {
+        pdebug(DEBUG_ERROR, "Unable to add wake up eventfd to epoll set, errno: %d", errno);
+        socket_poller_destroy(p);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+extern int socket_poller_destroy(socket_poller_p *p)
+{
+    if(!p || !*p) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if((*p)->wake_fd >= 0) {
+        close((*p)->wake_fd);
+    }
+
+    if((*p)->epoll_fd >= 0) {
+        close((*p)->epoll_fd);
+    }
+
+    mem_free(*p);
+
+    *p = NULL;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * socket_poller_set
+ *
+ * Set the events (SOCKET_EVENT_READ and/or SOCKET_EVENT_WRITE) we want
+ * to hear about for the socket.  Passing zero events removes the
+ * socket from the poller.  The context is returned by socket_poller_wait()
+ * when the socket is ready.  Nothing is done if the events have
+ * not changed.
+ */
+extern int socket_poller_set(socket_poller_p p, sock_p s, int events, void *context)
+{
+    struct epoll_event event;
+    int rc = 0;
+
+    if(!p || !s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* nothing to watch yet, or the socket was closed. */
+    if(s->fd < 0) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    /*
+     * attempts to connect to other addresses are watched too.  They leave
+     * the set when they are closed.
+     */
+    for(int i=1; events && i < s->num_attempts; i++) {
+        if(!s->attempts[i].polled) {
+            mem_set(&event, 0, sizeof(event));
+            event.events = EPOLLOUT;
+            event.data.ptr = context;
+
+            if(epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, s->attempts[i].fd, &event)) {
+                pdebug(DEBUG_WARN, "Unable to add connection attempt to poller, errno: %d", errno);
+                return PLCTAG_ERR_BAD_PARAM;
+            }
+
+            s->attempts[i].polled = 1;
+        }
+    }
+
+    if(s->poll_fd == s->fd && s->poll_events == events) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    /*
+     * take the socket out of the set entirely when we do not want events.
+     * Errors and hang ups are always reported and would wake us up over
+     * and over otherwise.
+     */
+    if(!events) {
+        if(s->poll_fd == s->fd && epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL) && errno != ENOENT) {
+            pdebug(DEBUG_WARN, "Unable to remove socket from poller, errno: %d", errno);
+        }
+
+        s->poll_fd = -1;
+        s->poll_events = 0;
+
+        return PLCTAG_STATUS_OK;
+    }
+
+    mem_set(&event, 0, sizeof(event));
+    event.events = ((events & SOCKET_EVENT_READ) ? EPOLLIN : 0) | ((events & SOCKET_EVENT_WRITE) ? EPOLLOUT : 0);
+    event.data.ptr = context;
+
+    if(s->poll_fd == s->fd) {
+        rc = epoll_ctl(p->epoll_fd, EPOLL_CTL_MOD, s->fd, &event);
+        if(rc && errno == ENOENT) {
+            rc = epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, s->fd, &event);
+        }
+    } else {
+        rc = epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, s->fd, &event);
+        if(rc && errno == EEXIST) {
+            rc = epoll_ctl(p->epoll_fd, EPOLL_CTL_MOD, s->fd, &event);
+        }
+    }
+
+    if(rc) {
+        pdebug(DEBUG_WARN, "Unable to set socket events, errno: %d", errno);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    s->poll_fd = s->fd;
+    s->poll_events = events;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * socket_poller_wait
+ *
+ * Wait until at least one socket is ready, the poller is woken up or
+ * the timeout passes.  The contexts of the ready sockets are put in
+ * the passed array.  Returns the number of contexts.
+ */
+extern int socket_poller_wait(socket_poller_p p, void **contexts, int max_contexts, int timeout_ms)
+{
+    struct epoll_event events[SOCKET_POLLER_MAX_EVENTS];
+    int num_events = 0;
+    int num_contexts = 0;
+
+    if(!p || !contexts) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(max_contexts > SOCKET_POLLER_MAX_EVENTS) {
+        max_contexts = SOCKET_POLLER_MAX_EVENTS;
+    }
+
+    num_events = epoll_wait(p->epoll_fd, events, max_contexts, timeout_ms);
+
+    if(num_events < 0) {
+        if(errno == EINTR) {
+            return 0;
+        }
+
+        pdebug(DEBUG_WARN, "Error waiting for socket events, errno: %d", errno);
+        return PLCTAG_ERR_READ;
+    }
+
+    for(int i=0; i < num_events; i++) {
+        if(events[i].data.ptr) {
+            contexts[num_contexts] = events[i].data.ptr;
+            num_contexts++;
+        } else {
+            uint64_t count = 0;
+
+            /* clear the wake up. */
+            if(read(p->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+                pdebug(DEBUG_WARN, "Error clearing poller wake up, errno: %d", errno);
+            }
+        }
+    }
+
+    return num_contexts;
+}
+
+
+/*
+ * socket_poller_wakeup
+ *
+ * Make socket_poller_wait() return now.  Safe to call from any thread.
+ */
+extern int socket_poller_wakeup(socket_poller_p p)
+{
+    uint64_t one = 1;
+
+    if(!p) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(write(p->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        pdebug(DEBUG_WARN, "Error waking up poller, errno: %d", errno);
+        return PLCTAG_ERR_WRITE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+
+/***************************************************************************
+ ******************************** Files ************************************
+ **************************************************************************/
+
+
+/*
+ * file_read_all
+ *
+ * Read the whole file into a new buffer.  The buffer is zero terminated
+ * so that it can be used as a string, the terminator is not counted in
+ * the size.  The caller frees it with mem_free().  Returns
+ * PLCTAG_ERR_NOT_FOUND if there is no such file.
+ */
+extern int file_read_all(const char *name, char **data, int *size)
+{
+    int fd = -1;
+    char *buf = NULL;
+    int buf_size = 0;
+    int len = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!name || !data || !size) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *data = NULL;
+    *size = 0;
+
+    fd = open(name, O_RDONLY);
+    if(fd < 0) {
+        return (errno == ENOENT ? PLCTAG_ERR_NOT_FOUND : PLCTAG_ERR_OPEN);
+    }
+
+    do {
+        ssize_t count = 0;
 
+        /* grow the buffer, leaving room for the terminator. */
+        if(len + 1 >= buf_size) {
+            char *new_buf = mem_realloc(buf, buf_size + 4096);
+
+            if(!new_buf) {
+                rc = PLCTAG_ERR_NO_MEM;
+                break;
+            }
+
+            buf = new_buf;
+            buf_size += 4096;
+        }
+
+        count = read(fd, buf + len, (size_t)(buf_size - len - 1));
+        if(count < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            rc = PLCTAG_ERR_READ;
+            break;
+        }
+
+        if(count == 0) {
+            break;
+        }
+
+        len += (int)count;
+    } while(1);
+
+    close(fd);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        mem_free(buf);
+        return rc;
+    }
+
+    buf[len] = 0;
+
+    *data = buf;
+    *size = len;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * file_replace
+ *
+ * Replace the contents of the file.  The data is written to a temporary
+ * file next to it that is then renamed over the old one, so readers see
+ * either all of the old contents or all of the new.
+ */
+extern int file_replace(const char *name, const char *data, int size)
+{
+    char *tmp_name = NULL;
+    int fd = -1;
+    int written = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!name || (!data && size > 0)) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    tmp_name = str_concat(name, ".tmp");
+    if(!tmp_name) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    fd = open(tmp_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+        pdebug(DEBUG_WARN, "Unable to create %s, errno: %d", tmp_name, errno);
+        mem_free(tmp_name);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    while(written < size) {
+        ssize_t count = write(fd, data + written, (size_t)(size - written));
+
+        if(count < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            rc = PLCTAG_ERR_WRITE;
+            break;
+        }
+
+        written += (int)count;
+    }
+
+    /* make sure the data is there before the name points at it. */
+    if(rc == PLCTAG_STATUS_OK && fsync(fd)) {
+        rc = PLCTAG_ERR_WRITE;
+    }
+
+    if(close(fd) && rc == PLCTAG_STATUS_OK) {
+        rc = PLCTAG_ERR_WRITE;
+    }
+
+    if(rc == PLCTAG_STATUS_OK && rename(tmp_name, name)) {
+        pdebug(DEBUG_WARN, "Unable to rename %s to %s, errno: %d", tmp_name, name, errno);
+        rc = PLCTAG_ERR_WRITE;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        unlink(tmp_name);
+    }
+
+    mem_free(tmp_name);
+
+    return rc;
+}
 
 
 
@@ -1091,3 +2250,19 @@ int64_t time_ms(void)
 
     return  ((int64_t)tv.tv_sec*1000)+ ((int64_t)tv.tv_usec/1000);
 }
+
+
+
+/*
+ * time_us
+ *
+ * Return the current epoch time in microseconds.
+ */
+int64_t time_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv,NULL);
+
+    return  ((int64_t)tv.tv_sec*1000000)+ (int64_t)tv.tv_usec;
+}
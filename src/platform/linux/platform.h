@@ -82,6 +82,7 @@ extern void mem_set(void *dest, int c, int size);
 extern void mem_copy(void *dest, void *src, int size);
 extern void mem_move(void *dest, void *src, int size);
 extern int mem_cmp(void *src1, int src1_size, void *src2, int src2_size);
+extern uint32_t mem_alloc_count(void);
 
 /* string functions/defs */
 extern int str_cmp(const char *first, const char *second);
@@ -103,6 +104,12 @@ extern int mutex_try_lock(mutex_p m);
 extern int mutex_unlock(mutex_p m);
 extern int mutex_destroy(mutex_p *m);
 
+/* condition/event functions/defs, auto-reset on wake. */
+typedef struct cond_t *cond_p;
+extern int cond_create(cond_p *c);
+extern int cond_wait(cond_p c, int timeout_ms);
+extern int cond_signal(cond_p c);
+extern int cond_destroy(cond_p *c);
 
 
 /* macros are evil */
@@ -157,13 +164,36 @@ extern void lock_release(lock_t *lock);
 
 /* socket functions */
 typedef struct sock_t *sock_p;
+
+/* one piece of a gathered write. */
+#define SOCKET_MAX_IOVEC (256)
+typedef struct {
+    uint8_t *data;
+    int size;
+} socket_iovec_t;
+
 extern int socket_create(sock_p *s);
 extern int socket_connect_tcp(sock_p s, const char *host, int port);
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port);
+extern int socket_connect_tcp_check(sock_p s);
+extern int64_t socket_connect_tcp_next_time(sock_p s);
 extern int socket_read(sock_p s, uint8_t *buf, int size);
 extern int socket_write(sock_p s, uint8_t *buf, int size);
+extern int socket_write_vec(sock_p s, socket_iovec_t *iov, int iov_count);
 extern int socket_close(sock_p s);
 extern int socket_destroy(sock_p *s);
 
+/* socket readiness polling */
+#define SOCKET_EVENT_READ  (0x01)
+#define SOCKET_EVENT_WRITE (0x02)
+#define SOCKET_POLLER_MAX_EVENTS (64)
+typedef struct socket_poller_t *socket_poller_p;
+extern int socket_poller_create(socket_poller_p *p);
+extern int socket_poller_set(socket_poller_p p, sock_p s, int events, void *context);
+extern int socket_poller_wait(socket_poller_p p, void **contexts, int max_contexts, int timeout_ms);
+extern int socket_poller_wakeup(socket_poller_p p);
+extern int socket_poller_destroy(socket_poller_p *p);
+
 /* serial handling */
 typedef struct serial_port_t *serial_port_p;
 #define PLC_SERIAL_PORT_NULL ((plc_serial_port)NULL)
@@ -174,9 +204,14 @@ extern int plc_lib_serial_port_write(serial_port_p serial_port, uint8_t *data, i
 
 
 
+/* file functions */
+extern int file_read_all(const char *name, char **data, int *size);
+extern int file_replace(const char *name, const char *data, int size);
+
 /* misc functions */
 extern int sleep_ms(int ms);
 extern int64_t time_ms(void);
+extern int64_t time_us(void);
 
 #define snprintf_platform snprintf
 
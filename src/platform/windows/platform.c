@@ -41,6 +41,7 @@
 #include <io.h>
 #include <Winsock2.h>
 #include <Ws2tcpip.h>
+#include <mstcpip.h>
 #include <string.h>
 #include <stdlib.h>
 #include <winnt.h>
@@ -79,6 +80,9 @@ extern "C"
 
 
 
+/* count of heap allocations, used to check that hot paths do not allocate. */
+static volatile LONG mem_alloc_counter = 0;
+
 /*
  * mem_alloc
  *
@@ -91,6 +95,8 @@ extern void *mem_alloc(int size)
 {
     void *res = calloc(size, 1);
 
+    InterlockedIncrement(&mem_alloc_counter);
+
     return res;
 }
 
@@ -105,11 +111,26 @@ extern void *mem_alloc(int size)
  */
 extern void *mem_realloc(void *orig, int size)
 {
+    InterlockedIncrement(&mem_alloc_counter);
+
     return realloc(orig, (size_t)size);
 }
 
 
 
+/*
+ * mem_alloc_count
+ *
+ * Returns the number of allocations and reallocations done so far.  The
+ * count wraps.
+ */
+extern uint32_t mem_alloc_count(void)
+{
+    return (uint32_t)mem_alloc_counter;
+}
+
+
+
 
 
 /*
@@ -584,6 +605,101 @@ int mutex_destroy(mutex_p *m)
 
 
 
+/***************************************************************************
+ ***************************** Conditions **********************************
+ **************************************************************************/
+
+/*
+ * A cond is an auto-reset event.  A signal that arrives when nobody is
+ * waiting is remembered and consumed by the next wait.
+ */
+
+struct cond_t {
+    HANDLE h_event;
+};
+
+
+int cond_create(cond_p *c)
+{
+    if(!c) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *c = (struct cond_t *)mem_alloc(sizeof(struct cond_t));
+
+    if(! *c) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    /* auto-reset, initially not signalled. */
+    (*c)->h_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    if(!(*c)->h_event) {
+        mem_free(*c);
+        *c = NULL;
+        return PLCTAG_ERR_MUTEX_INIT;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * Wait until the cond is signalled or timeout_ms passes.  Returns
+ * PLCTAG_STATUS_OK if signalled and PLCTAG_ERR_TIMEOUT otherwise.
+ */
+int cond_wait(cond_p c, int timeout_ms)
+{
+    DWORD dwWaitResult = 0;
+
+    if(!c) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(timeout_ms < 0) {
+        timeout_ms = 0;
+    }
+
+    dwWaitResult = WaitForSingleObject(c->h_event, (DWORD)timeout_ms);
+
+    if(dwWaitResult == WAIT_OBJECT_0) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    return PLCTAG_ERR_TIMEOUT;
+}
+
+
+int cond_signal(cond_p c)
+{
+    if(!c) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    SetEvent(c->h_event);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int cond_destroy(cond_p *c)
+{
+    if(!c || !*c) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    CloseHandle((*c)->h_event);
+
+    mem_free(*c);
+
+    *c = NULL;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
 
 /***************************************************************************
  ******************************* Threads ***********************************
@@ -804,14 +920,92 @@ extern void lock_release(lock_t *lock)
  **************************************************************************/
 
 
+#define MAX_IPS (8)
+#define SOCKET_CONNECT_TIMEOUT_MS (10000)
+
+/*
+ * TCP keepalive probing of idle connections, so that a peer that went
+ * away without closing the connection is found in seconds instead of
+ * the system default of two hours.
+ */
+#define SOCKET_KEEPALIVE_IDLE_MS (10000)
+#define SOCKET_KEEPALIVE_INTERVAL_MS (2000)
+
+/*
+ * when a host has more than one address, the next one is tried if the
+ * attempts already started have not finished within this time.
+ */
+#define SOCKET_CONNECT_STAGGER_MS (250)
+
+/* resolved host names are remembered for this long. */
+#define ADDR_CACHE_SIZE (32)
+#define ADDR_CACHE_MAX_HOST (256)
+#define ADDR_CACHE_TTL_MS (300000)
+
 struct sock_t {
     SOCKET fd;
     int port;
     int is_open;
+
+    /* the host and addresses to try while connecting. */
+    char *host;
+    IN_ADDR ips[MAX_IPS];
+    int num_ips;
+    int next_ip;
+
+    /* connection attempts in progress, the oldest one is also in fd. */
+    struct {
+        SOCKET fd;
+        int ip_index;
+    } attempts[MAX_IPS];
+    int num_attempts;
+    int64_t next_attempt_time;
 };
 
 
-#define MAX_IPS (8)
+/*
+ * the poller keeps the socket rather than the fd, which changes while
+ * connecting.  Only the thread waiting on the poller changes sockets
+ * that are in it.
+ */
+struct socket_poller_entry_t {
+    sock_p sock;
+    int events;
+    void *context;
+};
+
+struct socket_poller_t {
+    mutex_p mutex;
+
+    /* loopback UDP socket used to wake up the waiting thread. */
+    SOCKET wake_fd;
+
+    struct socket_poller_entry_t *entries;
+    int num_entries;
+    int max_entries;
+};
+
+
+/* host name lookups shared by all sockets in the process. */
+struct addr_cache_entry_t {
+    char host[ADDR_CACHE_MAX_HOST];
+    IN_ADDR ips[MAX_IPS];
+    int num_ips;
+    int64_t expire_time;
+};
+
+static lock_t addr_cache_lock = LOCK_INIT;
+static struct addr_cache_entry_t addr_cache[ADDR_CACHE_SIZE];
+
+
+static int addr_cache_lookup(const char *host, IN_ADDR *ips);
+static void addr_cache_store(const char *host, IN_ADDR *ips, int num_ips);
+static void addr_cache_forget(const char *host);
+static void addr_cache_prefer(const char *host, IN_ADDR ip);
+static SOCKET socket_open_fd(void);
+static int socket_connect_next_ip(sock_p s);
+static void socket_connect_drop_attempt(sock_p s, int index);
+static void socket_connect_use_attempt(sock_p s, int index);
 
 
 /* windows needs to have the Winsock library initialized
@@ -848,204 +1042,562 @@ extern int socket_create(sock_p *s)
         return PLCTAG_ERR_NO_MEM;
     }
 
+    (*s)->fd = INVALID_SOCKET;
+
     pdebug(DEBUG_DETAIL, "Done.");
 
     return PLCTAG_STATUS_OK;
 }
 
 
-
+/*
+ * socket_connect_tcp
+ *
+ * Connect to the host and wait until the connection is up or
+ * has failed.
+ */
 extern int socket_connect_tcp(sock_p s, const char *host, int port)
 {
-    IN_ADDR ips[MAX_IPS];
-    int num_ips = 0;
-    struct sockaddr_in gw_addr;
-    int sock_opt = 1;
-    u_long non_blocking=1;
-    int i = 0;
-    int done = 0;
-    SOCKET fd;
-    struct timeval timeout; /* used for timing out connections etc. */
-    struct linger so_linger;
+    int rc = PLCTAG_STATUS_OK;
+    int64_t timeout_time = time_ms() + SOCKET_CONNECT_TIMEOUT_MS;
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
-    /* Open a socket for communication with the gateway. */
-    fd = socket(AF_INET, SOCK_STREAM, 0/*IPPROTO_TCP*/);
+    rc = socket_connect_tcp_start(s, host, port);
 
-    /* check for errors */
-    if(fd < 0) {
-        /*pdebug("Socket creation failed, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
+    while(rc == PLCTAG_STATUS_PENDING) {
+        WSAPOLLFD pfds[MAX_IPS];
+        int64_t now = time_ms();
+        int64_t wake_time = socket_connect_tcp_next_time(s);
 
-    /* set up our socket to allow reuse if we crash suddenly. */
-    sock_opt = 1;
+        if(now >= timeout_time) {
+            pdebug(DEBUG_WARN, "Timed out connecting to %s!", host);
+            socket_close(s);
+            return PLCTAG_ERR_TIMEOUT;
+        }
 
-    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Error setting socket reuse option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
-    }
+        if(!wake_time || wake_time > timeout_time) {
+            wake_time = timeout_time;
+        }
 
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+        for(int i=0; i < s->num_attempts; i++) {
+            pfds[i].fd = s->attempts[i].fd;
+            pfds[i].events = POLLWRNORM;
+            pfds[i].revents = 0;
+        }
 
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Error setting socket receive timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+        WSAPoll(pfds, (ULONG)s->num_attempts, (wake_time > now ? (int)(wake_time - now) : 0));
+
+        rc = socket_connect_tcp_check(s);
     }
 
-    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Error setting socket set timeout option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+/*
+ * socket_connect_tcp_start
+ *
+ * Start connecting to the host without blocking.  Returns
+ * PLCTAG_STATUS_PENDING if the connection is in progress.  Call
+ * socket_connect_tcp_check() when the socket becomes writable and
+ * at the time returned by socket_connect_tcp_next_time().
+ */
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port)
+{
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!s || !host) {
+        pdebug(DEBUG_WARN, "Null socket or host pointer!");
+        return PLCTAG_ERR_NULL_PTR;
     }
 
-    /* abort the connection on close. */
-    so_linger.l_onoff = 1;
-    so_linger.l_linger = 0;
+    /* drop any previous connection. */
+    socket_close(s);
 
-    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
-        closesocket(fd);
-        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
-        return PLCTAG_ERR_OPEN;
+    if(s->host) {
+        mem_free(s->host);
+    }
+
+    s->host = str_dup(host);
+    if(!s->host) {
+        pdebug(DEBUG_ERROR, "Unable to copy host name!");
+        return PLCTAG_ERR_NO_MEM;
     }
 
     /* figure out what address we are connecting to. */
+    mem_set(s->ips, 0, sizeof(s->ips));
+    s->num_ips = 0;
+    s->next_ip = 0;
+    s->port = port;
 
     /* try a numeric IP address conversion first. */
-    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
+    if(inet_pton(AF_INET,host,(struct in_addr *)s->ips) > 0) {
         pdebug(DEBUG_DETAIL, "Found numeric IP address: %s", host);
-        num_ips = 1;
+        s->num_ips = 1;
+    } else if((s->num_ips = addr_cache_lookup(host, s->ips)) > 0) {
+        pdebug(DEBUG_DETAIL, "Found %d cached addresses for %s.", s->num_ips, host);
     } else {
         struct addrinfo hints;
+        struct addrinfo *res_head = NULL;
         struct addrinfo *res = NULL;
         int rc = 0;
 
-        mem_set(&ips, 0, sizeof(ips));
         mem_set(&hints, 0, sizeof(hints));
 
         hints.ai_socktype = SOCK_STREAM; /* TCP */
         hints.ai_family = AF_INET; /* IP V4 only */
 
-        if ((rc = getaddrinfo(host, NULL, &hints, &res)) != 0) {
+        if ((rc = getaddrinfo(host, NULL, &hints, &res_head)) != 0) {
             pdebug(DEBUG_WARN, "Error looking up PLC IP address %s, error = %d\n", host, rc);
 
-            if (res) {
-                freeaddrinfo(res);
+            if (res_head) {
+                freeaddrinfo(res_head);
             }
 
             return PLCTAG_ERR_BAD_GATEWAY;
         }
 
-        for (num_ips = 0; res && num_ips < MAX_IPS; num_ips++) {
-            ips[num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
-            res = res->ai_next;
+        for(res = res_head; res && s->num_ips < MAX_IPS; res = res->ai_next) {
+            s->ips[s->num_ips].s_addr = ((struct sockaddr_in *)(res->ai_addr))->sin_addr.s_addr;
+            s->num_ips++;
         }
 
-        freeaddrinfo(res);
+        freeaddrinfo(res_head);
+
+        addr_cache_store(host, s->ips, s->num_ips);
     }
 
+    pdebug(DEBUG_DETAIL, "Done.");
 
-    /* now try to connect to the remote gateway.  We may need to
-     * try several of the IPs we have.
-     */
+    return socket_connect_next_ip(s);
+}
 
-    i = 0;
-    done = 0;
 
-    memset((void *)&gw_addr,0, sizeof(gw_addr));
-    gw_addr.sin_family = AF_INET ;
-    gw_addr.sin_port = htons(port);
+/*
+ * socket_connect_tcp_check
+ *
+ * See if a connection started with socket_connect_tcp_start() has
+ * finished.  The first attempt to connect wins and the others are
+ * dropped.  If the attempts in progress are slow or have all failed,
+ * the next address is tried.
+ */
+extern int socket_connect_tcp_check(sock_p s)
+{
+    WSAPOLLFD pfds[MAX_IPS];
+    int num_pfds = 0;
 
-    do {
-        int rc;
-        /* try each IP until we run out or get a connection. */
-        gw_addr.sin_addr.s_addr = ips[i].s_addr;
+    if(!s) {
+        pdebug(DEBUG_WARN, "Null socket pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
 
-        /*pdebug(DEBUG_DETAIL,"Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&ips[i])));*/
+    if(s->is_open) {
+        return PLCTAG_STATUS_OK;
+    }
 
-        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+    if(s->num_attempts == 0) {
+        pdebug(DEBUG_WARN, "Socket is not connecting!");
+        return PLCTAG_ERR_OPEN;
+    }
 
-        if( rc == 0) {
-            /* Windows MSVC does not like inet_ntoa(), not safe.
-             * pdebug(DEBUG_DETAIL, "Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&ips[i])));
-             */
-            done = 1;
-        } else {
-            /* MSVC does not like inet_ntoa(), not safe.
-             * pdebug(DEBUG_DETAIL, "Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&ips[i])),errno);
-             */
-            i++;
-        }
-    } while(!done && i < num_ips);
+    num_pfds = s->num_attempts;
 
-    if(!done) {
-        closesocket(fd);
-        pdebug(DEBUG_WARN,"Unable to connect to any gateway host IP address!");
-        return PLCTAG_ERR_OPEN;
+    for(int i=0; i < num_pfds; i++) {
+        pfds[i].fd = s->attempts[i].fd;
+        pfds[i].events = POLLWRNORM;
+        pfds[i].revents = 0;
     }
 
+    if(WSAPoll(pfds, (ULONG)num_pfds, 0) > 0) {
+        /* index walks the attempts, which move down as failed ones are dropped. */
+        for(int i=0, index=0; i < num_pfds; i++) {
+            int sock_err = 0;
+            int sock_err_len = sizeof(sock_err);
 
-    /* FIXME
-     * connect() is a little easier to handle in blocking mode, for now
-     * we make the socket non-blocking here, after connect().
-     */
+            if(!pfds[i].revents) {
+                index++;
+                continue;
+            }
 
-    if(ioctlsocket(fd,FIONBIO,&non_blocking)) {
-        /*pdebug("Error getting socket options, errno: %d", errno);*/
-        closesocket(fd);
-        return PLCTAG_ERR_OPEN;
+            if(getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, (char *)&sock_err, &sock_err_len) || sock_err) {
+                pdebug(DEBUG_DETAIL, "Attempt to connect failed, error: %d", sock_err);
+                socket_connect_drop_attempt(s, index);
+            } else {
+                socket_connect_use_attempt(s, index);
+                return PLCTAG_STATUS_OK;
+            }
+        }
     }
 
-    /* save the values */
-    s->fd = fd;
-    s->port = port;
-    s->is_open = 1;
+    if(s->next_ip < s->num_ips && (s->num_attempts == 0 || time_ms() >= s->next_attempt_time)) {
+        return socket_connect_next_ip(s);
+    }
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    if(s->num_attempts == 0) {
+        pdebug(DEBUG_WARN, "Unable to connect to any gateway host IP address!");
+        addr_cache_forget(s->host);
+        return PLCTAG_ERR_OPEN;
+    }
 
-    return PLCTAG_STATUS_OK;
+    return PLCTAG_STATUS_PENDING;
 }
 
 
+/*
+ * socket_connect_tcp_next_time
+ *
+ * When socket_connect_tcp_check() should be called to start on the
+ * next address if nothing else happens first.  Zero if there are no
+ * more addresses to try.
+ */
+extern int64_t socket_connect_tcp_next_time(sock_p s)
+{
+    if(!s || s->is_open || s->next_ip >= s->num_ips) {
+        return 0;
+    }
+
+    return s->next_attempt_time;
+}
 
 
 
+/*
+ * socket_open_fd
+ *
+ * Create a non-blocking TCP socket with the options we want.
+ */
+SOCKET socket_open_fd(void)
+{
+    int sock_opt = 1;
+    u_long non_blocking=1;
+    SOCKET fd;
+    struct timeval timeout; /* used for timing out connections etc. */
+    struct linger so_linger;
+    struct tcp_keepalive keepalive;
+    DWORD bytes_returned = 0;
 
+    /* Open a socket for communication with the gateway. */
+    fd = socket(AF_INET, SOCK_STREAM, 0/*IPPROTO_TCP*/);
 
+    /* check for errors */
+    if(fd == INVALID_SOCKET) {
+        pdebug(DEBUG_WARN,"Socket creation failed, error: %d", WSAGetLastError());
+        return INVALID_SOCKET;
+    }
 
+    /* set up our socket to allow reuse if we crash suddenly. */
+    sock_opt = 1;
 
+    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
+        closesocket(fd);
+        pdebug(DEBUG_WARN,"Error setting socket reuse option, errno: %d",errno);
+        return INVALID_SOCKET;
+    }
 
-extern int socket_read(sock_p s, uint8_t *buf, int size)
-{
-    int rc;
+    timeout.tv_sec = 10;
+    timeout.tv_usec = 0;
 
-    if(!s || !buf) {
-        return PLCTAG_ERR_NULL_PTR;
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
+        closesocket(fd);
+        pdebug(DEBUG_WARN,"Error setting socket receive timeout option, errno: %d",errno);
+        return INVALID_SOCKET;
     }
 
-    if(!s->is_open) {
-        pdebug(DEBUG_WARN, "Socket is not open!");
-        return PLCTAG_ERR_READ;
+    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
+        closesocket(fd);
+        pdebug(DEBUG_WARN,"Error setting socket set timeout option, errno: %d",errno);
+        return INVALID_SOCKET;
     }
 
-    /* The socket is non-blocking. */
-    rc = recv(s->fd, (char *)buf, size, 0);
+    /* find out about dead peers on idle connections. */
+    keepalive.onoff = 1;
+    keepalive.keepalivetime = SOCKET_KEEPALIVE_IDLE_MS;
+    keepalive.keepaliveinterval = SOCKET_KEEPALIVE_INTERVAL_MS;
 
-    if(rc < 0) {
-        int err = WSAGetLastError();
+    if(WSAIoctl(fd, SIO_KEEPALIVE_VALS, &keepalive, (DWORD)sizeof(keepalive), NULL, 0, &bytes_returned, NULL, NULL)) {
+        closesocket(fd);
+        pdebug(DEBUG_WARN,"Error setting socket keepalive option, error: %d", WSAGetLastError());
+        return INVALID_SOCKET;
+    }
 
-        if(err == WSAEWOULDBLOCK) {
-            return 0;
-        } else {
-            pdebug(DEBUG_WARN,"socket read error rc=%d, errno=%d", rc, err);
+    /* abort the connection on close. */
+    so_linger.l_onoff = 1;
+    so_linger.l_linger = 0;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger))) {
+        closesocket(fd);
+        pdebug(DEBUG_ERROR,"Error setting socket close linger option, errno: %d",errno);
+        return INVALID_SOCKET;
+    }
+
+    /* connect() does not block, we wait for the socket to become writable. */
+    if(ioctlsocket(fd,FIONBIO,&non_blocking)) {
+        pdebug(DEBUG_WARN, "Error setting socket to non-blocking, error: %d", WSAGetLastError());
+        closesocket(fd);
+        return INVALID_SOCKET;
+    }
+
+    return fd;
+}
+
+
+/*
+ * socket_connect_next_ip
+ *
+ * Start a connection to the next address we have not tried yet.  The
+ * attempts already in progress keep going.
+ */
+int socket_connect_next_ip(sock_p s)
+{
+    struct sockaddr_in gw_addr;
+
+    memset((void *)&gw_addr,0, sizeof(gw_addr));
+    gw_addr.sin_family = AF_INET ;
+    gw_addr.sin_port = htons((u_short)s->port);
+
+    /* try each IP until we run out or get a connection started. */
+    while(s->next_ip < s->num_ips) {
+        int rc;
+        SOCKET fd = socket_open_fd();
+
+        if(fd == INVALID_SOCKET) {
+            return PLCTAG_ERR_OPEN;
+        }
+
+        gw_addr.sin_addr.s_addr = s->ips[s->next_ip].s_addr;
+        s->next_ip++;
+
+        s->attempts[s->num_attempts].fd = fd;
+        s->attempts[s->num_attempts].ip_index = s->next_ip - 1;
+        s->num_attempts++;
+        s->fd = s->attempts[0].fd;
+
+        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+
+        if(rc == 0) {
+            socket_connect_use_attempt(s, s->num_attempts - 1);
+            return PLCTAG_STATUS_OK;
+        } else if(WSAGetLastError() == WSAEWOULDBLOCK) {
+            s->next_attempt_time = time_ms() + SOCKET_CONNECT_STAGGER_MS;
+            return PLCTAG_STATUS_PENDING;
+        } else {
+            /* MSVC does not like inet_ntoa(), not safe. */
+            pdebug(DEBUG_DETAIL, "Attempt to connect failed, error: %d", WSAGetLastError());
+            socket_connect_drop_attempt(s, s->num_attempts - 1);
+        }
+    }
+
+    if(s->num_attempts > 0) {
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    pdebug(DEBUG_WARN,"Unable to connect to any gateway host IP address!");
+
+    addr_cache_forget(s->host);
+
+    return PLCTAG_ERR_OPEN;
+}
+
+
+/*
+ * socket_connect_drop_attempt
+ *
+ * Close a failed connection attempt.
+ */
+void socket_connect_drop_attempt(sock_p s, int index)
+{
+    closesocket(s->attempts[index].fd);
+
+    for(int i=index; i+1 < s->num_attempts; i++) {
+        s->attempts[i] = s->attempts[i+1];
+    }
+
+    s->num_attempts--;
+    s->fd = (s->num_attempts > 0 ? s->attempts[0].fd : INVALID_SOCKET);
+}
+
+
+/*
+ * socket_connect_use_attempt
+ *
+ * The connection attempt worked.  It becomes the socket and the
+ * rest are closed.
+ */
+void socket_connect_use_attempt(sock_p s, int index)
+{
+    SOCKET fd = s->attempts[index].fd;
+
+    for(int i=0; i < s->num_attempts; i++) {
+        if(i != index) {
+            closesocket(s->attempts[i].fd);
+        }
+    }
+
+    /* try this address first next time. */
+    if(s->attempts[index].ip_index > 0) {
+        addr_cache_prefer(s->host, s->ips[s->attempts[index].ip_index]);
+    }
+
+    s->num_attempts = 0;
+    s->fd = fd;
+    s->is_open = 1;
+}
+
+
+/*
+ * addr_cache_lookup
+ *
+ * Copy the addresses of the host into ips if they were looked up
+ * recently.  Returns the number of addresses, zero if none.
+ */
+int addr_cache_lookup(const char *host, IN_ADDR *ips)
+{
+    int64_t now = time_ms();
+    int num_ips = 0;
+
+    spin_block(&addr_cache_lock) {
+        for(int i=0; i < ADDR_CACHE_SIZE; i++) {
+            struct addr_cache_entry_t *entry = &addr_cache[i];
+
+            if(entry->num_ips > 0 && entry->expire_time > now && str_cmp_i(entry->host, host) == 0) {
+                mem_copy(ips, entry->ips, (int)sizeof(entry->ips[0]) * entry->num_ips);
+                num_ips = entry->num_ips;
+                break;
+            }
+        }
+    }
+
+    return num_ips;
+}
+
+
+/*
+ * addr_cache_store
+ *
+ * Remember the addresses of the host.  The entry for the same host, an
+ * unused one or the one closest to expiring is replaced.
+ */
+void addr_cache_store(const char *host, IN_ADDR *ips, int num_ips)
+{
+    int64_t now = time_ms();
+
+    if(num_ips <= 0 || str_length(host) >= ADDR_CACHE_MAX_HOST) {
+        return;
+    }
+
+    spin_block(&addr_cache_lock) {
+        struct addr_cache_entry_t *entry = &addr_cache[0];
+
+        for(int i=0; i < ADDR_CACHE_SIZE; i++) {
+            if(addr_cache[i].num_ips > 0 && str_cmp_i(addr_cache[i].host, host) == 0) {
+                entry = &addr_cache[i];
+                break;
+            }
+
+            if(addr_cache[i].expire_time < entry->expire_time) {
+                entry = &addr_cache[i];
+            }
+        }
+
+        str_copy(entry->host, ADDR_CACHE_MAX_HOST, host);
+        mem_copy(entry->ips, ips, (int)sizeof(ips[0]) * num_ips);
+        entry->num_ips = num_ips;
+        entry->expire_time = now + ADDR_CACHE_TTL_MS;
+    }
+}
+
+
+/*
+ * addr_cache_forget
+ *
+ * None of the addresses worked, look the host up again next time.
+ */
+void addr_cache_forget(const char *host)
+{
+    if(!host) {
+        return;
+    }
+
+    spin_block(&addr_cache_lock) {
+        for(int i=0; i < ADDR_CACHE_SIZE; i++) {
+            if(addr_cache[i].num_ips > 0 && str_cmp_i(addr_cache[i].host, host) == 0) {
+                addr_cache[i].num_ips = 0;
+                addr_cache[i].expire_time = 0;
+            }
+        }
+    }
+}
+
+
+/*
+ * addr_cache_prefer
+ *
+ * Swap the address that worked to the front of the host's list.
+ */
+void addr_cache_prefer(const char *host, IN_ADDR ip)
+{
+    if(!host) {
+        return;
+    }
+
+    spin_block(&addr_cache_lock) {
+        for(int i=0; i < ADDR_CACHE_SIZE; i++) {
+            struct addr_cache_entry_t *entry = &addr_cache[i];
+
+            if(entry->num_ips > 0 && str_cmp_i(entry->host, host) == 0) {
+                for(int j=1; j < entry->num_ips; j++) {
+                    if(entry->ips[j].s_addr == ip.s_addr) {
+                        entry->ips[j] = entry->ips[0];
+                        entry->ips[0] = ip;
+                        break;
+                    }
+                }
+
+                break;
+            }
+        }
+    }
+}
+
+
+
+
+extern int socket_read(sock_p s, uint8_t *buf, int size)
+{
+    int rc;
+
+    if(!s || !buf) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!s->is_open) {
+        pdebug(DEBUG_WARN, "Socket is not open!");
+        return PLCTAG_ERR_READ;
+    }
+
+    /* The socket is non-blocking. */
+    rc = recv(s->fd, (char *)buf, size, 0);
+
+    if(rc < 0) {
+        int err = WSAGetLastError();
+
+        if(err == WSAEWOULDBLOCK) {
+            return 0;
+        } else {
+            pdebug(DEBUG_WARN,"socket read error rc=%d, errno=%d", rc, err);
             return PLCTAG_ERR_READ;
         }
     }
 
+    /* a zero-length read on a readable socket means the other end closed it. */
+    if(rc == 0 && size > 0) {
+        pdebug(DEBUG_WARN, "Socket closed by remote end!");
+        return PLCTAG_ERR_READ;
+    }
+
     return rc;
 }
 
@@ -1082,21 +1634,78 @@ extern int socket_write(sock_p s, uint8_t *buf, int size)
 
 
 
+/*
+ * socket_write_vec
+ *
+ * Write the pieces in iov out as one stream without copying them
+ * together first.  At most SOCKET_MAX_IOVEC pieces are used.  Returns the
+ * number of bytes written, which may be less than the total.
+ */
+extern int socket_write_vec(sock_p s, socket_iovec_t *iov, int iov_count)
+{
+    WSABUF bufs[SOCKET_MAX_IOVEC];
+    DWORD bytes_sent = 0;
+    int rc;
+
+    if(!s || !iov) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!s->is_open) {
+        pdebug(DEBUG_WARN, "Socket is not open!");
+        return PLCTAG_ERR_WRITE;
+    }
+
+    if(iov_count > SOCKET_MAX_IOVEC) {
+        iov_count = SOCKET_MAX_IOVEC;
+    }
+
+    for(int i=0; i < iov_count; i++) {
+        bufs[i].buf = (CHAR *)iov[i].data;
+        bufs[i].len = (ULONG)iov[i].size;
+    }
+
+    /* The socket is non-blocking. */
+    rc = WSASend(s->fd, bufs, (DWORD)iov_count, &bytes_sent, 0, NULL, NULL);
+
+    if(rc == SOCKET_ERROR) {
+        int err = WSAGetLastError();
+
+        if(err == WSAEWOULDBLOCK) {
+            return PLCTAG_ERR_NO_DATA;
+        } else {
+            pdebug(DEBUG_WARN,"socket write error rc=%d, errno=%d", rc, err);
+            return PLCTAG_ERR_WRITE;
+        }
+    }
+
+    return (int)bytes_sent;
+}
+
+
+
 extern int socket_close(sock_p s)
 {
     if(!s) {
         return PLCTAG_ERR_NULL_PTR;
     }
 
-    if(!s->is_open) {
+    if(s->fd == INVALID_SOCKET) {
         return PLCTAG_STATUS_OK;
     }
 
-    if(!closesocket(s->fd)) {
+    /* stop any other connection attempts, the first one is the fd. */
+    for(int i=1; i < s->num_attempts; i++) {
+        closesocket(s->attempts[i].fd);
+    }
+
+    s->num_attempts = 0;
+
+    if(closesocket(s->fd)) {
         return PLCTAG_ERR_CLOSE;
     }
 
-    s->fd = 0;
+    s->fd = INVALID_SOCKET;
     s->is_open = 0;
 
     return PLCTAG_STATUS_OK;
@@ -1110,6 +1719,10 @@ extern int socket_destroy(sock_p *s)
 
     socket_close(*s);
 
+    if((*s)->host) {
+        mem_free((*s)->host);
+    }
+
     mem_free(*s);
 
     *s = 0;
@@ -1122,6 +1735,277 @@ extern int socket_destroy(sock_p *s)
 
 
 
+/*
+ * Socket pollers wait for any of a set of sockets to become ready.
+ * Windows does not have epoll so we keep our own list of sockets and
+ * use WSAPoll().  A loopback UDP socket connected to itself is used
+ * so that other threads can wake up the thread waiting on the poller.
+ */
+
+extern int socket_poller_create(socket_poller_p *p)
+{
+    struct sockaddr_in addr;
+    int addr_len = sizeof(addr);
+    u_long non_blocking=1;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!p) {
+        pdebug(DEBUG_WARN, "Null poller pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(!socket_lib_init()) {
+        pdebug(DEBUG_WARN,"error initializing Windows Sockets.");
+        return PLCTAG_ERR_WINSOCK;
+    }
+
+    *p = (socket_poller_p)mem_alloc(sizeof(struct socket_poller_t));
+    if(! *p) {
+        pdebug(DEBUG_ERROR, "Unable to allocate memory for socket poller!");
+        WSACleanup();
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    (*p)->wake_fd = INVALID_SOCKET;
+
+    rc = mutex_create(&(*p)->mutex);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create poller mutex!");
+        socket_poller_destroy(p);
+        return rc;
+    }
+
+    (*p)->wake_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if((*p)->wake_fd == INVALID_SOCKET) {
+        pdebug(DEBUG_ERROR, "Unable to create wake up socket, error: %d", WSAGetLastError());
+        socket_poller_destroy(p);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    mem_set(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    if(bind((*p)->wake_fd, (struct sockaddr *)&addr, sizeof(addr))
+       || getsockname((*p)->wake_fd, (struct sockaddr *)&addr, &addr_len)
+       || connect((*p)->wake_fd, (struct sockaddr *)&addr, sizeof(addr))
+       || ioctlsocket((*p)->wake_fd, FIONBIO, &non_blocking)) {
+        pdebug(DEBUG_ERROR, "Unable to set up wake up socket, error: %d", WSAGetLastError());
+        socket_poller_destroy(p);
+        return PLCTAG_ERR_CREATE;
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+extern int socket_poller_destroy(socket_poller_p *p)
+{
+    if(!p || !*p) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if((*p)->wake_fd != INVALID_SOCKET) {
+        closesocket((*p)->wake_fd);
+    }
+
+    if((*p)->mutex) {
+        mutex_destroy(&(*p)->mutex);
+    }
+
+    if((*p)->entries) {
+        mem_free((*p)->entries);
+    }
+
+    mem_free(*p);
+
+    *p = NULL;
+
+    WSACleanup();
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * socket_poller_set
+ *
+ * Set the events (SOCKET_EVENT_READ and/or SOCKET_EVENT_WRITE) we want
+ * to hear about for the socket.  Passing zero events removes the
+ * socket from the poller.  The context is returned by
+ * socket_poller_wait() when the socket is ready.
+ */
+extern int socket_poller_set(socket_poller_p p, sock_p s, int events, void *context)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!p || !s) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    critical_block(p->mutex) {
+        int i = 0;
+
+        for(i=0; i < p->num_entries && p->entries[i].sock != s; i++) { }
+
+        /* nothing to watch, or the socket is going away. */
+        if(!events || s->fd == INVALID_SOCKET) {
+            if(i < p->num_entries) {
+                p->entries[i] = p->entries[p->num_entries - 1];
+                p->num_entries--;
+            }
+
+            break;
+        }
+
+        if(i == p->num_entries) {
+            if(p->num_entries >= p->max_entries) {
+                int new_max = (p->max_entries ? p->max_entries * 2 : 16);
+                struct socket_poller_entry_t *new_entries = mem_realloc(p->entries, (int)sizeof(*new_entries) * new_max);
+
+                if(!new_entries) {
+                    rc = PLCTAG_ERR_NO_MEM;
+                    break;
+                }
+
+                p->entries = new_entries;
+                p->max_entries = new_max;
+            }
+
+            p->num_entries++;
+        }
+
+        p->entries[i].sock = s;
+        p->entries[i].events = events;
+        p->entries[i].context = context;
+    }
+
+    return rc;
+}
+
+
+/*
+ * socket_poller_wait
+ *
+ * Wait until at least one socket is ready, the poller is woken up or
+ * the timeout passes.  The contexts of the ready sockets are put in
+ * the passed array.  Returns the number of contexts.
+ */
+extern int socket_poller_wait(socket_poller_p p, void **contexts, int max_contexts, int timeout_ms)
+{
+    WSAPOLLFD *pfds = NULL;
+    void **pfd_contexts = NULL;
+    int num_pfds = 0;
+    int num_contexts = 0;
+    int rc = 0;
+
+    if(!p || !contexts) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* take a copy of the sockets so that others can change the set while we wait. */
+    critical_block(p->mutex) {
+        /* a connecting socket may have an attempt in progress to each address. */
+        num_pfds = (p->num_entries * MAX_IPS) + 1;
+        pfds = mem_alloc((int)sizeof(*pfds) * num_pfds);
+        pfd_contexts = mem_alloc((int)sizeof(*pfd_contexts) * num_pfds);
+
+        if(!pfds || !pfd_contexts) {
+            break;
+        }
+
+        pfds[0].fd = p->wake_fd;
+        pfds[0].events = POLLRDNORM;
+        pfd_contexts[0] = NULL;
+        num_pfds = 1;
+
+        for(int i=0; i < p->num_entries; i++) {
+            sock_p s = p->entries[i].sock;
+            short events = (short)(((p->entries[i].events & SOCKET_EVENT_READ) ? POLLRDNORM : 0) | ((p->entries[i].events & SOCKET_EVENT_WRITE) ? POLLWRNORM : 0));
+
+            if(s->fd == INVALID_SOCKET) {
+                continue;
+            }
+
+            pfds[num_pfds].fd = s->fd;
+            pfds[num_pfds].events = events;
+            pfd_contexts[num_pfds] = p->entries[i].context;
+            num_pfds++;
+
+            for(int j=1; j < s->num_attempts; j++) {
+                pfds[num_pfds].fd = s->attempts[j].fd;
+                pfds[num_pfds].events = POLLWRNORM;
+                pfd_contexts[num_pfds] = p->entries[i].context;
+                num_pfds++;
+            }
+        }
+    }
+
+    if(!pfds || !pfd_contexts) {
+        pdebug(DEBUG_ERROR, "Unable to allocate memory for poll set!");
+        mem_free(pfds);
+        mem_free(pfd_contexts);
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    rc = WSAPoll(pfds, (ULONG)num_pfds, timeout_ms);
+
+    if(rc == SOCKET_ERROR) {
+        pdebug(DEBUG_WARN, "Error waiting for socket events, error: %d", WSAGetLastError());
+        rc = PLCTAG_ERR_READ;
+    } else {
+        /* clear any wake ups. */
+        if(pfds[0].revents) {
+            char buf[16];
+
+            while(recv(p->wake_fd, buf, sizeof(buf), 0) > 0) { }
+        }
+
+        for(int i=1; i < num_pfds && num_contexts < max_contexts; i++) {
+            if(pfds[i].revents) {
+                contexts[num_contexts] = pfd_contexts[i];
+                num_contexts++;
+            }
+        }
+
+        rc = num_contexts;
+    }
+
+    mem_free(pfds);
+    mem_free(pfd_contexts);
+
+    return rc;
+}
+
+
+/*
+ * socket_poller_wakeup
+ *
+ * Make socket_poller_wait() return now.  Safe to call from any thread.
+ */
+extern int socket_poller_wakeup(socket_poller_p p)
+{
+    char one = 1;
+
+    if(!p) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(send(p->wake_fd, &one, 1, 0) < 0 && WSAGetLastError() != WSAEWOULDBLOCK) {
+        pdebug(DEBUG_WARN, "Error waking up poller, error: %d", WSAGetLastError());
+        return PLCTAG_ERR_WRITE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 
 
 
@@ -1393,6 +2277,137 @@ int plc_lib_serial_port_write(serial_port_p serial_port, uint8_t *data, int size
 
 
 
+/***************************************************************************
+ ******************************** Files ************************************
+ **************************************************************************/
+
+
+/*
+ * file_read_all
+ *
+ * Read the whole file into a new buffer.  The buffer is zero terminated
+ * so that it can be used as a string, the terminator is not counted in
+ * the size.  The caller frees it with mem_free().  Returns
+ * PLCTAG_ERR_NOT_FOUND if there is no such file.
+ */
+int file_read_all(const char *name, char **data, int *size)
+{
+    FILE *file = NULL;
+    char *buf = NULL;
+    int buf_size = 0;
+    int len = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!name || !data || !size) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    *data = NULL;
+    *size = 0;
+
+    if(fopen_s(&file, name, "rb") || !file) {
+        return (errno == ENOENT ? PLCTAG_ERR_NOT_FOUND : PLCTAG_ERR_OPEN);
+    }
+
+    do {
+        size_t count = 0;
+
+        /* grow the buffer, leaving room for the terminator. */
+        if(len + 1 >= buf_size) {
+            char *new_buf = mem_realloc(buf, buf_size + 4096);
+
+            if(!new_buf) {
+                rc = PLCTAG_ERR_NO_MEM;
+                break;
+            }
+
+            buf = new_buf;
+            buf_size += 4096;
+        }
+
+        count = fread(buf + len, 1, (size_t)(buf_size - len - 1), file);
+
+        len += (int)count;
+
+        if(count == 0) {
+            if(ferror(file)) {
+                rc = PLCTAG_ERR_READ;
+            }
+
+            break;
+        }
+    } while(1);
+
+    fclose(file);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        mem_free(buf);
+        return rc;
+    }
+
+    buf[len] = 0;
+
+    *data = buf;
+    *size = len;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * file_replace
+ *
+ * Replace the contents of the file.  The data is written to a temporary
+ * file next to it that is then moved over the old one, so readers see
+ * either all of the old contents or all of the new.
+ */
+int file_replace(const char *name, const char *data, int size)
+{
+    char *tmp_name = NULL;
+    FILE *file = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!name || (!data && size > 0)) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    tmp_name = str_concat(name, ".tmp");
+    if(!tmp_name) {
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    if(fopen_s(&file, tmp_name, "wb") || !file) {
+        pdebug(DEBUG_WARN, "Unable to create %s, errno: %d", tmp_name, errno);
+        mem_free(tmp_name);
+        return PLCTAG_ERR_OPEN;
+    }
+
+    if(size > 0 && fwrite(data, 1, (size_t)size, file) != (size_t)size) {
+        rc = PLCTAG_ERR_WRITE;
+    }
+
+    if(fclose(file) && rc == PLCTAG_STATUS_OK) {
+        rc = PLCTAG_ERR_WRITE;
+    }
+
+    if(rc == PLCTAG_STATUS_OK && !MoveFileExA(tmp_name, name, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        pdebug(DEBUG_WARN, "Unable to move %s to %s, error: %d", tmp_name, name, (int)GetLastError());
+        rc = PLCTAG_ERR_WRITE;
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        DeleteFileA(tmp_name);
+    }
+
+    mem_free(tmp_name);
+
+    return rc;
+}
+
+
+
+
 /***************************************************************************
  ***************************** Miscellaneous *******************************
  **************************************************************************/
@@ -1435,6 +2450,31 @@ int64_t time_ms(void)
 }
 
 
+/*
+ * time_us
+ *
+ * Return current system time in microsecond units.  Same epoch as
+ * time_ms().
+ */
+
+int64_t time_us(void)
+{
+    FILETIME ft;
+    int64_t res;
+
+    GetSystemTimeAsFileTime(&ft);
+
+    /* calculate time as 100ns increments since Jan 1, 1601. */
+    res = (int64_t)(ft.dwLowDateTime) + ((int64_t)(ft.dwHighDateTime) << 32);
+
+    /* get time in us */
+
+    res = res / 10;
+
+    return  res;
+}
+
+
 struct tm *localtime_r(const time_t *timep, struct tm *result)
 {
     time_t t = *timep;
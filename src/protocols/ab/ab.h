@@ -36,6 +36,7 @@
 void ab_teardown(void);
 int ab_init();
 plc_tag_p ab_tag_create(attr attribs);
+int ab_prewarm(attr attribs, int timeout);
 
 
 #endif
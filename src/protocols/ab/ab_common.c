@@ -38,6 +38,8 @@
 #include <ab/eip_plc5_pccc.h>
 #include <ab/eip_slc_pccc.h>
 #include <ab/eip_dhp_pccc.h>
+#include <system/system.h>
+#include <ab/payload_cache.h>
 #include <ab/session.h>
 #include <ab/tag.h>
 #include <util/attr.h>
@@ -51,8 +53,10 @@
 
 //volatile ab_session_p sessions = NULL;
 //volatile mutex_p global_session_mut = NULL;
-//
-//volatile vector_p read_group_tags = NULL;
+
+/* tags that are members of a read group. */
+static volatile mutex_p read_group_mutex = NULL;
+static volatile vector_p read_group_tags = NULL;
 
 
 /* request/response handling thread */
@@ -76,6 +80,9 @@ volatile int library_terminating = 0;
 
 /* forward declarations*/
 static int get_tag_data_type(ab_tag_p tag, attr attribs);
+static int setup_stripes(ab_tag_p tag, attr attribs);
+static int pack_stats(uint64_t *values, int max_values);
+static int shed_count(uint64_t *values, int max_values);
 
 static void ab_tag_destroy(ab_tag_p tag);
 static int default_abort(plc_tag_p tag);
@@ -87,7 +94,7 @@ static int default_write(plc_tag_p tag);
 
 
 /* vtables for different kinds of tags */
-struct tag_vtable_t default_vtable = { default_abort, default_read, default_status, default_tickler, default_write };
+struct tag_vtable_t default_vtable = { default_abort, default_read, default_status, default_tickler, default_write, NULL, NULL };
 
 
 /*
@@ -101,11 +108,34 @@ int ab_init(void)
 
     pdebug(DEBUG_INFO,"Initializing AB protocol library.");
 
+    if((rc = payload_cache_startup()) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to initialize payload size cache!");
+        return rc;
+    }
+
     if((rc = session_startup()) != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to initialize session library!");
         return rc;
     }
 
+    if((rc = mutex_create((mutex_p *)&read_group_mutex)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create read group mutex!");
+        return rc;
+    }
+
+    read_group_tags = vector_create(10, 10);
+    if(!read_group_tags) {
+        pdebug(DEBUG_ERROR, "Unable to allocate read group tag list!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    /* publish the session statistics as system tags. */
+    if((rc = system_tag_register_stats("pack_stats", pack_stats)) != PLCTAG_STATUS_OK
+    || (rc = system_tag_register_stats("shed_count", shed_count)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to publish session statistics!");
+        return rc;
+    }
+
     pdebug(DEBUG_INFO,"Finished initializing AB protocol library.");
 
     return rc;
@@ -118,6 +148,9 @@ void ab_teardown(void)
 {
     pdebug(DEBUG_INFO,"Releasing global AB protocol resources.");
 
+    system_tag_unregister_stats("pack_stats");
+    system_tag_unregister_stats("shed_count");
+
     pdebug(DEBUG_INFO,"Terminating IO thread.");
     /* kill the IO thread first. */
     library_terminating = 1;
@@ -130,15 +163,167 @@ void ab_teardown(void)
 
     session_teardown();
 
+    payload_cache_teardown();
+
+    pdebug(DEBUG_INFO,"Freeing read group information.");
+
+    if(read_group_tags) {
+        vector_destroy(read_group_tags);
+        read_group_tags = NULL;
+    }
+
+    if(read_group_mutex) {
+        mutex_destroy((mutex_p *)&read_group_mutex);
+        read_group_mutex = NULL;
+    }
+
     pdebug(DEBUG_INFO,"Done.");
 }
 
 
+/*
+ * how well requests are being packed into packets, over all sessions:
+ * packets, requests in them, payload bytes used and payload bytes
+ * available.
+ */
+int pack_stats(uint64_t *values, int max_values)
+{
+    if(max_values < 4) {
+        return 0;
+    }
+
+    session_get_pack_stats(&values[0], &values[1], &values[2], &values[3]);
+
+    return 4;
+}
+
+
+/*
+ * how many requests were dropped unsent because their caller stopped waiting.
+ */
+int shed_count(uint64_t *values, int max_values)
+{
+    if(max_values < 1) {
+        return 0;
+    }
+
+    values[0] = session_get_shed_count();
+
+    return 1;
+}
+
+
+
+/*
+ * ab_prewarm
+ *
+ * Open the sessions that tags with these attributes would use, so that
+ * the connection is up before the first tag is created.  The sessions
+ * stay open until the library shuts down.  With a timeout, wait until
+ * they are all connected.
+ */
+int ab_prewarm(attr attribs, int timeout)
+{
+    const char *gateway = attr_get_str(attribs, "gateway", NULL);
+    int connections = attr_get_int(attribs, "connections", 1);
+    int use_connected_msg = 0;
+    ab_session_p prewarmed[SESSION_MAX_STRIPES];
+    int num_prewarmed = 0;
+    int64_t timeout_time = time_ms() + timeout;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!gateway || str_length(gateway) == 0) {
+        pdebug(DEBUG_WARN, "A gateway is required!");
+        return PLCTAG_ERR_BAD_GATEWAY;
+    }
+
+    if(connections < 1 || connections > SESSION_MAX_STRIPES) {
+        pdebug(DEBUG_WARN, "Number of connections, %d, must be between 1 and %d!", connections, SESSION_MAX_STRIPES);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    /* the same connection choice that tag creation makes. */
+    switch(get_plc_type(attribs)) {
+    case AB_PROTOCOL_PLC:
+    case AB_PROTOCOL_SLC:
+    case AB_PROTOCOL_MLGX:
+    case AB_PROTOCOL_LGX_PCCC:
+        use_connected_msg = 0;
+        break;
+
+    case AB_PROTOCOL_LGX:
+        if(!attr_get_str(attribs, "path", NULL)) {
+            pdebug(DEBUG_WARN,"A path is required for Logix-class PLCs!");
+            return PLCTAG_ERR_BAD_PARAM;
+        }
+
+        use_connected_msg = attr_get_int(attribs, "use_connected_msg", 1);
+        break;
+
+    case AB_PROTOCOL_MLGX800:
+        use_connected_msg = 1;
+        break;
+
+    default:
+        pdebug(DEBUG_WARN, "CPU type not valid or missing.");
+        return PLCTAG_ERR_BAD_DEVICE;
+    }
+
+    if(connections > 1 && (get_plc_type(attribs) != AB_PROTOCOL_LGX || !use_connected_msg)) {
+        pdebug(DEBUG_WARN, "Multiple connections are only supported for connected Logix tags!");
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    attr_set_int(attribs, "use_connected_msg", use_connected_msg);
+
+    for(int i=0; i < connections; i++) {
+        ab_session_p session = NULL;
+
+        rc = session_find_or_create_stripe(&session, attribs, gateway, i);
+        if(rc != PLCTAG_STATUS_OK || !session) {
+            pdebug(DEBUG_WARN, "Unable to create session %d to %s!", i, gateway);
+            return (rc != PLCTAG_STATUS_OK ? rc : PLCTAG_ERR_BAD_GATEWAY);
+        }
+
+        /* the held reference keeps it alive while we look at it. */
+        prewarmed[num_prewarmed++] = session;
+
+        rc = session_hold(session);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to keep session %d to %s!", i, gateway);
+            return rc;
+        }
+    }
+
+    if(!timeout) {
+        pdebug(DEBUG_INFO, "Done.");
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    /* wait for all the sessions to connect. */
+    for(int i=0; i < num_prewarmed && rc == PLCTAG_STATUS_OK; i++) {
+        rc = session_wait_status(prewarmed[i], timeout_time);
+    }
+
+    if(rc == PLCTAG_STATUS_PENDING) {
+        pdebug(DEBUG_WARN, "Timed out waiting for %s to connect!", gateway);
+        rc = PLCTAG_ERR_TIMEOUT;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
 
 plc_tag_p ab_tag_create(attr attribs)
 {
     ab_tag_p tag = AB_TAG_NULL;
     const char *path = NULL;
+    const char *priority = NULL;
     int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO,"Starting.");
@@ -148,7 +333,7 @@ plc_tag_p ab_tag_create(attr attribs)
      * we have a vehicle for returning status.
      */
 
-    tag = (ab_tag_p)rc_alloc(sizeof(struct ab_tag_t), (rc_cleanup_func)ab_tag_destroy);
+    tag = (ab_tag_p)plc_tag_alloc(sizeof(struct ab_tag_t), (tag_destroy_func)ab_tag_destroy);
 
     if(!tag) {
         pdebug(DEBUG_ERROR,"Unable to allocate memory for AB EIP tag!");
@@ -231,6 +416,8 @@ plc_tag_p ab_tag_create(attr attribs)
         /* default to requiring a connection. */
         tag->use_connected_msg = attr_get_int(attribs,"use_connected_msg", 1);
         tag->allow_packing = attr_get_int(attribs, "allow_packing", 1);
+        tag->allow_linger = attr_get_int(attribs, "allow_linger", 1);
+        tag->parallel_write = attr_get_int(attribs, "parallel_write", 0);
         tag->vtable = &eip_cip_vtable;
 
         break;
@@ -249,6 +436,30 @@ plc_tag_p ab_tag_create(attr attribs)
         break;
     }
 
+    /* reads can be put ahead of background polling. */
+    priority = attr_get_str(attribs, "priority", "normal");
+    if(str_cmp_i(priority, "normal") == 0) {
+        tag->priority = SESSION_PRIORITY_NORMAL;
+    } else if(str_cmp_i(priority, "high") == 0) {
+        tag->priority = SESSION_PRIORITY_HIGH;
+    } else {
+        pdebug(DEBUG_WARN, "Priority must be \"normal\" or \"high\"!");
+        tag->status = PLCTAG_ERR_BAD_PARAM;
+        return (plc_tag_p)tag;
+    }
+
+    /*
+     * the session shares the link fairly between tags, or between the
+     * classes tags are put in, in proportion to their weights.
+     */
+    tag->sched_class = attr_get_int(attribs, "sched_class", 0);
+    tag->sched_weight = attr_get_int(attribs, "sched_weight", SESSION_DEFAULT_SCHED_WEIGHT);
+    if(tag->sched_class < 0 || tag->sched_weight < 1 || tag->sched_weight > SESSION_MAX_SCHED_WEIGHT) {
+        pdebug(DEBUG_WARN, "Scheduling class must not be negative and weight must be between 1 and %d!", SESSION_MAX_SCHED_WEIGHT);
+        tag->status = PLCTAG_ERR_BAD_PARAM;
+        return (plc_tag_p)tag;
+    }
+
     /* determine the total tag size if this is not a tag list. */
     if(!tag->tag_list) {
         if(!tag->elem_size) {
@@ -292,14 +503,25 @@ plc_tag_p ab_tag_create(attr attribs)
      *
      * All tags need sessions.  They are the TCP connection to the gateway PLC.
      */
-    if(session_find_or_create(&tag->session, attribs) != PLCTAG_STATUS_OK) {
+    if(session_find_or_create(&tag->stripes[0], attribs) != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_INFO,"Unable to create session!");
         tag->status = PLCTAG_ERR_BAD_GATEWAY;
         return (plc_tag_p)tag;
     }
 
+    tag->num_stripes = 1;
+    tag->session = tag->stripes[0];
+
     pdebug(DEBUG_DETAIL, "using session=%p", tag->session);
 
+    /* more connections to spread the requests over? */
+    rc = setup_stripes(tag, attribs);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_INFO, "Unable to set up extra connections!");
+        tag->status = rc;
+        return (plc_tag_p)tag;
+    }
+
     /*
      * check the tag name, this is protocol specific.
      */
@@ -313,12 +535,177 @@ plc_tag_p ab_tag_create(attr attribs)
     /* trigger the first read. */
     tag->first_read = 1;
 
+    /* tags in a read group are read together. */
+    if(attr_get_str(attribs, "read_group", NULL)) {
+        if(tag->vtable != &eip_cip_vtable || !tag->use_connected_msg || !tag->allow_packing || tag->tag_list) {
+            pdebug(DEBUG_WARN, "Read groups are only supported for connected Logix tags that allow packing!");
+            tag->status = PLCTAG_ERR_UNSUPPORTED;
+            return (plc_tag_p)tag;
+        }
+
+        tag->read_group = str_dup(attr_get_str(attribs, "read_group", NULL));
+        if(!tag->read_group) {
+            pdebug(DEBUG_WARN, "Unable to copy read group name!");
+            tag->status = PLCTAG_ERR_NO_MEM;
+            return (plc_tag_p)tag;
+        }
+
+        critical_block(read_group_mutex) {
+            vector_put(read_group_tags, vector_length(read_group_tags), tag);
+        }
+    }
+
     pdebug(DEBUG_INFO,"Done.");
 
     return (plc_tag_p)tag;
 }
 
 
+
+/*
+ * find_read_group_tags
+ *
+ * Return a new vector with the other tags in the same read group on
+ * the same session as the passed tag.  Each tag in the vector has a
+ * reference that the caller must release before destroying the vector.
+ * Returns NULL if the tag is not in a read group.
+ */
+
+vector_p find_read_group_tags(ab_tag_p tag)
+{
+    vector_p result = NULL;
+
+    if(!tag || !tag->read_group) {
+        return NULL;
+    }
+
+    result = vector_create(10, 10);
+    if(!result) {
+        pdebug(DEBUG_WARN, "Unable to allocate read group result list!");
+        return NULL;
+    }
+
+    critical_block(read_group_mutex) {
+        for(int i=0; i < vector_length(read_group_tags); i++) {
+            ab_tag_p member = vector_get(read_group_tags, i);
+
+            if(member == tag || member->stripes[0] != tag->stripes[0] || str_cmp(member->read_group, tag->read_group) != 0) {
+                continue;
+            }
+
+            /* skip tags that are being destroyed. */
+            member = rc_inc(member);
+            if(member) {
+                vector_put(result, vector_length(result), member);
+            }
+        }
+    }
+
+    return result;
+}
+
+
+/*
+ * ab_tag_use_session
+ *
+ * Make the passed session the one the tag's next operation uses, if it
+ * is one of the tag's sessions.  Returns non-zero if it is.  This is not
+ * thread-safe, call it with the tag's mutex held.
+ */
+
+int ab_tag_use_session(ab_tag_p tag, ab_session_p session)
+{
+    for(int i=0; i < tag->num_stripes; i++) {
+        if(tag->stripes[i] == session) {
+            tag->session = session;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * setup_stripes
+ *
+ * connections=N opens N parallel sessions to the gateway and
+ * alternate_gateways=host1,host2 adds N more through each of those
+ * hosts to the same path.  The tag spreads its requests over all of
+ * them.  Stripe zero on the gateway is the normal shared session.
+ */
+
+int setup_stripes(ab_tag_p tag, attr attribs)
+{
+    int connections = attr_get_int(attribs, "connections", 1);
+    const char *alternate_gateways = attr_get_str(attribs, "alternate_gateways", NULL);
+    char **gateways = NULL;
+    int num_gateways = 1;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(connections < 1 || connections > SESSION_MAX_STRIPES) {
+        pdebug(DEBUG_WARN, "Number of connections, %d, must be between 1 and %d!", connections, SESSION_MAX_STRIPES);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(connections == 1 && !alternate_gateways) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(tag->vtable != &eip_cip_vtable || !tag->use_connected_msg) {
+        pdebug(DEBUG_WARN, "Multiple connections are only supported for connected Logix tags!");
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    if(alternate_gateways) {
+        gateways = str_split(alternate_gateways, ",");
+        if(!gateways) {
+            pdebug(DEBUG_WARN, "Unable to split alternate gateway list!");
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        while(gateways[num_gateways - 1]) {
+            num_gateways++;
+        }
+    }
+
+    for(int i=0; i < connections && rc == PLCTAG_STATUS_OK; i++) {
+        for(int g=0; g < num_gateways; g++) {
+            const char *host = (g == 0 ? attr_get_str(attribs, "gateway", "") : gateways[g - 1]);
+
+            /* the first one is already set up. */
+            if(i == 0 && g == 0) {
+                continue;
+            }
+
+            if(tag->num_stripes >= SESSION_MAX_STRIPES) {
+                pdebug(DEBUG_WARN, "Too many connections, at most %d are supported!", SESSION_MAX_STRIPES);
+                rc = PLCTAG_ERR_BAD_PARAM;
+                break;
+            }
+
+            if(session_find_or_create_stripe(&tag->stripes[tag->num_stripes], attribs, host, i) != PLCTAG_STATUS_OK || !tag->stripes[tag->num_stripes]) {
+                pdebug(DEBUG_WARN, "Unable to create session %d to %s!", i, host);
+                rc = PLCTAG_ERR_BAD_GATEWAY;
+                break;
+            }
+
+            tag->num_stripes++;
+        }
+    }
+
+    if(gateways) {
+        mem_free(gateways);
+    }
+
+    pdebug(DEBUG_DETAIL, "Tag uses %d sessions.", tag->num_stripes);
+
+    return rc;
+}
+
+
+
 /*
  * determine the tag's data type and size.  Or at least guess it.
  */
@@ -557,8 +944,13 @@ int ab_tag_abort(ab_tag_p tag)
         tag->req = rc_dec(tag->req);
     }
 
+    ab_tag_abort_fragments(tag);
+
     tag->read_in_progress = 0;
     tag->write_in_progress = 0;
+    tag->group_read = 0;
+    tag->group_read_leader = 0;
+    tag->queue_full_retry = 0;
     tag->offset = 0;
 
     pdebug(DEBUG_DETAIL, "Done.");
@@ -569,6 +961,80 @@ int ab_tag_abort(ab_tag_p tag)
 
 
 
+/*
+ * ab_tag_abort_fragments
+ *
+ * Drop the fragments of a read or write that are in flight behind the
+ * one in req.
+ */
+void ab_tag_abort_fragments(ab_tag_p tag)
+{
+    for(int i=0; i < tag->num_frag_reqs; i++) {
+        spin_block(&tag->frag_reqs[i]->lock) {
+            tag->frag_reqs[i]->abort_request = 1;
+        }
+
+        tag->frag_reqs[i] = rc_dec(tag->frag_reqs[i]);
+    }
+
+    tag->num_frag_reqs = 0;
+    tag->frag_size = 0;
+    tag->frag_next_offset = 0;
+}
+
+
+
+
+/*
+ * ab_tag_queue_depth
+ *
+ * How many requests are waiting to be sent on the sessions this tag uses.
+ */
+int ab_tag_queue_depth(ab_tag_p tag)
+{
+    int depth = 0;
+
+    for(int i=0; i < tag->num_stripes; i++) {
+        int rc = session_get_queue_depth(tag->stripes[i]);
+
+        if(rc < 0) {
+            return rc;
+        }
+
+        depth += rc;
+    }
+
+    return depth;
+}
+
+
+
+/*
+ * ab_tag_wait_for_room
+ *
+ * Called by a blocking caller of the API when the tag has a request that
+ * did not fit in its session's queue.  That is either the request that
+ * starts the operation or the next piece of one in progress.  Waits until
+ * there is room or the caller's deadline passes.
+ *
+ * Returns PLCTAG_STATUS_PENDING if the tag has nothing waiting for room.
+ */
+int ab_tag_wait_for_room(ab_tag_p tag)
+{
+    if((tag->read_in_progress || tag->write_in_progress) && !tag->queue_full_retry) {
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    if(!tag->session || !tag->op_deadline) {
+        return PLCTAG_ERR_QUEUE_FULL;
+    }
+
+    return session_wait_for_room(tag->session, tag->op_deadline * 1000);
+}
+
+
+
+
 /*
  * ab_tag_status
  *
@@ -623,26 +1089,40 @@ void ab_tag_destroy(ab_tag_p tag)
         return;
     }
 
-    session = tag->session;
+    /* make sure the session is not still delivering data into this tag. */
+    ab_tag_abort(tag);
 
-    /* tags should always have a session.  Release it. */
-    pdebug(DEBUG_DETAIL,"Getting ready to release tag session %p",tag->session);
-    if(session) {
-        pdebug(DEBUG_DETAIL, "Removing tag from session.");
-        rc_dec(session);
-        tag->session = NULL;
-    } else {
-        pdebug(DEBUG_WARN,"No session pointer!");
-    }
+    /* take it out of its read group. */
+    if(tag->read_group) {
+        critical_block(read_group_mutex) {
+            for(int i=0; i < vector_length(read_group_tags); i++) {
+                if(vector_get(read_group_tags, i) == tag) {
+                    vector_remove(read_group_tags, i);
+                    break;
+                }
+            }
+        }
 
-    if(tag->ext_mutex) {
-        mutex_destroy(&(tag->ext_mutex));
-        tag->ext_mutex = NULL;
+        mem_free(tag->read_group);
+        tag->read_group = NULL;
     }
 
-    if(tag->api_mutex) {
-        mutex_destroy(&(tag->api_mutex));
-        tag->api_mutex = NULL;
+    /* tags should always have a session.  Release them. */
+    pdebug(DEBUG_DETAIL,"Getting ready to release tag session %p",tag->session);
+    tag->session = NULL;
+
+    if(tag->num_stripes > 0) {
+        pdebug(DEBUG_DETAIL, "Removing tag from %d sessions.", tag->num_stripes);
+
+        for(int i=0; i < tag->num_stripes; i++) {
+            session = tag->stripes[i];
+            tag->stripes[i] = NULL;
+            rc_dec(session);
+        }
+
+        tag->num_stripes = 0;
+    } else {
+        pdebug(DEBUG_WARN,"No session pointer!");
     }
 
     if (tag->data) {
@@ -46,7 +46,11 @@ typedef struct ab_request_t *ab_request_p;
 
 
 extern int ab_tag_abort(ab_tag_p tag);
+extern void ab_tag_abort_fragments(ab_tag_p tag);
 extern int ab_tag_status(ab_tag_p tag);
+extern int ab_tag_queue_depth(ab_tag_p tag);
+extern int ab_tag_wait_for_room(ab_tag_p tag);
+extern int ab_tag_use_session(ab_tag_p tag, ab_session_p session);
 //int ab_tag_destroy(ab_tag_p p_tag);
 extern int get_plc_type(attr attribs);
 extern int check_cpu(ab_tag_p tag, attr attribs);
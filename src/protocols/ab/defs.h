@@ -50,6 +50,7 @@
 #define AB_EIP_DEFAULT_TIMEOUT 2000 /* in ms */
 
 /* AB Commands */
+#define AB_EIP_LIST_SERVICES        ((uint16_t)0x0004)
 #define AB_EIP_REGISTER_SESSION     ((uint16_t)0x0065)
 #define AB_EIP_UNREGISTER_SESSION   ((uint16_t)0x0066)
 #define AB_EIP_UNCONNECTED_SEND     ((uint16_t)0x006F)
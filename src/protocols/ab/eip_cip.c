@@ -130,17 +130,26 @@ START_PACK typedef struct {
 
 
 
+static int create_read_request_connected(ab_tag_p tag, int byte_offset, ab_request_p *request);
 static int build_read_request_connected(ab_tag_p tag, int byte_offset);
+static int start_group_read(ab_tag_p tag);
+static void complete_group_read(ab_tag_p tag);
 static int build_tag_list_request_connected(ab_tag_p tag);
 static int build_read_request_unconnected(ab_tag_p tag, int byte_offset);
+static int create_write_request_connected(ab_tag_p tag, int byte_offset, ab_request_p *request);
 static int build_write_request_connected(ab_tag_p tag, int byte_offset);
+static void queue_write_fragments_connected(ab_tag_p tag);
 static int build_write_request_unconnected(ab_tag_p tag, int byte_offset);
 static int check_read_status_connected(ab_tag_p tag);
+static int read_next_fragments_connected(ab_tag_p tag);
+static int next_fragment(ab_tag_p tag);
+static int fragment_ready(ab_tag_p tag);
 static int check_read_tag_list_status_connected(ab_tag_p tag);
 static int check_read_status_unconnected(ab_tag_p tag);
 static int check_write_status_connected(ab_tag_p tag);
 static int check_write_status_unconnected(ab_tag_p tag);
 static int calculate_write_data_per_packet(ab_tag_p tag);
+static int retry_when_room(ab_tag_p tag, int rc);
 
 static int tag_read_start(ab_tag_p tag);
 static int tag_tickler(ab_tag_p tag);
@@ -152,7 +161,9 @@ struct tag_vtable_t eip_cip_vtable = {
     (tag_vtable_func)tag_read_start,
     (tag_vtable_func)ab_tag_status, /* shared */
     (tag_vtable_func)tag_tickler,
-    (tag_vtable_func)tag_write_start
+    (tag_vtable_func)tag_write_start,
+    (tag_vtable_func)ab_tag_queue_depth, /* shared */
+    (tag_vtable_func)ab_tag_wait_for_room /* shared */
 };
 
 
@@ -169,12 +180,36 @@ int tag_tickler(ab_tag_p tag)
 
     pdebug(DEBUG_SPEW,"Starting.");
 
+    /* the next piece of the operation did not fit in the queue, try again. */
+    if(tag->queue_full_retry) {
+        if(!tag->read_in_progress) {
+            rc = tag_write_start(tag);
+        } else if(tag->use_connected_msg && !tag->tag_list && !tag->group_read) {
+            rc = read_next_fragments_connected(tag);
+        } else {
+            rc = tag_read_start(tag);
+        }
+
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+            ab_tag_abort(tag);
+        }
+
+        tag->status = rc;
+
+        pdebug(DEBUG_SPEW, "Done.  Queued the next piece again.");
+
+        return rc;
+    }
+
     if (tag->read_in_progress) {
         if(tag->use_connected_msg) {
             if(tag->tag_list) {
                 rc = check_read_tag_list_status_connected(tag);
             } else {
-                rc = check_read_status_connected(tag);
+                /* with several fragments in flight, the next one may already be in. */
+                do {
+                    rc = check_read_status_connected(tag);
+                } while(rc == PLCTAG_STATUS_PENDING && tag->read_in_progress && fragment_ready(tag));
             }
         } else {
             rc = check_read_status_unconnected(tag);
@@ -182,6 +217,16 @@ int tag_tickler(ab_tag_p tag)
 
         tag->status = rc;
 
+        if(!tag->read_in_progress) {
+            tag->group_read = 0;
+
+            /* the rest of the group got their data in the same response. */
+            if(tag->group_read_leader) {
+                tag->group_read_leader = 0;
+                complete_group_read(tag);
+            }
+        }
+
         pdebug(DEBUG_SPEW,"Done.  Read in progress.");
 
         return rc;
@@ -189,7 +234,9 @@ int tag_tickler(ab_tag_p tag)
 
     if (tag->write_in_progress) {
         if(tag->use_connected_msg) {
-            rc = check_write_status_connected(tag);
+            do {
+                rc = check_write_status_connected(tag);
+            } while(rc == PLCTAG_STATUS_PENDING && tag->write_in_progress && fragment_ready(tag));
         } else {
             rc = check_write_status_unconnected(tag);
         }
@@ -222,9 +269,44 @@ int tag_tickler(ab_tag_p tag)
 int tag_read_start(ab_tag_p tag)
 {
     int rc = PLCTAG_STATUS_OK;
+    int next_piece = 0;
 
     pdebug(DEBUG_INFO, "Starting");
 
+    /* another member of the read group may have started this read for us. */
+    if(tag->read_in_progress && tag->group_read && tag->req) {
+        int resp_received = 0;
+
+        spin_block(&tag->req->lock) {
+            resp_received = tag->req->resp_received;
+        }
+
+        if(!resp_received) {
+            pdebug(DEBUG_DETAIL, "Joining read already started by the read group.");
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        /* that response is from a while ago, get fresh data. */
+        pdebug(DEBUG_DETAIL, "Discarding uncollected read group response.");
+        ab_tag_abort(tag);
+    }
+
+    next_piece = (tag->offset > 0 || tag->queue_full_retry);
+
+    /* a new read, not the next piece of a fragmented one. */
+    if(!next_piece) {
+        tag->group_read = 0;
+
+        /*
+         * spread the tag's operations over its sessions.  All the pieces of
+         * one operation stay on the session it started on.  A pre-read uses
+         * the session its write picked.
+         */
+        if(tag->num_stripes > 1 && !tag->pre_write_read) {
+            tag->session = session_pick_stripe(tag->stripes, tag->num_stripes);
+        }
+    }
+
     /* mark the tag read in progress */
     tag->read_in_progress = 1;
 
@@ -232,6 +314,8 @@ int tag_read_start(ab_tag_p tag)
     if(tag->use_connected_msg) {
         if(tag->tag_list) {
             rc = build_tag_list_request_connected(tag);
+        } else if(tag->read_group && tag->offset == 0 && !tag->pre_write_read) {
+            rc = start_group_read(tag);
         } else {
             rc = build_read_request_connected(tag, tag->offset);
         }
@@ -240,11 +324,20 @@ int tag_read_start(ab_tag_p tag)
     }
 
     if (rc != PLCTAG_STATUS_OK) {
+        if(next_piece && retry_when_room(tag, rc) == PLCTAG_STATUS_PENDING) {
+            return PLCTAG_STATUS_PENDING;
+        }
+
         pdebug(DEBUG_WARN,"Unable to build read request!");
 
+        /* nothing is in flight, let the status show why. */
+        ab_tag_abort(tag);
+        tag->status = rc;
+
         return rc;
     }
 
+    tag->queue_full_retry = 0;
     tag->status = PLCTAG_STATUS_PENDING;
 
     pdebug(DEBUG_INFO, "Done.");
@@ -267,6 +360,7 @@ int tag_read_start(ab_tag_p tag)
 int tag_write_start(ab_tag_p tag)
 {
     int rc = PLCTAG_STATUS_OK;
+    int next_piece = 0;
 
     pdebug(DEBUG_INFO, "Starting");
 
@@ -277,6 +371,24 @@ int tag_write_start(ab_tag_p tag)
         return PLCTAG_ERR_UNSUPPORTED;
     }
 
+    /* do not let an uncollected read group response overwrite the data we are writing. */
+    if(tag->read_in_progress && tag->group_read) {
+        pdebug(DEBUG_DETAIL, "Dropping read started by the read group.");
+        ab_tag_abort(tag);
+    }
+
+    /* a write after its own pre-read finds the read still marked in progress. */
+    next_piece = (tag->offset > 0 || tag->read_in_progress || tag->queue_full_retry);
+
+    /*
+     * spread the tag's operations over its sessions.  Not for the next
+     * piece of a fragmented write, nor when the write follows its own
+     * pre-read.
+     */
+    if(tag->num_stripes > 1 && !next_piece) {
+        tag->session = session_pick_stripe(tag->stripes, tag->num_stripes);
+    }
+
     /*
      * if the tag has not been read yet, read it.
      *
@@ -307,10 +419,23 @@ int tag_write_start(ab_tag_p tag)
     }
 
     if (rc != PLCTAG_STATUS_OK) {
+        if(next_piece && retry_when_room(tag, rc) == PLCTAG_STATUS_PENDING) {
+            return PLCTAG_STATUS_PENDING;
+        }
+
         pdebug(DEBUG_WARN,"Unable to build write request!");
+
+        ab_tag_abort(tag);
+        tag->status = rc;
+
         return rc;
     }
 
+    if(tag->use_connected_msg && tag->parallel_write) {
+        queue_write_fragments_connected(tag);
+    }
+
+    tag->queue_full_retry = 0;
     tag->status = PLCTAG_STATUS_PENDING;
 
     pdebug(DEBUG_INFO, "Done.");
@@ -319,7 +444,39 @@ int tag_write_start(ab_tag_p tag)
 }
 
 
-int build_read_request_connected(ab_tag_p tag, int byte_offset)
+
+/*
+ * retry_when_room
+ *
+ * The next piece of an operation in progress could not be queued.  The
+ * tickler must not wait for room, so if the session blocks when full the
+ * operation is kept and the piece is queued again on a later tickle.  A
+ * blocking caller waits for the room in its own wait loop.  Any other
+ * error is passed back.
+ */
+
+int retry_when_room(ab_tag_p tag, int rc)
+{
+    if(rc != PLCTAG_ERR_QUEUE_FULL || session_get_queue_full_policy(tag->session) != SESSION_QUEUE_FULL_BLOCK) {
+        return rc;
+    }
+
+    pdebug(DEBUG_DETAIL, "Queue is full, queuing the next piece later.");
+
+    tag->queue_full_retry = 1;
+    tag->status = PLCTAG_STATUS_PENDING;
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+/*
+ * create_read_request_connected
+ *
+ * Build a connected read request for the tag without queuing it.
+ */
+
+int create_read_request_connected(ab_tag_p tag, int byte_offset, ab_request_p *request)
 {
     eip_cip_co_req* cip = NULL;
     uint8_t* data = NULL;
@@ -335,6 +492,11 @@ int build_read_request_connected(ab_tag_p tag, int byte_offset)
         return rc;
     }
 
+    /* a read before a write is part of the write. */
+    req->priority = (tag->pre_write_read ? SESSION_PRIORITY_HIGH : tag->priority);
+    req->sched_class = tag->sched_class;
+    req->sched_weight = tag->sched_weight;
+
     /* point the request struct at the buffer */
     cip = (eip_cip_co_req*)(req->data);
 
@@ -390,6 +552,51 @@ int build_read_request_connected(ab_tag_p tag, int byte_offset)
     //req->session = tag->session;
 
     req->allow_packing = tag->allow_packing;
+    req->allow_linger = tag->allow_linger;
+
+    /* plain reads can share the response of an identical read from another tag handle. */
+    req->allow_dedupe = !tag->pre_write_read;
+
+    /* reads can be replayed after a reconnect. */
+    req->allow_replay = 1;
+
+    /* it is dropped if it is still queued when the caller stops waiting. */
+    req->deadline_us = tag->op_deadline * 1000;
+
+    /*
+     * have the session put the data straight into the tag buffer, but only
+     * when a blocking caller holds the tag's API mutex until the read is
+     * done or aborted.  Otherwise the data is copied in under the mutex
+     * when the read status is checked.  Not for a pre-read for a write as
+     * that must not overwrite the tag's data, nor for a read started by
+     * another member of the read group.
+     */
+    if(tag->op_deadline && !tag->pre_write_read && !tag->group_read && byte_offset < tag->size) {
+        req->resp_dest = tag->data + byte_offset;
+        req->resp_dest_size = tag->size - byte_offset;
+    }
+
+    *request = req;
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int build_read_request_connected(ab_tag_p tag, int byte_offset)
+{
+    ab_request_p req = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    rc = create_read_request_connected(tag, byte_offset, &req);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create read request!");
+        return rc;
+    }
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
@@ -408,6 +615,161 @@ int build_read_request_connected(ab_tag_p tag, int byte_offset)
     return PLCTAG_STATUS_OK;
 }
 
+
+
+/*
+ * start_group_read
+ *
+ * Start a read of the tag and of every other idle member of its read
+ * group on the same session.  The requests are queued as a group so
+ * that they go out in one packet and all the members see the same
+ * snapshot of the PLC.  Members that are busy, or whose mutex is held
+ * by another thread, are left out.  The members are only try-locked
+ * so two groups reads started at once cannot deadlock.
+ *
+ * This must be called with the tag's mutex held.
+ */
+
+int start_group_read(ab_tag_p tag)
+{
+    vector_p members = NULL;
+    ab_tag_p locked_members[MAX_REQUESTS] = {NULL};
+    int num_locked_members = 0;
+    ab_request_p reqs[MAX_REQUESTS] = {NULL};
+    int num_reqs = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    rc = create_read_request_connected(tag, tag->offset, &reqs[0]);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create read request!");
+        return rc;
+    }
+
+    num_reqs = 1;
+
+    members = find_read_group_tags(tag);
+
+    for(int i=0; members && i < vector_length(members) && num_reqs < MAX_REQUESTS; i++) {
+        ab_tag_p member = vector_get(members, i);
+        ab_request_p req = NULL;
+
+        if(mutex_try_lock(member->api_mutex) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_DETAIL, "Read group member %d is busy.", member->tag_id);
+            continue;
+        }
+
+        locked_members[num_locked_members] = member;
+        num_locked_members++;
+
+        if(member->read_in_progress || member->write_in_progress) {
+            pdebug(DEBUG_DETAIL, "Read group member %d already has an operation in progress.", member->tag_id);
+            continue;
+        }
+
+        /* the whole group goes over the session this tag picked. */
+        if(!ab_tag_use_session(member, tag->session)) {
+            pdebug(DEBUG_DETAIL, "Read group member %d does not use session %p.", member->tag_id, tag->session);
+            continue;
+        }
+
+        member->group_read = 1;
+        member->offset = 0;
+
+        if(create_read_request_connected(member, 0, &req) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to create read request for read group member %d!", member->tag_id);
+            member->group_read = 0;
+            continue;
+        }
+
+        member->req = req;
+        member->read_in_progress = 1;
+        member->status = PLCTAG_STATUS_PENDING;
+
+        reqs[num_reqs] = req;
+        num_reqs++;
+    }
+
+    pdebug(DEBUG_DETAIL, "Reading %d tags in the read group.", num_reqs);
+
+    rc = session_add_request_group(tag->session, reqs, num_reqs);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to add read group requests to session! rc=%d", rc);
+
+        for(int i=0; i < num_locked_members; i++) {
+            if(locked_members[i]->group_read) {
+                ab_tag_abort(locked_members[i]);
+                locked_members[i]->status = rc;
+            }
+        }
+
+        reqs[0]->abort_request = 1;
+        rc_dec(reqs[0]);
+    } else {
+        tag->req = reqs[0];
+        tag->group_read_leader = (num_reqs > 1);
+    }
+
+    for(int i=0; i < num_locked_members; i++) {
+        mutex_unlock(locked_members[i]->api_mutex);
+    }
+
+    if(members) {
+        for(int i=0; i < vector_length(members); i++) {
+            rc_dec(vector_get(members, i));
+        }
+
+        vector_destroy(members);
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * complete_group_read
+ *
+ * The response to a group read answered every member.  Finish the
+ * reads of the members so that their data is the same snapshot as the
+ * tag's, and let their read caches use it.  A member whose mutex is
+ * held by another thread finishes the next time it is checked.
+ *
+ * This must be called with the tag's mutex held.
+ */
+
+void complete_group_read(ab_tag_p tag)
+{
+    vector_p members = find_read_group_tags(tag);
+
+    if(!members) {
+        return;
+    }
+
+    for(int i=0; i < vector_length(members); i++) {
+        ab_tag_p member = vector_get(members, i);
+
+        if(mutex_try_lock(member->api_mutex) == PLCTAG_STATUS_OK) {
+            if(member->group_read && member->read_in_progress) {
+                if(tag_tickler(member) == PLCTAG_STATUS_OK) {
+                    member->read_cache_expire = time_ms() + member->read_cache_ms;
+                }
+            }
+
+            mutex_unlock(member->api_mutex);
+        }
+
+        rc_dec(member);
+    }
+
+    vector_destroy(members);
+}
+
+
+
 int build_tag_list_request_connected(ab_tag_p tag)
 {
     eip_cip_co_req* cip = NULL;
@@ -427,6 +789,10 @@ int build_tag_list_request_connected(ab_tag_p tag)
         return rc;
     }
 
+    req->priority = tag->priority;
+    req->sched_class = tag->sched_class;
+    req->sched_weight = tag->sched_weight;
+
     /* point the request struct at the buffer */
     cip = (eip_cip_co_req*)(req->data);
 
@@ -540,6 +906,9 @@ int build_tag_list_request_connected(ab_tag_p tag)
     req->request_size = (int)((int)sizeof(*cip) + (int)(data - data_start));
 
     req->allow_packing = tag->allow_packing;
+    req->allow_linger = tag->allow_linger;
+
+    req->deadline_us = tag->op_deadline * 1000;
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
@@ -578,6 +947,11 @@ int build_read_request_unconnected(ab_tag_p tag, int byte_offset)
         return rc;
     }
 
+    /* a read before a write is part of the write. */
+    req->priority = (tag->pre_write_read ? SESSION_PRIORITY_HIGH : tag->priority);
+    req->sched_class = tag->sched_class;
+    req->sched_weight = tag->sched_weight;
+
     /* point the request struct at the buffer */
     cip = (eip_cip_uc_req*)(req->data);
 
@@ -668,6 +1042,12 @@ int build_read_request_unconnected(ab_tag_p tag, int byte_offset)
 
     /* allow packing if the tag allows it. */
     req->allow_packing = tag->allow_packing;
+    req->allow_linger = tag->allow_linger;
+
+    /* a read can be sent again if the connection is lost before the response. */
+    req->allow_replay = 1;
+
+    req->deadline_us = tag->op_deadline * 1000;
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
@@ -689,7 +1069,14 @@ int build_read_request_unconnected(ab_tag_p tag, int byte_offset)
 
 
 
-int build_write_request_connected(ab_tag_p tag, int byte_offset)
+/*
+ * create_write_request_connected
+ *
+ * Build a connected write request for the next fragment of the tag's
+ * data without queuing it.  The tag's offset moves past the data in it.
+ */
+
+int create_write_request_connected(ab_tag_p tag, int byte_offset, ab_request_p *request)
 {
     int rc = PLCTAG_STATUS_OK;
     eip_cip_co_req* cip = NULL;
@@ -700,19 +1087,29 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
 
     pdebug(DEBUG_INFO, "Starting.");
 
-    /* get a request buffer */
-    rc = session_create_request(tag->session, tag->tag_id, &req);
+    rc = calculate_write_data_per_packet(tag);
     if (rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
+        pdebug(DEBUG_ERROR, "Unable to calculate valid write data per packet!.  rc=%s", plc_tag_decode_error(rc));
         return rc;
     }
 
-    rc = calculate_write_data_per_packet(tag);
+    if (!tag->encoded_type_info_size) {
+        pdebug(DEBUG_WARN,"Data type unsupported!");
+        return PLCTAG_ERR_UNSUPPORTED;
+    }
+
+    /* get a request buffer */
+    rc = session_create_request(tag->session, tag->tag_id, &req);
     if (rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_ERROR, "Unable to calculate valid write data per packet!.  rc=%s", plc_tag_decode_error(rc));
+        pdebug(DEBUG_ERROR, "Unable to get new request.  rc=%d", rc);
         return rc;
     }
 
+    /* writes go ahead of background reads. */
+    req->priority = SESSION_PRIORITY_HIGH;
+    req->sched_class = tag->sched_class;
+    req->sched_weight = tag->sched_weight;
+
     if(tag->write_data_per_packet < tag->size) {
         multiple_requests = 1;
     }
@@ -748,13 +1145,8 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
     data += tag->encoded_name_size;
 
     /* copy encoded type info */
-    if (tag->encoded_type_info_size) {
-        mem_copy(data, tag->encoded_type_info, tag->encoded_type_info_size);
-        data += tag->encoded_type_info_size;
-    } else {
-        pdebug(DEBUG_WARN,"Data type unsupported!");
-        return PLCTAG_ERR_UNSUPPORTED;
-    }
+    mem_copy(data, tag->encoded_type_info, tag->encoded_type_info_size);
+    data += tag->encoded_type_info_size;
 
     /* copy the item count, little endian */
     *((uint16_le*)data) = h2le16((uint16_t)(tag->elem_count));
@@ -767,16 +1159,16 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
     }
 
     /* how much data to write? */
-    write_size = tag->size - tag->offset;
+    write_size = tag->size - byte_offset;
 
     if(write_size > tag->write_data_per_packet) {
         write_size = tag->write_data_per_packet;
     }
 
     /* now copy the data to write */
-    mem_copy(data, tag->data + tag->offset, write_size);
+    mem_copy(data, tag->data + byte_offset, write_size);
     data += write_size;
-    tag->offset += write_size;
+    tag->offset = byte_offset + write_size;
 
     /* need to pad data to multiple of 16-bits */
     if (write_size & 0x01) {
@@ -804,6 +1196,31 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
 
     /* allow packing if the tag allows it. */
     req->allow_packing = tag->allow_packing;
+    req->allow_linger = tag->allow_linger;
+
+    req->deadline_us = tag->op_deadline * 1000;
+
+    *request = req;
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+int build_write_request_connected(ab_tag_p tag, int byte_offset)
+{
+    ab_request_p req = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    rc = create_write_request_connected(tag, byte_offset, &req);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create write request!");
+        return rc;
+    }
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
@@ -824,6 +1241,45 @@ int build_write_request_connected(ab_tag_p tag, int byte_offset)
 
 
 
+/*
+ * queue_write_fragments_connected
+ *
+ * Queue the fragments of a parallel write that follow the one in req,
+ * up to MAX_FRAGS of them.  Whatever cannot be queued now is sent when
+ * earlier fragments are done.
+ */
+
+void queue_write_fragments_connected(ab_tag_p tag)
+{
+    while(tag->num_frag_reqs < MAX_FRAGS && tag->offset < tag->size) {
+        ab_request_p req = NULL;
+        int byte_offset = tag->offset;
+        int rc = PLCTAG_STATUS_OK;
+
+        rc = create_write_request_connected(tag, byte_offset, &req);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_DETAIL, "Unable to create write request, rc=%s.", plc_tag_decode_error(rc));
+            break;
+        }
+
+        rc = session_add_request(tag->session, req);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_DETAIL, "Unable to queue write request, rc=%s.", plc_tag_decode_error(rc));
+            rc_dec(req);
+            tag->offset = byte_offset;
+            break;
+        }
+
+        pdebug(DEBUG_DETAIL, "Writing fragment at offset %d ahead.", byte_offset);
+
+        tag->frag_reqs[tag->num_frag_reqs] = req;
+        tag->frag_offsets[tag->num_frag_reqs] = byte_offset;
+        tag->num_frag_reqs++;
+    }
+}
+
+
+
 
 int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
 {
@@ -845,6 +1301,11 @@ int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
         return rc;
     }
 
+    /* writes go ahead of background reads. */
+    req->priority = SESSION_PRIORITY_HIGH;
+    req->sched_class = tag->sched_class;
+    req->sched_weight = tag->sched_weight;
+
     rc = calculate_write_data_per_packet(tag);
     if (rc != PLCTAG_STATUS_OK) {
         pdebug(DEBUG_ERROR, "Unable to calculate valid write data per packet!.  rc=%s", plc_tag_decode_error(rc));
@@ -976,6 +1437,9 @@ int build_write_request_unconnected(ab_tag_p tag, int byte_offset)
 
     /* allow packing if the tag allows it. */
     req->allow_packing = tag->allow_packing;
+    req->allow_linger = tag->allow_linger;
+
+    req->deadline_us = tag->op_deadline * 1000;
 
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
@@ -1014,6 +1478,7 @@ static int check_read_status_connected(ab_tag_p tag)
     uint8_t* data;
     uint8_t* data_end;
     int partial_data = 0;
+    int data_size = 0;
 
     pdebug(DEBUG_SPEW, "Starting.");
 
@@ -1023,6 +1488,7 @@ static int check_read_status_connected(ab_tag_p tag)
     }
 
     if (!tag->req) {
+        ab_tag_abort_fragments(tag);
         tag->read_in_progress = 0;
         tag->offset = 0;
 
@@ -1056,6 +1522,7 @@ static int check_read_status_connected(ab_tag_p tag)
         if(rc_is_error(rc)) {
             /* the request is dead, from session side. */
             tag->req = rc_dec(tag->req);
+            ab_tag_abort_fragments(tag);
         }
 
         return rc;
@@ -1161,18 +1628,21 @@ static int check_read_status_connected(ab_tag_p tag)
                 break;
             }
 
+            /* the session may have already put the data into the tag buffer. */
+            data_size = (int)(data_end - data) + tag->req->resp_dest_len;
+
             /* check data size. */
-            if ((tag->offset + (data_end - data)) > tag->size) {
+            if ((tag->offset + data_size) > tag->size) {
                 pdebug(DEBUG_WARN,
                        "Read data is too long (%d bytes) to fit in tag data buffer (%d bytes)!",
-                       tag->offset + (int)(data_end - data),
+                       tag->offset + data_size,
                        tag->size);
-                pdebug(DEBUG_WARN,"byte_offset=%d, data size=%d", tag->offset, (int)(data_end - data));
+                pdebug(DEBUG_WARN,"byte_offset=%d, data size=%d", tag->offset, data_size);
                 rc = PLCTAG_ERR_TOO_LARGE;
                 break;
             }
 
-            pdebug(DEBUG_INFO, "Got %d bytes of data", (data_end - data));
+            pdebug(DEBUG_INFO, "Got %d bytes of data", data_size);
 
             /*
              * copy the data, but only if this is not
@@ -1180,12 +1650,12 @@ static int check_read_status_connected(ab_tag_p tag)
              * want to overwrite the data the upstream has
              * put into the tag's data buffer.
              */
-            if (!tag->pre_write_read) {
+            if (!tag->pre_write_read && !tag->req->resp_dest_len) {
                 mem_copy(tag->data + tag->offset, data, (int)(data_end - data));
             }
 
             /* bump the byte offset */
-            tag->offset += (int)(data_end - data);
+            tag->offset += data_size;
         } else {
             pdebug(DEBUG_DETAIL, "Response returned no data and no error.");
         }
@@ -1202,14 +1672,21 @@ static int check_read_status_connected(ab_tag_p tag)
     if (rc == PLCTAG_STATUS_OK) {
         /* skip if we are doing a pre-write read. */
         if (!tag->pre_write_read && partial_data && tag->offset < tag->size) {
-            /* call read start again to get the next piece */
-            pdebug(DEBUG_DETAIL, "calling tag_read_start() to get the next chunk.");
-            rc = tag_read_start(tag);
+            if(tag->group_read) {
+                /* call read start again to get the next piece */
+                pdebug(DEBUG_DETAIL, "calling tag_read_start() to get the next chunk.");
+                rc = tag_read_start(tag);
+            } else {
+                rc = read_next_fragments_connected(tag);
+            }
         } else {
             /* done! */
             tag->first_read = 0;
             tag->offset = 0;
 
+            /* the PLC may have less data than the tag size said. */
+            ab_tag_abort_fragments(tag);
+
             /* if this is a pre-read for a write, then pass off to the write routine */
             if (tag->pre_write_read) {
                 pdebug(DEBUG_DETAIL, "Restarting write call now.");
@@ -1239,6 +1716,144 @@ static int check_read_status_connected(ab_tag_p tag)
 
 
 
+/*
+ * read_next_fragments_connected
+ *
+ * Called when the fragment at the tag's offset has come in and there is
+ * more to read.  The first response shows how much data fits in one
+ * fragment, so the offsets of the rest are known from the tag size.
+ * Up to MAX_FRAGS of them are kept in flight at once so that the
+ * session can pipeline them instead of waiting for each in turn.
+ *
+ * This is not thread-safe!  It should be called with the tag mutex
+ * locked!
+ */
+
+int read_next_fragments_connected(ab_tag_p tag)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int end = tag->offset;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(!tag->frag_size) {
+        tag->frag_size = end;
+        tag->frag_next_offset = end;
+    }
+
+    if(tag->num_frag_reqs > 0 && tag->frag_offsets[0] <= end) {
+        /* the next fragment is already asked for. */
+        tag->offset = next_fragment(tag);
+    } else {
+        /* nothing in flight or the last fragment came back short, ask for what is missing. */
+        pdebug(DEBUG_DETAIL, "Reading fragment at offset %d.", end);
+
+        rc = build_read_request_connected(tag, end);
+        if(rc != PLCTAG_STATUS_OK) {
+            if(retry_when_room(tag, rc) == PLCTAG_STATUS_PENDING) {
+                return PLCTAG_STATUS_PENDING;
+            }
+
+            pdebug(DEBUG_WARN, "Unable to build read request!");
+            return rc;
+        }
+
+        if(tag->frag_next_offset <= end) {
+            tag->frag_next_offset = end + tag->frag_size;
+        }
+    }
+
+    /* keep the pipeline full. */
+    while(tag->frag_size > 0 && tag->num_frag_reqs < MAX_FRAGS && tag->frag_next_offset < tag->size) {
+        ab_request_p req = NULL;
+
+        rc = create_read_request_connected(tag, tag->frag_next_offset, &req);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_DETAIL, "Unable to create read request, rc=%s.", plc_tag_decode_error(rc));
+            break;
+        }
+
+        /* a full fragment fills a packet, packing would only make each one shorter. */
+        req->allow_packing = 0;
+
+        rc = session_add_request(tag->session, req);
+        if(rc != PLCTAG_STATUS_OK) {
+            /* the ones in flight are enough to go on with. */
+            pdebug(DEBUG_DETAIL, "Unable to queue read request, rc=%s.", plc_tag_decode_error(rc));
+            rc_dec(req);
+            break;
+        }
+
+        pdebug(DEBUG_DETAIL, "Reading fragment at offset %d ahead.", tag->frag_next_offset);
+
+        tag->frag_reqs[tag->num_frag_reqs] = req;
+        tag->frag_offsets[tag->num_frag_reqs] = tag->frag_next_offset;
+        tag->num_frag_reqs++;
+
+        tag->frag_next_offset += tag->frag_size;
+    }
+
+    tag->queue_full_retry = 0;
+    tag->status = PLCTAG_STATUS_PENDING;
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_PENDING;
+}
+
+
+
+/*
+ * next_fragment
+ *
+ * Make the first of the fragments in flight behind req the current
+ * request.  Returns its offset.
+ */
+
+int next_fragment(ab_tag_p tag)
+{
+    int offset = tag->frag_offsets[0];
+
+    tag->req = tag->frag_reqs[0];
+
+    tag->num_frag_reqs--;
+
+    for(int i=0; i < tag->num_frag_reqs; i++) {
+        tag->frag_reqs[i] = tag->frag_reqs[i+1];
+        tag->frag_offsets[i] = tag->frag_offsets[i+1];
+    }
+
+    tag->frag_reqs[tag->num_frag_reqs] = NULL;
+
+    return offset;
+}
+
+
+
+/*
+ * fragment_ready
+ *
+ * Check whether the response to the current request of a fragmented
+ * read or write is in.
+ */
+
+int fragment_ready(ab_tag_p tag)
+{
+    int ready = 0;
+
+    if(!tag->req) {
+        return 0;
+    }
+
+    spin_block(&tag->req->lock) {
+        ready = tag->req->resp_received;
+    }
+
+    return ready;
+}
+
+
+
 /*
  * check_read_tag_list_status_connected
  *
@@ -1696,6 +2311,7 @@ static int check_write_status_connected(ab_tag_p tag)
     }
 
     if (!tag->req) {
+        ab_tag_abort_fragments(tag);
         tag->write_in_progress = 0;
         tag->offset = 0;
 
@@ -1729,6 +2345,9 @@ static int check_write_status_connected(ab_tag_p tag)
         if(rc_is_error(rc)) {
             /* the request is dead, from session side. */
             tag->req = rc_dec(tag->req);
+
+            /* the fragments behind it are not written either. */
+            ab_tag_abort_fragments(tag);
         }
 
         return rc;
@@ -1772,7 +2391,12 @@ static int check_write_status_connected(ab_tag_p tag)
     tag->req = rc_dec(tag->req);
 
     if(rc == PLCTAG_STATUS_OK) {
-        if(tag->offset < tag->size) {
+        if(tag->num_frag_reqs > 0) {
+            /* wait for the next fragment in flight and keep the rest coming. */
+            next_fragment(tag);
+            queue_write_fragments_connected(tag);
+            rc = PLCTAG_STATUS_PENDING;
+        } else if(tag->offset < tag->size) {
 
             pdebug(DEBUG_DETAIL, "Write not complete, triggering next round.");
             rc = tag_write_start(tag);
@@ -1784,6 +2408,12 @@ static int check_write_status_connected(ab_tag_p tag)
     } else {
         pdebug(DEBUG_WARN,"Write failed!");
 
+        /*
+         * the first fragment that failed decides the status.  Fragments
+         * after it that were already sent may have been written.
+         */
+        ab_tag_abort_fragments(tag);
+
         tag->write_in_progress = 0;
         tag->offset = 0;
     }
@@ -41,7 +41,9 @@ struct tag_vtable_t plc5_vtable = {
     (tag_vtable_func)tag_read_start,
     (tag_vtable_func)tag_status,
     (tag_vtable_func)tag_tickler,
-    (tag_vtable_func)tag_write_start
+    (tag_vtable_func)tag_write_start,
+    (tag_vtable_func)ab_tag_queue_depth, /* shared */
+    (tag_vtable_func)ab_tag_wait_for_room /* shared */
 };
 
 
@@ -185,6 +187,10 @@ int tag_read_start(ab_tag_p tag)
         return rc;
     }
 
+    req->priority = tag->priority;
+    req->sched_class = tag->sched_class;
+    req->sched_weight = tag->sched_weight;
+
     /* point the struct pointers to the buffer*/
     pccc = (pccc_req *)(req->data);
 
@@ -247,6 +253,12 @@ int tag_read_start(ab_tag_p tag)
     /* mark it as ready to send */
     //req->send_request = 1;
 
+    /* safe to send again after a reconnect. */
+    req->allow_replay = 1;
+
+    /* it is dropped if it is still queued when the caller stops waiting. */
+    req->deadline_us = tag->op_deadline * 1000;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
     if(rc != PLCTAG_STATUS_OK) {
@@ -440,6 +452,11 @@ int tag_write_start(ab_tag_p tag)
         return rc;
     }
 
+    /* writes go ahead of background reads. */
+    req->priority = SESSION_PRIORITY_HIGH;
+    req->sched_class = tag->sched_class;
+    req->sched_weight = tag->sched_weight;
+
     pccc = (pccc_req *)(req->data);
 
     /* set up the embedded PCCC packet */
@@ -495,6 +512,8 @@ int tag_write_start(ab_tag_p tag)
     /* get ready to add the request to the queue for this session */
     req->request_size = (int)(data - (req->data));
 
+    req->deadline_us = tag->op_deadline * 1000;
+
     /* add the request to the session's list. */
     rc = session_add_request(tag->session, req);
     if(rc != PLCTAG_STATUS_OK) {
@@ -0,0 +1,476 @@
+/***************************************************************************
+ *   Copyright (C) 2016 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <platform.h>
+#include <stdio.h>
+#include <lib/libplctag.h>
+#include <ab/payload_cache.h>
+#include <util/debug.h>
+#include <util/vector.h>
+
+
+/*
+ * The cache is kept in memory and, if a file is given with the
+ * payload_cache_file attribute, loaded from and saved to that file.
+ * Each line of the file is "host extended size path".  The path may
+ * be empty.  Lines that do not parse are skipped.
+ *
+ * The I/O thread only changes the cache in memory.  The file is saved
+ * when the next tag is created and when the library shuts down.
+ */
+
+#define PAYLOAD_CACHE_MAX_ENTRIES (4096)
+#define PAYLOAD_CACHE_MAX_FIELD (256)
+#define PAYLOAD_CACHE_MAX_LINE (1024)
+
+/* the connection parameters have 9 bits for the size, 16 for Forward Open Extended. */
+#define PAYLOAD_CACHE_MAX_SIZE (0x01FF)
+#define PAYLOAD_CACHE_MAX_SIZE_EX (0xFFFF)
+
+struct payload_cache_entry_t {
+    char *host;
+    char *path;
+    int use_ex;
+    int size;
+};
+
+typedef struct payload_cache_entry_t *payload_cache_entry_p;
+
+
+static mutex_p cache_mutex = NULL;
+static mutex_p save_mutex = NULL;
+static vector_p cache_entries = NULL;
+static char *cache_file_name = NULL;
+static int cache_changed = 0;
+
+
+static int size_is_valid(int use_ex, int size);
+static payload_cache_entry_p find_entry_unsafe(const char *host, const char *path);
+static int set_entry_unsafe(const char *host, const char *path, int use_ex, int size);
+static void load_file_unsafe(void);
+static void load_line_unsafe(char *line);
+static char *format_file_unsafe(int *size);
+
+
+
+int payload_cache_startup(void)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    if((rc = mutex_create(&cache_mutex)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create payload cache mutex %s!", plc_tag_decode_error(rc));
+        return rc;
+    }
+
+    if((rc = mutex_create(&save_mutex)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to create payload cache save mutex %s!", plc_tag_decode_error(rc));
+        return rc;
+    }
+
+    if((cache_entries = vector_create(25, 25)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create payload cache vector!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    return rc;
+}
+
+
+void payload_cache_teardown(void)
+{
+    /* the I/O thread is gone, keep what it learned. */
+    if(cache_mutex && save_mutex) {
+        payload_cache_save();
+    }
+
+    if(cache_entries) {
+        for(int i=0; i < vector_length(cache_entries); i++) {
+            payload_cache_entry_p entry = vector_get(cache_entries, i);
+
+            mem_free(entry->host);
+            mem_free(entry->path);
+            mem_free(entry);
+        }
+
+        vector_destroy(cache_entries);
+        cache_entries = NULL;
+    }
+
+    if(cache_file_name) {
+        mem_free(cache_file_name);
+        cache_file_name = NULL;
+    }
+
+    if(cache_mutex) {
+        mutex_destroy(&cache_mutex);
+        cache_mutex = NULL;
+    }
+
+    if(save_mutex) {
+        mutex_destroy(&save_mutex);
+        save_mutex = NULL;
+    }
+}
+
+
+
+/*
+ * payload_cache_set_file
+ *
+ * Keep the cache in this file.  What is in the file already is loaded.
+ * There is one file for the process, the first one set is used.
+ */
+int payload_cache_set_file(const char *file_name)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    if(!file_name || str_length(file_name) == 0) {
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    critical_block(cache_mutex) {
+        if(cache_file_name) {
+            if(str_cmp(cache_file_name, file_name) != 0) {
+                pdebug(DEBUG_WARN, "Payload cache file is already %s, ignoring %s.", cache_file_name, file_name);
+            }
+
+            break;
+        }
+
+        cache_file_name = str_dup(file_name);
+        if(!cache_file_name) {
+            rc = PLCTAG_ERR_NO_MEM;
+            break;
+        }
+
+        load_file_unsafe();
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * payload_cache_save
+ *
+ * Write the cache to its file if it changed since it was last saved.
+ * The file is replaced as a whole, a reader never sees part of it.  Do
+ * not call this from the I/O thread.
+ */
+void payload_cache_save(void)
+{
+    critical_block(save_mutex) {
+        char *file_name = NULL;
+        char *text = NULL;
+        int size = 0;
+
+        critical_block(cache_mutex) {
+            if(!cache_file_name || !cache_changed) {
+                break;
+            }
+
+            file_name = str_dup(cache_file_name);
+            text = format_file_unsafe(&size);
+
+            if(file_name && text) {
+                cache_changed = 0;
+            }
+        }
+
+        /* write outside the cache mutex, the I/O thread may need the cache. */
+        if(file_name && text && file_replace(file_name, text, size) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to write payload cache file %s!", file_name);
+
+            critical_block(cache_mutex) {
+                cache_changed = 1;
+            }
+        }
+
+        mem_free(file_name);
+        mem_free(text);
+    }
+}
+
+
+
+/*
+ * payload_cache_lookup
+ *
+ * Get whether Forward Open Extended worked and the packet size the
+ * PLC accepted.  Returns PLCTAG_ERR_NOT_FOUND if we do not know.
+ */
+int payload_cache_lookup(const char *host, const char *path, int *use_ex, int *size)
+{
+    int rc = PLCTAG_ERR_NOT_FOUND;
+
+    critical_block(cache_mutex) {
+        payload_cache_entry_p entry = find_entry_unsafe(host, path);
+
+        if(entry) {
+            *use_ex = entry->use_ex;
+            *size = entry->size;
+            rc = PLCTAG_STATUS_OK;
+        }
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * payload_cache_store
+ *
+ * Remember what worked.  The file is only written when something
+ * changed.
+ */
+void payload_cache_store(const char *host, const char *path, int use_ex, int size)
+{
+    if(!size_is_valid(use_ex, size)) {
+        return;
+    }
+
+    critical_block(cache_mutex) {
+        if(set_entry_unsafe(host, path, use_ex, size)) {
+            cache_changed = 1;
+        }
+    }
+}
+
+
+
+/*
+ * payload_cache_forget
+ *
+ * The cached size did not work, negotiate from scratch next time.
+ */
+void payload_cache_forget(const char *host, const char *path)
+{
+    critical_block(cache_mutex) {
+        for(int i=0; i < vector_length(cache_entries); i++) {
+            payload_cache_entry_p entry = vector_get(cache_entries, i);
+
+            if(str_cmp_i(entry->host, host) == 0 && str_cmp(entry->path, path) == 0) {
+                vector_remove(cache_entries, i);
+
+                mem_free(entry->host);
+                mem_free(entry->path);
+                mem_free(entry);
+
+                cache_changed = 1;
+                break;
+            }
+        }
+    }
+}
+
+
+
+
+/***********************************************************************
+ ************************ Helper Functions *****************************
+ **********************************************************************/
+
+
+int size_is_valid(int use_ex, int size)
+{
+    return (size > 0 && size <= (use_ex ? PAYLOAD_CACHE_MAX_SIZE_EX : PAYLOAD_CACHE_MAX_SIZE));
+}
+
+
+payload_cache_entry_p find_entry_unsafe(const char *host, const char *path)
+{
+    for(int i=0; i < vector_length(cache_entries); i++) {
+        payload_cache_entry_p entry = vector_get(cache_entries, i);
+
+        if(str_cmp_i(entry->host, host) == 0 && str_cmp(entry->path, path) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * set_entry_unsafe
+ *
+ * Add or update the entry.  Returns non-zero if anything changed.
+ */
+int set_entry_unsafe(const char *host, const char *path, int use_ex, int size)
+{
+    payload_cache_entry_p entry = find_entry_unsafe(host, path);
+
+    if(entry) {
+        if(entry->use_ex == use_ex && entry->size == size) {
+            return 0;
+        }
+
+        entry->use_ex = use_ex;
+        entry->size = size;
+
+        return 1;
+    }
+
+    if(vector_length(cache_entries) >= PAYLOAD_CACHE_MAX_ENTRIES) {
+        pdebug(DEBUG_WARN, "Payload cache is full!");
+        return 0;
+    }
+
+    entry = mem_alloc((int)sizeof(*entry));
+    if(!entry) {
+        pdebug(DEBUG_ERROR, "Unable to allocate payload cache entry!");
+        return 0;
+    }
+
+    entry->host = str_dup(host);
+    entry->path = str_dup(path);
+    entry->use_ex = use_ex;
+    entry->size = size;
+
+    if(!entry->host || !entry->path || vector_put(cache_entries, vector_length(cache_entries), entry) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_ERROR, "Unable to add payload cache entry!");
+        mem_free(entry->host);
+        mem_free(entry->path);
+        mem_free(entry);
+        return 0;
+    }
+
+    return 1;
+}
+
+
+void load_file_unsafe(void)
+{
+    char *text = NULL;
+    char **lines = NULL;
+    int size = 0;
+    int count = vector_length(cache_entries);
+    int rc = PLCTAG_STATUS_OK;
+
+    rc = file_read_all(cache_file_name, &text, &size);
+    if(rc != PLCTAG_STATUS_OK) {
+        if(rc == PLCTAG_ERR_NOT_FOUND) {
+            pdebug(DEBUG_INFO, "No payload cache in %s yet.", cache_file_name);
+        } else {
+            pdebug(DEBUG_WARN, "Unable to read payload cache file %s!", cache_file_name);
+        }
+
+        return;
+    }
+
+    lines = str_split(text, "\n");
+    if(!lines) {
+        pdebug(DEBUG_WARN, "Unable to split payload cache file %s into lines!", cache_file_name);
+        mem_free(text);
+        return;
+    }
+
+    for(int i=0; lines[i]; i++) {
+        load_line_unsafe(lines[i]);
+    }
+
+    mem_free(lines);
+    mem_free(text);
+
+    pdebug(DEBUG_INFO, "Loaded %d payload sizes from %s.", vector_length(cache_entries) - count, cache_file_name);
+}
+
+
+void load_line_unsafe(char *line)
+{
+    char **fields = NULL;
+    int num_fields = 0;
+    int use_ex = 0;
+    int size = 0;
+    int len = str_length(line);
+
+    /* files edited on Windows. */
+    if(len > 0 && line[len - 1] == '\r') {
+        line[len - 1] = 0;
+    }
+
+    if(line[0] == '#' || line[0] == 0) {
+        return;
+    }
+
+    fields = str_split(line, " ");
+    if(!fields) {
+        return;
+    }
+
+    while(fields[num_fields]) {
+        num_fields++;
+    }
+
+    if(num_fields < 3 || num_fields > 4
+       || str_length(fields[0]) >= PAYLOAD_CACHE_MAX_FIELD
+       || (num_fields == 4 && str_length(fields[3]) >= PAYLOAD_CACHE_MAX_FIELD)
+       || str_to_int(fields[1], &use_ex) || str_to_int(fields[2], &size)
+       || (use_ex != 0 && use_ex != 1) || !size_is_valid(use_ex, size)) {
+        pdebug(DEBUG_DETAIL, "Skipping bad payload cache line.");
+    } else {
+        set_entry_unsafe(fields[0], (num_fields == 4 ? fields[3] : ""), use_ex, size);
+    }
+
+    mem_free(fields);
+}
+
+
+/*
+ * format_file_unsafe
+ *
+ * The contents of the cache file.  The caller frees the text.
+ */
+char *format_file_unsafe(int *size)
+{
+    int capacity = (vector_length(cache_entries) + 1) * PAYLOAD_CACHE_MAX_LINE;
+    char *text = mem_alloc(capacity);
+    int len = 0;
+
+    if(!text) {
+        pdebug(DEBUG_ERROR, "Unable to allocate payload cache file buffer!");
+        return NULL;
+    }
+
+    len = snprintf_platform(text, (size_t)capacity, "# host extended size path\n");
+
+    for(int i=0; i < vector_length(cache_entries) && len < capacity; i++) {
+        payload_cache_entry_p entry = vector_get(cache_entries, i);
+
+        /* it would not load again. */
+        if(str_length(entry->host) >= PAYLOAD_CACHE_MAX_FIELD || str_length(entry->path) >= PAYLOAD_CACHE_MAX_FIELD) {
+            continue;
+        }
+
+        len += snprintf_platform(text + len, (size_t)(capacity - len), "%s %d %d %s\n", entry->host, entry->use_ex, entry->size, entry->path);
+    }
+
+    if(len >= capacity) {
+        pdebug(DEBUG_WARN, "Payload cache file does not fit in %d bytes!", capacity);
+        mem_free(text);
+        return NULL;
+    }
+
+    *size = len;
+
+    return text;
+}
@@ -0,0 +1,36 @@
+/***************************************************************************
+ *   Copyright (C) 2016 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __AB_PROTOCOL_PAYLOAD_CACHE_H__
+#define __AB_PROTOCOL_PAYLOAD_CACHE_H__ 1
+
+/*
+ * Forward Open packet sizes that each PLC accepted, by host and path,
+ * so that new connections skip the negotiation.
+ */
+extern int payload_cache_startup(void);
+extern void payload_cache_teardown(void);
+extern int payload_cache_set_file(const char *file_name);
+extern void payload_cache_save(void);
+extern int payload_cache_lookup(const char *host, const char *path, int *use_ex, int *size);
+extern void payload_cache_store(const char *host, const char *path, int use_ex, int size);
+extern void payload_cache_forget(const char *host, const char *path);
+
+#endif
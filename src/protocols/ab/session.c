@@ -24,6 +24,7 @@
 #include <ab/cip.h>
 #include <ab/defs.h>
 #include <ab/error_codes.h>
+#include <ab/payload_cache.h>
 #include <ab/session.h>
 #include <util/debug.h>
 #include <inttypes.h>
@@ -31,10 +32,11 @@
 #include <stdlib.h>
 #include <time.h>
 
-#define MAX_REQUESTS (200)
-
 #define EIP_CIP_PREFIX_SIZE (44) /* bytes of encap header and CFP connected header */
 
+/* how many released requests a session keeps for reuse. */
+#define SESSION_REQUEST_POOL_SIZE (64)
+
 /* WARNING: this must fit within 9 bits! */
 #define MAX_CIP_MSG_SIZE        (0x01FF & 508)
 
@@ -46,54 +48,187 @@
 #define MAX_CIP_SLC_MSG_SIZE (222)
 #define MAX_CIP_MLGX_MSG_SIZE (244)
 
+#define SESSION_DISCONNECT_TIMEOUT (5000)
+
+/* how long to wait for the TCP connection and for a Forward Close. */
+#define SESSION_CONNECT_TIMEOUT (10000)
+#define SESSION_FORWARD_CLOSE_TIMEOUT (250)
+
 /*
- * Number of milliseconds to wait to try to set up the session again
- * after a failure.
+ * All sessions are run by a small, fixed pool of I/O threads.  Each
+ * thread waits for any of its sessions' sockets to become ready and
+ * then runs the state machines of the sessions that have work to do.
  */
-#define RETRY_WAIT_MS (5000)
+#define SESSION_IO_THREADS (2)
+#define SESSION_IO_MAX_WAIT_MS (100)
+#define SESSION_IO_MAX_EVENTS (64)
+#define SESSION_MAX_STEPS (64)
+
+struct session_io_thread_t {
+    mutex_p mutex;
+    vector_p sessions;
+    vector_p run_list;
+    socket_poller_p poller;
+    thread_p thread;
+    volatile int terminating;
+};
+
+typedef enum { SESSION_OPEN_SOCKET, SESSION_WAIT_OPEN_SOCKET,
+               SESSION_REGISTER, SESSION_WAIT_REGISTER,
+               SESSION_CONNECT, SESSION_WAIT_CONNECT,
+               SESSION_IDLE, SESSION_DISCONNECT, SESSION_WAIT_DISCONNECT,
+               SESSION_UNREGISTER, SESSION_CLOSE_SOCKET,
+               SESSION_START_RETRY, SESSION_WAIT_RETRY,
+               SESSION_WAIT_RECONNECT
+             } session_state_t;
 
-#define SESSION_DISCONNECT_TIMEOUT (5000)
 
 
+typedef struct request_pool_t *request_pool_p;
 
-static ab_session_p session_create_unsafe(const char *host, int gw_port, const char *path, int plc_type, int use_connected_msg);
+/*
+ * a Forward Close a rider could not send itself because it was destroyed.
+ * The carrier sends it and ignores the response.
+ */
+struct pending_close_t {
+    uint16_t conn_serial_number;
+    uint8_t conn_path_size;
+    uint8_t *conn_path;
+};
+
+static ab_session_p session_create_unsafe(const char *host, int gw_port, const char *path, int plc_type, int use_connected_msg, ab_session_p carrier);
 static int session_init(ab_session_p session);
 //static int get_plc_type(attr attribs);
 static int add_session_unsafe(ab_session_p n);
 static int remove_session_unsafe(ab_session_p n);
-static ab_session_p find_session_by_host_unsafe(const char *gateway, const char *path);
-static int session_match_valid(const char *host, const char *path, ab_session_p session);
-static int session_add_request_unsafe(ab_session_p sess, ab_request_p req);
+static ab_session_p find_session_by_host_unsafe(const char *gateway, const char *path, int stripe);
+static int session_match_valid(const char *host, const char *path, int stripe, ab_session_p session);
+static ab_session_p find_carrier_unsafe(const char *host, int stripe);
+static int session_attach_carrier(ab_session_p session);
+static void session_detach_carrier(ab_session_p session);
+static void session_release_writer(ab_session_p session);
+static void session_wake_riders(ab_session_p session, int only_blocked);
+static int route_response(ab_session_p session, int *consumed);
+static int response_is_for(ab_session_p reader, ab_session_p session, int connected, uint32_t conn_id);
+static void queue_pending_close_unsafe(ab_session_p carrier, ab_session_p rider);
+static int start_pending_close(ab_session_p session);
+static void drop_pending_closes(ab_session_p session);
+static int session_add_request_unsafe(ab_session_p sess, ab_request_p req, ab_request_p after);
+static int session_admit_unsafe(ab_session_p session, ab_request_p *reqs, int num_reqs);
+static void session_signal_room_unsafe(ab_session_p session);
+static int request_queue_push_unsafe(ab_session_p session, ab_request_p req, ab_request_p after);
+static int request_queue_insert_unsafe(ab_session_p session, ab_request_p req);
+static int64_t request_source_key(ab_request_p req);
+static ab_request_p request_queue_pop_unsafe(ab_session_p session);
+static void request_queue_unlink_unsafe(ab_session_p session, ab_request_p req);
+static void request_queue_release_unsafe(ab_session_p session, ab_request_p req);
+static int request_heap_reserve(ab_session_p session, int priority);
+static void request_heap_insert(ab_session_p session, ab_request_p req);
+static void request_heap_remove(ab_session_p session, ab_request_p req);
+static int request_heap_before(ab_request_p first, ab_request_p second);
+static void request_heap_put_back(ab_session_p session, ab_request_p chain);
+static ab_request_p request_group_next_unsafe(ab_session_p session, int priority, ab_request_p req);
 static int session_open_socket(ab_session_p session);
 static void session_destroy(void *session);
-static int session_register(ab_session_p session);
+static int send_register_req(ab_session_p session);
+static int recv_register_resp(ab_session_p session);
 static int session_close_socket(ab_session_p session);
 static int session_unregister(ab_session_p session);
-static THREAD_FUNC(session_handler);
+static void session_wakeup(ab_session_p session);
+static THREAD_FUNC(session_io_handler);
+static void session_run(ab_session_p session);
+static int session_handler(ab_session_p session);
+static void session_run_at(ab_session_p session, int64_t run_time);
+static void session_update_poll_events(ab_session_p session);
 static int process_requests(ab_session_p session);
+static int start_next_packet(ab_session_p session);
+static int64_t pack_linger_until_unsafe(ab_session_p session, int capacity);
+static int dispatch_response(ab_session_p session);
+static void fail_in_flight_requests(ab_session_p session, int status, int replay);
+static void mark_packet_sent(ab_session_p session);
+static void fail_late_packet(ab_session_p session, uint64_t packet_seq_id);
+static void session_update_rtt(ab_session_p session, int64_t rtt_us);
+static int session_timeout(ab_session_p session);
+static int session_retry_delay(ab_session_p session);
+static void session_set_backoff(ab_session_p session, int backoff);
+static void session_connected(ab_session_p session);
+static int keepalive_due(ab_session_p session, int64_t now);
+static void start_keepalive(ab_session_p session);
 //static int check_packing(ab_session_p session, ab_request_p request);
 static int get_payload_size(ab_request_p request);
+static int requests_are_same_read(ab_request_p first, ab_request_p second);
+static int tag_id_in_list(int tag_id, int *tag_ids, int num_tag_ids);
 static int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests);
-static int prepare_request(ab_session_p session);
-static int send_eip_request(ab_session_p session, int timeout);
-static int recv_eip_response(ab_session_p session, int timeout);
+static int prepare_request(ab_session_p session, uint64_t *packet_seq_id);
+static int write_eip_request(ab_session_p session);
+static int read_eip_response(ab_session_p session);
+static void start_eip_exchange(ab_session_p session, int timeout);
+static int exchange_eip_packet(ab_session_p session);
 static int unpack_response(ab_session_p session, ab_request_p request, int sub_packet);
-static int perform_forward_open(ab_session_p session);
+static int unpack_reply(ab_session_p session, ab_request_p request, uint8_t *reply, int reply_len, int *new_eip_len);
+static int cip_read_reply_data_offset(uint8_t *reply, int reply_len);
+static int ensure_request_capacity(ab_session_p session, ab_request_p request, int new_size);
+static int start_forward_open(ab_session_p session);
+static int check_forward_open(ab_session_p session);
 static int perform_forward_close(ab_session_p session);
-static int try_forward_open_ex(ab_session_p session, int *max_payload_size_guess);
-static int try_forward_open(ab_session_p session);
+static void perform_pending_closes(ab_session_p session);
 static int send_forward_open_req(ab_session_p session);
 static int send_forward_open_req_ex(ab_session_p session);
 static int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess);
 static int send_forward_close_req(ab_session_p session);
+static void build_forward_close_req(ab_session_p session, uint16_t conn_serial_number, uint8_t *conn_path, uint8_t conn_path_size);
 static int recv_forward_close_resp(ab_session_p session);
+static int request_recycle(void *req_arg);
 static void request_destroy(void *req_arg);
+static request_pool_p request_pool_create(void);
+static void request_pool_close(request_pool_p pool);
+static void request_pool_destroy(void *pool_arg);
 static int session_request_increase_buffer(ab_request_p request, int new_capacity);
 
 
 static volatile mutex_p session_mutex = NULL;
 static volatile vector_p sessions = NULL;
 
+/* sessions opened ahead of their tags, each holds a reference. */
+static volatile vector_p held_sessions = NULL;
+
+/* packing statistics over all sessions. */
+static lock_t pack_stats_lock = LOCK_INIT;
+static uint64_t pack_stats_packets = 0;
+static uint64_t pack_stats_requests = 0;
+static uint64_t pack_stats_bytes = 0;
+static uint64_t pack_stats_capacity = 0;
+
+/* requests dropped over all sessions because their caller stopped waiting before they were sent. */
+static lock_t shed_count_lock = LOCK_INIT;
+static uint64_t shed_count = 0;
+
+/*
+ * Released requests and their buffers are kept here for reuse so that
+ * steady state polling does not allocate.  Requests can outlive their
+ * session, so the pool is reference counted and each request created
+ * for it holds a reference.
+ */
+struct request_pool_t {
+    mutex_p mutex;
+    int closed;
+    int num_free;
+    ab_request_p free_requests[SESSION_REQUEST_POOL_SIZE];
+};
+
+/*
+ * a source of requests for the fair scheduler, a scheduling class or a
+ * tag that is not in one.  It is kept while it has requests queued.
+ */
+struct sched_source_t {
+    int64_t key;
+    int num_queued;
+    uint64_t last_finish;
+};
+
+static struct session_io_thread_t io_threads[SESSION_IO_THREADS];
+static volatile int next_io_thread = 0;
+
 
 
 
@@ -111,12 +246,54 @@ int session_startup()
         return PLCTAG_ERR_NO_MEM;
     }
 
+    if((held_sessions = vector_create(25, 5)) == NULL) {
+        pdebug(DEBUG_ERROR, "Unable to create held session vector!");
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    for(int i=0; i < SESSION_IO_THREADS; i++) {
+        struct session_io_thread_t *io = &io_threads[i];
+
+        if((rc = mutex_create(&io->mutex)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create I/O thread mutex %s!", plc_tag_decode_error(rc));
+            return rc;
+        }
+
+        if((io->sessions = vector_create(SESSION_MIN_REQUESTS, SESSION_INC_REQUESTS)) == NULL
+           || (io->run_list = vector_create(SESSION_MIN_REQUESTS, SESSION_INC_REQUESTS)) == NULL) {
+            pdebug(DEBUG_ERROR, "Unable to create I/O thread session vectors!");
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        if((rc = socket_poller_create(&io->poller)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create I/O thread socket poller %s!", plc_tag_decode_error(rc));
+            return rc;
+        }
+
+        io->terminating = 0;
+
+        if((rc = thread_create(&io->thread, session_io_handler, 32*1024, io)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_ERROR, "Unable to create I/O thread %s!", plc_tag_decode_error(rc));
+            return rc;
+        }
+    }
+
     return rc;
 }
 
 
 void session_teardown()
 {
+    if(held_sessions) {
+        for(int i=0; i < vector_length(held_sessions); i++) {
+            rc_dec(vector_get(held_sessions, i));
+        }
+
+        vector_destroy(held_sessions);
+
+        held_sessions = NULL;
+    }
+
     if(sessions) {
         for(int i=0; i < vector_length(sessions); i++) {
             ab_session_p session = vector_get(sessions, i);
@@ -130,6 +307,45 @@ void session_teardown()
         sessions = NULL;
     }
 
+    /* stop the I/O threads.  Any sessions still alive are no longer run. */
+    for(int i=0; i < SESSION_IO_THREADS; i++) {
+        struct session_io_thread_t *io = &io_threads[i];
+
+        if(io->thread) {
+            io->terminating = 1;
+            socket_poller_wakeup(io->poller);
+
+            thread_join(io->thread);
+            thread_destroy(&io->thread);
+            io->thread = NULL;
+        }
+
+        if(io->sessions) {
+            critical_block(io->mutex) {
+                for(int j=0; j < vector_length(io->sessions); j++) {
+                    ab_session_p session = vector_get(io->sessions, j);
+                    session->io_thread = NULL;
+                }
+            }
+
+            vector_destroy(io->sessions);
+            io->sessions = NULL;
+        }
+
+        if(io->run_list) {
+            vector_destroy(io->run_list);
+            io->run_list = NULL;
+        }
+
+        if(io->poller) {
+            socket_poller_destroy(&io->poller);
+        }
+
+        if(io->mutex) {
+            mutex_destroy(&io->mutex);
+        }
+    }
+
 
     if(session_mutex) {
         mutex_destroy((mutex_p *)&session_mutex);
@@ -194,10 +410,156 @@ int session_get_max_payload(ab_session_p session)
     return result;
 }
 
+
+
+/*
+ * session_pick_stripe
+ *
+ * Pick the session with the fewest requests queued and in flight.
+ * Sessions that are not connected right now count as busy.  Ties go to
+ * the first one so that light traffic stays on one connection and
+ * packs well.
+ */
+ab_session_p session_pick_stripe(ab_session_p *stripes, int num_stripes)
+{
+    ab_session_p result = NULL;
+    int best_load = INT_MAX;
+
+    for(int i=0; i < num_stripes; i++) {
+        int load = 0;
+
+        critical_block(stripes[i]->mutex) {
+            load = stripes[i]->num_queued + stripes[i]->packets_in_flight;
+
+            if(stripes[i]->state != SESSION_IDLE) {
+                load += MAX_REQUESTS;
+            }
+        }
+
+        if(load < best_load) {
+            best_load = load;
+            result = stripes[i];
+        }
+    }
+
+    return result;
+}
+
+
+
+/*
+ * session_get_pack_stats
+ *
+ * Packing statistics over all sessions: packets sent, requests sent in
+ * them, payload bytes used and payload bytes available.  The fill ratio
+ * is bytes/capacity and the requests per packet is requests/packets.
+ * Any of the pointers can be NULL.
+ */
+void session_get_pack_stats(uint64_t *packets, uint64_t *requests, uint64_t *bytes, uint64_t *capacity)
+{
+    spin_block(&pack_stats_lock) {
+        if(packets) {
+            *packets = pack_stats_packets;
+        }
+
+        if(requests) {
+            *requests = pack_stats_requests;
+        }
+
+        if(bytes) {
+            *bytes = pack_stats_bytes;
+        }
+
+        if(capacity) {
+            *capacity = pack_stats_capacity;
+        }
+    }
+}
+
+
+
+/*
+ * session_get_queue_depth
+ *
+ * The number of requests queued on the session and not yet sent.
+ */
+int session_get_queue_depth(ab_session_p session)
+{
+    int depth = 0;
+
+    if(!session) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    critical_block(session->mutex) {
+        depth = session->num_queued;
+    }
+
+    return depth;
+}
+
+
+
+/*
+ * session_get_queue_full_policy
+ *
+ * What happens to new requests when the queue is full.  Another tag
+ * sharing the session can change it.
+ */
+int session_get_queue_full_policy(ab_session_p session)
+{
+    int policy = SESSION_QUEUE_FULL_REJECT;
+
+    if(!session) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    critical_block(session->mutex) {
+        policy = session->queue_full_policy;
+    }
+
+    return policy;
+}
+
+
+
+/*
+ * session_get_shed_count
+ *
+ * The number of requests, over all sessions, that were dropped from the
+ * queues because their deadline passed before they could be sent.
+ */
+uint64_t session_get_shed_count(void)
+{
+    uint64_t count = 0;
+
+    spin_block(&shed_count_lock) {
+        count = shed_count;
+    }
+
+    return count;
+}
+
+
+
 int session_find_or_create(ab_session_p *tag_session, attr attribs)
+{
+    return session_find_or_create_stripe(tag_session, attribs, attr_get_str(attribs, "gateway", ""), 0);
+}
+
+
+
+/*
+ * session_find_or_create_stripe
+ *
+ * Find or create one of the parallel sessions to a host and path.  Stripe
+ * zero is the session that tags share by default.  The host can be other
+ * than the tag's gateway, for instance a second Ethernet module in the
+ * same chassis.
+ */
+int session_find_or_create_stripe(ab_session_p *tag_session, attr attribs, const char *session_gw, int stripe)
 {
     /*int debug = attr_get_int(attribs,"debug",0);*/
-    const char *session_gw = attr_get_str(attribs, "gateway", "");
     const char *session_path = attr_get_str(attribs, "path", "");
     int use_connected_msg = attr_get_int(attribs, "use_connected_msg", 0);
     int session_gw_port = attr_get_int(attribs, "gateway_port", AB_EIP_DEFAULT_PORT);
@@ -208,9 +570,56 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
     int rc = PLCTAG_STATUS_OK;
     int auto_disconnect_enabled = 0;
     int auto_disconnect_timeout_ms = INT_MAX;
+    int max_packets_in_flight = attr_get_int(attribs, "max_packets_in_flight", SESSION_DEFAULT_PACKETS_IN_FLIGHT);
+    int pack_linger_us = attr_get_int(attribs, "pack_linger_us", SESSION_DEFAULT_PACK_LINGER_US);
+    int share_tcp = attr_get_int(attribs, "share_tcp", 0);
+    int retry_min_ms = attr_get_int(attribs, "retry_min_ms", SESSION_DEFAULT_RETRY_MIN_MS);
+    int retry_max_ms = attr_get_int(attribs, "retry_max_ms", SESSION_DEFAULT_RETRY_MAX_MS);
+    int keepalive_ms = attr_get_int(attribs, "keepalive_ms", 0);
+    const char *payload_cache_file = attr_get_str(attribs, "payload_cache_file", NULL);
+    int max_queued = attr_get_int(attribs, "max_queued_requests", 0);
+    const char *queue_full_str = attr_get_str(attribs, "queue_full", "reject");
+    int queue_full_policy = SESSION_QUEUE_FULL_REJECT;
+    ab_session_p carrier = AB_SESSION_NULL;
 
     pdebug(DEBUG_DETAIL, "Starting");
 
+    if(max_packets_in_flight < 1 || max_packets_in_flight > SESSION_MAX_PACKETS_IN_FLIGHT) {
+        pdebug(DEBUG_WARN, "Number of packets in flight, %d, must be between 1 and %d!", max_packets_in_flight, SESSION_MAX_PACKETS_IN_FLIGHT);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(pack_linger_us < 0 || pack_linger_us > SESSION_MAX_PACK_LINGER_US) {
+        pdebug(DEBUG_WARN, "Packing linger time, %dus, must be between 0 and %dus!", pack_linger_us, SESSION_MAX_PACK_LINGER_US);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(retry_min_ms < 1 || retry_max_ms < retry_min_ms || retry_max_ms > SESSION_MAX_RETRY_MS) {
+        pdebug(DEBUG_WARN, "Reconnect wait, %dms to %dms, must be between 1ms and %dms!", retry_min_ms, retry_max_ms, SESSION_MAX_RETRY_MS);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(keepalive_ms < 0 || keepalive_ms > SESSION_MAX_KEEPALIVE_MS) {
+        pdebug(DEBUG_WARN, "Keepalive idle time, %dms, must be between 0 (off) and %dms!", keepalive_ms, SESSION_MAX_KEEPALIVE_MS);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(max_queued < 0 || max_queued > SESSION_MAX_QUEUED_REQUESTS) {
+        pdebug(DEBUG_WARN, "Queue limit, %d, must be between 0 (none) and %d!", max_queued, SESSION_MAX_QUEUED_REQUESTS);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    if(str_cmp_i(queue_full_str, "reject") == 0) {
+        queue_full_policy = SESSION_QUEUE_FULL_REJECT;
+    } else if(str_cmp_i(queue_full_str, "coalesce") == 0) {
+        queue_full_policy = SESSION_QUEUE_FULL_COALESCE;
+    } else if(str_cmp_i(queue_full_str, "block") == 0) {
+        queue_full_policy = SESSION_QUEUE_FULL_BLOCK;
+    } else {
+        pdebug(DEBUG_WARN, "Queue full policy, %s, must be reject, coalesce or block!", queue_full_str);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
     auto_disconnect_timeout_ms = attr_get_int(attribs, "auto_disconnect_ms", INT_MAX);
     if(auto_disconnect_timeout_ms != INT_MAX) {
         pdebug(DEBUG_DETAIL, "Setting auto-disconnect after %dms.", auto_disconnect_timeout_ms);
@@ -223,18 +632,37 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
         attr_set_int(attribs, "use_connected_msg", 1);
     }
 
+    if(share_tcp && (!use_connected_msg || !shared_session)) {
+        pdebug(DEBUG_WARN, "Only shared, connected sessions can share a TCP connection!");
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    /* negotiated packet sizes are kept for the next run. */
+    if(payload_cache_file && (rc = payload_cache_set_file(payload_cache_file)) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to use payload cache file %s!", payload_cache_file);
+        return rc;
+    }
+
+    /* keep what the I/O thread learned since the last tag was created. */
+    payload_cache_save();
+
     critical_block(session_mutex) {
         /* if we are to share sessions, then look for an existing one. */
         if (shared_session) {
-            session = find_session_by_host_unsafe(session_gw, session_path);
+            session = find_session_by_host_unsafe(session_gw, session_path, stripe);
         } else {
             /* no sharing, create a new one */
             session = AB_SESSION_NULL;
         }
 
         if (session == AB_SESSION_NULL) {
-            pdebug(DEBUG_DETAIL, "Creating new session.");
-            session = session_create_unsafe(session_gw, session_gw_port, session_path, plc_type, use_connected_msg);
+            /* ride on another session's TCP connection to the same host? */
+            if(share_tcp) {
+                carrier = find_carrier_unsafe(session_gw, stripe);
+            }
+
+            pdebug(DEBUG_DETAIL, "Creating new session%s.", (carrier ? " sharing an existing TCP connection" : ""));
+            session = session_create_unsafe(session_gw, session_gw_port, session_path, plc_type, use_connected_msg, carrier);
 
             if (session == AB_SESSION_NULL) {
                 pdebug(DEBUG_WARN, "unable to create or find a session!");
@@ -242,6 +670,15 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
             } else {
                 session->auto_disconnect_enabled = auto_disconnect_enabled;
                 session->auto_disconnect_timeout_ms = auto_disconnect_timeout_ms;
+                session->max_packets_in_flight = max_packets_in_flight;
+                session->pack_linger_us = pack_linger_us;
+                session->stripe = stripe;
+                session->share_tcp = share_tcp;
+                session->retry_min_ms = retry_min_ms;
+                session->retry_max_ms = retry_max_ms;
+                session->keepalive_ms = keepalive_ms;
+                session->max_queued = max_queued;
+                session->queue_full_policy = queue_full_policy;
 
                 new_session = 1;
             }
@@ -256,10 +693,68 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
                 session->auto_disconnect_timeout_ms = auto_disconnect_timeout_ms;
             }
 
+            /* the I/O thread reads these, change them under the session mutex. */
+            critical_block(session->mutex) {
+                /* the pipeline window only goes up. */
+                if(session->max_packets_in_flight < max_packets_in_flight) {
+                    pdebug(DEBUG_DETAIL, "Increasing packets in flight to %d.", max_packets_in_flight);
+                    session->max_packets_in_flight = max_packets_in_flight;
+                }
+
+                /*
+                 * so does the linger time.  Tags that cannot wait turn it off
+                 * for themselves with allow_linger=0.
+                 */
+                if(session->pack_linger_us < pack_linger_us) {
+                    pdebug(DEBUG_DETAIL, "Increasing packing linger time to %dus.", pack_linger_us);
+                    session->pack_linger_us = pack_linger_us;
+                }
+
+                /* the gentler reconnect policy wins, the PLC may be serving many clients. */
+                if(session->retry_min_ms < retry_min_ms) {
+                    session->retry_min_ms = retry_min_ms;
+                }
+
+                if(session->retry_max_ms < retry_max_ms) {
+                    session->retry_max_ms = retry_max_ms;
+                }
+
+                /* the keepalive idle time only goes down. */
+                if(keepalive_ms > 0 && (session->keepalive_ms == 0 || session->keepalive_ms > keepalive_ms)) {
+                    session->keepalive_ms = keepalive_ms;
+                }
+
+                /* let later sessions to the host ride on this one. */
+                if(share_tcp && !session->share_tcp) {
+                    session->share_tcp = share_tcp;
+                }
+
+                /*
+                 * the queue limit only goes down.  The policy is set by the tag
+                 * that set the limit in force.
+                 */
+                if(max_queued > 0 && (session->max_queued == 0 || session->max_queued > max_queued)) {
+                    pdebug(DEBUG_DETAIL, "Lowering queue limit to %d.", max_queued);
+                    session->max_queued = max_queued;
+                    session->queue_full_policy = queue_full_policy;
+                }
+            }
+
+            carrier = session->carrier;
+
             pdebug(DEBUG_DETAIL, "Reusing existing session.");
         }
     }
 
+    /* the carrier owns the socket and does the probing. */
+    if(rc == PLCTAG_STATUS_OK && carrier && keepalive_ms > 0) {
+        critical_block(carrier->mutex) {
+            if(carrier->keepalive_ms == 0 || carrier->keepalive_ms > keepalive_ms) {
+                carrier->keepalive_ms = keepalive_ms;
+            }
+        }
+    }
+
     /*
      * do this OUTSIDE the mutex in order to let other threads not block if
      * the session creation process blocks.
@@ -285,6 +780,103 @@ int session_find_or_create(ab_session_p *tag_session, attr attribs)
 }
 
 
+
+/*
+ * session_hold
+ *
+ * Keep the session open until the library shuts down, even if no tags
+ * use it.  Takes over the caller's reference.
+ */
+int session_hold(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int held = 0;
+
+    if(!session) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    critical_block(session_mutex) {
+        for(int i=0; i < vector_length(held_sessions); i++) {
+            if(vector_get(held_sessions, i) == session) {
+                held = 1;
+                break;
+            }
+        }
+
+        if(!held) {
+            rc = vector_put(held_sessions, vector_length(held_sessions), session);
+        }
+    }
+
+    if(held || rc != PLCTAG_STATUS_OK) {
+        rc_dec(session);
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * session_status
+ *
+ * PLCTAG_STATUS_OK when the session is connected and ready for
+ * requests, PLCTAG_ERR_BACKOFF while it waits to reconnect after
+ * failing and PLCTAG_STATUS_PENDING while it is connecting.
+ */
+int session_status(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_PENDING;
+
+    if(!session) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    critical_block(session->mutex) {
+        if(session->retry_backoff) {
+            rc = PLCTAG_ERR_BACKOFF;
+        } else if(session->state == SESSION_IDLE) {
+            rc = PLCTAG_STATUS_OK;
+        }
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * session_wait_status
+ *
+ * Wait until the session is connected or backing off, or until the
+ * passed time in milliseconds.  Returns the session status, which is
+ * still PLCTAG_STATUS_PENDING if the time ran out.
+ */
+int session_wait_status(ab_session_p session, int64_t timeout_time)
+{
+    int rc = PLCTAG_STATUS_PENDING;
+
+    if(!session) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    while((rc = session_status(session)) == PLCTAG_STATUS_PENDING && time_ms() < timeout_time) {
+        cond_wait(session->state_cond, (int)(timeout_time - time_ms()));
+    }
+
+    /*
+     * the condition wakes one waiter.  Pass the wake up on to any others,
+     * they will check the status and wait again if it does not concern them.
+     */
+    if(rc != PLCTAG_STATUS_PENDING) {
+        cond_signal(session->state_cond);
+    }
+
+    return rc;
+}
+
+
 ///* FIXME - This duplicates check_cpu in ab_common.c:check_cpu()!!! */
 //
 //int get_plc_type(attr attribs)
@@ -388,12 +980,16 @@ int remove_session(ab_session_p s)
 }
 
 
-int session_match_valid(const char *host, const char *path, ab_session_p session)
+int session_match_valid(const char *host, const char *path, int stripe, ab_session_p session)
 {
     if(!session) {
         return 0;
     }
 
+    if(session->stripe != stripe) {
+        return 0;
+    }
+
     /* don't use sessions that failed immediately. */
     if(session->failed) {
         return 0;
@@ -411,7 +1007,7 @@ int session_match_valid(const char *host, const char *path, ab_session_p session
 }
 
 
-ab_session_p find_session_by_host_unsafe(const char *host, const char *path)
+ab_session_p find_session_by_host_unsafe(const char *host, const char *path, int stripe)
 {
     for(int i=0; i < vector_length(sessions); i++) {
         ab_session_p session = vector_get(sessions, i);
@@ -419,7 +1015,7 @@ ab_session_p find_session_by_host_unsafe(const char *host, const char *path)
         /* is this session in the process of destruction? */
         session = rc_inc(session);
         if(session) {
-            if(session_match_valid(host, path, session)) {
+            if(session_match_valid(host, path, stripe, session)) {
                 return session;
             }
 
@@ -432,7 +1028,41 @@ ab_session_p find_session_by_host_unsafe(const char *host, const char *path)
 
 
 
-ab_session_p session_create_unsafe(const char *host, int gw_port, const char *path, int plc_type, int use_connected_msg)
+/*
+ * find_carrier_unsafe
+ *
+ * Find a session to the host that owns its own TCP connection and lets
+ * other connected sessions share it.  Sessions to the same host, but not
+ * the same stripe, stay on separate connections.
+ */
+ab_session_p find_carrier_unsafe(const char *host, int stripe)
+{
+    for(int i=0; i < vector_length(sessions); i++) {
+        ab_session_p session = vector_get(sessions, i);
+
+        /* is this session in the process of destruction? */
+        session = rc_inc(session);
+        if(session) {
+            if(session->share_tcp && session->use_connected_msg && !session->carrier && !session->failed
+               && session->stripe == stripe && !str_cmp_i(host, session->host)) {
+                return session;
+            }
+
+            rc_dec(session);
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * session_create_unsafe
+ *
+ * The new session takes over the reference to the carrier, if any.
+ */
+ab_session_p session_create_unsafe(const char *host, int gw_port, const char *path, int plc_type, int use_connected_msg, ab_session_p carrier)
 {
     static volatile uint32_t srand_setup = 0;
     static volatile uint32_t connection_id = 0;
@@ -447,9 +1077,12 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
     session = (ab_session_p)rc_alloc(sizeof(struct ab_session_t), session_destroy);
     if (!session) {
         pdebug(DEBUG_WARN, "Error allocating new session.");
+        rc_dec(carrier);
         return AB_SESSION_NULL;
     }
 
+    session->carrier = carrier;
+
     session->host = str_dup(host);
     if(!session->host) {
         pdebug(DEBUG_WARN, "Unable to duplicate host string!");
@@ -471,9 +1104,53 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
         return NULL;
     }
 
-    session->requests = vector_create(SESSION_MIN_REQUESTS, SESSION_INC_REQUESTS);
-    if(!session->requests) {
-        pdebug(DEBUG_WARN, "Unable to allocate vector for requests!");
+    session->in_flight = vector_create(SESSION_MIN_REQUESTS, SESSION_INC_REQUESTS);
+    if(!session->in_flight) {
+        pdebug(DEBUG_WARN, "Unable to allocate vector for requests in flight!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    session->request_pool = request_pool_create();
+    if(!session->request_pool) {
+        pdebug(DEBUG_WARN, "Unable to allocate request pool!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    session->sched_sources = hashtable_create(SESSION_MIN_REQUESTS);
+    if(!session->sched_sources) {
+        pdebug(DEBUG_WARN, "Unable to allocate scheduling source table!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    session->riders = vector_create(SESSION_MIN_REQUESTS, SESSION_INC_REQUESTS);
+    session->pending_closes = vector_create(SESSION_MIN_REQUESTS, SESSION_INC_REQUESTS);
+    if(!session->riders || !session->pending_closes) {
+        pdebug(DEBUG_WARN, "Unable to allocate vectors for sharing the TCP connection!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    /*
+     * the mutex is created here rather than in session_init() because
+     * riders use the carrier's mutex as soon as they are created.
+     */
+    if((rc = mutex_create(&(session->mutex))) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create session mutex!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    if((rc = cond_create(&(session->state_cond))) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create session state condition!");
+        rc_dec(session);
+        return NULL;
+    }
+
+    if((rc = cond_create(&(session->queue_cond))) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create session queue condition!");
         rc_dec(session);
         return NULL;
     }
@@ -481,6 +1158,7 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
     session->plc_type = plc_type;
     session->data_capacity = MAX_PACKET_SIZE_EX;
     session->use_connected_msg = use_connected_msg;
+    session->max_packets_in_flight = SESSION_DEFAULT_PACKETS_IN_FLIGHT;
     session->failed = 0;
     session->conn_serial_number = (uint16_t)(intptr_t)(session);
 
@@ -539,6 +1217,21 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
      */
     session->orig_connection_id = ++connection_id;
 
+    /*
+     * a rider must run on its carrier's I/O thread as it uses the
+     * carrier's socket and receive buffer directly.
+     */
+    if(carrier) {
+        session->io_thread = carrier->io_thread;
+
+        critical_block(carrier->mutex) {
+            vector_put(carrier->riders, vector_length(carrier->riders), session);
+        }
+    } else {
+        session->io_thread = &io_threads[next_io_thread];
+        next_io_thread = (next_io_thread + 1) % SESSION_IO_THREADS;
+    }
+
     /* add the new session to the list. */
     add_session_unsafe(session);
 
@@ -551,27 +1244,34 @@ ab_session_p session_create_unsafe(const char *host, int gw_port, const char *pa
 /*
  * session_init
  *
- * This calls several blocking methods and so must not keep the main mutex
- * locked during them.
+ * Hand the session to one of the I/O threads.  The connection is
+ * set up in the background by the session state machine.
  */
 int session_init(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
+    struct session_io_thread_t *io = NULL;
 
     pdebug(DEBUG_INFO, "Starting.");
 
-    if((rc = mutex_create(&(session->mutex))) != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to create session mutex!");
+    /* the I/O thread was picked when the session was created. */
+    io = session->io_thread;
+
+    if(!io || !io->thread) {
+        pdebug(DEBUG_WARN, "No I/O thread available for session!");
         session->failed = 1;
-        return rc;
+        return PLCTAG_ERR_CREATE;
     }
 
-    if((rc = thread_create((thread_p *)&(session->handler_thread), session_handler, 32*1024, session)) != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to create session thread!");
-        session->failed = 1;
-        return rc;
+    session->state = SESSION_OPEN_SOCKET;
+    session->next_run_time = time_ms();
+
+    critical_block(io->mutex) {
+        vector_put(io->sessions, vector_length(io->sessions), session);
     }
 
+    socket_poller_wakeup(io->poller);
+
     pdebug(DEBUG_INFO, "Done.");
 
     return rc;
@@ -581,7 +1281,8 @@ int session_init(ab_session_p session)
 /*
  * session_open_socket()
  *
- * Connect to the host/port passed via TCP.
+ * Start connecting to the host/port passed via TCP.  Returns
+ * PLCTAG_STATUS_PENDING while the connection is in progress.
  */
 
 int session_open_socket(ab_session_p session)
@@ -590,17 +1291,23 @@ int session_open_socket(ab_session_p session)
 
     pdebug(DEBUG_INFO, "Starting.");
 
+    /* nothing is in flight on a new connection. */
+    session->send_data_size = 0;
+    session->send_data_offset = 0;
+    session->data_size = 0;
+    session->data_offset = 0;
+
     /* Open a socket for communication with the gateway. */
     rc = socket_create(&(session->sock));
 
     if (rc) {
         pdebug(DEBUG_WARN, "Unable to create socket for session!");
-        return 0;
+        return rc;
     }
 
-    rc = socket_connect_tcp(session->sock, session->host, AB_EIP_DEFAULT_PORT);
+    rc = socket_connect_tcp_start(session->sock, session->host, AB_EIP_DEFAULT_PORT);
 
-    if (rc != PLCTAG_STATUS_OK) {
+    if (rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
         pdebug(DEBUG_WARN, "Unable to connect socket for session!");
         return rc;
     }
@@ -612,23 +1319,16 @@ int session_open_socket(ab_session_p session)
 
 
 
-int session_register(ab_session_p session)
+int send_register_req(ab_session_p session)
 {
     eip_session_reg_req *req;
-    eip_encap *resp;
-    int rc = PLCTAG_STATUS_OK;
 
     pdebug(DEBUG_INFO, "Starting.");
 
-    /*
-     * clear the session data.
-     *
-     * We use the receiving buffer because we do not have a request and nothing can
-     * be coming in (we hope) on the socket yet.
-     */
-    mem_set(session->data, 0, sizeof(eip_session_reg_req));
+    /* clear the send buffer. */
+    mem_set(session->send_data, 0, sizeof(eip_session_reg_req));
 
-    req = (eip_session_reg_req *)(session->data);
+    req = (eip_session_reg_req *)(session->send_data);
 
     /* fill in the fields of the request */
     req->encap_command = h2le16(AB_EIP_REGISTER_SESSION);
@@ -641,29 +1341,22 @@ int session_register(ab_session_p session)
     req->eip_version = h2le16(AB_EIP_VERSION);
     req->option_flags = h2le16(0);
 
-    /*
-     * socket ops here are _ASYNCHRONOUS_!
-     *
-     * This is done this way because we do not have everything
-     * set up for a request to be handled by the thread.  I think.
-     */
-
     /* send registration to the gateway */
-    session->data_size = sizeof(eip_session_reg_req);
-    session->data_offset = 0;
+    session->send_data_size = sizeof(eip_session_reg_req);
 
-    rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Error sending session registration request %s!", plc_tag_decode_error(rc));
-        return rc;
-    }
+    start_eip_exchange(session, session_timeout(session));
 
-    /* get the response from the gateway */
-    rc = recv_eip_response(session, SESSION_DEFAULT_TIMEOUT);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Error receiving session registration response %s!", plc_tag_decode_error(rc));
-        return rc;
-    }
+    pdebug(DEBUG_INFO, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int recv_register_resp(ab_session_p session)
+{
+    eip_encap *resp;
+
+    pdebug(DEBUG_INFO, "Starting.");
 
     /* encap header is at the start of the buffer */
     resp = (eip_encap *)(session->data);
@@ -691,6 +1384,7 @@ int session_register(ab_session_p session)
 }
 
 
+
 int session_unregister(ab_session_p session)
 {
     (void)session;
@@ -706,16 +1400,60 @@ int session_unregister(ab_session_p session)
 
 
 
+/*
+ * session_close_socket
+ *
+ * A rider just lets go of its carrier.  A carrier takes the connections
+ * of all its riders down with the socket.
+ */
 int session_close_socket(ab_session_p session)
 {
     pdebug(DEBUG_INFO, "Starting.");
 
+    if(session->carrier) {
+        session_detach_carrier(session);
+
+        pdebug(DEBUG_INFO, "Done.");
+
+        return PLCTAG_STATUS_OK;
+    }
+
     if (session->sock) {
+        /* stop watching the socket before it goes away. */
+        if(session->io_thread) {
+            socket_poller_set(session->io_thread->poller, session->sock, 0, NULL);
+        }
+
         socket_close(session->sock);
         socket_destroy(&(session->sock));
         session->sock = NULL;
     }
 
+    /* a new socket needs a new registration. */
+    session->session_handle = 0;
+    session->transport_broken = 0;
+    session->deliver_blocked = 0;
+    session->writers_waiting = 0;
+
+    if(session->writer && session->writer != session) {
+        rc_dec(session->writer);
+    }
+
+    session->writer = NULL;
+
+    if(session->mutex) {
+        critical_block(session->mutex) {
+            session->transport_gen++;
+            session->num_attached = 0;
+        }
+
+        /* the connections they were for are gone with the socket. */
+        drop_pending_closes(session);
+
+        /* let the riders notice. */
+        session_wake_riders(session, 0);
+    }
+
     pdebug(DEBUG_INFO, "Done.");
 
     return PLCTAG_STATUS_OK;
@@ -723,590 +1461,2846 @@ int session_close_socket(ab_session_p session)
 
 
 
-void session_destroy(void *session_arg)
+/*
+ * session_attach_carrier
+ *
+ * Start using the carrier's TCP connection and registration.  If the
+ * carrier is not connected, get it going.  It wakes its riders up when
+ * it is ready.  Returns PLCTAG_STATUS_PENDING until then.
+ */
+int session_attach_carrier(ab_session_p session)
 {
-    ab_session_p session = session_arg;
-//    ab_request_p req = NULL;
+    ab_session_p carrier = session->carrier;
+    int rc = PLCTAG_STATUS_PENDING;
 
-    pdebug(DEBUG_INFO, "Starting.");
-
-    if (!session) {
-        pdebug(DEBUG_WARN, "Session ptr is null!");
+    pdebug(DEBUG_DETAIL, "Starting.");
 
-        return;
+    critical_block(carrier->mutex) {
+        if(carrier->sock && carrier->state == SESSION_IDLE && carrier->session_handle && !carrier->transport_broken) {
+            carrier->num_attached++;
+            session->carrier_gen = carrier->transport_gen;
+            session->session_handle = carrier->session_handle;
+            rc = PLCTAG_STATUS_OK;
+        }
     }
 
-    /* so remove the session from the list so no one else can reference it. */
-    remove_session(session);
-
-    pdebug(DEBUG_INFO, "Session sent %"PRId64" packets.", session->packet_count);
+    if(rc == PLCTAG_STATUS_PENDING) {
+        pdebug(DEBUG_DETAIL, "Waiting for the shared TCP connection.");
 
-    /* terminate the thread first. */
-    session->terminating = 1;
+        carrier->riders_waiting = 1;
+        session_wakeup(carrier);
 
-    /* get rid of the handler thread. */
-    if(session->handler_thread) {
-        thread_join(session->handler_thread);
-        thread_destroy(&(session->handler_thread));
-        session->handler_thread = NULL;
+        return rc;
     }
 
-    if(session->targ_connection_id) {
-        /*
-         * we do not want the internal loop to immediately
-         * return, so set the flag like we are not terminating.
-         * There is still a timeout that applies.
-         */
-        session->terminating = 0;
-        perform_forward_close(session);
-        session->terminating = 1;
-    }
+    /* nothing is in flight on a new connection. */
+    session->send_data_size = 0;
+    session->send_data_offset = 0;
+    session->data_size = 0;
+    session->data_offset = 0;
+    session->resp_ready = 0;
+    session->write_blocked = 0;
 
-    if(session->session_handle) {
-        session_unregister(session);
-    }
+    pdebug(DEBUG_DETAIL, "Done.");
 
-    if(session->sock) {
-        session_close_socket(session);
-    }
+    return rc;
+}
 
-    if(session->requests) {
-        for(int i=0; i < vector_length(session->requests); i++) {
-            rc_dec(vector_get(session->requests, i));
-        }
 
-        vector_destroy(session->requests);
-        session->requests = NULL;
-    }
 
-    /* we are done with the mutex, finally destroy it. */
-    if(session->mutex) {
-        mutex_destroy(&(session->mutex));
-        session->mutex = NULL;
-    }
+/*
+ * session_detach_carrier
+ *
+ * Stop using the carrier's TCP connection.
+ */
+void session_detach_carrier(ab_session_p session)
+{
+    ab_session_p carrier = session->carrier;
 
-    if(session->conn_path) {
-        mem_free(session->conn_path);
-        session->conn_path = NULL;
-    }
+    pdebug(DEBUG_DETAIL, "Starting.");
 
-    if(session->path) {
-        mem_free(session->path);
-        session->path = NULL;
-    }
+    session_release_writer(session);
 
-    if(session->host) {
-        mem_free(session->host);
-        session->host = NULL;
+    critical_block(carrier->mutex) {
+        if(session->session_handle && session->carrier_gen == carrier->transport_gen) {
+            carrier->num_attached--;
+        }
     }
 
-    pdebug(DEBUG_INFO, "Done.");
+    session->session_handle = 0;
+    session->resp_ready = 0;
+    session->write_blocked = 0;
 
-    return;
-}
+    /* the carrier may be holding a response it cannot hand over now. */
+    if(carrier->deliver_blocked) {
+        session_wakeup(carrier);
+    }
 
+    pdebug(DEBUG_DETAIL, "Done.");
+}
 
 
 
 /*
- * session_add_request_unsafe
+ * session_release_writer
  *
- * You must hold the mutex before calling this!
+ * Give up the right to write to the socket, if we had it, and wake up
+ * anyone waiting for it.  Only one packet can be going out on a socket
+ * at a time.
  */
-int session_add_request_unsafe(ab_session_p session, ab_request_p req)
+void session_release_writer(ab_session_p session)
 {
-    int rc = PLCTAG_STATUS_OK;
+    ab_session_p transport = (session->carrier ? session->carrier : session);
 
-    pdebug(DEBUG_INFO, "Starting.");
+    if(transport->writer != session) {
+        return;
+    }
 
-    if(!session) {
-        pdebug(DEBUG_WARN, "Session is null!");
-        return PLCTAG_ERR_NULL_PTR;
+    /* a packet cut off part way leaves nothing usable on the stream after it. */
+    if(session->send_data_offset > 0 && session->send_data_offset < session->send_data_size) {
+        pdebug(DEBUG_WARN, "Packet only partly sent, the TCP connection must be reset!");
+        transport->transport_broken = 1;
+        session_wakeup(transport);
     }
 
-    req = rc_inc(req);
+    transport->writer = NULL;
 
-    if(!req) {
-        pdebug(DEBUG_WARN, "Request is either null or in the process of being deleted.");
-        return PLCTAG_ERR_NULL_PTR;
+    if(transport != session) {
+        rc_dec(session);
     }
 
-    /* make sure the request points to the session */
+    if(transport->writers_waiting) {
+        transport->writers_waiting = 0;
 
-    /* insert into the requests vector */
-    vector_put(session->requests, vector_length(session->requests), req);
+        if(transport->write_blocked) {
+            transport->write_blocked = 0;
+            session_wakeup(transport);
+        }
 
-    pdebug(DEBUG_INFO, "Total requests in the queue: %d", vector_length(session->requests));
+        session_wake_riders(transport, 1);
+    }
+}
 
-    pdebug(DEBUG_INFO, "Done.");
 
-    return rc;
-}
 
 /*
- * session_add_request
+ * session_wake_riders
  *
- * This is a thread-safe version of the above routine.
+ * Wake up the riders, or only the ones waiting to write.
  */
-int session_add_request(ab_session_p sess, ab_request_p req)
+void session_wake_riders(ab_session_p session, int only_blocked)
 {
-    int rc = PLCTAG_STATUS_OK;
+    if(!session->riders) {
+        return;
+    }
 
-    pdebug(DEBUG_DETAIL, "Starting. sess=%p, req=%p", sess, req);
+    critical_block(session->mutex) {
+        for(int i=0; i < vector_length(session->riders); i++) {
+            ab_session_p rider = vector_get(session->riders, i);
 
-    critical_block(sess->mutex) {
-        rc = session_add_request_unsafe(sess, req);
+            if(!only_blocked || rider->write_blocked) {
+                rider->write_blocked = 0;
+                session_wakeup(rider);
+            }
+        }
     }
+}
 
-    pdebug(DEBUG_DETAIL, "Done.");
 
-    return rc;
+
+/*
+ * queue_pending_close_unsafe
+ *
+ * Have the carrier send a Forward Close for a rider that is going away.
+ * You must hold the carrier's mutex.
+ */
+void queue_pending_close_unsafe(ab_session_p carrier, ab_session_p rider)
+{
+    struct pending_close_t *pending = NULL;
+
+    pending = (struct pending_close_t *)mem_alloc((int)sizeof(*pending) + rider->conn_path_size);
+    if(!pending) {
+        pdebug(DEBUG_WARN, "Unable to allocate pending Forward Close, the PLC will time out connection %x.", rider->orig_connection_id);
+        return;
+    }
+
+    pending->conn_serial_number = rider->conn_serial_number;
+    pending->conn_path_size = rider->conn_path_size;
+    pending->conn_path = (uint8_t *)(pending + 1);
+    mem_copy(pending->conn_path, rider->conn_path, rider->conn_path_size);
+
+    vector_put(carrier->pending_closes, vector_length(carrier->pending_closes), pending);
 }
 
 
+
 /*
- * session_remove_request_unsafe
+ * start_pending_close
  *
- * You must hold the mutex before calling this!
+ * Put the next Forward Close for a rider that went away in the send
+ * buffer.  Nothing waits for its response.  Returns
+ * PLCTAG_STATUS_PENDING if there is none.
  */
-int session_remove_request_unsafe(ab_session_p session, ab_request_p req)
+int start_pending_close(ab_session_p session)
 {
-    int rc = PLCTAG_STATUS_OK;
-//    ab_request_p cur, prev;
-
-    pdebug(DEBUG_DETAIL, "Starting.");
+    struct pending_close_t *pending = NULL;
 
-    if(session == NULL || req == NULL) {
-        return rc;
+    if(!session->pending_closes) {
+        return PLCTAG_STATUS_PENDING;
     }
 
-    for(int i=0; i < vector_length(session->requests); i++) {
-        if(vector_get(session->requests, i) == req) {
-            vector_remove(session->requests, i);
-            break;
+    critical_block(session->mutex) {
+        if(vector_length(session->pending_closes) > 0) {
+            pending = vector_remove(session->pending_closes, 0);
         }
     }
 
-    /* release the request refcount */
-    rc_dec(req);
-
-    pdebug(DEBUG_DETAIL, "Done.");
+    if(!pending) {
+        return PLCTAG_STATUS_PENDING;
+    }
 
-    return rc;
-}
+    pdebug(DEBUG_DETAIL, "Closing connection %u of a session that shared this one's TCP connection.", pending->conn_serial_number);
 
+    build_forward_close_req(session, pending->conn_serial_number, pending->conn_path, pending->conn_path_size);
 
+    mem_free(pending);
 
-/*****************************************************************
- **************** Session handling functions *********************
- ****************************************************************/
+    session->send_iov[0].data = session->send_data;
+    session->send_iov[0].size = (int)session->send_data_size;
+    session->send_iov_count = 1;
+    session->send_iov_index = 0;
+    session->send_data_offset = 0;
 
+    return PLCTAG_STATUS_OK;
+}
 
-typedef enum { SESSION_OPEN_SOCKET, SESSION_REGISTER, SESSION_CONNECT,
-               SESSION_IDLE, SESSION_DISCONNECT, SESSION_UNREGISTER,
-               SESSION_CLOSE_SOCKET, SESSION_START_RETRY, SESSION_WAIT_RETRY,
-               SESSION_WAIT_RECONNECT
-             } session_state_t;
 
 
-THREAD_FUNC(session_handler)
+void drop_pending_closes(ab_session_p session)
 {
-    ab_session_p session = arg;
-    int rc = PLCTAG_STATUS_OK;
-    session_state_t state = SESSION_OPEN_SOCKET;
-    int64_t timeout_time = 0;
-    int64_t auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
-    int auto_disconnect = 0;
+    if(!session->pending_closes || !session->mutex) {
+        return;
+    }
+
+    critical_block(session->mutex) {
+        while(vector_length(session->pending_closes) > 0) {
+            mem_free(vector_remove(session->pending_closes, vector_length(session->pending_closes) - 1));
+        }
+    }
+}
+
+
+
+void session_destroy(void *session_arg)
+{
+    ab_session_p session = session_arg;
+//    ab_request_p req = NULL;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if (!session) {
+        pdebug(DEBUG_WARN, "Session ptr is null!");
+
+        return;
+    }
+
+    /* so remove the session from the list so no one else can reference it. */
+    remove_session(session);
+
+    /*
+     * a rider must leave its carrier before anything else, the carrier
+     * looks at its riders when handing over responses.  If the rider
+     * still has a connection open, the carrier closes it for us.
+     */
+    if(session->carrier) {
+        ab_session_p carrier = session->carrier;
+
+        critical_block(carrier->mutex) {
+            for(int i=0; i < vector_length(carrier->riders); i++) {
+                if(vector_get(carrier->riders, i) == session) {
+                    vector_remove(carrier->riders, i);
+                    break;
+                }
+            }
+
+            if(session->session_handle && session->carrier_gen == carrier->transport_gen) {
+                carrier->num_attached--;
+
+                if(session->targ_connection_id) {
+                    queue_pending_close_unsafe(carrier, session);
+                }
+            }
+        }
+
+        session_wakeup(carrier);
+
+        session->session_handle = 0;
+        session->carrier = rc_dec(carrier);
+    }
+
+    pdebug(DEBUG_INFO, "Session sent %"PRId64" packets.", session->packet_count);
+
+    if(session->srtt_us > 0) {
+        pdebug(DEBUG_INFO, "Session round trip time %"PRId64"us, deviation %"PRId64"us, timeout %dms.", session->srtt_us, session->rttvar_us, session_timeout(session));
+    }
+
+    if(session->pack_packets > 0 && session->pack_capacity > 0) {
+        pdebug(DEBUG_INFO, "Session packed %"PRIu64" requests into %"PRIu64" packets, %.2f requests per packet, %.1f%% fill.",
+                           session->pack_requests,
+                           session->pack_packets,
+                           (double)session->pack_requests / (double)session->pack_packets,
+                           100.0 * (double)session->pack_bytes / (double)session->pack_capacity);
+    }
+
+    if(session->dedupe_count > 0) {
+        pdebug(DEBUG_INFO, "Session answered %"PRIu64" duplicate reads from other requests' responses.", session->dedupe_count);
+    }
+
+    if(session->shed_count > 0) {
+        pdebug(DEBUG_INFO, "Session shed %"PRIu64" requests that were not sent before their deadline.", session->shed_count);
+    }
+
+    /*
+     * take the session away from its I/O thread first.  The I/O thread
+     * holds a reference while it runs the session, so it is not running now.
+     */
+    if(session->io_thread) {
+        struct session_io_thread_t *io = session->io_thread;
+
+        critical_block(io->mutex) {
+            for(int i=0; i < vector_length(io->sessions); i++) {
+                if(vector_get(io->sessions, i) == session) {
+                    vector_remove(io->sessions, i);
+                    break;
+                }
+            }
+        }
+
+        if(session->sock) {
+            socket_poller_set(io->poller, session->sock, 0, NULL);
+        }
+    }
+
+    if(session->sock && session->targ_connection_id) {
+        perform_pending_closes(session);
+        perform_forward_close(session);
+    }
+
+    if(session->session_handle) {
+        session_unregister(session);
+    }
+
+    if(session->sock) {
+        session_close_socket(session);
+    }
+
+    session->io_thread = NULL;
+
+    if(session->in_flight) {
+        fail_in_flight_requests(session, PLCTAG_ERR_ABORT, 0);
+
+        vector_destroy(session->in_flight);
+        session->in_flight = NULL;
+    }
+
+    /* release the queued requests, that also frees their scheduling sources. */
+    while(session->num_queued > 0) {
+        rc_dec(request_queue_pop_unsafe(session));
+    }
+
+    for(int p=0; p < SESSION_NUM_PRIORITIES; p++) {
+        if(session->queues[p].heap) {
+            mem_free(session->queues[p].heap);
+            session->queues[p].heap = NULL;
+        }
+    }
+
+    if(session->sched_sources) {
+        hashtable_destroy(session->sched_sources);
+        session->sched_sources = NULL;
+    }
+
+    /* riders hold references to their carrier, so none are left. */
+    if(session->riders) {
+        vector_destroy(session->riders);
+        session->riders = NULL;
+    }
+
+    if(session->pending_closes) {
+        drop_pending_closes(session);
+        vector_destroy(session->pending_closes);
+        session->pending_closes = NULL;
+    }
+
+    /* requests still held by tags will be freed when they are released. */
+    if(session->request_pool) {
+        request_pool_close(session->request_pool);
+        session->request_pool = rc_dec(session->request_pool);
+    }
+
+    /* nobody can be waiting for the session to connect, the waiters hold references. */
+    if(session->state_cond) {
+        cond_destroy(&(session->state_cond));
+        session->state_cond = NULL;
+    }
+
+    /* nobody can be waiting for room in the queue any more. */
+    if(session->queue_cond) {
+        cond_destroy(&(session->queue_cond));
+        session->queue_cond = NULL;
+    }
+
+    /* we are done with the mutex, finally destroy it. */
+    if(session->mutex) {
+        mutex_destroy(&(session->mutex));
+        session->mutex = NULL;
+    }
+
+    if(session->conn_path) {
+        mem_free(session->conn_path);
+        session->conn_path = NULL;
+    }
+
+    if(session->path) {
+        mem_free(session->path);
+        session->path = NULL;
+    }
+
+    if(session->host) {
+        mem_free(session->host);
+        session->host = NULL;
+    }
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return;
+}
+
+
+
+
+/*
+ * session_add_request_unsafe
+ *
+ * Queue the request in fair order, or right behind after if that is set.
+ *
+ * You must hold the mutex before calling this!
+ */
+int session_add_request_unsafe(ab_session_p session, ab_request_p req, ab_request_p after)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_INFO, "Starting.");
+
+    if(!session) {
+        pdebug(DEBUG_WARN, "Session is null!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* no point queuing while we are waiting to reconnect. */
+    if(session->retry_backoff) {
+        pdebug(DEBUG_DETAIL, "Session is waiting to reconnect, failing request.");
+        return PLCTAG_ERR_BACKOFF;
+    }
+
+    req = rc_inc(req);
+
+    if(!req) {
+        pdebug(DEBUG_WARN, "Request is either null or in the process of being deleted.");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    req->time_queued_us = time_us();
+
+    /* queue it among the other requests of the same priority. */
+    rc = request_queue_push_unsafe(session, req, after);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to queue request, error %s!", plc_tag_decode_error(rc));
+        rc_dec(req);
+        return rc;
+    }
+
+    pdebug(DEBUG_INFO, "Total requests in the queue: %d", session->num_queued);
+
+    pdebug(DEBUG_INFO, "Done.");
+
+    return rc;
+}
+
+/*
+ * session_add_request_group
+ *
+ * Queue requests that must be sent together in one packet.  They are
+ * queued next to each other with the priority, deadline and place in the
+ * fair order of the first one.  The packer takes the whole group or none
+ * of it.  The queue limit
+ * applies to the group as a whole.
+ */
+int session_add_request_group(ab_session_p sess, ab_request_p *reqs, int num_reqs)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting. sess=%p, %d requests", sess, num_reqs);
+
+    if(!sess || !reqs) {
+        pdebug(DEBUG_WARN, "Called with null pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(num_reqs < 1 || num_reqs > MAX_REQUESTS) {
+        pdebug(DEBUG_WARN, "Request group size, %d, must be between 1 and %d!", num_reqs, MAX_REQUESTS);
+        return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    critical_block(sess->mutex) {
+        rc = session_admit_unsafe(sess, reqs, num_reqs);
+        if(rc != PLCTAG_STATUS_OK) {
+            break;
+        }
+
+        for(int i=0; i < num_reqs; i++) {
+            reqs[i]->priority = reqs[0]->priority;
+            reqs[i]->deadline_us = reqs[0]->deadline_us;
+            reqs[i]->group_count = 0;
+
+            rc = session_add_request_unsafe(sess, reqs[i], (i > 0 ? reqs[i-1] : NULL));
+            if(rc != PLCTAG_STATUS_OK) {
+                break;
+            }
+
+            /* only count what made it into the queue. */
+            reqs[0]->group_count = i + 1;
+        }
+
+        session_signal_room_unsafe(sess);
+    }
+
+    /* get the I/O thread to pick up the new requests now. */
+    session_wakeup(sess);
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * session_add_request
+ *
+ * This is a thread-safe version of the above routine.  It also applies
+ * the session's queue limit.
+ */
+int session_add_request(ab_session_p sess, ab_request_p req)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting. sess=%p, req=%p", sess, req);
+
+    critical_block(sess->mutex) {
+        rc = session_admit_unsafe(sess, &req, 1);
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = session_add_request_unsafe(sess, req, NULL);
+        }
+
+        session_signal_room_unsafe(sess);
+    }
+
+    /* get the I/O thread to pick up the new request now. */
+    if(rc == PLCTAG_STATUS_OK) {
+        session_wakeup(sess);
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+/*
+ * session_admit_unsafe
+ *
+ * Decide whether new requests can be queued.  There is always room if
+ * the session has no queue limit, the queue is empty or the requests fit
+ * under the limit.  Otherwise the session's queue full policy decides:
+ *
+ * reject - fail with PLCTAG_ERR_QUEUE_FULL.
+ * coalesce - a read that is the same as one already queued is let in, it
+ *     shares that read's response and adds nothing to the wire.  Anything
+ *     else is rejected.
+ * block - rejected here as well.  The caller of a blocking read or write
+ *     waits for room with session_wait_for_room(), holding no lock but its
+ *     own tag's.  The pieces of an operation in progress are queued again
+ *     later.
+ *
+ * You must hold the mutex before calling this!
+ */
+int session_admit_unsafe(ab_session_p session, ab_request_p *reqs, int num_reqs)
+{
+    if(session->max_queued <= 0 || session->num_queued == 0 || session->num_queued + num_reqs <= session->max_queued) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    switch(session->queue_full_policy) {
+    case SESSION_QUEUE_FULL_COALESCE:
+        if(num_reqs == 1 && reqs[0]->allow_dedupe) {
+            for(int p=0; p < SESSION_NUM_PRIORITIES; p++) {
+                for(int i=0; i < session->queues[p].len; i++) {
+                    ab_request_p queued = session->queues[p].heap[i];
+
+                    if(!queued->abort_request && requests_are_same_read(queued, reqs[0])) {
+                        pdebug(DEBUG_DETAIL, "Queue is full, but the read is the same as one already queued.");
+                        return PLCTAG_STATUS_OK;
+                    }
+                }
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    pdebug(DEBUG_DETAIL, "Queue is full with %d requests, rejecting the request.", session->num_queued);
+
+    return PLCTAG_ERR_QUEUE_FULL;
+}
+
+
+
+/*
+ * session_wait_for_room
+ *
+ * Wait until there is room in the queue or the deadline passes.  Only the
+ * caller of a blocking read or write waits here, never the I/O thread nor
+ * the tickler.  Fails at once with PLCTAG_ERR_QUEUE_FULL unless the queue
+ * full policy is to block.
+ *
+ * This must not be called with the session mutex held.
+ */
+int session_wait_for_room(ab_session_p session, int64_t deadline_us)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int64_t wait_us = 0;
+
+    critical_block(session->mutex) {
+        if(session->queue_full_policy != SESSION_QUEUE_FULL_BLOCK) {
+            rc = PLCTAG_ERR_QUEUE_FULL;
+        } else if(session->max_queued > 0 && session->num_queued >= session->max_queued) {
+            session->queue_waiters++;
+            rc = PLCTAG_STATUS_PENDING;
+        }
+    }
+
+    if(rc != PLCTAG_STATUS_PENDING) {
+        return rc;
+    }
+
+    pdebug(DEBUG_DETAIL, "Queue is full, waiting for room.");
+
+    wait_us = deadline_us - time_us();
+    if(wait_us > 0) {
+        cond_wait(session->queue_cond, (int)((wait_us + 999) / 1000));
+    }
+
+    critical_block(session->mutex) {
+        session->queue_waiters--;
+
+        /*
+         * the signal is taken by whoever wakes first, even a waiter that
+         * already timed out.  Hand it on to the next one.
+         */
+        session_signal_room_unsafe(session);
+    }
+
+    if(deadline_us <= time_us()) {
+        pdebug(DEBUG_DETAIL, "Timed out waiting for room in the queue.");
+        return PLCTAG_ERR_TIMEOUT;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * session_signal_room_unsafe
+ *
+ * Let a caller waiting for room in the queue try again.  Each waiter that
+ * gets in passes the signal on if there is still room.
+ *
+ * You must hold the mutex before calling this!
+ */
+void session_signal_room_unsafe(ab_session_p session)
+{
+    if(session->queue_waiters > 0 && (session->max_queued <= 0 || session->num_queued < session->max_queued)) {
+        cond_signal(session->queue_cond);
+    }
+}
+
+
+
+/*
+ * session_remove_request_unsafe
+ *
+ * You must hold the mutex before calling this!
+ */
+int session_remove_request_unsafe(ab_session_p session, ab_request_p req)
+{
+    int rc = PLCTAG_STATUS_OK;
+//    ab_request_p cur, prev;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(session == NULL || req == NULL) {
+        return rc;
+    }
+
+    /* it may have been taken out of the queue already. */
+    if(req->queue_index >= 0 && req->priority >= 0 && req->priority < SESSION_NUM_PRIORITIES &&
+       req->queue_index < session->queues[req->priority].len && session->queues[req->priority].heap[req->queue_index] == req) {
+        request_queue_unlink_unsafe(session, req);
+    }
+
+    /* release the request refcount */
+    rc_dec(req);
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * request_queue_push_unsafe
+ *
+ * Add the request to the queue for its priority class in fair order.
+ * The queue takes over the caller's reference.
+ *
+ * Each scheduling class, or each tag that is not in a class, is a source.
+ * A request gets a virtual finish time: the finish time of the source's
+ * last queued request, or the session's virtual time if it has none,
+ * plus its size divided by its weight.  Requests are taken in finish time
+ * order, so a source that queues a burst of requests only gets its share
+ * of each packet while other sources have requests waiting.  A source's
+ * requests stay in the order they were queued.
+ *
+ * If after is set, the request goes right behind it with the same finish
+ * time.  This keeps the requests of a group together.
+ *
+ * The source's last finish time is kept in the session's source table and
+ * the queue is a heap, so this takes O(log n) time.
+ *
+ * You must hold the mutex before calling this!
+ */
+int request_queue_push_unsafe(ab_session_p session, ab_request_p req, ab_request_p after)
+{
+    if(after) {
+        req->sched_finish = after->sched_finish;
+    } else {
+        struct sched_source_t *source = hashtable_get(session->sched_sources, request_source_key(req));
+        uint64_t start = session->sched_vtime;
+        int weight = (req->sched_weight > 0 ? req->sched_weight : SESSION_DEFAULT_SCHED_WEIGHT);
+
+        if(source && source->last_finish > start) {
+            start = source->last_finish;
+        }
+
+        req->sched_finish = start + ((uint64_t)get_payload_size(req) * SESSION_MAX_SCHED_WEIGHT) / (uint64_t)weight;
+    }
+
+    /* ties go in queueing order. */
+    session->sched_seq++;
+    req->sched_seq = session->sched_seq;
+
+    return request_queue_insert_unsafe(session, req);
+}
+
+
+
+/*
+ * request_queue_insert_unsafe
+ *
+ * Put a request with its finish time set into the heap of its priority
+ * class and count it against its source.
+ *
+ * You must hold the mutex before calling this!
+ */
+int request_queue_insert_unsafe(ab_session_p session, ab_request_p req)
+{
+    int64_t key = request_source_key(req);
+    struct sched_source_t *source = NULL;
+    int rc = PLCTAG_STATUS_OK;
+
+    if(req->priority < 0 || req->priority >= SESSION_NUM_PRIORITIES) {
+        req->priority = SESSION_PRIORITY_NORMAL;
+    }
+
+    rc = request_heap_reserve(session, req->priority);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    source = hashtable_get(session->sched_sources, key);
+    if(!source) {
+        source = mem_alloc((int)sizeof(*source));
+        if(!source) {
+            pdebug(DEBUG_WARN, "Unable to allocate scheduling source!");
+            return PLCTAG_ERR_NO_MEM;
+        }
+
+        source->key = key;
+
+        rc = hashtable_put(session->sched_sources, key, source);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to add scheduling source, error %s!", plc_tag_decode_error(rc));
+            mem_free(source);
+            return rc;
+        }
+    }
+
+    if(source->last_finish < req->sched_finish) {
+        source->last_finish = req->sched_finish;
+    }
+
+    source->num_queued++;
+    req->sched_source = source;
+
+    request_heap_insert(session, req);
+
+    session->num_queued++;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * request_source_key
+ *
+ * Requests in the same scheduling class, or outside any class from the
+ * same tag, share one fair share of the session.  Tag IDs fit in 32 bits,
+ * the classes get the keys above them.
+ */
+int64_t request_source_key(ab_request_p req)
+{
+    if(req->sched_class) {
+        return ((int64_t)1 << 32) + req->sched_class;
+    }
+
+    return (int64_t)req->tag_id;
+}
+
+
+
+/*
+ * request_queue_pop_unsafe
+ *
+ * Remove and return the first request of the highest priority class
+ * that has any.  NULL if the queues are empty.
+ * The caller gets the queue's reference.
+ *
+ * You must hold the mutex before calling this!
+ */
+ab_request_p request_queue_pop_unsafe(ab_session_p session)
+{
+    for(int p=0; p < SESSION_NUM_PRIORITIES; p++) {
+        if(session->queues[p].len > 0) {
+            ab_request_p req = session->queues[p].heap[0];
+
+            request_queue_unlink_unsafe(session, req);
+
+            return req;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * request_queue_unlink_unsafe
+ *
+ * Remove a request from anywhere in the queue.
+ * The caller gets the queue's reference.
+ *
+ * You must hold the mutex before calling this!
+ */
+void request_queue_unlink_unsafe(ab_session_p session, ab_request_p req)
+{
+    request_heap_remove(session, req);
+    request_queue_release_unsafe(session, req);
+}
+
+
+
+/*
+ * request_queue_release_unsafe
+ *
+ * Account for a request that has been taken out of the heap for good.
+ * A source with nothing left queued is forgotten, its next request starts
+ * from the session's virtual time.
+ *
+ * You must hold the mutex before calling this!
+ */
+void request_queue_release_unsafe(ab_session_p session, ab_request_p req)
+{
+    struct sched_source_t *source = req->sched_source;
+
+    req->sched_source = NULL;
+
+    if(source) {
+        source->num_queued--;
+
+        if(source->num_queued <= 0) {
+            hashtable_remove(session->sched_sources, source->key);
+            mem_free(source);
+        }
+    }
+
+    session->num_queued--;
+
+    session_signal_room_unsafe(session);
+}
+
+
+
+/*
+ * request_heap_reserve
+ *
+ * Make sure the heap of the priority class has room for one more
+ * request.
+ *
+ * You must hold the mutex before calling this!
+ */
+int request_heap_reserve(ab_session_p session, int priority)
+{
+    ab_request_p *new_heap = NULL;
+    int new_capacity = 0;
+
+    if(session->queues[priority].len < session->queues[priority].capacity) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    new_capacity = (session->queues[priority].capacity > 0 ? session->queues[priority].capacity * 2 : SESSION_MIN_REQUESTS);
+
+    new_heap = mem_alloc(new_capacity * (int)sizeof(ab_request_p));
+    if(!new_heap) {
+        pdebug(DEBUG_WARN, "Unable to grow the request queue to %d entries!", new_capacity);
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    if(session->queues[priority].heap) {
+        mem_copy(new_heap, session->queues[priority].heap, session->queues[priority].len * (int)sizeof(ab_request_p));
+        mem_free(session->queues[priority].heap);
+    }
+
+    session->queues[priority].heap = new_heap;
+    session->queues[priority].capacity = new_capacity;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * request_heap_insert
+ *
+ * Put the request into the heap of its priority class.  There must be
+ * room for it.  Requests that go after it move down.
+ *
+ * You must hold the mutex before calling this!
+ */
+void request_heap_insert(ab_session_p session, ab_request_p req)
+{
+    ab_request_p *heap = session->queues[req->priority].heap;
+    int index = session->queues[req->priority].len;
+
+    session->queues[req->priority].len++;
+
+    while(index > 0 && request_heap_before(req, heap[(index - 1) / 2])) {
+        int parent = (index - 1) / 2;
+
+        heap[index] = heap[parent];
+        heap[index]->queue_index = index;
+        index = parent;
+    }
+
+    heap[index] = req;
+    req->queue_index = index;
+}
+
+
+
+/*
+ * request_heap_remove
+ *
+ * Take the request out of the heap of its priority class.  The last
+ * request in the heap fills the hole and moves up or down to its place.
+ *
+ * You must hold the mutex before calling this!
+ */
+void request_heap_remove(ab_session_p session, ab_request_p req)
+{
+    ab_request_p *heap = session->queues[req->priority].heap;
+    int len = session->queues[req->priority].len - 1;
+    int index = req->queue_index;
+    ab_request_p last = heap[len];
+
+    session->queues[req->priority].len = len;
+    req->queue_index = -1;
+
+    if(index == len) {
+        return;
+    }
+
+    while(index > 0 && request_heap_before(last, heap[(index - 1) / 2])) {
+        int parent = (index - 1) / 2;
+
+        heap[index] = heap[parent];
+        heap[index]->queue_index = index;
+        index = parent;
+    }
+
+    while(2 * index + 1 < len) {
+        int child = 2 * index + 1;
+
+        if(child + 1 < len && request_heap_before(heap[child + 1], heap[child])) {
+            child++;
+        }
+
+        if(!request_heap_before(heap[child], last)) {
+            break;
+        }
+
+        heap[index] = heap[child];
+        heap[index]->queue_index = index;
+        index = child;
+    }
+
+    heap[index] = last;
+    last->queue_index = index;
+}
+
+
+
+/*
+ * request_heap_before
+ *
+ * Whether the first request goes out before the second one, by finish
+ * time and then by queueing order.
+ */
+int request_heap_before(ab_request_p first, ab_request_p second)
+{
+    if(first->sched_finish != second->sched_finish) {
+        return first->sched_finish < second->sched_finish;
+    }
+
+    return first->sched_seq < second->sched_seq;
+}
+
+
+
+/*
+ * request_heap_put_back
+ *
+ * Put a chain of requests taken out of the heap with request_heap_remove()
+ * back into it.  They keep their finish times, so they go back to their
+ * places.
+ *
+ * You must hold the mutex before calling this!
+ */
+void request_heap_put_back(ab_session_p session, ab_request_p chain)
+{
+    while(chain) {
+        ab_request_p req = chain;
+
+        chain = req->next;
+        req->next = NULL;
+
+        request_heap_insert(session, req);
+    }
+}
+
+
+
+/*
+ * request_group_next_unsafe
+ *
+ * The request of req's group queued right behind it, once req has been
+ * taken out of the heap.  The requests of a group share a finish time and
+ * were queued one after the other, so it is on top.  NULL if it is gone.
+ *
+ * You must hold the mutex before calling this!
+ */
+ab_request_p request_group_next_unsafe(ab_session_p session, int priority, ab_request_p req)
+{
+    ab_request_p next = NULL;
+
+    if(session->queues[priority].len == 0) {
+        return NULL;
+    }
+
+    next = session->queues[priority].heap[0];
+
+    if(next->sched_finish != req->sched_finish || next->sched_seq != req->sched_seq + 1) {
+        return NULL;
+    }
+
+    return next;
+}
+
+
+
+/*****************************************************************
+ **************** Session handling functions *********************
+ ****************************************************************/
+
+
+/*
+ * session_wakeup
+ *
+ * Get the session's I/O thread to run the session soon.  Safe to call
+ * from any thread.
+ */
+void session_wakeup(ab_session_p session)
+{
+    struct session_io_thread_t *io = session->io_thread;
+
+    if(!io) {
+        return;
+    }
+
+    critical_block(io->mutex) {
+        session->wakeup = 1;
+    }
+
+    socket_poller_wakeup(io->poller);
+}
+
+
+
+THREAD_FUNC(session_io_handler)
+{
+    struct session_io_thread_t *io = arg;
+    void *ready[SESSION_IO_MAX_EVENTS];
+
+    pdebug(DEBUG_INFO, "Starting I/O thread %p", io);
+
+    while(!io->terminating) {
+        int num_ready = 0;
+        int wait_ms = SESSION_IO_MAX_WAIT_MS;
+        int64_t now = time_ms();
+
+        /* sleep until the earliest time a session wants to run. */
+        critical_block(io->mutex) {
+            for(int i=0; i < vector_length(io->sessions) && wait_ms > 0; i++) {
+                ab_session_p session = vector_get(io->sessions, i);
+
+                if(session->wakeup || session->next_run_time <= now) {
+                    wait_ms = 0;
+                } else if(session->next_run_time - now < wait_ms) {
+                    wait_ms = (int)(session->next_run_time - now);
+                }
+            }
+        }
+
+        num_ready = socket_poller_wait(io->poller, ready, SESSION_IO_MAX_EVENTS, wait_ms);
+        if(num_ready < 0) {
+            pdebug(DEBUG_WARN, "Error waiting for sockets, %s!", plc_tag_decode_error(num_ready));
+            num_ready = 0;
+            sleep_ms(1);
+        }
+
+        if(io->terminating) {
+            break;
+        }
+
+        now = time_ms();
+
+        /* pick out the sessions with something to do. */
+        critical_block(io->mutex) {
+            for(int i=0; i < vector_length(io->sessions); i++) {
+                ab_session_p session = vector_get(io->sessions, i);
+                int run = (session->wakeup || session->next_run_time <= now);
+
+                for(int j=0; j < num_ready && !run; j++) {
+                    run = (ready[j] == session);
+                }
+
+                /* skip sessions in the process of destruction. */
+                if(run && rc_inc(session)) {
+                    session->wakeup = 0;
+                    vector_put(io->run_list, vector_length(io->run_list), session);
+                }
+            }
+        }
+
+        /* this can cause destroy actions so do this outside the mutex. */
+        while(vector_length(io->run_list) > 0) {
+            ab_session_p session = vector_remove(io->run_list, vector_length(io->run_list) - 1);
+
+            session_run(session);
+
+            rc_dec(session);
+        }
+    }
+
+    pdebug(DEBUG_INFO, "I/O thread %p done.", io);
+
+    THREAD_RETURN(0);
+}
+
+
+
+/*
+ * session_run
+ *
+ * Step the session's state machine until it has to wait for the
+ * network or a timer.  Then tell the poller what the session is
+ * waiting for.
+ */
+void session_run(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int steps = 0;
+
+    /* check in regularly even if nothing happens. */
+    session->next_run_time = time_ms() + SESSION_IO_MAX_WAIT_MS;
+
+    /* a rider that is part way through a packet may be able to send more now. */
+    if(session->writer && session->writer != session) {
+        session_wakeup(session->writer);
+    }
+
+    do {
+        rc = session_handler(session);
+        steps++;
+    } while(rc == PLCTAG_STATUS_OK && steps < SESSION_MAX_STEPS);
+
+    /* do not let one busy session starve the others, come back to it next time around. */
+    if(rc == PLCTAG_STATUS_OK) {
+        session->next_run_time = time_ms();
+    }
+
+    session_update_poll_events(session);
+}
+
+
+
+/*
+ * session_run_at
+ *
+ * Make sure the session runs again no later than the passed time.
+ */
+void session_run_at(ab_session_p session, int64_t run_time)
+{
+    if(run_time < session->next_run_time) {
+        session->next_run_time = run_time;
+    }
+}
+
+
+
+/*
+ * session_update_poll_events
+ *
+ * Only ask for read events while a response is expected.  Otherwise
+ * a socket closed by the PLC would keep waking us up.
+ */
+void session_update_poll_events(ab_session_p session)
+{
+    int events = 0;
+
+    if(!session->sock || !session->io_thread) {
+        return;
+    }
+
+    switch(session->state) {
+    case SESSION_WAIT_OPEN_SOCKET:
+        events = SOCKET_EVENT_WRITE;
+        break;
+
+    case SESSION_WAIT_REGISTER:
+    case SESSION_WAIT_CONNECT:
+    case SESSION_WAIT_DISCONNECT:
+        events = (session->send_data_size > 0 ? SOCKET_EVENT_WRITE : SOCKET_EVENT_READ);
+        break;
+
+    case SESSION_IDLE:
+        /* riders send and receive through our socket. */
+        events = (session->send_data_size > 0 || session->writer ? SOCKET_EVENT_WRITE : 0)
+               | (session->packets_in_flight > 0 || session->num_attached > 0 || session->keepalive_seq_id ? SOCKET_EVENT_READ : 0);
+        break;
+
+    default:
+        events = 0;
+        break;
+    }
+
+    socket_poller_set(session->io_thread->poller, session->sock, events, session);
+}
+
+
+
+/*
+ * session_handler
+ *
+ * Run one step of the session state machine.  Returns PLCTAG_STATUS_OK
+ * if the session should be stepped again right away and
+ * PLCTAG_STATUS_PENDING if it is waiting on the network or a timer.
+ */
+int session_handler(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int64_t now = time_ms();
+    int64_t next_time = 0;
+    int delay_ms = 0;
+    int keepalive_ms = 0;
+
+    /* a rider's connection goes away with the carrier's TCP connection. */
+    if(session->carrier && session->session_handle && session->carrier_gen != session->carrier->transport_gen) {
+        pdebug(DEBUG_WARN, "Shared TCP connection was closed!");
+
+        fail_in_flight_requests(session, PLCTAG_ERR_BAD_CONNECTION, 1);
+
+        session->targ_connection_id = 0;
+        session->state = SESSION_CLOSE_SOCKET;
+    }
+
+    switch(session->state) {
+    case SESSION_OPEN_SOCKET:
+        pdebug(DEBUG_DETAIL, "in SESSION_OPEN_SOCKET state.");
+
+        /* riders use the carrier's socket and registration. */
+        if(session->carrier) {
+            if(session_attach_carrier(session) == PLCTAG_STATUS_PENDING) {
+                /* the carrier is backed off, so are we. */
+                if(session->carrier->retry_backoff && !session->retry_backoff) {
+                    session_set_backoff(session, 1);
+                }
+
+                return PLCTAG_STATUS_PENDING;
+            }
+
+            session->auto_disconnect_time = now + SESSION_DISCONNECT_TIMEOUT;
+            session->state = SESSION_CONNECT;
+
+            return PLCTAG_STATUS_OK;
+        }
+
+        /* we must connect to the gateway*/
+        if ((rc = session_open_socket(session)) != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+            pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_CLOSE_SOCKET;
+        } else {
+            /* set the timeout for disconnect. */
+            session->auto_disconnect_time = now + SESSION_DISCONNECT_TIMEOUT;
+            session->exchange_deadline = now + SESSION_CONNECT_TIMEOUT;
+
+            session->state = SESSION_WAIT_OPEN_SOCKET;
+        }
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_WAIT_OPEN_SOCKET:
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_OPEN_SOCKET state.");
+
+        rc = socket_connect_tcp_check(session->sock);
+        if(rc == PLCTAG_STATUS_PENDING) {
+            if(session->exchange_deadline < now) {
+                pdebug(DEBUG_WARN, "Timed out connecting to %s!", session->host);
+                session->state = SESSION_CLOSE_SOCKET;
+                return PLCTAG_STATUS_OK;
+            }
+
+            /* come back to start on the next address if these are slow. */
+            next_time = socket_connect_tcp_next_time(session->sock);
+            session_run_at(session, (next_time && next_time < session->exchange_deadline) ? next_time : session->exchange_deadline);
+
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_CLOSE_SOCKET;
+        } else {
+            session->state = SESSION_REGISTER;
+        }
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_REGISTER:
+        pdebug(DEBUG_DETAIL, "in SESSION_REGISTER state.");
+
+        send_register_req(session);
+        session->state = SESSION_WAIT_REGISTER;
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_WAIT_REGISTER:
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_REGISTER state.");
+
+        rc = exchange_eip_packet(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
+            return rc;
+        }
+
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = recv_register_resp(session);
+        }
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "session registration failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_CLOSE_SOCKET;
+        } else if(session->use_connected_msg) {
+            session->state = SESSION_CONNECT;
+        } else {
+            session->state = SESSION_IDLE;
+            session_connected(session);
+        }
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_CONNECT:
+        pdebug(DEBUG_DETAIL, "in SESSION_CONNECT state.");
+
+        start_forward_open(session);
+        session->state = SESSION_WAIT_CONNECT;
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_WAIT_CONNECT:
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_CONNECT state.");
+
+        rc = check_forward_open(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
+            return rc;
+        }
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Forward open failed %s!", plc_tag_decode_error(rc));
+            session->state = SESSION_UNREGISTER;
+        } else {
+            pdebug(DEBUG_DETAIL, "forward open succeeded, going to idle state.");
+            session->state = SESSION_IDLE;
+            session_connected(session);
+
+            /* riders can use the connection now. */
+            if(session->riders_waiting) {
+                session->riders_waiting = 0;
+                session_wake_riders(session, 0);
+            }
+        }
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_IDLE:
+        pdebug(DEBUG_SPEW, "in SESSION_IDLE state.");
+
+        /* a rider left a packet part way out, the stream cannot be used. */
+        if(session->transport_broken) {
+            fail_in_flight_requests(session, PLCTAG_ERR_BAD_CONNECTION, 1);
+            session->state = SESSION_CLOSE_SOCKET;
+            return PLCTAG_STATUS_OK;
+        }
+
+        /* if there is work to do, or riders need the socket, make sure we do not disconnect. */
+        critical_block(session->mutex) {
+            if(session->num_queued > 0 || vector_length(session->in_flight) > 0 || session->num_attached > 0) {
+                session->auto_disconnect_time = now + SESSION_DISCONNECT_TIMEOUT;
+            }
+        }
+
+        rc = process_requests(session);
+        if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+            pdebug(DEBUG_WARN, "Error while processing requests %s!", plc_tag_decode_error(rc));
+
+            if(session->use_connected_msg) {
+                session->state = SESSION_DISCONNECT;
+            } else {
+                session->state = SESSION_UNREGISTER;
+            }
+
+            return PLCTAG_STATUS_OK;
+        }
+
+        /* check if we should disconnect */
+        if(session->auto_disconnect_time < now) {
+            pdebug(DEBUG_DETAIL, "Disconnecting due to inactivity.");
+
+            session->auto_disconnect = 1;
+
+            if(session->use_connected_msg) {
+                session->state = SESSION_DISCONNECT;
+            } else {
+                session->state = SESSION_UNREGISTER;
+            }
+
+            return PLCTAG_STATUS_OK;
+        }
+
+        session_run_at(session, session->auto_disconnect_time);
+
+        critical_block(session->mutex) {
+            keepalive_ms = session->keepalive_ms;
+        }
+
+        if(keepalive_ms > 0 && !session->carrier && !session->keepalive_seq_id) {
+            session_run_at(session, session->keepalive_time);
+        }
+
+        return rc;
+
+    case SESSION_DISCONNECT:
+        pdebug(DEBUG_DETAIL, "in SESSION_DISCONNECT state.");
+
+        send_forward_close_req(session);
+        session->state = SESSION_WAIT_DISCONNECT;
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_WAIT_DISCONNECT:
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_DISCONNECT state.");
+
+        rc = exchange_eip_packet(session);
+        if(rc == PLCTAG_STATUS_PENDING) {
+            return rc;
+        }
+
+        if(rc == PLCTAG_STATUS_OK) {
+            rc = recv_forward_close_resp(session);
+        }
+
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Forward close failed %s!", plc_tag_decode_error(rc));
+        }
+
+        session->targ_connection_id = 0;
+        session->state = SESSION_UNREGISTER;
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_UNREGISTER:
+        pdebug(DEBUG_DETAIL, "in SESSION_UNREGISTER state.");
+        if((rc = session_unregister(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unregistering session failed %s!", plc_tag_decode_error(rc));
+        }
+
+        session->state = SESSION_CLOSE_SOCKET;
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_CLOSE_SOCKET:
+        pdebug(DEBUG_DETAIL, "in SESSION_CLOSE_SOCKET state.");
+        if((rc = session_close_socket(session)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Closing session socket failed %s!", plc_tag_decode_error(rc));
+        }
+
+        if(session->auto_disconnect) {
+            session->state = SESSION_WAIT_RECONNECT;
+        } else {
+            session->state = SESSION_START_RETRY;
+        }
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_START_RETRY:
+        pdebug(DEBUG_DETAIL, "in SESSION_START_RETRY state.");
+
+        /* set up timer for retry. */
+        delay_ms = session_retry_delay(session);
+        session->retry_count++;
+        session->retry_time = now + delay_ms;
+
+        pdebug(DEBUG_DETAIL, "Retry %d in %dms.", session->retry_count, delay_ms);
+
+        /* fail requests fast until we are connected again. */
+        if(delay_ms > 0 && !session->retry_backoff) {
+            session_set_backoff(session, 1);
+        }
+
+        /* start waiting. */
+        session->state = SESSION_WAIT_RETRY;
+
+        return PLCTAG_STATUS_OK;
+
+    case SESSION_WAIT_RETRY:
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_RETRY state.");
+
+        if(session->retry_time <= now) {
+            pdebug(DEBUG_DETAIL, "Transitioning to SESSION_OPEN_SOCKET.");
+            session->state = SESSION_OPEN_SOCKET;
+            return PLCTAG_STATUS_OK;
+        }
+
+        session_run_at(session, session->retry_time);
+
+        return PLCTAG_STATUS_PENDING;
+
+    case SESSION_WAIT_RECONNECT:
+        /* wait for at least one request to queue before reconnecting. */
+        pdebug(DEBUG_SPEW, "in SESSION_WAIT_RECONNECT state.");
+
+        session->auto_disconnect = 0;
+        rc = PLCTAG_STATUS_PENDING;
+
+        /* if there is work to do, or riders are waiting, reconnect.. */
+        critical_block(session->mutex) {
+            if(session->num_queued > 0 || session->riders_waiting) {
+                pdebug(DEBUG_DETAIL, "There are requests waiting, reopening connection to PLC.");
+
+                session->state = SESSION_OPEN_SOCKET;
+                rc = PLCTAG_STATUS_OK;
+            }
+        }
+
+        return rc;
+
+    default:
+        pdebug(DEBUG_ERROR, "Unknown state %d!", session->state);
+
+        /* FIXME - this logic is not complete.  We might be here without
+         * a connected session or a registered session. */
+        if(session->use_connected_msg) {
+            session->state = SESSION_DISCONNECT;
+        } else {
+            session->state = SESSION_UNREGISTER;
+        }
+
+        return PLCTAG_STATUS_OK;
+    }
+}
+
+
+/*
+ * process_requests
+ *
+ * Keep the wire busy.  New packets are packed and sent as long as there is
+ * room in the window of packets in flight.  Then any response that has
+ * arrived is matched back to the requests that were sent in its packet.
+ * A packet whose response is late times out its own requests.  Only
+ * several late packets in a row reset the session.
+ *
+ * Returns PLCTAG_STATUS_PENDING if there was nothing to do.
+ */
+int process_requests(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int did_something = 0;
+    int max_packets_in_flight = 0;
+
+    debug_set_tag_id(0);
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(!session) {
+        pdebug(DEBUG_WARN, "Null session pointer!");
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    /* another tag may open the window up. */
+    critical_block(session->mutex) {
+        max_packets_in_flight = session->max_packets_in_flight;
+    }
+
+    do {
+        /* close the connections of riders that went away. */
+        if(session->send_data_size == 0) {
+            if(start_pending_close(session) == PLCTAG_STATUS_OK) {
+                did_something = 1;
+            }
+        }
+
+        /* start a new packet if the last one is out and the window is not full. */
+        if(session->send_data_size == 0 && session->packets_in_flight < max_packets_in_flight) {
+            rc = start_next_packet(session);
+            if(rc == PLCTAG_STATUS_OK) {
+                did_something = 1;
+            } else if(rc != PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_WARN, "Unable to start sending the next packet, %s!", plc_tag_decode_error(rc));
+                break;
+            }
+        }
+
+        /* nothing else to send, see if the PLC is still there. */
+        if(session->send_data_size == 0 && keepalive_due(session, time_ms())) {
+            start_keepalive(session);
+            did_something = 1;
+        }
+
+        /* push out as much of the current packet as the socket will take. */
+        if(session->send_data_size > 0) {
+            rc = write_eip_request(session);
+            if(rc == PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_DETAIL, "Packet sent, %d packets in flight.", session->packets_in_flight);
+                mark_packet_sent(session);
+                session->send_data_size = 0;
+                session->send_data_offset = 0;
+                did_something = 1;
+            } else if(rc != PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_WARN, "Error sending packet %s!", plc_tag_decode_error(rc));
+                break;
+            }
+        }
+
+        /*
+         * pick up a response if one is ready.  A carrier also reads for
+         * its riders and a rider must take what it was handed.
+         */
+        if(session->packets_in_flight > 0 || session->num_attached > 0 || session->resp_ready || session->keepalive_seq_id) {
+            rc = read_eip_response(session);
+            if(rc == PLCTAG_STATUS_OK && session->keepalive_seq_id && session->resp_seq_id == session->keepalive_seq_id) {
+                pdebug(DEBUG_DETAIL, "Got keepalive response.");
+
+                session_update_rtt(session, time_us() - session->keepalive_sent_us);
+
+                session->keepalive_seq_id = 0;
+                session->data_size = 0;
+                session->data_offset = 0;
+
+                did_something = 1;
+            } else if(rc == PLCTAG_STATUS_OK) {
+                rc = dispatch_response(session);
+
+                session->data_size = 0;
+                session->data_offset = 0;
+
+                if(rc != PLCTAG_STATUS_OK) {
+                    pdebug(DEBUG_WARN, "Error processing response %s!", plc_tag_decode_error(rc));
+                    break;
+                }
+
+                did_something = 1;
+            } else if(rc != PLCTAG_STATUS_PENDING) {
+                pdebug(DEBUG_WARN, "Error receiving packet response %s!", plc_tag_decode_error(rc));
+                break;
+            } else {
+                /* the oldest request in flight is at the front. */
+                ab_request_p oldest = (vector_length(session->in_flight) > 0 ? vector_get(session->in_flight, 0) : NULL);
+
+                if(oldest && oldest->time_sent) {
+                    int64_t deadline_us = oldest->time_sent + (int64_t)session_timeout(session) * 1000;
+
+                    if(deadline_us < time_us()) {
+                        pdebug(DEBUG_WARN, "Timed out after %dms waiting for response to packet %" PRIx64 "!", session_timeout(session), oldest->packet_seq_id);
+
+                        /* do not give up as quickly next time. */
+                        if(session->timeout_backoff < SESSION_MAX_TIMEOUT_BACKOFF) {
+                            session->timeout_backoff++;
+                        }
+
+                        session->missed_responses++;
+
+                        if(session->missed_responses >= SESSION_MAX_MISSED_RESPONSES) {
+                            pdebug(DEBUG_WARN, "%d responses in a row are late, resetting the session.", session->missed_responses);
+                            rc = PLCTAG_ERR_TIMEOUT;
+                            break;
+                        }
+
+                        /* a response that still comes in later matches nothing and is dropped. */
+                        fail_late_packet(session, oldest->packet_seq_id);
+
+                        did_something = 1;
+                    } else {
+                        session_run_at(session, (deadline_us + 999) / 1000);
+                    }
+                }
+
+                if(session->keepalive_seq_id && session->keepalive_sent_us) {
+                    int64_t deadline_us = session->keepalive_sent_us + (int64_t)session_timeout(session) * 1000;
+
+                    if(deadline_us < time_us()) {
+                        pdebug(DEBUG_WARN, "No response to keepalive after %dms, the connection is dead!", session_timeout(session));
+
+                        if(session->timeout_backoff < SESSION_MAX_TIMEOUT_BACKOFF) {
+                            session->timeout_backoff++;
+                        }
+
+                        rc = PLCTAG_ERR_TIMEOUT;
+                        break;
+                    }
+
+                    session_run_at(session, (deadline_us + 999) / 1000);
+                }
+            }
+        }
+
+        rc = (did_something ? PLCTAG_STATUS_OK : PLCTAG_STATUS_PENDING);
+    } while(0);
+
+    /* problem? dump everything in flight, the session will be reset. */
+    if(rc != PLCTAG_STATUS_OK && rc != PLCTAG_STATUS_PENDING) {
+        fail_in_flight_requests(session, rc, 1);
+    }
+
+    debug_set_tag_id(0);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * start_next_packet
+ *
+ * Purge aborted requests and requests whose deadline has passed from the
+ * queue, then pack the queued requests
+ * that best fill the payload into the send buffer.  The requests move to
+ * the in flight list until their response comes back.
+ *
+ * The packer looks at up to SESSION_PACK_LOOKAHEAD requests, in priority
+ * and then fair order, see request_queue_push_unsafe(), and takes each
+ * one that still fits.  It takes them off the queue heaps one by one and
+ * puts the ones it passed over back afterwards.  A request
+ * that does not fit is passed over, but then no later request for the
+ * same tag is taken so each tag's requests still go out in order.  Once a
+ * request has been passed over SESSION_PACK_MAX_SKIPS times, nothing
+ * behind it is taken ahead of it any more.
+ *
+ * If the session has a packing linger time, a packet that is not full
+ * yet is held back until the oldest request in it has waited that long.
+ *
+ * A read that is identical to one already in the packet is not sent.  It
+ * rides along with the first one and gets its own copy of the response.
+ * It only does so if nothing but reads were packed after the first one,
+ * so that it cannot see data from before a write it should see.
+ *
+ * Returns PLCTAG_STATUS_PENDING if there is nothing to send.
+ */
+int start_next_packet(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    ab_request_p request = NULL;
+    ab_request_p bundled_requests[MAX_REQUESTS] = {NULL};
+    int num_bundled_requests = 0;
+    ab_request_p aborted_requests[MAX_REQUESTS] = {NULL};
+    int num_aborted_requests = 0;
+    int num_shed_requests = 0;
+    ab_request_p duplicate_requests[MAX_REQUESTS] = {NULL};
+    int duplicate_of[MAX_REQUESTS] = {0};
+    int num_duplicate_requests = 0;
+    int last_non_read = -1;
+    int skipped_tags[SESSION_PACK_LOOKAHEAD] = {0};
+    int num_skipped_tags = 0;
+    int capacity = 0;
+    int remaining_space = 0;
+    int64_t linger_until_us = 0;
+    int64_t now_us = time_us();
+    uint64_t packet_seq_id = 0;
+
+    pdebug(DEBUG_SPEW, "Checking for requests to process.");
+
+    /* pick the requests to send out of the queues. */
+    critical_block(session->mutex) {
+        int num_looked_at = 0;
+        int done = 0;
+
+        capacity = session->max_payload_size - (int)sizeof(cip_multi_req_header);
+        remaining_space = capacity;
+
+        /* wait a bit for more requests to fill the packet? */
+        linger_until_us = pack_linger_until_unsafe(session, capacity);
+        if(linger_until_us) {
+            break;
+        }
+
+        for(int p=0; p < SESSION_NUM_PRIORITIES && !done; p++) {
+            /* requests taken out of the heap and passed over, they go back below. */
+            ab_request_p passed_over = NULL;
+            ab_request_p *passed_over_tail = &passed_over;
+
+            while(!done && session->queues[p].len > 0) {
+                int payload_size = 0;
+                int tag_skipped = 0;
+
+                request = session->queues[p].heap[0];
+
+                /*
+                 * aborted requests are dropped wherever we see them.  So are
+                 * requests whose caller has given up waiting, there is no
+                 * point spending the link on answers nobody will use.
+                 */
+                if(request->abort_request || (request->deadline_us && request->deadline_us <= now_us)) {
+                    ab_request_p member = NULL;
+
+                    if(num_aborted_requests >= MAX_REQUESTS) {
+                        done = 1;
+                        break;
+                    }
+
+                    request_queue_unlink_unsafe(session, request);
+                    aborted_requests[num_aborted_requests] = request;
+                    num_aborted_requests++;
+
+                    /* the rest of its group still goes out together. */
+                    if(request->group_count > 1 && (member = request_group_next_unsafe(session, p, request))) {
+                        member->group_count = request->group_count - 1;
+                    }
+
+                    if(!request->abort_request) {
+                        num_shed_requests++;
+                    }
+
+                    continue;
+                }
+
+                if(num_looked_at >= SESSION_PACK_LOOKAHEAD || num_bundled_requests >= MAX_REQUESTS) {
+                    done = 1;
+                    break;
+                }
+
+                num_looked_at++;
+
+                payload_size = get_payload_size(request);
+
+                tag_skipped = tag_id_in_list(request->tag_id, skipped_tags, num_skipped_tags);
+
+                /* take it out to look at the next one, it goes back if it is passed over. */
+                request_heap_remove(session, request);
+                request->next = NULL;
+
+                /* a group goes out whole in one packet or waits for the next one. */
+                if(request->group_count > 1) {
+                    ab_request_p last = request;
+                    ab_request_p member = NULL;
+                    int group_len = 1;
+                    int group_size = payload_size;
+                    int group_skipped = tag_skipped;
+
+                    while(group_len < request->group_count && (member = request_group_next_unsafe(session, p, last))) {
+                        request_heap_remove(session, member);
+                        member->next = NULL;
+                        last->next = member;
+                        last = member;
+                        group_len++;
+                        group_size += get_payload_size(last);
+                        group_skipped = group_skipped || tag_id_in_list(last->tag_id, skipped_tags, num_skipped_tags);
+                    }
 
+                    if(group_size >= capacity || group_len > MAX_REQUESTS) {
+                        pdebug(DEBUG_WARN, "Read group of %d requests does not fit in one packet, sending them separately.", group_len);
+                        request->group_count = 0;
+
+                        /* the first one is looked at on its own below. */
+                        request_heap_put_back(session, request->next);
+                        request->next = NULL;
+                    } else if(num_bundled_requests + group_len <= MAX_REQUESTS &&
+                              (num_bundled_requests == 0 || (!group_skipped && group_size < remaining_space))) {
+                        while(request) {
+                            member = request;
+                            request = member->next;
+
+                            member->next = NULL;
+                            member->group_count = 0;
+                            request_queue_release_unsafe(session, member);
+                            bundled_requests[num_bundled_requests] = member;
+                            num_bundled_requests++;
+                        }
+
+                        remaining_space -= group_size;
+
+                        if(remaining_space <= 0) {
+                            done = 1;
+                        }
+
+                        continue;
+                    } else {
+                        /* passed over, the whole group. */
+                        request->pack_skips++;
+
+                        if(request->pack_skips >= SESSION_PACK_MAX_SKIPS || num_skipped_tags + group_len > SESSION_PACK_LOOKAHEAD) {
+                            request_heap_put_back(session, request);
+                            done = 1;
+                            break;
+                        }
+
+                        for(member = request; member; member = member->next) {
+                            if(!tag_id_in_list(member->tag_id, skipped_tags, num_skipped_tags)) {
+                                skipped_tags[num_skipped_tags] = member->tag_id;
+                                num_skipped_tags++;
+                            }
+                        }
+
+                        *passed_over_tail = request;
+                        passed_over_tail = &last->next;
+
+                        continue;
+                    }
+                }
+
+                /* is the same read already going out in this packet? */
+                if(request->allow_dedupe && !tag_skipped && num_duplicate_requests < MAX_REQUESTS) {
+                    int leader = -1;
 
-    pdebug(DEBUG_INFO, "Starting thread for session %p", session);
+                    for(int i=last_non_read + 1; i < num_bundled_requests; i++) {
+                        if(requests_are_same_read(bundled_requests[i], request)) {
+                            leader = i;
+                            break;
+                        }
+                    }
 
-    while(!session->terminating) {
-        int idle = 0;
+                    if(leader >= 0) {
+                        request_queue_release_unsafe(session, request);
+                        duplicate_requests[num_duplicate_requests] = request;
+                        duplicate_of[num_duplicate_requests] = leader;
+                        num_duplicate_requests++;
 
-        switch(state) {
-        case SESSION_OPEN_SOCKET:
-            pdebug(DEBUG_DETAIL, "in SESSION_OPEN_SOCKET state.");
+                        continue;
+                    }
+                }
 
-            /* we must connect to the gateway*/
-            if ((rc = session_open_socket(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "session connect failed %s!", plc_tag_decode_error(rc));
-                state = SESSION_CLOSE_SOCKET;
-            } else {
-                /* set the timeout for disconnect. */
-                //if(session->auto_disconnect_enabled) {
-                auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
-                //}
+                /*
+                 * The first request always goes, packable or not.  After that,
+                 * only packable requests that fit and do not overtake an
+                 * earlier request for the same tag.
+                 */
+                if(num_bundled_requests == 0 || (request->allow_packing && !tag_skipped && payload_size < remaining_space)) {
+                    request_queue_release_unsafe(session, request);
+                    bundled_requests[num_bundled_requests] = request;
+
+                    if(!request->allow_dedupe) {
+                        last_non_read = num_bundled_requests;
+                    }
+
+                    num_bundled_requests++;
+
+                    remaining_space -= payload_size;
+
+                    if(!request->allow_packing || remaining_space <= 0) {
+                        done = 1;
+                    }
+
+                    continue;
+                }
+
+                /* passed over. */
+                request->pack_skips++;
 
-                state = SESSION_REGISTER;
+                if(request->pack_skips >= SESSION_PACK_MAX_SKIPS) {
+                    pdebug(DEBUG_DETAIL, "Request %p for tag %d was passed over %d times, it goes next.", request, request->tag_id, request->pack_skips);
+                    request_heap_insert(session, request);
+                    done = 1;
+                    break;
+                }
+
+                if(!tag_skipped) {
+                    skipped_tags[num_skipped_tags] = request->tag_id;
+                    num_skipped_tags++;
+                }
+
+                *passed_over_tail = request;
+                passed_over_tail = &request->next;
             }
-            break;
 
-        case SESSION_REGISTER:
-            pdebug(DEBUG_DETAIL, "in SESSION_REGISTER state.");
-            if ((rc = session_register(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "session registration failed %s!", plc_tag_decode_error(rc));
-                state = SESSION_CLOSE_SOCKET;
-            } else {
-                if(session->use_connected_msg) {
-                    state = SESSION_CONNECT;
-                } else {
-                    state = SESSION_IDLE;
+            request_heap_put_back(session, passed_over);
+        }
+
+        /*
+         * the fair scheduler's clock moves up to the earliest finish time
+         * sent.  Sources that had nothing queued start from there.
+         */
+        if(num_bundled_requests > 0) {
+            uint64_t vtime = bundled_requests[0]->sched_finish;
+
+            for(int i=1; i < num_bundled_requests; i++) {
+                if(bundled_requests[i]->sched_finish < vtime) {
+                    vtime = bundled_requests[i]->sched_finish;
                 }
             }
-            break;
 
-        case SESSION_CONNECT:
-            pdebug(DEBUG_DETAIL, "in SESSION_CONNECT state.");
-            if((rc = perform_forward_open(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Forward open failed %s!", plc_tag_decode_error(rc));
-                state = SESSION_UNREGISTER;
+            if(vtime > session->sched_vtime) {
+                session->sched_vtime = vtime;
+            }
+        }
+    }
+
+    /* this can cause destroy actions so do this outside the mutex. */
+    if(num_aborted_requests > 0) {
+        pdebug(DEBUG_SPEW, "%d requests to abort.", num_aborted_requests);
+
+        for(int i=0; i < num_aborted_requests; i++) {
+            request = aborted_requests[i];
+
+            debug_set_tag_id(request->tag_id);
+
+            if(request->abort_request) {
+                pdebug(DEBUG_DETAIL, "Request %p is aborted.", request);
+                request->status = PLCTAG_ERR_ABORT;
             } else {
-                pdebug(DEBUG_DETAIL, "forward open succeeded, going to idle state.");
-                state = SESSION_IDLE;
+                pdebug(DEBUG_DETAIL, "Request %p was not sent before its deadline.", request);
+                request->status = PLCTAG_ERR_TIMEOUT;
             }
+
+            request->request_size = 0;
+            request->resp_received = 1;
+
+            plc_tag_wake(request->tag_id);
+
+            aborted_requests[i] = rc_dec(request);
+        }
+
+        debug_set_tag_id(0);
+    }
+
+    if(num_shed_requests > 0) {
+        pdebug(DEBUG_DETAIL, "Shed %d requests that were past their deadline.", num_shed_requests);
+
+        session->shed_count += (uint64_t)num_shed_requests;
+
+        spin_block(&shed_count_lock) {
+            shed_count += (uint64_t)num_shed_requests;
+        }
+    }
+
+    if(linger_until_us) {
+        pdebug(DEBUG_SPEW, "Holding the packet back for more requests.");
+
+        /* the timers are in milliseconds, round up. */
+        session_run_at(session, (linger_until_us + 999) / 1000);
+
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    if(num_bundled_requests == 0) {
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    pdebug(DEBUG_DETAIL, "%d requests to process.", num_bundled_requests);
+
+    do {
+        /* copy and pack the requests into the session buffer. */
+        rc = pack_requests(session, bundled_requests, num_bundled_requests);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Error while packing requests, %s!", plc_tag_decode_error(rc));
             break;
+        }
+
+        /* fill in all the necessary parts to the request. */
+        if((rc = prepare_request(session, &packet_seq_id)) != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to prepare request, %s!", plc_tag_decode_error(rc));
+            break;
+        }
+    } while(0);
+
+    /* problem? clean up the bundled requests. */
+    if(rc != PLCTAG_STATUS_OK) {
+        for(int i=0; i < num_bundled_requests; i++) {
+            bundled_requests[i]->status = rc;
+            bundled_requests[i]->request_size = 0;
+            bundled_requests[i]->resp_received = 1;
+            plc_tag_wake(bundled_requests[i]->tag_id);
+            bundled_requests[i] = rc_dec(bundled_requests[i]);
+        }
 
-        case SESSION_IDLE:
-            pdebug(DEBUG_SPEW, "in SESSION_IDLE state.");
+        for(int i=0; i < num_duplicate_requests; i++) {
+            duplicate_requests[i]->status = rc;
+            duplicate_requests[i]->request_size = 0;
+            duplicate_requests[i]->resp_received = 1;
+            plc_tag_wake(duplicate_requests[i]->tag_id);
+            duplicate_requests[i] = rc_dec(duplicate_requests[i]);
+        }
 
-            idle = 1;
+        session->send_data_size = 0;
 
-            /* if there is work to do, make sure we do not disconnect. */
-            critical_block(session->mutex) {
-                if(vector_length(session->requests) > 0) {
-                    auto_disconnect_time = time_ms() + SESSION_DISCONNECT_TIMEOUT;
-                }
+        return rc;
+    }
+
+    /* keep track of how well the packets are filled. */
+    if(remaining_space < 0) {
+        remaining_space = 0;
+    }
+
+    session->pack_packets++;
+    session->pack_requests += (uint64_t)num_bundled_requests;
+    session->pack_bytes += (uint64_t)(capacity - remaining_space);
+    session->pack_capacity += (uint64_t)capacity;
+
+    spin_block(&pack_stats_lock) {
+        pack_stats_packets++;
+        pack_stats_requests += (uint64_t)num_bundled_requests;
+        pack_stats_bytes += (uint64_t)(capacity - remaining_space);
+        pack_stats_capacity += (uint64_t)capacity;
+    }
+
+    /* the requests are in flight now.  Our references move to the in flight list. */
+    for(int i=0; i < num_bundled_requests; i++) {
+        bundled_requests[i]->packet_seq_id = packet_seq_id;
+        bundled_requests[i]->packing_num = i;
+        bundled_requests[i]->time_sent = 0;
+
+        vector_put(session->in_flight, vector_length(session->in_flight), bundled_requests[i]);
+    }
+
+    /* the duplicates unpack the same part of the response as the request they copy. */
+    for(int i=0; i < num_duplicate_requests; i++) {
+        duplicate_requests[i]->packet_seq_id = packet_seq_id;
+        duplicate_requests[i]->packing_num = duplicate_of[i];
+        duplicate_requests[i]->time_sent = 0;
+
+        vector_put(session->in_flight, vector_length(session->in_flight), duplicate_requests[i]);
+    }
+
+    if(num_duplicate_requests > 0) {
+        pdebug(DEBUG_DETAIL, "%d duplicate reads share responses.", num_duplicate_requests);
+        session->dedupe_count += (uint64_t)num_duplicate_requests;
+    }
+
+    session->send_data_offset = 0;
+    session->packets_in_flight++;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * pack_linger_until_unsafe
+ *
+ * Decide whether the next packet should be held back for more requests.
+ * Returns the time, in microseconds, until which to wait or zero if the
+ * packet should go now.  It goes now if lingering is off, if the oldest
+ * queued request has waited long enough, if any queued request cannot
+ * wait or cannot be packed, or if the queued requests already fill the
+ * packet.
+ *
+ * You must hold the mutex before calling this!
+ */
+int64_t pack_linger_until_unsafe(ab_session_p session, int capacity)
+{
+    int64_t linger_until_us = 0;
+    int64_t oldest_queued_us = 0;
+    int64_t first_deadline_us = 0;
+    int num_looked_at = 0;
+    int payload_size = 0;
+
+    if(session->pack_linger_us <= 0) {
+        return 0;
+    }
+
+    /* the heaps are not sorted, but any requests will do for this. */
+    for(int p=0; p < SESSION_NUM_PRIORITIES; p++) {
+        for(int i=0; i < session->queues[p].len; i++) {
+            ab_request_p request = session->queues[p].heap[i];
+
+            if(request->abort_request) {
+                continue;
             }
 
-            if((rc = process_requests(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error while processing requests %s!", plc_tag_decode_error(rc));
-                idle = 0;
-                if(session->use_connected_msg) {
-                    state = SESSION_DISCONNECT;
-                } else {
-                    state = SESSION_UNREGISTER;
-                }
+            if(!request->allow_packing || !request->allow_linger) {
+                return 0;
+            }
+
+            if(!oldest_queued_us || request->time_queued_us < oldest_queued_us) {
+                oldest_queued_us = request->time_queued_us;
             }
 
-            /* check if we should disconnect */
-            //if(session->auto_disconnect_enabled) {
-            if(auto_disconnect_time < time_ms()) {
-                pdebug(DEBUG_DETAIL, "Disconnecting due to inactivity.");
+            if(request->deadline_us && (!first_deadline_us || request->deadline_us < first_deadline_us)) {
+                first_deadline_us = request->deadline_us;
+            }
 
-                auto_disconnect = 1;
-                idle = 0;
+            payload_size += get_payload_size(request);
+            num_looked_at++;
 
-                if(session->use_connected_msg) {
-                    state = SESSION_DISCONNECT;
-                } else {
-                    state = SESSION_UNREGISTER;
+            if(payload_size >= capacity || num_looked_at >= SESSION_PACK_LOOKAHEAD) {
+                return 0;
+            }
+        }
+    }
+
+    if(!oldest_queued_us) {
+        return 0;
+    }
+
+    /* the oldest request sets the deadline. */
+    linger_until_us = oldest_queued_us + session->pack_linger_us;
+
+    if(linger_until_us <= time_us()) {
+        return 0;
+    }
+
+    /* do not hold a request back past the time its caller gives up. */
+    if(first_deadline_us && first_deadline_us <= linger_until_us) {
+        return 0;
+    }
+
+    return linger_until_us;
+}
+
+
+
+/*
+ * dispatch_response
+ *
+ * Find the requests that were sent in the packet the response in the
+ * session buffer answers and unpack the response into them.  Connected
+ * responses are matched on the connection sequence number and unconnected
+ * ones on the sender context.
+ */
+int dispatch_response(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+    eip_encap *encap = (eip_encap *)(session->data);
+    ab_request_p responding_requests[MAX_PACKET_REQUESTS] = {NULL};
+    int num_responding_requests = 0;
+    uint64_t packet_seq_id = 0;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+        packet_seq_id = le2h16(((eip_cip_co_resp *)(session->data))->cpf_conn_seq_num);
+    } else {
+        packet_seq_id = session->resp_seq_id;
+    }
+
+    /* pull out all the requests sent in the matching packet, in packing order. */
+    for(int i=0; i < vector_length(session->in_flight) && num_responding_requests < MAX_PACKET_REQUESTS; i++) {
+        ab_request_p request = vector_get(session->in_flight, i);
+
+        if(request->packet_seq_id == packet_seq_id) {
+            responding_requests[num_responding_requests] = request;
+            num_responding_requests++;
+
+            vector_remove(session->in_flight, i);
+            i--;
+        }
+    }
+
+    if(num_responding_requests == 0) {
+        pdebug(DEBUG_WARN, "Got response for packet %" PRIx64 " that matches no request in flight, dropping it.", packet_seq_id);
+        return PLCTAG_STATUS_OK;
+    }
+
+    session->packets_in_flight--;
+
+    session_update_rtt(session, time_us() - responding_requests[0]->time_sent);
+
+    pdebug(DEBUG_DETAIL, "Got response for packet %" PRIx64 " with %d requests, %d packets still in flight.", packet_seq_id, num_responding_requests, session->packets_in_flight);
+
+    do {
+        /*
+         * check the CIP status, but only if this is a bundled
+         * response.   If it is a singleton, then we pass the
+         * status back to the tag.  Duplicate reads share the
+         * packing number of the request they copy, so only a
+         * bundle has packing numbers past zero.
+         */
+        int bundled = 0;
+
+        for(int i=0; i < num_responding_requests; i++) {
+            if(responding_requests[i]->packing_num > 0) {
+                bundled = 1;
+                break;
+            }
+        }
+
+        if(bundled) {
+            if(le2h16(encap->encap_command) == AB_EIP_UNCONNECTED_SEND) {
+                eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(session->data);
+                pdebug(DEBUG_INFO, "Received unconnected packet with session sequence ID %llx", resp->encap_sender_context);
+
+                /* punt if we got an overall error or it is not a partial/bundled error. */
+                if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
+                    rc = decode_cip_error_code(&(resp->status));
+                    pdebug(DEBUG_WARN, "Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
+                    break;
+                }
+            } else if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
+                eip_cip_co_resp *resp = (eip_cip_co_resp *)(session->data);
+                pdebug(DEBUG_INFO, "Received connected packet with connection ID %x and sequence ID %u(%x)", le2h32(resp->cpf_orig_conn_id), le2h16(resp->cpf_conn_seq_num), le2h16(resp->cpf_conn_seq_num));
+
+                /* punt if we got an overall error or it is not a partial/bundled error. */
+                if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
+                    rc = decode_cip_error_code(&(resp->status));
+                    pdebug(DEBUG_WARN, "Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
+                    break;
                 }
             }
-            //}
+        }
 
-            break;
+        /* copy the results back out. Every request gets a copy. */
+        for(int i=0; i < num_responding_requests; i++) {
+            debug_set_tag_id(responding_requests[i]->tag_id);
+
+            rc = unpack_response(session, responding_requests[i], responding_requests[i]->packing_num);
+            if(rc != PLCTAG_STATUS_OK) {
+                pdebug(DEBUG_WARN, "Unable to unpack response!");
+                break;
+            }
+
+            /* release our reference */
+            responding_requests[i] = rc_dec(responding_requests[i]);
+        }
+
+        debug_set_tag_id(0);
+    } while(0);
+
+    /* problem? clean up the requests that did not get their response. */
+    if(rc != PLCTAG_STATUS_OK) {
+        for(int i=0; i < num_responding_requests; i++) {
+            if(responding_requests[i]) {
+                responding_requests[i]->status = rc;
+                responding_requests[i]->request_size = 0;
+                responding_requests[i]->resp_received = 1;
+                plc_tag_wake(responding_requests[i]->tag_id);
+                responding_requests[i] = rc_dec(responding_requests[i]);
+            }
+        }
+    }
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * session_update_rtt
+ *
+ * Feed a measured round trip time into the smoothed estimate, the same
+ * way TCP does (RFC 6298).
+ */
+void session_update_rtt(ab_session_p session, int64_t rtt_us)
+{
+    if(rtt_us < 0) {
+        return;
+    }
+
+    if(session->srtt_us == 0) {
+        session->srtt_us = rtt_us;
+        session->rttvar_us = rtt_us / 2;
+    } else {
+        int64_t delta = session->srtt_us - rtt_us;
+
+        if(delta < 0) {
+            delta = -delta;
+        }
+
+        session->rttvar_us = (3 * session->rttvar_us + delta) / 4;
+        session->srtt_us = (7 * session->srtt_us + rtt_us) / 8;
+
+        /* zero means not measured yet. */
+        if(session->srtt_us == 0) {
+            session->srtt_us = 1;
+        }
+    }
+
+    session->timeout_backoff = 0;
+    session->missed_responses = 0;
+
+    pdebug(DEBUG_SPEW, "Round trip %" PRId64 "us, smoothed %" PRId64 "us, deviation %" PRId64 "us.", rtt_us, session->srtt_us, session->rttvar_us);
+}
+
+
+
+/*
+ * session_timeout
+ *
+ * How long, in milliseconds, to wait for a response.  Until a round trip
+ * has been measured, this is SESSION_DEFAULT_TIMEOUT.
+ */
+int session_timeout(ab_session_p session)
+{
+    int64_t timeout_ms = SESSION_DEFAULT_TIMEOUT;
+
+    if(session->srtt_us > 0) {
+        /*
+         * a very steady link has next to no deviation, so always allow
+         * at least twice the smoothed round trip.
+         */
+        int64_t margin_us = 4 * session->rttvar_us;
+
+        if(margin_us < session->srtt_us) {
+            margin_us = session->srtt_us;
+        }
+
+        timeout_ms = (session->srtt_us + margin_us + 999) / 1000;
+
+        if(timeout_ms < SESSION_MIN_TIMEOUT) {
+            timeout_ms = SESSION_MIN_TIMEOUT;
+        }
+    }
+
+    timeout_ms <<= session->timeout_backoff;
+
+    if(timeout_ms > SESSION_MAX_TIMEOUT) {
+        timeout_ms = SESSION_MAX_TIMEOUT;
+    }
+
+    return (int)timeout_ms;
+}
+
+
+
+/*
+ * session_retry_delay
+ *
+ * How long to wait before the next reconnect attempt.  The first retry
+ * after a failure is immediate, a blip should not cost us anything.
+ * After that the wait doubles each time from the minimum to the maximum.
+ * Half of it is random so that many clients of a PLC that went away do
+ * not all come back at once.
+ */
+int session_retry_delay(ab_session_p session)
+{
+    int64_t delay_ms = 0;
+    int64_t max_ms = 0;
+    int64_t half_ms = 0;
+
+    if(session->retry_count == 0) {
+        return 0;
+    }
+
+    /* other tags can change the policy. */
+    critical_block(session->mutex) {
+        delay_ms = session->retry_min_ms;
+        max_ms = session->retry_max_ms;
+    }
+
+    for(int i=1; i < session->retry_count && delay_ms < max_ms; i++) {
+        delay_ms *= 2;
+    }
+
+    if(delay_ms > max_ms) {
+        delay_ms = max_ms;
+    }
+
+    half_ms = delay_ms / 2;
+
+    return (int)(delay_ms - half_ms + (rand() % (half_ms + 1)));
+}
+
+
+
+/*
+ * session_set_backoff
+ *
+ * Start or stop failing requests right away.  When starting, the queued
+ * requests are failed too, nothing will be sent for a while.
+ */
+void session_set_backoff(ab_session_p session, int backoff)
+{
+    ab_request_p failed = NULL;
+    ab_request_p request = NULL;
 
-        case SESSION_DISCONNECT:
-            pdebug(DEBUG_DETAIL, "in SESSION_DISCONNECT state.");
-            if((rc = perform_forward_close(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Forward close failed %s!", plc_tag_decode_error(rc));
-            }
+    pdebug(DEBUG_DETAIL, "%s reconnect backoff.", (backoff ? "Starting" : "Stopping"));
 
-            state = SESSION_UNREGISTER;
-            break;
+    critical_block(session->mutex) {
+        session->retry_backoff = backoff;
 
-        case SESSION_UNREGISTER:
-            pdebug(DEBUG_DETAIL, "in SESSION_UNREGISTER state.");
-            if((rc = session_unregister(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unregistering session failed %s!", plc_tag_decode_error(rc));
+        if(backoff) {
+            while((request = request_queue_pop_unsafe(session))) {
+                request->next = failed;
+                failed = request;
             }
+        }
+    }
 
-            state = SESSION_CLOSE_SOCKET;
-            break;
+    /* wake the tags outside the mutex. */
+    while(failed) {
+        request = failed;
+        failed = request->next;
+        request->next = NULL;
 
-        case SESSION_CLOSE_SOCKET:
-            pdebug(DEBUG_DETAIL, "in SESSION_CLOSE_SOCKET state.");
-            if((rc = session_close_socket(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Closing session socket failed %s!", plc_tag_decode_error(rc));
-            }
+        debug_set_tag_id(request->tag_id);
 
-            if(auto_disconnect) {
-                state = SESSION_WAIT_RECONNECT;
-            } else {
-                state = SESSION_START_RETRY;
-            }
+        pdebug(DEBUG_DETAIL, "Failing queued request %p.", request);
 
-            break;
+        spin_block(&request->lock) {
+            request->status = PLCTAG_ERR_BACKOFF;
+            request->request_size = 0;
+            request->resp_received = 1;
+        }
 
-        case SESSION_START_RETRY:
-            pdebug(DEBUG_DETAIL, "in SESSION_START_RETRY state.");
+        plc_tag_wake(request->tag_id);
 
-            /* set up timer for retry. */
+        rc_dec(request);
+    }
 
-            /* FIXME - make this a tag attribute. */
-            timeout_time = time_ms() + RETRY_WAIT_MS;
+    debug_set_tag_id(0);
 
-            /* start waiting. */
-            state = SESSION_WAIT_RETRY;
+    /* riders waiting for our connection must know too. */
+    if(backoff && session->riders_waiting) {
+        session_wake_riders(session, 0);
+    }
 
-            break;
+    /* as must anyone waiting for the session to come up. */
+    if(backoff) {
+        cond_signal(session->state_cond);
+    }
+}
 
-        case SESSION_WAIT_RETRY:
-            pdebug(DEBUG_SPEW, "in SESSION_WAIT_RETRY state.");
 
-            /* make us sleep on each iteration. */
-            idle = 1;
 
-            if(timeout_time < time_ms()) {
-                pdebug(DEBUG_DETAIL, "Transitioning to SESSION_OPEN_SOCKET.");
-                state = SESSION_OPEN_SOCKET;
-            }
+/*
+ * session_connected
+ *
+ * The session is ready for requests again.  Reset the reconnect policy.
+ */
+void session_connected(ab_session_p session)
+{
+    int keepalive_ms = 0;
 
-            break;
+    session->retry_count = 0;
 
-        case SESSION_WAIT_RECONNECT:
-            /* wait for at least one request to queue before reconnecting. */
-            pdebug(DEBUG_SPEW, "in SESSION_WAIT_RECONNECT state.");
+    critical_block(session->mutex) {
+        keepalive_ms = session->keepalive_ms;
+    }
 
-            idle = 1;
-            auto_disconnect = 0;
+    session->keepalive_seq_id = 0;
+    session->keepalive_time = time_ms() + keepalive_ms;
 
-            /* if there is work to do, reconnect.. */
-            critical_block(session->mutex) {
-                if(vector_length(session->requests) > 0) {
-                    pdebug(DEBUG_DETAIL, "There are requests waiting, reopening connection to PLC.");
+    if(session->retry_backoff) {
+        session_set_backoff(session, 0);
+    }
 
-                    idle = 0;
-                    state = SESSION_OPEN_SOCKET;
-                }
-            }
+    /* anyone waiting for the session to come up can go now. */
+    cond_signal(session->state_cond);
+}
 
-            break;
 
 
-        default:
-            pdebug(DEBUG_ERROR, "Unknown state %d!", state);
+/*
+ * keepalive_due
+ *
+ * Should an idle connection be probed now?  Only when nothing else is
+ * going on, any response shows that the connection is alive.
+ */
+int keepalive_due(ab_session_p session, int64_t now)
+{
+    int keepalive_ms = 0;
 
-            /* FIXME - this logic is not complete.  We might be here without
-             * a connected session or a registered session. */
-            if(session->use_connected_msg) {
-                state = SESSION_DISCONNECT;
-            } else {
-                state = SESSION_UNREGISTER;
-            }
+    /* other tags can change the idle time. */
+    critical_block(session->mutex) {
+        keepalive_ms = session->keepalive_ms;
+    }
 
-            break;
-        }
+    if(keepalive_ms <= 0 || session->carrier || session->keepalive_seq_id) {
+        return 0;
+    }
 
-        /*
-         * give up the CPU a bit, but only if we are not
-         * doing some linked states.
-         */
-        if(idle && !session->terminating) {
-            sleep_ms(1);
-        }
+    if(session->packets_in_flight > 0 || session->writer) {
+        return 0;
     }
 
-    THREAD_RETURN(0);
+    return (session->keepalive_time <= now);
 }
 
 
-int process_requests(ab_session_p session)
+
+/*
+ * start_keepalive
+ *
+ * Send a List Services request.  It is cheap and every EIP device
+ * answers it.  If no answer comes back in time, the connection is
+ * dead and the session reconnects before the tags need it.
+ */
+void start_keepalive(ab_session_p session)
 {
-    int rc = PLCTAG_STATUS_OK;
-    ab_request_p request = NULL;
-    ab_request_p bundled_requests[MAX_REQUESTS] = {NULL};
-    int num_bundled_requests = 0;
-    ab_request_p aborted_requests[MAX_REQUESTS] = {NULL};
-    int num_aborted_requests = 0;
-    int remaining_space = 0;
+    eip_encap *encap = (eip_encap *)(session->send_data);
+    int keepalive_ms = 0;
 
-    debug_set_tag_id(0);
+    pdebug(DEBUG_DETAIL, "Probing idle connection to %s.", session->host);
 
-    pdebug(DEBUG_SPEW, "Starting.");
+    mem_set(encap, 0, (int)sizeof(*encap));
 
-    if(!session) {
-        pdebug(DEBUG_WARN, "Null session pointer!");
-        return PLCTAG_ERR_NULL_PTR;
+    critical_block(session->mutex) {
+        session->keepalive_seq_id = ++session->session_seq_id;
+        keepalive_ms = session->keepalive_ms;
     }
 
-    pdebug(DEBUG_SPEW, "Checking for requests to process.");
-
-    rc = PLCTAG_STATUS_OK;
-    request = NULL;
-    session->data_size = 0;
-    session->data_offset = 0;
+    encap->encap_command = h2le16(AB_EIP_LIST_SERVICES);
+    encap->encap_length = h2le16(0);
+    encap->encap_session_handle = h2le32(session->session_handle);
+    encap->encap_sender_context = h2le64(session->keepalive_seq_id);
 
-    /* grab a request off the front of the list. */
-    critical_block(session->mutex) {
-        /* is there anything to do? */
-        if(vector_length(session->requests)) {
-            //int blocked = 0;
+    session->send_data_size = (uint32_t)sizeof(*encap);
+    session->send_data_offset = 0;
 
-            /* remove the aborted requests. */
-            for(int i=0; i < vector_length(session->requests) && num_aborted_requests < MAX_REQUESTS; i++) {
-                request = vector_get(session->requests, i);
+    session->send_iov[0].data = session->send_data;
+    session->send_iov[0].size = (int)session->send_data_size;
+    session->send_iov_count = 1;
+    session->send_iov_index = 0;
 
-                /* filter out the aborts. */
-                if(request && request->abort_request) {
-                    aborted_requests[num_aborted_requests] = request;
-                    num_aborted_requests++;
+    /* stamped once it is written. */
+    session->keepalive_sent_us = 0;
+    session->keepalive_time = time_ms() + keepalive_ms;
+}
 
-                    /* remove it from the queue. */
-                    vector_remove(session->requests, i);
 
-                    /* vector size has changed, back up one. */
-                    i--;
-                }
-            }
 
-            remaining_space = session->max_payload_size - (int)sizeof(cip_multi_req_header);
+/*
+ * mark_packet_sent
+ *
+ * Stamp the requests of the packet that was just written, and the
+ * keepalive if that is what it was, with the time it went out.  Time
+ * spent waiting for the socket does not count against the response
+ * timeout.  A packet is only started once the last one is out, so its
+ * requests are the ones at the end of the in flight list without a
+ * time stamp.
+ */
+void mark_packet_sent(ab_session_p session)
+{
+    int64_t now_us = time_us();
 
-            /* if there are still requests after purging all the aborted requests, process them. */
-            if(vector_length(session->requests)) {
-                do {
-                    request = vector_get(session->requests, 0);
+    for(int i=vector_length(session->in_flight) - 1; i >= 0; i--) {
+        ab_request_p request = vector_get(session->in_flight, i);
 
-                    remaining_space = remaining_space - get_payload_size(request);
+        if(request->time_sent) {
+            break;
+        }
 
+        request->time_sent = now_us;
+    }
 
-                    /*
-                     * If we have a non-packable request, only queue it if it is the first one.
-                     * If the request is packable, keep queuing as long as there is space.
-                     */
+    if(session->keepalive_seq_id && !session->keepalive_sent_us) {
+        session->keepalive_sent_us = now_us;
+    }
+}
 
-                    if(num_bundled_requests == 0 || (request->allow_packing && remaining_space > 0)) {
-                        //pdebug(DEBUG_DETAIL, "packed %d requests with remaining space %d", num_bundled_requests+1, remaining_space);
-                        bundled_requests[num_bundled_requests] = request;
-                        num_bundled_requests++;
 
-                        /* remove it from the queue. */
-                        vector_remove(session->requests, 0);
-                    }
-                } while(vector_length(session->requests) && remaining_space > 0 && num_bundled_requests < MAX_REQUESTS && request->allow_packing);
-            } else {
-                pdebug(DEBUG_DETAIL, "All requests in queue were aborted, nothing to do.");
-            }
-        }
-    }
 
-    /* this can cause destroy actions so do this outside the mutex. */
-    if(num_aborted_requests > 0) {
+/*
+ * fail_late_packet
+ *
+ * Time out the requests of one packet whose response is late.  The
+ * session carries on with the rest.
+ */
+void fail_late_packet(ab_session_p session, uint64_t packet_seq_id)
+{
+    for(int i=0; i < vector_length(session->in_flight); i++) {
+        ab_request_p request = vector_get(session->in_flight, i);
 
-        pdebug(DEBUG_SPEW, "%d requests to abort.", num_aborted_requests);
+        if(request->packet_seq_id != packet_seq_id) {
+            continue;
+        }
 
-        for(int i=0; i < num_aborted_requests; i++) {
-            request = aborted_requests[i];
+        vector_remove(session->in_flight, i);
+        i--;
 
-            debug_set_tag_id(request->tag_id);
+        debug_set_tag_id(request->tag_id);
 
-            pdebug(DEBUG_DETAIL, "Request %p is aborted.", request);
+        pdebug(DEBUG_DETAIL, "Timing out request %p.", request);
 
-            request->status = PLCTAG_ERR_ABORT;
+        spin_block(&request->lock) {
+            request->status = PLCTAG_ERR_TIMEOUT;
             request->request_size = 0;
             request->resp_received = 1;
-
-            aborted_requests[i] = rc_dec(request);
         }
+
+        plc_tag_wake(request->tag_id);
+
+        rc_dec(request);
     }
 
     debug_set_tag_id(0);
 
-    if(num_bundled_requests > 0) {
+    session->packets_in_flight--;
+}
+
+
+
+/*
+ * fail_in_flight_requests
+ *
+ * Give every request that is waiting for a response the passed
+ * status and reset the send and receive state.  Used when the
+ * connection is being torn down.
+ *
+ * If replay is set, reads that are not too old are queued again
+ * instead, in the order they were sent.  They go out again once the
+ * session has reconnected, so the tags only see a delay.  They are
+ * queued like new requests: they count against the queue limit and
+ * take their fair place behind the other sources' requests.  A read
+ * that does not fit in the queue fails like the rest.  Writes always
+ * fail, we cannot know if they were done.
+ */
+void fail_in_flight_requests(ab_session_p session, int status, int replay)
+{
+    int64_t replay_after_us = time_us() - (int64_t)SESSION_REPLAY_WINDOW_MS * 1000;
+    int num_replayed = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_DETAIL, "Starting.");
+
+    for(int i=0; replay && i < vector_length(session->in_flight); i++) {
+        ab_request_p request = vector_get(session->in_flight, i);
 
-        pdebug(DEBUG_DETAIL, "%d requests to process.", num_bundled_requests);
+        if(!request->allow_replay || request->abort_request || request->time_queued_us < replay_after_us) {
+            continue;
+        }
 
-        do {
-            /* copy and pack the requests into the session buffer. */
-            rc = pack_requests(session, bundled_requests, num_bundled_requests);
+        critical_block(session->mutex) {
+            rc = session_admit_unsafe(session, &request, 1);
             if(rc != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error while packing requests, %s!", plc_tag_decode_error(rc));
                 break;
             }
 
-            /* fill in all the necessary parts to the request. */
-            if((rc = prepare_request(session)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unable to prepare request, %s!", plc_tag_decode_error(rc));
-                break;
-            }
+            request->packet_seq_id = 0;
+            request->packing_num = 0;
+            request->pack_skips = 0;
+            request->time_sent = 0;
 
-            /* send the request */
-            if((rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error sending packet %s!", plc_tag_decode_error(rc));
-                break;
-            }
+            rc = request_queue_push_unsafe(session, request, NULL);
+        }
 
-            /* wait for the response */
-            if((rc = recv_eip_response(session, SESSION_DEFAULT_TIMEOUT)) != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Error receiving packet response %s!", plc_tag_decode_error(rc));
-                break;
-            }
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_WARN, "Unable to queue request %p again, error %s!", request, plc_tag_decode_error(rc));
+            continue;
+        }
 
-            /*
-             * check the CIP status, but only if this is a bundled
-             * response.   If it is a singleton, then we pass the
-             * status back to the tag.
-             */
-            if(num_bundled_requests > 1) {
-                if(le2h16(((eip_encap *)(session->data))->encap_command) == AB_EIP_UNCONNECTED_SEND) {
-                    eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(session->data);
-                    pdebug(DEBUG_INFO, "Received unconnected packet with session sequence ID %llx", resp->encap_sender_context);
-
-                    /* punt if we got an overall error or it is not a partial/bundled error. */
-                    if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
-                        rc = decode_cip_error_code(&(resp->status));
-                        pdebug(DEBUG_WARN, "Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
-                        break;
-                    }
-                } else if(le2h16(((eip_encap *)(session->data))->encap_command) == AB_EIP_CONNECTED_SEND) {
-                    eip_cip_co_resp *resp = (eip_cip_co_resp *)(session->data);
-                    pdebug(DEBUG_INFO, "Received connected packet with connection ID %x and sequence ID %u(%x)", le2h32(resp->cpf_orig_conn_id), le2h16(resp->cpf_conn_seq_num), le2h16(resp->cpf_conn_seq_num));
-
-                    /* punt if we got an overall error or it is not a partial/bundled error. */
-                    if(resp->status != AB_EIP_OK && resp->status != AB_CIP_ERR_PARTIAL_ERROR) {
-                        rc = decode_cip_error_code(&(resp->status));
-                        pdebug(DEBUG_WARN, "Command failed! (%d/%d) %s", resp->status, rc, plc_tag_decode_error(rc));
-                        break;
-                    }
-                }
-            }
+        /* our reference went back to the queue. */
+        vector_remove(session->in_flight, i);
+        i--;
 
-            /* copy the results back out. Every request gets a copy. */
-            for(int i=0; i < num_bundled_requests; i++) {
-                debug_set_tag_id(bundled_requests[i]->tag_id);
+        num_replayed++;
+    }
 
-                rc = unpack_response(session, bundled_requests[i], i);
-                if(rc != PLCTAG_STATUS_OK) {
-                    pdebug(DEBUG_WARN, "Unable to unpack response!");
-                    break;
-                }
+    if(num_replayed > 0) {
+        pdebug(DEBUG_INFO, "%d reads will be sent again after reconnecting.", num_replayed);
+    }
 
-                /* release our reference */
-                bundled_requests[i] = rc_dec(bundled_requests[i]);
-            }
+    for(int i=0; i < vector_length(session->in_flight); i++) {
+        ab_request_p request = vector_get(session->in_flight, i);
 
-            rc = PLCTAG_STATUS_OK;
-        } while(0);
+        debug_set_tag_id(request->tag_id);
 
-        /* problem? clean up the pending requests and dump everything. */
-        if(rc != PLCTAG_STATUS_OK) {
-            for(int i=0; i < num_bundled_requests; i++) {
-                if(bundled_requests[i]) {
-                    bundled_requests[i]->status = rc;
-                    bundled_requests[i]->request_size = 0;
-                    bundled_requests[i]->resp_received = 1;
-                    bundled_requests[i] = rc_dec(bundled_requests[i]);
-                }
-            }
+        pdebug(DEBUG_DETAIL, "Failing request %p with status %s.", request, plc_tag_decode_error(status));
+
+        spin_block(&request->lock) {
+            request->status = status;
+            request->request_size = 0;
+            request->resp_received = 1;
         }
+
+        plc_tag_wake(request->tag_id);
+
+        rc_dec(request);
     }
 
     debug_set_tag_id(0);
 
-    pdebug(DEBUG_SPEW, "Done.");
+    while(vector_length(session->in_flight) > 0) {
+        vector_remove(session->in_flight, vector_length(session->in_flight) - 1);
+    }
 
-    return rc;
+    /* let others use the socket, this must happen before the send state is reset. */
+    session_release_writer(session);
+
+    session->packets_in_flight = 0;
+    session->missed_responses = 0;
+    session->keepalive_seq_id = 0;
+    session->send_data_size = 0;
+    session->send_data_offset = 0;
+    session->data_size = 0;
+    session->data_offset = 0;
+
+    pdebug(DEBUG_DETAIL, "Done.");
 }
 
 
@@ -1314,49 +4308,35 @@ int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
 {
     int rc = PLCTAG_STATUS_OK;
     eip_cip_co_resp *packed_resp = (eip_cip_co_resp *)(session->data);
-    eip_cip_co_resp *unpacked_resp = NULL;
     uint8_t *pkt_start = NULL;
     uint8_t *pkt_end = NULL;
     int new_eip_len = 0;
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
-    /* clear out the request data. */
-    mem_set(request->data, 0, request->request_capacity);
-
     /* change what we do depending on the type. */
     if(packed_resp->reply_service != (AB_EIP_CMD_CIP_MULTI | AB_EIP_CMD_CIP_OK)) {
-        /* copy the data back into the request buffer. */
-        new_eip_len = (int)session->data_size;
-        pdebug(DEBUG_DETAIL, "Got single response packet.  Copying %d bytes unchanged.", new_eip_len);
-
-        if(new_eip_len > request->request_capacity) {
-            int request_capacity = 0;
-
-            pdebug(DEBUG_DETAIL, "Request buffer too small, allocating larger buffer.");
-
-            critical_block(session->mutex) {
-                request_capacity = (size_t)(session->max_payload_size + EIP_CIP_PREFIX_SIZE);
-            }
+        if(request->resp_dest && le2h16(packed_resp->encap_command) == AB_EIP_CONNECTED_SEND) {
+            /* split the reply so that the data can go straight to the destination. */
+            pdebug(DEBUG_DETAIL, "Got single response packet.");
 
-            /* make sure it will fit. */
-            if(new_eip_len > request_capacity) {
-                pdebug(DEBUG_WARN, "something is very wrong, packet length is %d but allowable capacity is %d!", new_eip_len, request_capacity);
-                return PLCTAG_ERR_TOO_LARGE;
-            }
+            pkt_start = &packed_resp->reply_service;
+            pkt_end = session->data + session->data_size;
+        } else {
+            /* copy the data back into the request buffer. */
+            new_eip_len = (int)session->data_size;
+            pdebug(DEBUG_DETAIL, "Got single response packet.  Copying %d bytes unchanged.", new_eip_len);
 
-            rc = session_request_increase_buffer(request, request_capacity);
+            rc = ensure_request_capacity(session, request, new_eip_len);
             if(rc != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unable to increase request buffer size to %d bytes!", request_capacity);
                 return rc;
             }
-        }
 
-        mem_copy(request->data, session->data, new_eip_len);
+            mem_copy(request->data, session->data, new_eip_len);
+        }
     } else {
         cip_multi_resp_header *multi = (cip_multi_resp_header *)(&packed_resp->reply_service);
         uint16_t total_responses = le2h16(multi->request_count);
-        int pkt_len = 0;
 
         /* this is a packed response. */
         pdebug(DEBUG_DETAIL, "Got multiple response packet, subpacket %d", sub_packet);
@@ -1372,62 +4352,184 @@ int unpack_response(ab_session_p session, ab_request_p request, int sub_packet)
         } else {
             pkt_end = (session->data + le2h16(packed_resp->encap_length) + sizeof(eip_encap));
         }
+    }
+
+    if(pkt_start) {
+        rc = unpack_reply(session, request, pkt_start, (int)(pkt_end - pkt_start), &new_eip_len);
+        if(rc != PLCTAG_STATUS_OK) {
+            return rc;
+        }
+    }
+
+    pdebug(DEBUG_DETAIL, "Unpacked packet:");
+    pdebug_dump_bytes(DEBUG_DETAIL, request->data, new_eip_len);
+
+    /* notify the reading thread that the request is ready */
+    spin_block(&request->lock) {
+        request->status = PLCTAG_STATUS_OK;
+        request->request_size = new_eip_len;
+        request->resp_received = 1;
+    }
+
+    /* wake up any thread blocked on this tag. */
+    plc_tag_wake(request->tag_id);
+
+    pdebug(DEBUG_DETAIL, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * unpack_reply
+ *
+ * Build a stand-alone connected response in the request buffer from one
+ * CIP reply found in the session buffer.  If the request has a
+ * destination for its data and the reply carries read data, the data is
+ * copied directly to the destination and only the reply header and type
+ * information land in the request buffer.
+ */
+
+int unpack_reply(ab_session_p session, ab_request_p request, uint8_t *reply, int reply_len, int *new_eip_len)
+{
+    int rc = PLCTAG_STATUS_OK;
+    eip_cip_co_resp *unpacked_resp = NULL;
+    int data_offset = 0;
+    int data_len = 0;
+    int header_len = reply_len;
+
+    /* only split out data the destination can take.  Otherwise leave it to the tag to complain. */
+    if(request->resp_dest) {
+        data_offset = cip_read_reply_data_offset(reply, reply_len);
+
+        if(data_offset > 0 && (reply_len - data_offset) <= request->resp_dest_size) {
+            data_len = reply_len - data_offset;
+            header_len = data_offset;
+        }
+    }
 
-        pkt_len = (int)(pkt_end - pkt_start);
+    *new_eip_len = header_len + (int)sizeof(eip_cip_co_generic_response);
 
-        /* replace the request buffer if it is not big enough. */
-        new_eip_len = pkt_len + (int)sizeof(eip_cip_co_generic_response);
-        if(new_eip_len > request->request_capacity) {
-            int request_capacity = 0;
+    /* replace the request buffer if it is not big enough. */
+    rc = ensure_request_capacity(session, request, *new_eip_len);
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
 
-            pdebug(DEBUG_DETAIL, "Request buffer too small, allocating larger buffer.");
+    /* point to the response buffer in a structured way. */
+    unpacked_resp = (eip_cip_co_resp *)(request->data);
 
-            critical_block(session->mutex) {
-                request_capacity = (size_t)(session->max_payload_size + EIP_CIP_PREFIX_SIZE);
-            }
+    /* copy the header down */
+    mem_copy(request->data, session->data, (int)sizeof(eip_cip_co_resp));
 
-            /* make sure it will fit. */
-            if(new_eip_len > request_capacity) {
-                pdebug(DEBUG_WARN, "something is very wrong, packet length is %d but allowable capacity is %d!", new_eip_len, request_capacity);
-                return PLCTAG_ERR_TOO_LARGE;
-            }
+    /* size of the new packet */
+    *new_eip_len = (int)(((uint8_t *)(&unpacked_resp->reply_service) + header_len) /* end of the packet */
+                         - (uint8_t *)(request->data));                             /* start of the packet */
 
-            rc = session_request_increase_buffer(request, request_capacity);
-            if(rc != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unable to increase request buffer size to %d bytes!", request_capacity);
-                return rc;
+    /* now copy the reply header and any data not going directly to the destination over that. */
+    mem_copy(&unpacked_resp->reply_service, reply, header_len);
+
+    /* stitch up the packet sizes. */
+    unpacked_resp->cpf_cdi_item_length = h2le16((uint16_t)(header_len + (int)sizeof(uint16_le))); /* extra for the connection sequence */
+    unpacked_resp->encap_length = h2le16((uint16_t)(*new_eip_len - (int)sizeof(eip_encap)));
+
+    /*
+     * The tag may have aborted the request and gone away.  The abort is
+     * done under the request lock, so holding it keeps the destination
+     * valid while we copy.
+     */
+    if(data_len > 0) {
+        spin_block(&request->lock) {
+            if(!request->abort_request) {
+                mem_copy(request->resp_dest, reply + data_offset, data_len);
+                request->resp_dest_len = data_len;
             }
         }
 
-        /* point to the response buffer in a structured way. */
-        unpacked_resp = (eip_cip_co_resp *)(request->data);
+        pdebug(DEBUG_DETAIL, "Copied %d bytes of reply data directly to the destination.", data_len);
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cip_read_reply_data_offset
+ *
+ * Find where the data starts in a successful CIP read reply.  The data
+ * follows the reply header and the type information.  Returns zero if
+ * this is not a read reply with data.
+ */
+
+int cip_read_reply_data_offset(uint8_t *reply, int reply_len)
+{
+    int offset = 4; /* reply service, reserved, status and status word count. */
+    int type_length = 0;
+
+    if(reply_len <= offset + 2) {
+        return 0;
+    }
+
+    if(reply[0] != (AB_EIP_CMD_CIP_READ_FRAG | AB_EIP_CMD_CIP_OK) && reply[0] != (AB_EIP_CMD_CIP_READ | AB_EIP_CMD_CIP_OK)) {
+        return 0;
+    }
+
+    if((reply[2] != AB_CIP_STATUS_OK && reply[2] != AB_CIP_STATUS_FRAG) || reply[3] != 0) {
+        return 0;
+    }
+
+    if(reply[offset] >= AB_CIP_DATA_BIT && reply[offset] <= AB_CIP_DATA_STRINGI) {
+        type_length = 2;
+    } else if(reply[offset] == AB_CIP_DATA_ABREV_STRUCT || reply[offset] == AB_CIP_DATA_ABREV_ARRAY ||
+              reply[offset] == AB_CIP_DATA_FULL_STRUCT || reply[offset] == AB_CIP_DATA_FULL_ARRAY) {
+        type_length = reply[offset + 1] + 2;
+    } else {
+        return 0;
+    }
+
+    if(offset + type_length >= reply_len) {
+        return 0;
+    }
+
+    return offset + type_length;
+}
+
 
-        /* copy the header down */
-        mem_copy(request->data, session->data, (int)sizeof(eip_cip_co_resp));
 
-        /* size of the new packet */
-        new_eip_len = (uint16_t)(((uint8_t *)(&unpacked_resp->reply_service) + pkt_len) /* end of the packet */
-                                 - (uint8_t *)(request->data));                                      /* start of the packet */
+/*
+ * ensure_request_capacity
+ *
+ * Grow the request buffer if a response of new_size bytes will not fit.
+ */
 
-        /* now copy the packet over that. */
-        mem_copy(&unpacked_resp->reply_service, pkt_start, pkt_len);
+int ensure_request_capacity(ab_session_p session, ab_request_p request, int new_size)
+{
+    int rc = PLCTAG_STATUS_OK;
+    int request_capacity = 0;
 
-        /* stitch up the packet sizes. */
-        unpacked_resp->cpf_cdi_item_length = h2le16((uint16_t)(pkt_len + (int)sizeof(uint16_le))); /* extra for the connection sequence */
-        unpacked_resp->encap_length = h2le16((uint16_t)(new_eip_len - (uint16_t)sizeof(eip_encap)));
+    if(new_size <= request->request_capacity) {
+        return PLCTAG_STATUS_OK;
     }
 
-    pdebug(DEBUG_DETAIL, "Unpacked packet:");
-    pdebug_dump_bytes(DEBUG_DETAIL, request->data, new_eip_len);
+    pdebug(DEBUG_DETAIL, "Request buffer too small, allocating larger buffer.");
 
-    /* notify the reading thread that the request is ready */
-    spin_block(&request->lock) {
-        request->status = PLCTAG_STATUS_OK;
-        request->request_size = new_eip_len;
-        request->resp_received = 1;
+    critical_block(session->mutex) {
+        request_capacity = (int)(session->max_payload_size + EIP_CIP_PREFIX_SIZE);
     }
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    /* make sure it will fit. */
+    if(new_size > request_capacity) {
+        pdebug(DEBUG_WARN, "something is very wrong, packet length is %d but allowable capacity is %d!", new_size, request_capacity);
+        return PLCTAG_ERR_TOO_LARGE;
+    }
+
+    rc = session_request_increase_buffer(request, request_capacity);
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to increase request buffer size to %d bytes!", request_capacity);
+        return rc;
+    }
 
     return PLCTAG_STATUS_OK;
 }
@@ -1458,6 +4560,59 @@ int get_payload_size(ab_request_p request)
 
 
 
+/*
+ * requests_are_same_read
+ *
+ * Two connected reads are the same if their CIP requests are byte for
+ * byte the same: same service, encoded tag name, element count and
+ * offset.
+ */
+int requests_are_same_read(ab_request_p first, ab_request_p second)
+{
+    eip_cip_co_req *first_req = (eip_cip_co_req *)(first->data);
+    eip_cip_co_req *second_req = (eip_cip_co_req *)(second->data);
+    int first_size = 0;
+    int second_size = 0;
+
+    if(!first->allow_dedupe || !second->allow_dedupe) {
+        return 0;
+    }
+
+    if(le2h16(first_req->encap_command) != AB_EIP_CONNECTED_SEND || le2h16(second_req->encap_command) != AB_EIP_CONNECTED_SEND) {
+        return 0;
+    }
+
+    /* the connection sequence number is not part of the CIP request. */
+    first_size = le2h16(first_req->cpf_cdi_item_length) - (int)sizeof(uint16_le);
+    second_size = le2h16(second_req->cpf_cdi_item_length) - (int)sizeof(uint16_le);
+
+    return mem_cmp((uint8_t *)(first_req + 1), first_size, (uint8_t *)(second_req + 1), second_size) == 0;
+}
+
+
+
+int tag_id_in_list(int tag_id, int *tag_ids, int num_tag_ids)
+{
+    for(int i=0; i < num_tag_ids; i++) {
+        if(tag_ids[i] == tag_id) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * pack_requests
+ *
+ * Set up the send pieces for the bundled requests.  A single request is
+ * sent straight from its own buffer.  For more than one, the encapsulation
+ * and Multiple Service Packet header with its offset table are built in
+ * the session send buffer and each request's CIP part is sent directly
+ * from the request buffer.  Nothing is copied into one big packet.
+ */
 int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests)
 {
     eip_cip_co_req *new_req = NULL;
@@ -1468,49 +4623,41 @@ int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests
     int current_offset = 0;
     uint8_t *pkt_start = NULL;
     int pkt_len = 0;
-    uint8_t *first_pkt_data = NULL;
-    uint8_t *next_pkt_data = NULL;
+    int total_size = 0;
 
     pdebug(DEBUG_INFO, "Starting.");
 
     debug_set_tag_id(requests[0]->tag_id);
 
-    /* get the header info from the first request. Just copy the whole thing. */
-    mem_copy(session->data, requests[0]->data, requests[0]->request_size);
-    session->data_size = (uint32_t)requests[0]->request_size;
+    session->send_iov_index = 0;
 
     /* special case the case where there is just one request. */
     if(num_requests == 1) {
         pdebug(DEBUG_INFO, "Only one request, so done.");
 
+        session->send_iov[0].data = requests[0]->data;
+        session->send_iov[0].size = requests[0]->request_size;
+        session->send_iov_count = 1;
+        session->send_data_size = (uint32_t)requests[0]->request_size;
+
         debug_set_tag_id(0);
 
         return PLCTAG_STATUS_OK;
     }
 
-    /* set up multi-packet header. */
+    /* get the header info from the first request. */
+    mem_copy(session->send_data, requests[0]->data, (int)sizeof(eip_cip_co_req));
+
+    packed_req = (eip_cip_co_req *)(session->send_data);
+
+    /* set up multi-packet header right after the connection sequence number. */
 
     header_size = (int)(sizeof(cip_multi_req_header)
                         + (sizeof(uint16_le) * (size_t)num_requests)); /* offsets for each request. */
 
     pdebug(DEBUG_DETAIL, "header size %d", header_size);
 
-    packed_req = (eip_cip_co_req *)(session->data);
-
-    /* make room in the request packet in the session for the header. */
-    pkt_start = (uint8_t *)(&packed_req->cpf_conn_seq_num) + sizeof(packed_req->cpf_conn_seq_num);
-    pkt_len = (int)le2h16(packed_req->cpf_cdi_item_length) - (int)sizeof(packed_req->cpf_conn_seq_num);
-
-    pdebug(DEBUG_DETAIL, "packet 0 is of length %d.", pkt_len);
-
-    /* point to where we want the current packet to start. */
-    first_pkt_data = pkt_start + header_size;
-
-    /* move the data over to make room */
-    mem_move(first_pkt_data, pkt_start, pkt_len);
-
-    /* now fill in the header. Use pkt_start as it is pointing to the right location. */
-    multi_header = (cip_multi_req_header *)pkt_start;
+    multi_header = (cip_multi_req_header *)(session->send_data + sizeof(eip_cip_co_req));
     multi_header->service_code = AB_EIP_CMD_CIP_MULTI;
     multi_header->req_path_size = 0x02; /* length of path in words */
     multi_header->req_path[0] = 0x20; /* Class */
@@ -1519,15 +4666,14 @@ int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests
     multi_header->req_path[3] = 0x01; /* #1 */
     multi_header->request_count = h2le16((uint16_t)num_requests);
 
-    /* set up the offset for the first request. */
-    current_offset = (int)(sizeof(uint16_le) + (sizeof(uint16_le) * (size_t)num_requests));
-    multi_header->request_offsets[0] = h2le16((uint16_t)current_offset);
+    session->send_iov[0].data = session->send_data;
+    session->send_iov[0].size = (int)sizeof(eip_cip_co_req) + header_size;
+    total_size = session->send_iov[0].size;
 
-    next_pkt_data = first_pkt_data + pkt_len;
-    current_offset = current_offset + pkt_len;
+    /* offsets are from the request count field. */
+    current_offset = (int)(sizeof(uint16_le) + (sizeof(uint16_le) * (size_t)num_requests));
 
-    /* now process the rest of the requests. */
-    for(int i=1; i<num_requests; i++) {
+    for(int i=0; i<num_requests; i++) {
         debug_set_tag_id(requests[i]->tag_id);
 
         /* set up the offset */
@@ -1542,22 +4688,24 @@ int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests
 
         pdebug(DEBUG_DETAIL, "packet %d is of length %d.", i, pkt_len);
 
-        /* copy the request into the session buffer. */
-        mem_copy(next_pkt_data, pkt_start, pkt_len);
+        /* send it from where it is. */
+        session->send_iov[i + 1].data = pkt_start;
+        session->send_iov[i + 1].size = pkt_len;
 
-        /* calculate the next packet info. */
-        next_pkt_data += pkt_len;
         current_offset += pkt_len;
+        total_size += pkt_len;
     }
 
+    session->send_iov_count = num_requests + 1;
+
     /* stitch up the CPF packet length */
-    packed_req->cpf_cdi_item_length = h2le16((uint16_t)(next_pkt_data - (uint8_t *)(&packed_req->cpf_conn_seq_num)));
+    packed_req->cpf_cdi_item_length = h2le16((uint16_t)(total_size - (int)offsetof(eip_cip_co_req, cpf_conn_seq_num)));
 
     /* stick up the EIP packet length */
-    packed_req->encap_length = h2le16((uint16_t)((size_t)(next_pkt_data - session->data) - sizeof(eip_encap)));
+    packed_req->encap_length = h2le16((uint16_t)(total_size - (int)sizeof(eip_encap)));
 
     /* set the total data size */
-    session->data_size = (uint32_t)(next_pkt_data - session->data);
+    session->send_data_size = (uint32_t)total_size;
 
     debug_set_tag_id(0);
 
@@ -1568,21 +4716,22 @@ int pack_requests(ab_session_p session, ab_request_p *requests, int num_requests
 
 
 
-int prepare_request(ab_session_p session)
+int prepare_request(ab_session_p session, uint64_t *packet_seq_id)
 {
     eip_encap *encap = NULL;
     int payload_size = 0;
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
-    encap = (eip_encap *)(session->data);
-    payload_size = (int)session->data_size - (int)sizeof(eip_encap);
-
     if(!session) {
         pdebug(DEBUG_WARN, "Called with null session!");
         return PLCTAG_ERR_NULL_PTR;
     }
 
+    /* the header is always in the first piece. */
+    encap = (eip_encap *)(session->send_iov[0].data);
+    payload_size = (int)session->send_data_size - (int)sizeof(eip_encap);
+
     /* fill in the fields of the request. */
 
     encap->encap_length = h2le16((uint16_t)payload_size);
@@ -1592,15 +4741,16 @@ int prepare_request(ab_session_p session)
 
     /* set up the session sequence ID for this transaction */
     if(le2h16(encap->encap_command) == AB_EIP_UNCONNECTED_SEND) {
-        /* get new ID */
-        session->session_seq_id++;
+        /* get new ID, the PCCC code uses the same counter from other threads. */
+        critical_block(session->mutex) {
+            *packet_seq_id = ++session->session_seq_id;
+        }
 
-        //request->session_seq_id = session->session_seq_id;
-        encap->encap_sender_context = h2le64(session->session_seq_id); /* link up the request seq ID and the packet seq ID */
+        encap->encap_sender_context = h2le64(*packet_seq_id); /* link up the request seq ID and the packet seq ID */
 
-        pdebug(DEBUG_INFO, "Preparing unconnected packet with session sequence ID %llx", session->session_seq_id);
+        pdebug(DEBUG_INFO, "Preparing unconnected packet with session sequence ID %llx", *packet_seq_id);
     } else if(le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND) {
-        eip_cip_co_req *conn_req = (eip_cip_co_req *)(session->data);
+        eip_cip_co_req *conn_req = (eip_cip_co_req *)(encap);
 
         pdebug(DEBUG_DETAIL, "cpf_targ_conn_id=%x", session->targ_connection_id);
 
@@ -1610,6 +4760,8 @@ int prepare_request(ab_session_p session)
         session->conn_seq_num++;
         conn_req->cpf_conn_seq_num = h2le16(session->conn_seq_num);
 
+        *packet_seq_id = session->conn_seq_num;
+
         pdebug(DEBUG_INFO, "Preparing connected packet with connection ID %x and sequence ID %u(%x)", session->orig_connection_id, session->conn_seq_num, session->conn_seq_num);
     } else {
         pdebug(DEBUG_WARN, "Unsupported packet type %x!", le2h16(encap->encap_command));
@@ -1617,8 +4769,10 @@ int prepare_request(ab_session_p session)
     }
 
     /* display the data */
-    pdebug(DEBUG_INFO, "Prepared packet of size %d", session->data_size);
-    pdebug_dump_bytes(DEBUG_INFO, session->data, (int)session->data_size);
+    pdebug(DEBUG_INFO, "Prepared packet of size %d in %d pieces", session->send_data_size, session->send_iov_count);
+    for(int i=0; i < session->send_iov_count; i++) {
+        pdebug_dump_bytes(DEBUG_INFO, session->send_iov[i].data, session->send_iov[i].size);
+    }
 
     pdebug(DEBUG_INFO, "Done.");
 
@@ -1627,216 +4781,515 @@ int prepare_request(ab_session_p session)
 
 
 
-
-int send_eip_request(ab_session_p session, int timeout)
+/*
+ * write_eip_request
+ *
+ * Write as much of the packet pieces as the socket will take without
+ * blocking.  Returns PLCTAG_STATUS_PENDING if part of the packet is still
+ * waiting to be sent.  The pieces are advanced in place, the poller
+ * tells us when to continue.
+ */
+int write_eip_request(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
-    int64_t timeout_time = 0;
+    int written = 0;
+    ab_session_p transport = (session->carrier ? session->carrier : session);
 
-    pdebug(DEBUG_DETAIL, "Starting.");
+    pdebug(DEBUG_SPEW, "Starting.");
 
-    if(!session) {
-        pdebug(DEBUG_WARN, "Session pointer is null.");
-        return PLCTAG_ERR_NULL_PTR;
+    if(!transport->sock) {
+        pdebug(DEBUG_WARN, "No socket to write to!");
+        return PLCTAG_ERR_BAD_CONNECTION;
     }
 
-    if(timeout > 0) {
-        timeout_time = time_ms() + timeout;
-    } else {
-        timeout_time = INT64_MAX;
+    /* a shared socket takes one packet at a time. */
+    if(transport->writer && transport->writer != session) {
+        session->write_blocked = 1;
+        transport->writers_waiting = 1;
+        return PLCTAG_STATUS_PENDING;
     }
 
-    pdebug(DEBUG_DETAIL, "Sending packet of size %d", session->data_size);
-    pdebug_dump_bytes(DEBUG_DETAIL, session->data, (int)(session->data_size));
+    if(!transport->writer) {
+        transport->writer = (transport == session ? session : rc_inc(session));
+    }
 
-    session->data_offset = 0;
-    session->packet_count++;
+    if(session->send_data_offset == 0) {
+        pdebug(DEBUG_DETAIL, "Sending packet of size %d", session->send_data_size);
 
-    /* send the packet */
-    do {
-        rc = socket_write(session->sock, session->data + session->data_offset, (int)session->data_size - (int)session->data_offset);
+        session->packet_count++;
+    }
+
+    rc = socket_write_vec(transport->sock, &session->send_iov[session->send_iov_index], session->send_iov_count - session->send_iov_index);
+
+    if(rc == PLCTAG_ERR_NO_DATA) {
+        /* the socket buffer is full. */
+        rc = 0;
+    }
+
+    if(rc < 0) {
+        pdebug(DEBUG_WARN, "Error, %d, writing socket!", rc);
+        return rc;
+    }
+
+    session->send_data_offset += (uint32_t)rc;
+
+    /* step past what went out. */
+    written = rc;
+    while(written > 0 && session->send_iov_index < session->send_iov_count) {
+        socket_iovec_t *iov = &session->send_iov[session->send_iov_index];
+
+        if(written >= iov->size) {
+            written -= iov->size;
+            iov->size = 0;
+            session->send_iov_index++;
+        } else {
+            iov->data += written;
+            iov->size -= written;
+            written = 0;
+        }
+    }
+
+    if(session->send_data_offset < session->send_data_size) {
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    session_release_writer(session);
+
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+/*
+ * read_eip_response
+ *
+ * Read whatever data is available without blocking to fill in
+ * a packet in the receive buffer.  Returns PLCTAG_STATUS_PENDING
+ * if the packet is not complete yet.  Only the bytes of one packet
+ * are read so that the next response stays in the socket.
+ */
+int read_eip_response(ab_session_p session)
+{
+    uint32_t data_needed = 0;
+    int consumed = 0;
+    int keepalive_ms = 0;
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(session->carrier) {
+        /* the carrier reads a rider's responses and hands them over. */
+        if(!session->resp_ready) {
+            return PLCTAG_STATUS_PENDING;
+        }
+
+        session->resp_ready = 0;
+
+        /* it may be holding the next one for us. */
+        if(session->carrier->deliver_blocked) {
+            session_wakeup(session->carrier);
+        }
+    } else do {
+        if(session->data_offset < sizeof(eip_encap)) {
+            data_needed = sizeof(eip_encap);
+        } else {
+            data_needed = (uint32_t)(sizeof(eip_encap) + le2h16(((eip_encap *)(session->data))->encap_length));
+        }
+
+        /* the packet is already complete if it is waiting to be handed over. */
+        if(session->data_offset < data_needed) {
+            rc = socket_read(session->sock, session->data + session->data_offset, (int)(data_needed - session->data_offset));
+
+            if (rc < 0) {
+                /* error! */
+                pdebug(DEBUG_WARN, "Error reading socket! rc=%d", rc);
+                return rc;
+            }
 
-        if(rc >= 0) {
             session->data_offset += (uint32_t)rc;
+
+            /* recalculate the amount of data needed if we have just completed the read of an encap header */
+            if(session->data_offset >= sizeof(eip_encap)) {
+                data_needed = (uint32_t)(sizeof(eip_encap) + le2h16(((eip_encap *)(session->data))->encap_length));
+
+                if(data_needed > session->data_capacity) {
+                    pdebug(DEBUG_WARN, "Packet response (%d) is larger than possible buffer size (%d)!", data_needed, session->data_capacity);
+                    return PLCTAG_ERR_TOO_LARGE;
+                }
+            }
+
+            /* did we get all the data? */
+            if(session->data_offset < data_needed) {
+                return PLCTAG_STATUS_PENDING;
+            }
         }
 
-        /* give up the CPU if we still are looping */
-        if(!session->terminating && rc >= 0 && session->data_offset < session->data_size) {
-            sleep_ms(1);
+        session->resp_seq_id = le2h64(((eip_encap *)(session->data))->encap_sender_context);
+        session->data_size = data_needed;
+
+        /* the connection is alive, no need to probe it for a while. */
+        critical_block(session->mutex) {
+            keepalive_ms = session->keepalive_ms;
+        }
+
+        if(keepalive_ms > 0) {
+            session->keepalive_time = time_ms() + keepalive_ms;
+        }
+
+        pdebug(DEBUG_DETAIL, "request received all needed data (%d bytes of %d).", session->data_offset, data_needed);
+
+        pdebug_dump_bytes(DEBUG_DETAIL, session->data, (int)(session->data_offset));
+
+        /* on a shared connection, the response may be for a rider. */
+        rc = route_response(session, &consumed);
+        if(rc != PLCTAG_STATUS_OK) {
+            return rc;
+        }
+
+        if(consumed) {
+            session->data_offset = 0;
+            session->data_size = 0;
         }
-    } while(!session->terminating && rc >= 0 && session->data_offset < session->data_size && timeout_time > time_ms());
+    } while(consumed);
 
-    if(session->terminating) {
-        pdebug(DEBUG_WARN, "Session is terminating.");
-        return PLCTAG_ERR_ABORT;
+    /* check status. */
+    if(le2h32(((eip_encap *)(session->data))->encap_status) != AB_EIP_OK) {
+        return PLCTAG_ERR_BAD_STATUS;
     }
 
-    if(rc < 0) {
-        pdebug(DEBUG_WARN, "Error, %d, writing socket!", rc);
-        return rc;
+    pdebug(DEBUG_SPEW, "Done.");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * route_response
+ *
+ * Hand the response in the receive buffer of a carrier to the rider it
+ * is for.  Connected responses are matched on our connection ID and
+ * unconnected ones on the sender context.  Responses that nobody is
+ * waiting for, such as those to Forward Closes sent for riders that
+ * went away, are dropped.  Sets consumed if the response was handed
+ * over or dropped.  Returns PLCTAG_STATUS_PENDING if the rider has not
+ * taken its last response yet, the response stays in the buffer.
+ */
+int route_response(ab_session_p session, int *consumed)
+{
+    eip_encap *encap = (eip_encap *)(session->data);
+    ab_session_p rider = NULL;
+    int connected = (le2h16(encap->encap_command) == AB_EIP_CONNECTED_SEND);
+    uint32_t conn_id = 0;
+    int share_tcp = 0;
+
+    *consumed = 0;
+
+    critical_block(session->mutex) {
+        share_tcp = session->share_tcp;
+    }
+
+    if(!share_tcp || session->carrier) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(connected) {
+        conn_id = le2h32(((eip_cip_co_resp *)(session->data))->cpf_orig_conn_id);
+    }
+
+    if(response_is_for(session, session, connected, conn_id)) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    critical_block(session->mutex) {
+        for(int i=0; i < vector_length(session->riders); i++) {
+            ab_session_p tmp = vector_get(session->riders, i);
+
+            /* only riders using the current connection. */
+            if(!tmp->session_handle || tmp->carrier_gen != session->transport_gen) {
+                continue;
+            }
+
+            if(response_is_for(session, tmp, connected, conn_id)) {
+                /* is this rider in the process of destruction? */
+                rider = rc_inc(tmp);
+                break;
+            }
+        }
+    }
+
+    *consumed = 1;
+
+    if(!rider) {
+        pdebug(DEBUG_DETAIL, "Dropping response that no session on this connection is waiting for.");
+        return PLCTAG_STATUS_OK;
+    }
+
+    if(rider->resp_ready) {
+        pdebug(DEBUG_DETAIL, "Rider has not taken its last response yet.");
+        session->deliver_blocked = 1;
+        *consumed = 0;
+        rc_dec(rider);
+        return PLCTAG_STATUS_PENDING;
+    }
+
+    mem_copy(rider->data, session->data, (int)session->data_size);
+    rider->data_offset = session->data_size;
+    rider->data_size = session->data_size;
+    rider->resp_seq_id = session->resp_seq_id;
+    rider->resp_ready = 1;
+
+    session->deliver_blocked = 0;
+
+    session_wakeup(rider);
+
+    rc_dec(rider);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * response_is_for
+ *
+ * Is the response in the reader's buffer one the session is waiting for?
+ */
+int response_is_for(ab_session_p reader, ab_session_p session, int connected, uint32_t conn_id)
+{
+    if(connected) {
+        return (session->orig_connection_id == conn_id);
+    }
+
+    /* the last exchange may be over, but then the response is dropped later. */
+    if(session->exchange_seq_id == reader->resp_seq_id) {
+        return 1;
+    }
+
+    if(session->keepalive_seq_id && session->keepalive_seq_id == reader->resp_seq_id) {
+        return 1;
+    }
+
+    for(int i=0; i < vector_length(session->in_flight); i++) {
+        ab_request_p request = vector_get(session->in_flight, i);
+
+        if(request->packet_seq_id == reader->resp_seq_id) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * start_eip_exchange
+ *
+ * Get ready to send the packet in the send buffer and read its
+ * response.  Used while setting up and tearing down the connection.
+ */
+void start_eip_exchange(ab_session_p session, int timeout)
+{
+    /* the whole packet is in the send buffer. */
+    session->send_iov[0].data = session->send_data;
+    session->send_iov[0].size = (int)session->send_data_size;
+    session->send_iov_count = 1;
+    session->send_iov_index = 0;
+
+    session->send_data_offset = 0;
+    session->data_offset = 0;
+    session->data_size = 0;
+    session->resp_ready = 0;
+    session->exchange_deadline = time_ms() + timeout;
+
+    /* the response has the same sender context. */
+    session->exchange_seq_id = le2h64(((eip_encap *)(session->send_data))->encap_sender_context);
+}
+
+
+
+/*
+ * exchange_eip_packet
+ *
+ * Push out the packet started with start_eip_exchange() and pick up
+ * its response without blocking.  Returns PLCTAG_STATUS_PENDING until
+ * the response is in the receive buffer.
+ */
+int exchange_eip_packet(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    pdebug(DEBUG_SPEW, "Starting.");
+
+    if(session->send_data_size > 0) {
+        rc = write_eip_request(session);
+        if(rc == PLCTAG_STATUS_OK) {
+            /* the send buffer is free again. */
+            session->send_data_size = 0;
+            session->send_data_offset = 0;
+        } else if(rc != PLCTAG_STATUS_PENDING) {
+            pdebug(DEBUG_WARN, "Error sending packet %s!", plc_tag_decode_error(rc));
+            return rc;
+        }
+    }
+
+    if(session->send_data_size == 0) {
+        rc = read_eip_response(session);
+
+        /* a late response to something else, keep waiting. */
+        if(rc == PLCTAG_STATUS_OK && session->resp_seq_id != session->exchange_seq_id) {
+            pdebug(DEBUG_DETAIL, "Dropping response with unexpected sender context %" PRIx64 ".", session->resp_seq_id);
+            session->data_offset = 0;
+            session->data_size = 0;
+            rc = PLCTAG_STATUS_PENDING;
+        }
+
+        if(rc != PLCTAG_STATUS_PENDING) {
+            return rc;
+        }
     }
 
-    if(timeout_time <= time_ms()) {
-        pdebug(DEBUG_WARN, "Timed out waiting to send data!");
+    if(session->exchange_deadline < time_ms()) {
+        pdebug(DEBUG_WARN, "Timed out waiting for response!");
+
+        if(session->timeout_backoff < SESSION_MAX_TIMEOUT_BACKOFF) {
+            session->timeout_backoff++;
+        }
+
         return PLCTAG_ERR_TIMEOUT;
     }
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    session_run_at(session, session->exchange_deadline);
+
+    pdebug(DEBUG_SPEW, "Done.");
 
-    return PLCTAG_STATUS_OK;
+    return PLCTAG_STATUS_PENDING;
 }
 
 
 
 /*
- * recv_eip_response
+ * start_forward_open
  *
- * Look at the passed session and read any data we can
- * to fill in a packet.  If we already have a full packet,
- * punt.
+ * If this PLC has been connected to before, use the same kind of
+ * Forward Open and packet size that worked then.  Otherwise try a
+ * Forward Open Extended first with a large packet if this is a
+ * Logix-class PLC.  check_forward_open() falls back from there.
  */
-int recv_eip_response(ab_session_p session, int timeout)
+int start_forward_open(ab_session_p session)
 {
-    uint32_t data_needed = 0;
-    int rc = PLCTAG_STATUS_OK;
-    int64_t timeout_time = 0;
+    int cached_use_ex = 0;
+    int cached_size = 0;
 
-    pdebug(DEBUG_DETAIL, "Starting.");
-
-    if(!session) {
-        pdebug(DEBUG_WARN, "Called with null session!");
-        return PLCTAG_ERR_NULL_PTR;
-    }
+    pdebug(DEBUG_INFO, "Starting.");
 
+    session->fo_use_ex = 1;
+    session->fo_retried = 0;
+    session->fo_cached = 0;
+    session->fo_payload_size_guess = session->max_payload_size;
 
-    if(timeout > 0) {
-        timeout_time = time_ms() + timeout;
-    } else {
-        timeout_time = INT64_MAX;
+    if(session->plc_type == AB_PROTOCOL_LGX && session->use_connected_msg) {
+        session->fo_payload_size_guess = MAX_CIP_MSG_SIZE_EX;
     }
 
-    session->data_offset = 0;
-    session->data_size = 0;
-    data_needed = sizeof(eip_encap);
-
-    do {
-        rc = socket_read(session->sock, session->data + session->data_offset,
-                         (int)(data_needed - session->data_offset));
-
-        if (rc < 0) {
-            /* error! */
-            pdebug(DEBUG_WARN, "Error reading socket! rc=%d", rc);
-            return rc;
-        } else {
-            session->data_offset += (uint32_t)rc;
-
-            /*pdebug_dump_bytes(session->debug, session->data, session->data_offset);*/
-
-            /* recalculate the amount of data needed if we have just completed the read of an encap header */
-            if(session->data_offset >= sizeof(eip_encap)) {
-                data_needed = (uint32_t)(sizeof(eip_encap) + le2h16(((eip_encap *)(session->data))->encap_length));
-
-                if(data_needed > session->data_capacity) {
-                    pdebug(DEBUG_WARN, "Packet response (%d) is larger than possible buffer size (%d)!", data_needed, session->data_capacity);
-                    return PLCTAG_ERR_TOO_LARGE;
-                }
-            }
-        }
-
-        /* did we get all the data? */
-        if(!session->terminating && session->data_offset < data_needed) {
-            /* do not hog the CPU */
-            sleep_ms(1);
-        }
-    } while(!session->terminating && session->data_offset < data_needed && timeout_time > time_ms());
+    if(payload_cache_lookup(session->host, session->path, &cached_use_ex, &cached_size) == PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_DETAIL, "Using cached %s packet size of %d.", (cached_use_ex ? "ForwardOpenEx" : "ForwardOpen"), cached_size);
 
-    if(session->terminating) {
-        pdebug(DEBUG_INFO, "Session is terminating, returning...");
-        return PLCTAG_ERR_ABORT;
+        session->fo_use_ex = cached_use_ex;
+        session->fo_cached = 1;
+        session->fo_payload_size_guess = cached_size;
     }
 
-    if(timeout_time <= time_ms()) {
-        pdebug(DEBUG_WARN, "Timed out waiting for data to read!");
-        return PLCTAG_ERR_TIMEOUT;
+    critical_block(session->mutex) {
+        session->fo_old_max_payload_size = session->max_payload_size;
+        session->max_payload_size = (uint16_t)session->fo_payload_size_guess;
     }
 
-    session->resp_seq_id = le2h64(((eip_encap *)(session->data))->encap_sender_context);
-    session->data_size = data_needed;
+    pdebug(DEBUG_INFO, "Done.");
 
-    rc = PLCTAG_STATUS_OK;
+    return (session->fo_use_ex ? send_forward_open_req_ex(session) : send_forward_open_req(session));
+}
 
-    pdebug(DEBUG_DETAIL, "request received all needed data (%d bytes of %d).", session->data_offset, data_needed);
 
-    pdebug_dump_bytes(DEBUG_DETAIL, session->data, (int)(session->data_offset));
 
-    /* check status. */
-    if(le2h32(((eip_encap *)(session->data))->encap_status) != AB_EIP_OK) {
-        rc = PLCTAG_ERR_BAD_STATUS;
+/*
+ * check_forward_open
+ *
+ * Wait for the Forward Open response.  If the PLC wants a smaller
+ * packet, try once more with the size it told us.  If it does not
+ * support the extended command, fall back to the old one.
+ */
+int check_forward_open(ab_session_p session)
+{
+    int rc = PLCTAG_STATUS_OK;
+
+    rc = exchange_eip_packet(session);
+    if(rc == PLCTAG_STATUS_PENDING) {
+        return rc;
     }
 
-    pdebug(DEBUG_DETAIL, "Done.");
+    pdebug(DEBUG_INFO, "Starting.");
 
-    return rc;
-}
+    if(rc == PLCTAG_STATUS_OK) {
+        rc = recv_forward_open_resp(session, (session->fo_use_ex ? &session->fo_payload_size_guess : NULL));
+    }
 
+    if(rc == PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_DETAIL, "ForwardOpen succeeded and maximum CIP packet size is %d.", session->max_payload_size);
+        payload_cache_store(session->host, session->path, session->fo_use_ex, session->max_payload_size);
+        return rc;
+    }
 
+    /* what worked before did not work now. */
+    if(session->fo_cached) {
+        payload_cache_forget(session->host, session->path);
+        session->fo_cached = 0;
+    }
 
-int perform_forward_open(ab_session_p session)
-{
-    int rc = PLCTAG_STATUS_OK;
-    int max_payload_size = session->max_payload_size;
+    /* put back the old size, the guess did not work. */
+    critical_block(session->mutex) {
+        session->max_payload_size = session->fo_old_max_payload_size;
+    }
 
-    pdebug(DEBUG_INFO, "Starting.");
+    if(rc == PLCTAG_ERR_TOO_LARGE && session->fo_use_ex && !session->fo_retried) {
+        /* we support the Forward Open Extended command, but we need to use a smaller size. */
+        pdebug(DEBUG_DETAIL, "ForwardOpenEx is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE_EX, session->fo_payload_size_guess);
 
-    do {
-        /*
-         * Try with a large packet if this is a Logix-class PLC
-         * and we are doing connected messaging.
-         */
+        session->fo_retried = 1;
 
-        if(session->plc_type == AB_PROTOCOL_LGX && session->use_connected_msg) {
-            max_payload_size = MAX_CIP_MSG_SIZE_EX;
+        critical_block(session->mutex) {
+            session->max_payload_size = (uint16_t)session->fo_payload_size_guess;
         }
 
-        rc = try_forward_open_ex(session, &max_payload_size);
-        if(rc == PLCTAG_ERR_TOO_LARGE) {
-            /* we support the Forward Open Extended command, but we need to use a smaller size. */
-            pdebug(DEBUG_DETAIL, "ForwardOpenEx is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE_EX, max_payload_size);
-
-            rc = try_forward_open_ex(session, &max_payload_size);
-            if(rc != PLCTAG_STATUS_OK) {
-                pdebug(DEBUG_WARN, "Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
-            } else {
-                pdebug(DEBUG_DETAIL, "ForwardOpenEx succeeded with packet size %d.", session->max_payload_size);
-            }
-        } else if(rc == PLCTAG_ERR_UNSUPPORTED) {
-            rc = try_forward_open(session);
-            if(rc == PLCTAG_ERR_TOO_LARGE) {
-                /* we support the Forward Open Extended command, but we need to use a smaller size. */
-                pdebug(DEBUG_DETAIL, "ForwardOpen is supported but packet size of %d is not, trying %d.", MAX_CIP_MSG_SIZE, session->max_payload_size);
+        rc = send_forward_open_req_ex(session);
+    } else if(rc == PLCTAG_ERR_UNSUPPORTED && session->fo_use_ex) {
+        pdebug(DEBUG_DETAIL, "ForwardOpenEx is not supported, trying ForwardOpen.");
 
-                rc = try_forward_open(session);
-                if(rc != PLCTAG_STATUS_OK) {
-                    pdebug(DEBUG_WARN, "Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
-                } else {
-                    pdebug(DEBUG_DETAIL, "ForwardOpen succeeded with packet size %d.", session->max_payload_size);
-                }
-            }
-        } /*else {
-            pdebug(DEBUG_WARN, "Unknown error! rc=%d", rc);
-        }*/
-    } while(0);
+        session->fo_use_ex = 0;
 
-    if(rc == PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_DETAIL, "ForwardOpen succeeded and maximum CIP packet size is %d.", session->max_payload_size);
+        rc = send_forward_open_req(session);
+    } else {
+        pdebug(DEBUG_WARN, "Unable to open connection to PLC (%s)!", plc_tag_decode_error(rc));
+        return rc;
     }
 
     pdebug(DEBUG_INFO, "Done.");
 
-    return rc;
+    return (rc == PLCTAG_STATUS_OK ? PLCTAG_STATUS_PENDING : rc);
 }
 
 
+
+/*
+ * perform_forward_close
+ *
+ * This blocks.  It is only used when the session is destroyed and
+ * is no longer run by an I/O thread.
+ */
 int perform_forward_close(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
@@ -1850,113 +5303,61 @@ int perform_forward_close(ab_session_p session)
             break;
         }
 
-        rc = recv_forward_close_resp(session);
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_DETAIL, "Forward close not received, %s!", plc_tag_decode_error(rc));
-            break;
+        while((rc = exchange_eip_packet(session)) == PLCTAG_STATUS_PENDING) {
+            sleep_ms(1);
         }
-    } while(0);
-
-    pdebug(DEBUG_INFO, "Done.");
-
-    return rc;
-}
-
-
-int try_forward_open_ex(ab_session_p session, int *packet_size_guess)
-{
-    int rc = PLCTAG_STATUS_OK;
-    ab_request_p req=NULL;
-    uint16_t old_max_payload_size = 0;
-
-
-    pdebug(DEBUG_INFO, "Starting.");
 
-    critical_block(session->mutex) {
-        old_max_payload_size = session->max_payload_size;
-        session->max_payload_size = (uint16_t)*packet_size_guess;
-    }
-
-    /* get a request buffer */
-    rc = session_create_request(session, 0, &req);
-
-    do {
         if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to get new request, %s!", plc_tag_decode_error(rc));
-            rc = 0;
-            break;
-        }
-
-        /* send the ForwardOpenEx command to the PLC */
-        if((rc = send_forward_open_req_ex(session)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to send ForwardOpenEx packet!");
+            pdebug(DEBUG_DETAIL, "Forward close not received, %s!", plc_tag_decode_error(rc));
             break;
         }
 
-        /* check for the ForwardOpen response. */
-        if((rc = recv_forward_open_resp(session, packet_size_guess)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to use ForwardOpen response!");
+        rc = recv_forward_close_resp(session);
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_DETAIL, "Forward close response not good, %s!", plc_tag_decode_error(rc));
             break;
         }
     } while(0);
 
-    if(req) {
-        req = rc_dec(req);
-    }
-
-    if(rc != PLCTAG_STATUS_OK) {
-        critical_block(session->mutex) {
-            session->max_payload_size = old_max_payload_size;
-        }
-    }
-
     pdebug(DEBUG_INFO, "Done.");
 
     return rc;
 }
 
 
-int try_forward_open(ab_session_p session)
+
+
+/*
+ * perform_pending_closes
+ *
+ * Close the connections of riders that went away just before their
+ * carrier.  This blocks like perform_forward_close().
+ */
+void perform_pending_closes(ab_session_p session)
 {
     int rc = PLCTAG_STATUS_OK;
-    ab_request_p req=NULL;
 
     pdebug(DEBUG_INFO, "Starting.");
 
-    /* get a request buffer */
-    rc = session_create_request(session, 0, &req);
-
-    do {
-        if(rc != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to get new request, %s!", plc_tag_decode_error(rc));
-            rc = 0;
-            break;
-        }
+    while(start_pending_close(session) == PLCTAG_STATUS_OK) {
+        start_eip_exchange(session, SESSION_FORWARD_CLOSE_TIMEOUT);
 
-        /* send the ForwardOpen command to the PLC */
-        if((rc = send_forward_open_req(session)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to send ForwardOpenEx packet!");
-            break;
+        while((rc = exchange_eip_packet(session)) == PLCTAG_STATUS_PENDING) {
+            sleep_ms(1);
         }
 
-        /* check for the ForwardOpen response. */
-        if((rc = recv_forward_open_resp(session, NULL)) != PLCTAG_STATUS_OK) {
-            pdebug(DEBUG_WARN, "Unable to use ForwardOpen response!");
+        if(rc != PLCTAG_STATUS_OK) {
+            pdebug(DEBUG_DETAIL, "Forward close not received, %s!", plc_tag_decode_error(rc));
             break;
         }
-    } while(0);
-
-    if(req) {
-        req = rc_dec(req);
     }
 
     pdebug(DEBUG_INFO, "Done.");
-
-    return rc;
 }
 
 
 
+
 int send_forward_open_req(ab_session_p session)
 {
     eip_forward_open_request_t *fo = NULL;
@@ -1965,12 +5366,12 @@ int send_forward_open_req(ab_session_p session)
 
     pdebug(DEBUG_INFO, "Starting");
 
-    mem_set(session->data, 0, (int)(sizeof(*fo) + session->conn_path_size));
+    mem_set(session->send_data, 0, (int)(sizeof(*fo) + session->conn_path_size));
 
-    fo = (eip_forward_open_request_t *)(session->data);
+    fo = (eip_forward_open_request_t *)(session->send_data);
 
     /* point to the end of the struct */
-    data = (session->data) + sizeof(eip_forward_open_request_t);
+    data = (session->send_data) + sizeof(eip_forward_open_request_t);
 
     /* set up the path information. */
     mem_copy(data, session->conn_path, session->conn_path_size);
@@ -2033,9 +5434,9 @@ int send_forward_open_req(ab_session_p session)
     fo->path_size = session->conn_path_size/2; /* size in 16-bit words */
 
     /* set the size of the request */
-    session->data_size = (uint32_t)(data - (session->data));
+    session->send_data_size = (uint32_t)(data - (session->send_data));
 
-    rc = send_eip_request(session, 0);
+    start_eip_exchange(session, session_timeout(session));
 
     pdebug(DEBUG_INFO, "Done");
 
@@ -2052,12 +5453,12 @@ int send_forward_open_req_ex(ab_session_p session)
 
     pdebug(DEBUG_INFO, "Starting");
 
-    mem_set(session->data, 0, (int)(sizeof(*fo) + session->conn_path_size));
+    mem_set(session->send_data, 0, (int)(sizeof(*fo) + session->conn_path_size));
 
-    fo = (eip_forward_open_request_ex_t *)(session->data);
+    fo = (eip_forward_open_request_ex_t *)(session->send_data);
 
     /* point to the end of the struct */
-    data = (session->data) + sizeof(eip_forward_open_request_ex_t);
+    data = (session->send_data) + sizeof(eip_forward_open_request_ex_t);
 
     /* set up the path information. */
     mem_copy(data, session->conn_path, session->conn_path_size);
@@ -2105,9 +5506,9 @@ int send_forward_open_req_ex(ab_session_p session)
     fo->path_size = session->conn_path_size/2; /* size in 16-bit words */
 
     /* set the size of the request */
-    session->data_size = (uint32_t)(data - (session->data));
+    session->send_data_size = (uint32_t)(data - (session->send_data));
 
-    rc = send_eip_request(session, SESSION_DEFAULT_TIMEOUT);
+    start_eip_exchange(session, session_timeout(session));
 
     pdebug(DEBUG_INFO, "Done");
 
@@ -2124,12 +5525,6 @@ int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
 
     pdebug(DEBUG_INFO, "Starting");
 
-    rc = recv_eip_response(session, 0);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to receive Forward Open response.");
-        return rc;
-    }
-
     fo_resp = (eip_forward_open_response_t *)(session->data);
 
     do {
@@ -2194,27 +5589,46 @@ int recv_forward_open_resp(ab_session_p session, int *max_payload_size_guess)
 
 
 int send_forward_close_req(ab_session_p session)
+{
+    pdebug(DEBUG_INFO, "Starting");
+
+    build_forward_close_req(session, session->conn_serial_number, session->conn_path, session->conn_path_size);
+
+    start_eip_exchange(session, SESSION_FORWARD_CLOSE_TIMEOUT);
+
+    pdebug(DEBUG_INFO, "Done");
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+/*
+ * build_forward_close_req
+ *
+ * Put a Forward Close for the connection with the passed serial number
+ * and path into the send buffer.  A carrier uses this to close the
+ * connections of riders that went away.
+ */
+void build_forward_close_req(ab_session_p session, uint16_t conn_serial_number, uint8_t *conn_path, uint8_t conn_path_size)
 {
     eip_forward_close_req_t *fo;
     uint8_t *data;
-    int rc = PLCTAG_STATUS_OK;
 
-    pdebug(DEBUG_INFO, "Starting");
-
-    fo = (eip_forward_close_req_t *)(session->data);
+    fo = (eip_forward_close_req_t *)(session->send_data);
 
     /* point to the end of the struct */
-    data = (session->data) + sizeof(eip_forward_close_req_t);
+    data = (session->send_data) + sizeof(eip_forward_close_req_t);
 
     /* set up the path information. */
-    mem_copy(data, session->conn_path, session->conn_path_size);
-    data += session->conn_path_size;
+    mem_copy(data, conn_path, conn_path_size);
+    data += conn_path_size;
 
     /* fill in the static parts */
 
     /* encap header parts */
     fo->encap_command = h2le16(AB_EIP_UNCONNECTED_SEND); /* 0x006F EIP Send RR Data command */
     fo->encap_length = h2le16((uint16_t)(data - (uint8_t *)(&fo->interface_handle))); /* total length of packet except for encap header */
+    fo->encap_session_handle = h2le32(session->session_handle);
     fo->encap_sender_context = h2le64(++session->session_seq_id);
     fo->router_timeout = h2le16(1);                       /* one second is enough ? */
 
@@ -2236,19 +5650,13 @@ int send_forward_close_req(ab_session_p session)
     /* Forward Open Params */
     fo->secs_per_tick = AB_EIP_SECS_PER_TICK;         /* seconds per tick, no used? */
     fo->timeout_ticks = AB_EIP_TIMEOUT_TICKS;         /* timeout = srd_secs_per_tick * src_timeout_ticks, not used? */
-    fo->conn_serial_number = h2le16(session->conn_serial_number); /* our connection SEQUENCE number. */
+    fo->conn_serial_number = h2le16(conn_serial_number); /* our connection SEQUENCE number. */
     fo->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);               /* our unique :-) vendor ID */
     fo->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);           /* our serial number. */
-    fo->path_size = session->conn_path_size/2; /* size in 16-bit words */
+    fo->path_size = conn_path_size/2; /* size in 16-bit words */
 
     /* set the size of the request */
-    session->data_size = (uint32_t)(data - (session->data));
-
-    rc = send_eip_request(session, 100);
-
-    pdebug(DEBUG_INFO, "Done");
-
-    return rc;
+    session->send_data_size = (uint32_t)(data - (session->send_data));
 }
 
 
@@ -2259,12 +5667,6 @@ int recv_forward_close_resp(ab_session_p session)
 
     pdebug(DEBUG_INFO, "Starting");
 
-    rc = recv_eip_response(session, 150);
-    if(rc != PLCTAG_STATUS_OK) {
-        pdebug(DEBUG_WARN, "Unable to receive Forward Close response, %s!", plc_tag_decode_error(rc));
-        return rc;
-    }
-
     fo_resp = (eip_forward_close_resp_t *)(session->data);
 
     do {
@@ -2301,9 +5703,10 @@ int recv_forward_close_resp(ab_session_p session)
 int session_create_request(ab_session_p session, int tag_id, ab_request_p *req)
 {
     int rc = PLCTAG_STATUS_OK;
-    ab_request_p res;
+    ab_request_p res = NULL;
     size_t request_capacity = 0;
     uint8_t *buffer = NULL;
+    request_pool_p pool = session->request_pool;
 
     critical_block(session->mutex) {
         request_capacity = (size_t)(session->max_payload_size + EIP_CIP_PREFIX_SIZE);
@@ -2311,6 +5714,39 @@ int session_create_request(ab_session_p session, int tag_id, ab_request_p *req)
 
     pdebug(DEBUG_DETAIL, "Starting.");
 
+    /* reuse a released request if there is one. */
+    if(pool) {
+        critical_block(pool->mutex) {
+            if(pool->num_free > 0) {
+                pool->num_free--;
+                res = pool->free_requests[pool->num_free];
+                pool->free_requests[pool->num_free] = NULL;
+            }
+        }
+    }
+
+    if(res) {
+        /* the payload size can go up after the Forward Open. */
+        if(res->request_capacity < (int)request_capacity) {
+            rc = session_request_increase_buffer(res, (int)request_capacity);
+            if(rc != PLCTAG_STATUS_OK) {
+                rc_dec(res);
+                *req = NULL;
+                return rc;
+            }
+        }
+
+        res->tag_id = tag_id;
+        res->priority = SESSION_PRIORITY_NORMAL;
+        res->sched_weight = SESSION_DEFAULT_SCHED_WEIGHT;
+
+        *req = res;
+
+        pdebug(DEBUG_DETAIL, "Done, reusing request %p.", res);
+
+        return PLCTAG_STATUS_OK;
+    }
+
     buffer = (uint8_t *)mem_alloc((int)request_capacity);
     if(!buffer) {
         pdebug(DEBUG_WARN, "Unable to allocate request buffer!");
@@ -2318,7 +5754,7 @@ int session_create_request(ab_session_p session, int tag_id, ab_request_p *req)
         return PLCTAG_ERR_NO_MEM;
     }
 
-    res = (ab_request_p)rc_alloc((int)sizeof(struct ab_request_t), request_destroy);
+    res = (ab_request_p)rc_alloc_recyclable((int)sizeof(struct ab_request_t), request_recycle, request_destroy);
     if (!res) {
         mem_free(buffer);
         *req = NULL;
@@ -2328,6 +5764,9 @@ int session_create_request(ab_session_p session, int tag_id, ab_request_p *req)
         res->tag_id = tag_id;
         res->request_capacity = (int)request_capacity;
         res->lock = LOCK_INIT;
+        res->priority = SESSION_PRIORITY_NORMAL;
+        res->sched_weight = SESSION_DEFAULT_SCHED_WEIGHT;
+        res->pool = rc_inc(pool);
 
         *req = res;
     }
@@ -2341,6 +5780,58 @@ int session_create_request(ab_session_p session, int tag_id, ab_request_p *req)
 
 
 
+/*
+ * request_recycle
+ *
+ * Called when the last reference to a request is released.  If the pool
+ * the request came from has room, the request and its buffer are cleared
+ * and kept for reuse.  Returns non-zero if it was kept.
+ *
+ * Once the request is in the pool, another thread can take it, so it
+ * must not be touched after the pool mutex is released.
+ */
+
+int request_recycle(void *req_arg)
+{
+    ab_request_p req = req_arg;
+    request_pool_p pool = req->pool;
+    int recycled = 0;
+
+    if(!pool) {
+        return 0;
+    }
+
+    critical_block(pool->mutex) {
+        if(!pool->closed && pool->num_free < SESSION_REQUEST_POOL_SIZE) {
+            uint8_t *data = req->data;
+            int request_capacity = req->request_capacity;
+
+            /* clear everything but the buffer and the pool. */
+            mem_set(req, 0, (int)sizeof(*req));
+            mem_set(data, 0, request_capacity);
+
+            req->data = data;
+            req->request_capacity = request_capacity;
+            req->lock = LOCK_INIT;
+            req->pool = pool;
+
+            if(rc_recycle(req)) {
+                pool->free_requests[pool->num_free] = req;
+                pool->num_free++;
+                recycled = 1;
+            }
+        }
+    }
+
+    if(recycled) {
+        pdebug(DEBUG_DETAIL, "Request kept for reuse.");
+    }
+
+    return recycled;
+}
+
+
+
 /*
  * request_destroy
  *
@@ -2360,10 +5851,81 @@ void request_destroy(void *req_arg)
         req->data = NULL;
     }
 
+    /* this may free the pool, so do it outside its mutex. */
+    req->pool = rc_dec(req->pool);
+
     pdebug(DEBUG_DETAIL, "Done.");
 }
 
 
+
+request_pool_p request_pool_create(void)
+{
+    request_pool_p pool = NULL;
+
+    pool = (request_pool_p)rc_alloc((int)sizeof(struct request_pool_t), request_pool_destroy);
+    if(!pool) {
+        pdebug(DEBUG_WARN, "Unable to allocate request pool!");
+        return NULL;
+    }
+
+    if(mutex_create(&pool->mutex) != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "Unable to create request pool mutex!");
+        rc_dec(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+
+
+/*
+ * request_pool_close
+ *
+ * Stop keeping requests and free the ones that are waiting for reuse.
+ * Each holds a reference to the pool, so this lets the pool go away
+ * once the last request in use is released.
+ */
+
+void request_pool_close(request_pool_p pool)
+{
+    ab_request_p free_requests[SESSION_REQUEST_POOL_SIZE] = {NULL};
+    int num_free = 0;
+
+    critical_block(pool->mutex) {
+        pool->closed = 1;
+
+        num_free = pool->num_free;
+
+        for(int i=0; i < num_free; i++) {
+            free_requests[i] = pool->free_requests[i];
+            pool->free_requests[i] = NULL;
+        }
+
+        pool->num_free = 0;
+    }
+
+    for(int i=0; i < num_free; i++) {
+        rc_dec(free_requests[i]);
+    }
+}
+
+
+
+void request_pool_destroy(void *pool_arg)
+{
+    request_pool_p pool = pool_arg;
+
+    if(pool->mutex) {
+        mutex_destroy(&pool->mutex);
+        pool->mutex = NULL;
+    }
+}
+
+
+
+
 int session_request_increase_buffer(ab_request_p request, int new_capacity)
 {
     uint8_t *old_buffer = NULL;
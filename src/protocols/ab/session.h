@@ -30,6 +30,7 @@
 
 #include <ab/ab_common.h>
 #include <ab/defs.h>
+#include <util/hashtable.h>
 #include <util/rc.h>
 #include <util/vector.h>
 
@@ -37,11 +38,85 @@
 
 #define SESSION_DEFAULT_TIMEOUT (2000)
 
+/*
+ * once round trips have been measured, timeouts follow them within these
+ * limits.  Each timeout in a row doubles the next one, up to the maximum.
+ * A late packet only times out its own requests.  The session is reset
+ * after SESSION_MAX_MISSED_RESPONSES late packets in a row.
+ */
+#define SESSION_MIN_TIMEOUT (200)
+#define SESSION_MAX_TIMEOUT (10000)
+#define SESSION_MAX_TIMEOUT_BACKOFF (4)
+#define SESSION_MAX_MISSED_RESPONSES (3)
+
+/*
+ * reconnect policy.  The first retry after a failure is immediate, then the
+ * wait doubles from the minimum up to the maximum, with jitter.
+ */
+#define SESSION_DEFAULT_RETRY_MIN_MS (1000)
+#define SESSION_DEFAULT_RETRY_MAX_MS (60000)
+#define SESSION_MAX_RETRY_MS (3600000)
+
+/* longest idle time between keepalive probes. */
+#define SESSION_MAX_KEEPALIVE_MS (3600000)
+
+/* reads in flight when the connection is lost are sent again if queued less than this long ago. */
+#define SESSION_REPLAY_WINDOW_MS (5000)
+
 #define MAX_PACKET_SIZE_EX  (44 + 4002)
 
+/* the most requests that can be packed into one packet. */
+#define MAX_REQUESTS (200)
+
+/*
+ * the most requests one response can answer.  Each packed request can
+ * have duplicate reads riding along, up to MAX_REQUESTS of them in all.
+ */
+#define MAX_PACKET_REQUESTS (2 * MAX_REQUESTS)
+
+/*
+ * how many queued requests the packer looks at when filling a packet, and
+ * how many times a request can be passed over before nothing behind it
+ * may be sent ahead of it.
+ */
+#define SESSION_PACK_LOOKAHEAD  (32)
+#define SESSION_PACK_MAX_SKIPS  (4)
+
+/* longest time a packet can be held back waiting for more requests. */
+#define SESSION_DEFAULT_PACK_LINGER_US (0)
+#define SESSION_MAX_PACK_LINGER_US (100000)
+
+/*
+ * queue limit and what to do with new requests when the queue is at it.
+ * A limit of zero means no limit.
+ */
+#define SESSION_MAX_QUEUED_REQUESTS (100000)
+#define SESSION_QUEUE_FULL_REJECT   (0)
+#define SESSION_QUEUE_FULL_COALESCE (1)
+#define SESSION_QUEUE_FULL_BLOCK    (2)
+
 #define SESSION_MIN_REQUESTS    (10)
 #define SESSION_INC_REQUESTS    (10)
 
+/* request priority classes, higher priority requests are sent first. */
+#define SESSION_PRIORITY_HIGH   (0)
+#define SESSION_PRIORITY_NORMAL (1)
+#define SESSION_NUM_PRIORITIES  (2)
+
+/*
+ * fair scheduling weights.  Each scheduling class, or tag not in a class,
+ * gets a share of the link in proportion to its weight.
+ */
+#define SESSION_DEFAULT_SCHED_WEIGHT (1)
+#define SESSION_MAX_SCHED_WEIGHT (100)
+
+/* most sessions a tag can spread its requests over. */
+#define SESSION_MAX_STRIPES (16)
+
+/* how many packets can be sent before we must wait for a response. */
+#define SESSION_DEFAULT_PACKETS_IN_FLIGHT (1)
+#define SESSION_MAX_PACKETS_IN_FLIGHT (32)
+
 
 struct ab_session_t {
 //    int status;
@@ -53,6 +128,32 @@ struct ab_session_t {
     char *path;
     sock_p sock;
 
+    /* which of the parallel sessions to this host and path this is. */
+    int stripe;
+
+    /*
+     * connected sessions to the same host can share one TCP connection
+     * and EIP registration.  The carrier owns the socket.  Each rider has
+     * its own Forward Open connection, but sends over the carrier's socket
+     * and gets its responses handed over by the carrier.  Riders run on the
+     * carrier's I/O thread, so the fields below are only touched there
+     * unless noted.
+     */
+    int share_tcp;
+    ab_session_p carrier;
+    vector_p riders;            /* under the mutex, no references held. */
+    int num_attached;           /* under the mutex. */
+    int riders_waiting;
+    uint32_t transport_gen;
+    uint32_t carrier_gen;
+    ab_session_p writer;        /* holds a reference if it is a rider. */
+    int writers_waiting;
+    int write_blocked;
+    int transport_broken;
+    int resp_ready;
+    int deliver_blocked;
+    vector_p pending_closes;    /* under the mutex. */
+
     /* connection variables. */
     int use_connected_msg;
     uint32_t orig_connection_id;
@@ -73,8 +174,56 @@ struct ab_session_t {
     /* Sequence ID for requests. */
     uint64_t session_seq_id;
 
-    /* list of outstanding requests for this session */
-    vector_p requests;
+    /*
+     * queued requests for this session, one heap per priority class with
+     * the request that finishes first on top.
+     */
+    struct {
+        ab_request_p *heap;
+        int len;
+        int capacity;
+    } queues[SESSION_NUM_PRIORITIES];
+    int num_queued;
+
+    /* virtual time of the fair scheduler, the finish time of the last request taken. */
+    uint64_t sched_vtime;
+
+    /* fair scheduler queueing order, and the sources with queued requests by key. */
+    uint64_t sched_seq;
+    hashtable_p sched_sources;
+
+    /* admission control.  API callers waiting for room in a full queue wait on queue_cond. */
+    int max_queued;
+    int queue_full_policy;
+    int queue_waiters;
+    cond_p queue_cond;
+
+    /* signalled when the session connects or starts backing off. */
+    cond_p state_cond;
+
+    /* released requests kept for reuse. */
+    struct request_pool_t *request_pool;
+
+    /* requests that have been sent and are waiting for a response. */
+    vector_p in_flight;
+    int packets_in_flight;
+    int max_packets_in_flight;
+
+    /* how long to wait for more requests before sending a part-full packet. */
+    int pack_linger_us;
+
+    /* data for sending messages */
+    uint32_t send_data_offset;
+    uint32_t send_data_size;
+    uint8_t send_data[MAX_PACKET_SIZE_EX];
+
+    /*
+     * the packet being sent, as pieces.  Packed requests are sent straight
+     * from the request buffers behind a header built in send_data.
+     */
+    socket_iovec_t send_iov[MAX_REQUESTS + 1];
+    int send_iov_count;
+    int send_iov_index;
 
     /* data for receiving messages */
     uint64_t resp_seq_id;
@@ -85,13 +234,66 @@ struct ab_session_t {
 
     uint64_t packet_count;
 
-    thread_p handler_thread;
-    int terminating;
+    /*
+     * keepalive probing of an idle connection.  Only the session that
+     * owns the socket probes.  Only touched by the I/O thread.
+     */
+    int keepalive_ms;
+    int64_t keepalive_time;
+    uint64_t keepalive_seq_id;
+    int64_t keepalive_sent_us;
+
+    /*
+     * smoothed round trip time and its mean deviation in microseconds,
+     * zero until the first response.  Only touched by the I/O thread.
+     */
+    int64_t srtt_us;
+    int64_t rttvar_us;
+    int timeout_backoff;
+    int missed_responses;
+
+    /* packing statistics, only touched by the I/O thread. */
+    uint64_t pack_packets;
+    uint64_t pack_requests;
+    uint64_t pack_bytes;
+    uint64_t pack_capacity;
+    uint64_t dedupe_count;
+    uint64_t shed_count;
+
     mutex_p mutex;
 
+    /* the I/O thread that runs this session's state machine. */
+    struct session_io_thread_t *io_thread;
+    int wakeup;
+    int64_t next_run_time;
+
+    /* state machine */
+    int state;
+    int64_t retry_time;
+
+    /*
+     * reconnect backoff.  While backed off, requests fail right away
+     * instead of queuing.  The flag is under the mutex.
+     */
+    int retry_count;
+    int retry_min_ms;
+    int retry_max_ms;
+    int retry_backoff;
+    int64_t exchange_deadline;
+    uint64_t exchange_seq_id;
+
+    /* Forward Open negotiation */
+    int fo_use_ex;
+    int fo_retried;
+    int fo_cached;
+    int fo_payload_size_guess;
+    uint16_t fo_old_max_payload_size;
+
     /* disconnect handling */
     int auto_disconnect_enabled;
     int auto_disconnect_timeout_ms;
+    int auto_disconnect;
+    int64_t auto_disconnect_time;
 };
 
 struct ab_request_t {
@@ -110,14 +312,75 @@ struct ab_request_t {
     /* allow requests to be packed in the session */
     int allow_packing;
     int packing_num;
-
-    /* time stamp for debugging output */
+    int pack_skips;
+
+    /* may be held back to fill the packet, and since when. */
+    int allow_linger;
+    int64_t time_queued_us;
+
+    /* a read that can share the response of an identical read. */
+    int allow_dedupe;
+
+    /* a read that can be sent again after a reconnect. */
+    int allow_replay;
+
+    /*
+     * set on the first request of a group that must go out in one packet,
+     * the number of requests in the group.  The rest follow it in the queue.
+     */
+    int group_count;
+
+    /*
+     * time in microseconds after which nobody waits for the answer, zero
+     * if there is no limit.  A request still queued by then is not sent.
+     */
+    int64_t deadline_us;
+
+    /*
+     * queueing, only used under the session mutex.  The index is the
+     * request's place in the heap of its priority class.  The link chains
+     * requests taken out of the queue.
+     */
+    int priority;
+    int queue_index;
+    ab_request_p next;
+
+    /*
+     * fair scheduling.  The class is zero if the request is scheduled with
+     * its tag's other requests.  The finish time and sequence number are
+     * set when it is queued.
+     */
+    int sched_class;
+    int sched_weight;
+    uint64_t sched_finish;
+    uint64_t sched_seq;
+    struct sched_source_t *sched_source;
+
+    /* sender context or connection sequence number of the packet this was sent in. */
+    uint64_t packet_seq_id;
+
+    /*
+     * time stamp in microseconds for round trip times and in-flight timeouts,
+     * taken when the whole packet has been written.  Zero until then.
+     */
     int64_t time_sent;
 
     /* used by the background thread for incrementally getting data */
     int request_size; /* total bytes, not just data */
     int request_capacity;
     uint8_t *data;
+
+    /*
+     * optional destination for read reply data.  If set, the session copies
+     * the data part of a read reply here instead of into the request buffer
+     * and sets resp_dest_len.  Only touched under the request lock.
+     */
+    uint8_t *resp_dest;
+    int resp_dest_size;
+    int resp_dest_len;
+
+    /* where to return the request when it is released. */
+    struct request_pool_t *pool;
 };
 
 
@@ -129,8 +392,19 @@ extern int session_startup();
 extern void session_teardown();
 
 extern int session_find_or_create(ab_session_p *session, attr attribs);
+extern int session_find_or_create_stripe(ab_session_p *session, attr attribs, const char *host, int stripe);
+extern ab_session_p session_pick_stripe(ab_session_p *stripes, int num_stripes);
+extern int session_hold(ab_session_p session);
+extern int session_status(ab_session_p session);
+extern int session_wait_status(ab_session_p session, int64_t timeout_time);
+extern int session_get_queue_depth(ab_session_p session);
+extern int session_get_queue_full_policy(ab_session_p session);
+extern int session_wait_for_room(ab_session_p session, int64_t deadline_us);
 extern int session_get_max_payload(ab_session_p session);
 extern int session_create_request(ab_session_p session, int tag_id, ab_request_p *request);
 extern int session_add_request(ab_session_p sess, ab_request_p req);
+extern int session_add_request_group(ab_session_p sess, ab_request_p *reqs, int num_reqs);
+extern void session_get_pack_stats(uint64_t *packets, uint64_t *requests, uint64_t *bytes, uint64_t *capacity);
+extern uint64_t session_get_shed_count(void);
 
 #endif
@@ -33,6 +33,9 @@
 #define MAX_TAG_TYPE_INFO   (64)
 #define MAX_CONN_PATH       (260)   /* 256 plus padding. */
 
+/* most fragments of one read or write that are in flight at once. */
+#define MAX_FRAGS           (8)
+
 /* they are used in some of these includes */
 #include <lib/libplctag.h>
 #include <lib/tag.h>
@@ -69,6 +72,13 @@ struct ab_tag_t {
     ab_session_p session;
     int use_connected_msg;
 
+    /*
+     * the sessions this tag can use.  The tag holds the references,
+     * session points at the one the current operation uses.
+     */
+    ab_session_p stripes[SESSION_MAX_STRIPES];
+    int num_stripes;
+
     /* this contains the encoded name */
     uint8_t encoded_name[MAX_TAG_NAME];
     int encoded_name_size;
@@ -100,11 +110,49 @@ struct ab_tag_t {
     ab_request_p req;
     int offset;
 
+    /*
+     * a large connected read asks for several fragments at once.  req is
+     * the one at offset, frag_reqs are the ones after it in offset order.
+     * frag_size is the data in one fragment, taken from the first response,
+     * and frag_next_offset is where the next fragment to ask for starts.
+     * A parallel write uses frag_reqs the same way, but its offset is
+     * where the data of the next fragment to send starts.
+     */
+    ab_request_p frag_reqs[MAX_FRAGS];
+    int frag_offsets[MAX_FRAGS];
+    int num_frag_reqs;
+    int frag_size;
+    int frag_next_offset;
+
     int allow_packing;
 
+    /* let the session hold this tag's requests back to fill packets. */
+    int allow_linger;
+
+    /* send all the fragments of a large write without waiting for each. */
+    int parallel_write;
+
+    /* priority class of the read requests, writes are always high. */
+    int priority;
+
+    /* fair scheduling class, zero to be scheduled on its own, and weight. */
+    int sched_class;
+    int sched_weight;
+
     /* flags for operations */
     int read_in_progress;
     int write_in_progress;
+
+    /*
+     * read groups.  group_read is set on a tag whose read was started by
+     * another member of its group, group_read_leader on the tag that
+     * started it and must complete the others.
+     */
+    int group_read;
+    int group_read_leader;
+
+    /* the next request of the operation in progress is waiting for room in the queue. */
+    int queue_full_retry;
     /*int connect_in_progress;*/
 };
 
@@ -25,6 +25,7 @@
 #include <lib/libplctag.h>
 #include <lib/version.h>
 #include <system/tag.h>
+#include <system/system.h>
 #include <lib/init.h>
 #include <util/rc.h>
 
@@ -40,6 +41,7 @@ struct tag_vtable_t {
 */
 
 static void system_tag_destroy(plc_tag_p tag);
+static system_stats_func find_stats(const char *name);
 
 
 static int system_tag_abort(plc_tag_p tag);
@@ -52,10 +54,22 @@ struct tag_vtable_t system_tag_vtable = {
         /* read */      system_tag_read,
         /* status */    system_tag_status,
         /* tickler */   (tag_vtable_func)(intptr_t)(0),
-        /* write */     system_tag_write
+        /* write */     system_tag_write,
+        /* queue depth */ (tag_vtable_func)(intptr_t)(0),
+        /* wait for room */ (tag_vtable_func)(intptr_t)(0)
     };
 
 
+/* statistics registered by the protocols. */
+#define MAX_SYSTEM_STATS (8)
+
+static lock_t stats_lock = LOCK_INIT;
+static struct {
+    char name[MAX_SYSTEM_TAG_NAME];
+    system_stats_func stats;
+} system_stats[MAX_SYSTEM_STATS];
+
+
 plc_tag_p system_tag_create(attr attribs)
 {
     system_tag_p tag = NULL;
@@ -76,7 +90,7 @@ plc_tag_p system_tag_create(attr attribs)
      * we have a vehicle for returning status.
      */
 
-    tag = (system_tag_p)rc_alloc(sizeof(struct system_tag_t), (rc_cleanup_func)system_tag_destroy);
+    tag = (system_tag_p)plc_tag_alloc(sizeof(struct system_tag_t), (tag_destroy_func)system_tag_destroy);
 
     if(!tag) {
         pdebug(DEBUG_ERROR,"Unable to allocate memory for system tag!");
@@ -131,6 +145,7 @@ static void system_tag_destroy(plc_tag_p ptag)
 static int system_tag_read(plc_tag_p ptag)
 {
     system_tag_p tag = (system_tag_p)ptag;
+    system_stats_func stats = NULL;
 
     pdebug(DEBUG_INFO,"Starting.");
 
@@ -154,6 +169,31 @@ static int system_tag_read(plc_tag_p ptag)
         return PLCTAG_STATUS_OK;
     }
 
+    /* number of heap allocations so far, for checking that polling does not allocate. */
+    if(str_cmp_i(&tag->name[0],"mem_alloc_count") == 0) {
+        uint32_t count = mem_alloc_count();
+        tag->data[0] = (uint8_t)(count & 0xFF);
+        tag->data[1] = (uint8_t)((count >> 8) & 0xFF);
+        tag->data[2] = (uint8_t)((count >> 16) & 0xFF);
+        tag->data[3] = (uint8_t)((count >> 24) & 0xFF);
+        return PLCTAG_STATUS_OK;
+    }
+
+    /* statistics published by a protocol. */
+    stats = find_stats(&tag->name[0]);
+    if(stats) {
+        uint64_t values[MAX_SYSTEM_TAG_SIZE / 8] = {0};
+        int num_values = stats(&values[0], MAX_SYSTEM_TAG_SIZE / 8);
+
+        for(int i=0; i < num_values; i++) {
+            for(int j=0; j < 8; j++) {
+                tag->data[(i*8) + j] = (uint8_t)((values[i] >> (j*8)) & 0xFF);
+            }
+        }
+
+        return PLCTAG_STATUS_OK;
+    }
+
     pdebug(DEBUG_WARN,"Unknown system tag %s", tag->name);
     return PLCTAG_ERR_UNSUPPORTED;
 }
@@ -179,6 +219,16 @@ static int system_tag_write(plc_tag_p ptag)
         return PLCTAG_ERR_NOT_IMPLEMENTED;
     }
 
+    /* so is the allocation count */
+    if(str_cmp_i(&tag->name[0],"mem_alloc_count") == 0) {
+        return PLCTAG_ERR_NOT_IMPLEMENTED;
+    }
+
+    /* and the protocol statistics */
+    if(find_stats(&tag->name[0])) {
+        return PLCTAG_ERR_NOT_IMPLEMENTED;
+    }
+
     if(str_cmp_i(&tag->name[0],"debug") == 0) {
         int res = 0;
         res = (int32_t)(((uint32_t)(tag->data[0])) +
@@ -193,3 +243,87 @@ static int system_tag_write(plc_tag_p ptag)
     return PLCTAG_ERR_NOT_IMPLEMENTED;
 }
 
+
+
+/*
+ * system_tag_register_stats
+ *
+ * Publish a protocol's statistics as the named system tag.
+ */
+int system_tag_register_stats(const char *name, system_stats_func stats)
+{
+    int rc = PLCTAG_ERR_NO_RESOURCES;
+
+    if(!name || !stats) {
+        return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(str_length(name) >= MAX_SYSTEM_TAG_NAME) {
+        pdebug(DEBUG_WARN, "Statistics name %s is too long!", name);
+        return PLCTAG_ERR_TOO_LARGE;
+    }
+
+    spin_block(&stats_lock) {
+        for(int i=0; i < MAX_SYSTEM_STATS; i++) {
+            if(!system_stats[i].stats || str_cmp_i(system_stats[i].name, name) == 0) {
+                str_copy(system_stats[i].name, MAX_SYSTEM_TAG_NAME, name);
+                system_stats[i].stats = stats;
+                rc = PLCTAG_STATUS_OK;
+                break;
+            }
+        }
+    }
+
+    if(rc != PLCTAG_STATUS_OK) {
+        pdebug(DEBUG_WARN, "No room to register statistics %s!", name);
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * system_tag_unregister_stats
+ *
+ * Stop publishing the named statistics.
+ */
+void system_tag_unregister_stats(const char *name)
+{
+    if(!name) {
+        return;
+    }
+
+    spin_block(&stats_lock) {
+        for(int i=0; i < MAX_SYSTEM_STATS; i++) {
+            if(system_stats[i].stats && str_cmp_i(system_stats[i].name, name) == 0) {
+                system_stats[i].stats = NULL;
+                system_stats[i].name[0] = 0;
+                break;
+            }
+        }
+    }
+}
+
+
+
+/*
+ * find_stats
+ *
+ * The function publishing the named statistics, NULL if there is none.
+ */
+system_stats_func find_stats(const char *name)
+{
+    system_stats_func stats = NULL;
+
+    spin_block(&stats_lock) {
+        for(int i=0; i < MAX_SYSTEM_STATS; i++) {
+            if(system_stats[i].stats && str_cmp_i(system_stats[i].name, name) == 0) {
+                stats = system_stats[i].stats;
+                break;
+            }
+        }
+    }
+
+    return stats;
+}
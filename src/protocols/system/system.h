@@ -28,4 +28,14 @@
 
 extern plc_tag_p system_tag_create(attr attribs);
 
+/*
+ * Protocols publish their statistics as read-only system tags.  The
+ * function fills in at most max_values counters and returns how many
+ * it filled in.  They are read as 64-bit little-endian values.
+ */
+typedef int (*system_stats_func)(uint64_t *values, int max_values);
+
+extern int system_tag_register_stats(const char *name, system_stats_func stats);
+extern void system_tag_unregister_stats(const char *name);
+
 #endif
@@ -27,7 +27,7 @@
 #include <lib/tag.h>
 
 #define MAX_SYSTEM_TAG_NAME (20)
-#define MAX_SYSTEM_TAG_SIZE (30)
+#define MAX_SYSTEM_TAG_SIZE (32)
 
 struct system_tag_t {
     /*struct plc_tag_t p_tag;*/
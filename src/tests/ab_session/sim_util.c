@@ -0,0 +1,218 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "../../lib/libplctag.h"
+#include "sim_util.h"
+
+#define SIM_START_TIMEOUT_MS (5000)
+
+static pid_t sim_pid = -1;
+
+static int sim_listening(void);
+
+
+void check_failed(const char *file, int line, const char *cond, const char *fmt, ...)
+{
+    va_list va;
+
+    fprintf(stderr, "%s:%d: check failed: %s: ", file, line, cond);
+
+    va_start(va, fmt);
+    vfprintf(stderr, fmt, va);
+    va_end(va);
+
+    fprintf(stderr, "\n");
+
+    sim_stop();
+
+    exit(1);
+}
+
+
+
+/*
+ * sim_start
+ *
+ * Start the simulator with one extra option, or none if option is NULL,
+ * and wait until it takes connections.  Its own output is thrown away.
+ */
+int sim_start(const char *sim_path, const char *option)
+{
+    int64_t timeout_time = now_ms() + SIM_START_TIMEOUT_MS;
+
+    sim_pid = fork();
+
+    if(sim_pid < 0) {
+        fprintf(stderr, "Unable to start the simulator!\n");
+        return 0;
+    }
+
+    if(sim_pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+
+        if(null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            close(null_fd);
+        }
+
+        execl(sim_path, sim_path, option, (char *)NULL);
+
+        _exit(127);
+    }
+
+    while(now_ms() < timeout_time) {
+        if(sim_listening()) {
+            return 1;
+        }
+
+        if(waitpid(sim_pid, NULL, WNOHANG) == sim_pid) {
+            fprintf(stderr, "The simulator %s exited at startup!\n", sim_path);
+            sim_pid = -1;
+            return 0;
+        }
+
+        sleep_ms(10);
+    }
+
+    fprintf(stderr, "The simulator did not start listening in time!\n");
+
+    sim_stop();
+
+    return 0;
+}
+
+
+
+void sim_stop(void)
+{
+    if(sim_pid > 0) {
+        kill(sim_pid, SIGKILL);
+        waitpid(sim_pid, NULL, 0);
+        sim_pid = -1;
+    }
+}
+
+
+
+int sim_listening(void)
+{
+    struct sockaddr_in addr;
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int rc = 0;
+
+    if(sock < 0) {
+        return 0;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(SIM_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    rc = (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+    close(sock);
+
+    return rc;
+}
+
+
+
+void sleep_ms(int ms)
+{
+    struct timespec wait_time;
+
+    wait_time.tv_sec = ms / 1000;
+    wait_time.tv_nsec = (long)(ms % 1000) * 1000000L;
+
+    while(nanosleep(&wait_time, &wait_time) != 0) { }
+}
+
+
+
+int64_t now_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+
+/*
+ * wait_for_status
+ *
+ * Wait for an operation started without a timeout to finish.  Returns its
+ * status, or PLCTAG_ERR_TIMEOUT if it is still pending after timeout_ms.
+ */
+int wait_for_status(int32_t tag, int timeout_ms)
+{
+    int64_t timeout_time = now_ms() + timeout_ms;
+    int rc = plc_tag_status(tag);
+
+    while(rc == PLCTAG_STATUS_PENDING && now_ms() < timeout_time) {
+        sleep_ms(1);
+        rc = plc_tag_status(tag);
+    }
+
+    return (rc == PLCTAG_STATUS_PENDING ? PLCTAG_ERR_TIMEOUT : rc);
+}
+
+
+
+/*
+ * get_pack_stat
+ *
+ * Read one of the library-wide packing counters: 0 for packets sent,
+ * 1 for the requests in them, 2 for the payload bytes used and 3 for the
+ * payload bytes available.
+ */
+uint64_t get_pack_stat(int index)
+{
+    int32_t tag = plc_tag_create("make=system&family=library&name=pack_stats", 1000);
+    uint64_t value = 0;
+
+    CHECK(tag >= 0, "unable to create the pack_stats tag, %s", plc_tag_decode_error(tag));
+    CHECK(plc_tag_read(tag, 1000) == PLCTAG_STATUS_OK, "unable to read the pack_stats tag");
+
+    value = plc_tag_get_uint64(tag, index * 8);
+
+    plc_tag_destroy(tag);
+
+    return value;
+}
@@ -0,0 +1,57 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#ifndef __TESTS_AB_SESSION_SIM_UTIL_H__
+#define __TESTS_AB_SESSION_SIM_UTIL_H__
+
+#include <stdint.h>
+
+/*
+ * Helpers for the tests that run the AB session code against the Logix
+ * simulator.  Each test gets the path to lgx_sim as its first argument
+ * and starts its own copy.  The simulator listens on the standard EIP
+ * port, so the tests cannot run at the same time.
+ */
+
+#define SIM_PORT (44818)
+
+/* tag attributes for the simulator, add the name and the rest. */
+#define SIM_TAG_ATTRS "protocol=ab-eip&gateway=127.0.0.1&path=1,0&cpu=LGX&elem_size=4"
+
+/* the simulator fills its DINT arrays with 100 + the element index. */
+#define SIM_DINT_VALUE(index) (100 + (index))
+
+/* TestBigArray has this many DINTs, more than fit in one packet. */
+#define SIM_BIG_ARRAY_ELEMS (1000)
+
+/* fail the test with a message if the condition does not hold. */
+#define CHECK(cond, ...) do { if(!(cond)) { check_failed(__FILE__, __LINE__, #cond, __VA_ARGS__); } } while(0)
+
+extern void check_failed(const char *file, int line, const char *cond, const char *fmt, ...);
+
+extern int sim_start(const char *sim_path, const char *option);
+extern void sim_stop(void);
+
+extern void sleep_ms(int ms);
+extern int64_t now_ms(void);
+extern int wait_for_status(int32_t tag, int timeout_ms);
+extern uint64_t get_pack_stat(int index);
+
+#endif
@@ -0,0 +1,128 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/*
+ * Identical reads from different tag handles share one request on the
+ * wire.  Every handle must still get its own copy of the data, and a
+ * handle reading a different number of elements must not be answered
+ * from the shared reply.
+ */
+
+#include <stdio.h>
+#include "../../lib/libplctag.h"
+#include "sim_util.h"
+
+#define NUM_SAME_TAGS (8)
+#define SAME_ELEMS (4)
+#define OTHER_ELEMS (6)
+#define NUM_ROUNDS (50)
+#define TIMEOUT_MS (5000)
+
+#define PACK_STAT_REQUESTS (1)
+
+static void check_values(int32_t tag, int elems, int round, const char *what);
+
+int main(int argc, char **argv)
+{
+    int32_t same_tags[NUM_SAME_TAGS];
+    int32_t other_tag = 0;
+    char attrs[256];
+    uint64_t requests = 0;
+    uint64_t reads = 0;
+
+    CHECK(argc > 1, "usage: %s <path to lgx_sim>", argv[0]);
+    CHECK(sim_start(argv[1], NULL), "unable to start the simulator");
+
+    snprintf(attrs, sizeof(attrs), SIM_TAG_ATTRS "&elem_count=%d&name=TestDINTArray&max_packets_in_flight=1", SAME_ELEMS);
+
+    for(int i=0; i < NUM_SAME_TAGS; i++) {
+        same_tags[i] = plc_tag_create(attrs, TIMEOUT_MS);
+        CHECK(same_tags[i] >= 0, "unable to create tag %d, %s", i, plc_tag_decode_error(same_tags[i]));
+    }
+
+    snprintf(attrs, sizeof(attrs), SIM_TAG_ATTRS "&elem_count=%d&name=TestDINTArray&max_packets_in_flight=1", OTHER_ELEMS);
+
+    other_tag = plc_tag_create(attrs, TIMEOUT_MS);
+    CHECK(other_tag >= 0, "unable to create the other tag, %s", plc_tag_decode_error(other_tag));
+
+    requests = get_pack_stat(PACK_STAT_REQUESTS);
+
+    for(int round=0; round < NUM_ROUNDS; round++) {
+        int rc = PLCTAG_STATUS_OK;
+
+        /* clear the buffers so that a read that was never answered shows up. */
+        for(int i=0; i < NUM_SAME_TAGS; i++) {
+            plc_tag_set_int32(same_tags[i], 0, 0);
+        }
+
+        plc_tag_set_int32(other_tag, (OTHER_ELEMS - 1) * 4, 0);
+
+        for(int i=0; i < NUM_SAME_TAGS; i++) {
+            rc = plc_tag_read(same_tags[i], 0);
+            CHECK(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK, "round %d, read of tag %d failed to start, %s", round, i, plc_tag_decode_error(rc));
+            reads++;
+
+            if(i == NUM_SAME_TAGS / 2) {
+                rc = plc_tag_read(other_tag, 0);
+                CHECK(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK, "round %d, read of the other tag failed to start, %s", round, plc_tag_decode_error(rc));
+                reads++;
+            }
+        }
+
+        for(int i=0; i < NUM_SAME_TAGS; i++) {
+            rc = wait_for_status(same_tags[i], TIMEOUT_MS);
+            CHECK(rc == PLCTAG_STATUS_OK, "round %d, read of tag %d failed, %s", round, i, plc_tag_decode_error(rc));
+            check_values(same_tags[i], SAME_ELEMS, round, "shared read");
+        }
+
+        rc = wait_for_status(other_tag, TIMEOUT_MS);
+        CHECK(rc == PLCTAG_STATUS_OK, "round %d, read of the other tag failed, %s", round, plc_tag_decode_error(rc));
+        check_values(other_tag, OTHER_ELEMS, round, "other read");
+    }
+
+    requests = get_pack_stat(PACK_STAT_REQUESTS) - requests;
+
+    printf("%llu reads sent %llu requests.\n", (unsigned long long)reads, (unsigned long long)requests);
+
+    CHECK(requests < reads, "no reads were shared, %llu requests for %llu reads", (unsigned long long)requests, (unsigned long long)reads);
+
+    for(int i=0; i < NUM_SAME_TAGS; i++) {
+        plc_tag_destroy(same_tags[i]);
+    }
+
+    plc_tag_destroy(other_tag);
+
+    sim_stop();
+
+    printf("All dedupe tests passed.\n");
+
+    return 0;
+}
+
+
+void check_values(int32_t tag, int elems, int round, const char *what)
+{
+    CHECK(plc_tag_get_size(tag) == elems * 4, "round %d, %s has size %d", round, what, plc_tag_get_size(tag));
+
+    for(int i=0; i < elems; i++) {
+        int32_t val = plc_tag_get_int32(tag, i * 4);
+
+        CHECK(val == SIM_DINT_VALUE(i), "round %d, %s element %d is %d", round, what, i, val);
+    }
+}
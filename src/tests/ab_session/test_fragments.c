@@ -0,0 +1,161 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/*
+ * Reads and writes of a tag too big for one packet.  The simulator only
+ * grants a small connection size, so the operations are split into many
+ * fragments, several of which are in flight at once.  The fragments must
+ * land at the right offsets whether they come back in order or not.
+ */
+
+#include <stdio.h>
+#include "../../lib/libplctag.h"
+#include "sim_util.h"
+
+#define NUM_ROUNDS (20)
+#define TIMEOUT_MS (5000)
+
+#define BIG_ARRAY_ATTRS SIM_TAG_ATTRS "&elem_count=1000&name=TestBigArray&max_packets_in_flight=4"
+
+/* the pattern written in each round of the write tests. */
+#define WRITE_VALUE(index, round) ((index) * 7 + (round))
+
+static void clear_tag(int32_t tag);
+static void check_sim_values(int32_t tag, int round, const char *what);
+static void test_writes(int32_t write_tag, int32_t read_tag);
+
+int main(int argc, char **argv)
+{
+    int32_t tag = 0;
+    int32_t other_tag = 0;
+
+    CHECK(argc > 1, "usage: %s <path to lgx_sim>", argv[0]);
+    CHECK(sim_start(argv[1], "--max-connection-size=508"), "unable to start the simulator");
+
+    tag = plc_tag_create(BIG_ARRAY_ATTRS, TIMEOUT_MS);
+    CHECK(tag >= 0, "unable to create the tag, %s", plc_tag_decode_error(tag));
+
+    other_tag = plc_tag_create(BIG_ARRAY_ATTRS, TIMEOUT_MS);
+    CHECK(other_tag >= 0, "unable to create the second tag, %s", plc_tag_decode_error(other_tag));
+
+    CHECK(plc_tag_get_size(tag) == SIM_BIG_ARRAY_ELEMS * 4, "tag size is %d", plc_tag_get_size(tag));
+
+    for(int round=0; round < NUM_ROUNDS; round++) {
+        int rc = PLCTAG_STATUS_OK;
+
+        /* a blocking read. */
+        clear_tag(tag);
+
+        rc = plc_tag_read(tag, TIMEOUT_MS);
+        CHECK(rc == PLCTAG_STATUS_OK, "round %d, blocking read failed, %s", round, plc_tag_decode_error(rc));
+        check_sim_values(tag, round, "blocking read");
+
+        /* two fragmented reads sharing the session at once. */
+        clear_tag(tag);
+        clear_tag(other_tag);
+
+        rc = plc_tag_read(tag, 0);
+        CHECK(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK, "round %d, read failed to start, %s", round, plc_tag_decode_error(rc));
+
+        rc = plc_tag_read(other_tag, 0);
+        CHECK(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK, "round %d, second read failed to start, %s", round, plc_tag_decode_error(rc));
+
+        rc = wait_for_status(tag, TIMEOUT_MS);
+        CHECK(rc == PLCTAG_STATUS_OK, "round %d, read failed, %s", round, plc_tag_decode_error(rc));
+        check_sim_values(tag, round, "read");
+
+        rc = wait_for_status(other_tag, TIMEOUT_MS);
+        CHECK(rc == PLCTAG_STATUS_OK, "round %d, second read failed, %s", round, plc_tag_decode_error(rc));
+        check_sim_values(other_tag, round, "second read");
+    }
+
+    plc_tag_destroy(tag);
+
+    /* the writes change the simulator's values, so they go last. */
+    tag = plc_tag_create(BIG_ARRAY_ATTRS "&parallel_write=1", TIMEOUT_MS);
+    CHECK(tag >= 0, "unable to create the write tag, %s", plc_tag_decode_error(tag));
+
+    test_writes(tag, other_tag);
+
+    plc_tag_destroy(tag);
+    plc_tag_destroy(other_tag);
+
+    sim_stop();
+
+    printf("All fragment tests passed.\n");
+
+    return 0;
+}
+
+
+/*
+ * Write a different pattern each round with the fragments sent in
+ * parallel, then read it back through another handle.
+ */
+void test_writes(int32_t write_tag, int32_t read_tag)
+{
+    for(int round=0; round < NUM_ROUNDS; round++) {
+        int rc = PLCTAG_STATUS_OK;
+
+        for(int i=0; i < SIM_BIG_ARRAY_ELEMS; i++) {
+            plc_tag_set_int32(write_tag, i * 4, WRITE_VALUE(i, round));
+        }
+
+        /* alternate blocking and non-blocking writes. */
+        if(round % 2) {
+            rc = plc_tag_write(write_tag, 0);
+            CHECK(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK, "round %d, write failed to start, %s", round, plc_tag_decode_error(rc));
+
+            rc = wait_for_status(write_tag, TIMEOUT_MS);
+        } else {
+            rc = plc_tag_write(write_tag, TIMEOUT_MS);
+        }
+
+        CHECK(rc == PLCTAG_STATUS_OK, "round %d, write failed, %s", round, plc_tag_decode_error(rc));
+
+        clear_tag(read_tag);
+
+        rc = plc_tag_read(read_tag, TIMEOUT_MS);
+        CHECK(rc == PLCTAG_STATUS_OK, "round %d, read back failed, %s", round, plc_tag_decode_error(rc));
+
+        for(int i=0; i < SIM_BIG_ARRAY_ELEMS; i++) {
+            int32_t val = plc_tag_get_int32(read_tag, i * 4);
+
+            CHECK(val == WRITE_VALUE(i, round), "round %d, written element %d reads back as %d", round, i, val);
+        }
+    }
+}
+
+
+void clear_tag(int32_t tag)
+{
+    for(int i=0; i < SIM_BIG_ARRAY_ELEMS; i++) {
+        plc_tag_set_int32(tag, i * 4, 0);
+    }
+}
+
+
+void check_sim_values(int32_t tag, int round, const char *what)
+{
+    for(int i=0; i < SIM_BIG_ARRAY_ELEMS; i++) {
+        int32_t val = plc_tag_get_int32(tag, i * 4);
+
+        CHECK(val == SIM_DINT_VALUE(i), "round %d, %s element %d is %d", round, what, i, val);
+    }
+}
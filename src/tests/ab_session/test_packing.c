@@ -0,0 +1,99 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/*
+ * Requests packed into Multiple Service Packets.  Only one packet may be
+ * in flight, so reads started together queue up behind the first one and
+ * must be packed.  Each tag reads a different element to catch replies
+ * split out to the wrong request.
+ */
+
+#include <stdio.h>
+#include "../../lib/libplctag.h"
+#include "sim_util.h"
+
+#define NUM_TAGS (20)
+#define NUM_ROUNDS (50)
+#define TIMEOUT_MS (5000)
+
+#define PACK_STAT_PACKETS (0)
+#define PACK_STAT_REQUESTS (1)
+#define PACK_STAT_BYTES (2)
+#define PACK_STAT_CAPACITY (3)
+
+int main(int argc, char **argv)
+{
+    int32_t tags[NUM_TAGS];
+    char attrs[256];
+    uint64_t packets = 0;
+    uint64_t requests = 0;
+    uint64_t bytes = 0;
+    uint64_t capacity = 0;
+
+    CHECK(argc > 1, "usage: %s <path to lgx_sim>", argv[0]);
+    CHECK(sim_start(argv[1], NULL), "unable to start the simulator");
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        snprintf(attrs, sizeof(attrs), SIM_TAG_ATTRS "&elem_count=1&name=TestBigArray[%d]&allow_packing=1&max_packets_in_flight=1", i);
+
+        tags[i] = plc_tag_create(attrs, TIMEOUT_MS);
+        CHECK(tags[i] >= 0, "unable to create tag %d, %s", i, plc_tag_decode_error(tags[i]));
+    }
+
+    packets = get_pack_stat(PACK_STAT_PACKETS);
+    requests = get_pack_stat(PACK_STAT_REQUESTS);
+    bytes = get_pack_stat(PACK_STAT_BYTES);
+    capacity = get_pack_stat(PACK_STAT_CAPACITY);
+
+    for(int round=0; round < NUM_ROUNDS; round++) {
+        for(int i=0; i < NUM_TAGS; i++) {
+            int rc = plc_tag_read(tags[i], 0);
+            CHECK(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK, "round %d, read of tag %d failed to start, %s", round, i, plc_tag_decode_error(rc));
+        }
+
+        for(int i=0; i < NUM_TAGS; i++) {
+            int rc = wait_for_status(tags[i], TIMEOUT_MS);
+            CHECK(rc == PLCTAG_STATUS_OK, "round %d, read of tag %d failed, %s", round, i, plc_tag_decode_error(rc));
+            CHECK(plc_tag_get_int32(tags[i], 0) == SIM_DINT_VALUE(i), "round %d, tag %d read %d", round, i, plc_tag_get_int32(tags[i], 0));
+        }
+    }
+
+    packets = get_pack_stat(PACK_STAT_PACKETS) - packets;
+    requests = get_pack_stat(PACK_STAT_REQUESTS) - requests;
+    bytes = get_pack_stat(PACK_STAT_BYTES) - bytes;
+    capacity = get_pack_stat(PACK_STAT_CAPACITY) - capacity;
+
+    printf("%llu requests in %llu packets, %llu of %llu bytes used.\n",
+           (unsigned long long)requests, (unsigned long long)packets,
+           (unsigned long long)bytes, (unsigned long long)capacity);
+
+    CHECK(requests >= (uint64_t)(NUM_TAGS * NUM_ROUNDS), "only %llu requests counted", (unsigned long long)requests);
+    CHECK(packets * 2 <= requests, "%llu requests took %llu packets", (unsigned long long)requests, (unsigned long long)packets);
+    CHECK(bytes > 0 && bytes <= capacity, "%llu bytes used of %llu", (unsigned long long)bytes, (unsigned long long)capacity);
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        plc_tag_destroy(tags[i]);
+    }
+
+    sim_stop();
+
+    printf("All packing tests passed.\n");
+
+    return 0;
+}
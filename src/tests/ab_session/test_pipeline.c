@@ -0,0 +1,78 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*
+ * Several packets in flight on one session.  Each tag reads a different
+ * element, so a response handed to the wrong request shows up as a wrong
+ * value.  Packing is off so that every read is a packet of its own.
+ */
+
+#include <stdio.h>
+#include "../../lib/libplctag.h"
+#include "sim_util.h"
+
+#define NUM_TAGS (10)
+#define NUM_ROUNDS (100)
+#define TIMEOUT_MS (5000)
+
+int main(int argc, char **argv)
+{
+    int32_t tags[NUM_TAGS];
+    char attrs[256];
+
+    CHECK(argc > 1, "usage: %s <path to lgx_sim>", argv[0]);
+    CHECK(sim_start(argv[1], NULL), "unable to start the simulator");
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        snprintf(attrs, sizeof(attrs), SIM_TAG_ATTRS "&elem_count=1&name=TestDINTArray[%d]&allow_packing=0&max_packets_in_flight=4", i);
+
+        tags[i] = plc_tag_create(attrs, TIMEOUT_MS);
+        CHECK(tags[i] >= 0, "unable to create tag %d, %s", i, plc_tag_decode_error(tags[i]));
+    }
+
+    for(int round=0; round < NUM_ROUNDS; round++) {
+        /* start all the reads so that they go out back to back. */
+        for(int i=0; i < NUM_TAGS; i++) {
+            int rc = plc_tag_read(tags[i], 0);
+            CHECK(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK, "round %d, read of tag %d failed to start, %s", round, i, plc_tag_decode_error(rc));
+        }
+
+        for(int i=0; i < NUM_TAGS; i++) {
+            int rc = wait_for_status(tags[i], TIMEOUT_MS);
+            CHECK(rc == PLCTAG_STATUS_OK, "round %d, read of tag %d failed, %s", round, i, plc_tag_decode_error(rc));
+            CHECK(plc_tag_get_int32(tags[i], 0) == SIM_DINT_VALUE(i), "round %d, tag %d read %d", round, i, plc_tag_get_int32(tags[i], 0));
+        }
+
+        /* a blocking read between the rounds shares the session with the others. */
+        CHECK(plc_tag_read(tags[round % NUM_TAGS], TIMEOUT_MS) == PLCTAG_STATUS_OK, "round %d, blocking read failed", round);
+        CHECK(plc_tag_get_int32(tags[round % NUM_TAGS], 0) == SIM_DINT_VALUE(round % NUM_TAGS), "round %d, blocking read got the wrong value", round);
+    }
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        plc_tag_destroy(tags[i]);
+    }
+
+    sim_stop();
+
+    printf("All pipelining tests passed.\n");
+
+    return 0;
+}
@@ -0,0 +1,204 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/*
+ * The queue full policies.  Each policy gets its own session by using a
+ * different loopback address for the simulator.  Only one packet may be
+ * in flight and only two requests may wait, so the queue fills quickly.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include "../../lib/libplctag.h"
+#include "sim_util.h"
+
+#define NUM_TAGS (20)
+#define NUM_ROUNDS (20)
+#define NUM_THREADS (8)
+#define TIMEOUT_MS (5000)
+
+/* like SIM_TAG_ATTRS, but with the gateway and queue policy filled in later. */
+#define QUEUE_TAG_ATTRS "protocol=ab-eip&gateway=%s&path=1,0&cpu=LGX&elem_size=4&max_packets_in_flight=1&max_queued_requests=2&queue_full=%s"
+
+static void test_reject(void);
+static void test_coalesce(void);
+static void test_block(void);
+static void *block_thread(void *arg);
+
+int main(int argc, char **argv)
+{
+    CHECK(argc > 1, "usage: %s <path to lgx_sim>", argv[0]);
+
+    /* the blocking test uses fragmented reads too. */
+    CHECK(sim_start(argv[1], "--max-connection-size=508"), "unable to start the simulator");
+
+    test_reject();
+    test_coalesce();
+    test_block();
+
+    sim_stop();
+
+    printf("All queue full tests passed.\n");
+
+    return 0;
+}
+
+
+/*
+ * Reads that do not fit are refused with PLCTAG_ERR_QUEUE_FULL, the rest
+ * complete normally.
+ */
+void test_reject(void)
+{
+    int32_t tags[NUM_TAGS];
+    int started[NUM_TAGS];
+    char attrs[256];
+    int num_full = 0;
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        snprintf(attrs, sizeof(attrs), QUEUE_TAG_ATTRS "&elem_count=1&name=TestBigArray[%d]&allow_packing=0", "127.0.0.1", "reject", i);
+
+        tags[i] = plc_tag_create(attrs, TIMEOUT_MS);
+        CHECK(tags[i] >= 0, "unable to create tag %d, %s", i, plc_tag_decode_error(tags[i]));
+    }
+
+    for(int round=0; round < NUM_ROUNDS; round++) {
+        for(int i=0; i < NUM_TAGS; i++) {
+            int rc = plc_tag_read(tags[i], 0);
+
+            CHECK(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK || rc == PLCTAG_ERR_QUEUE_FULL, "round %d, read of tag %d failed to start, %s", round, i, plc_tag_decode_error(rc));
+
+            started[i] = (rc != PLCTAG_ERR_QUEUE_FULL);
+
+            if(!started[i]) {
+                num_full++;
+            }
+        }
+
+        for(int i=0; i < NUM_TAGS; i++) {
+            if(started[i]) {
+                int rc = wait_for_status(tags[i], TIMEOUT_MS);
+
+                CHECK(rc == PLCTAG_STATUS_OK, "round %d, read of tag %d failed, %s", round, i, plc_tag_decode_error(rc));
+                CHECK(plc_tag_get_int32(tags[i], 0) == SIM_DINT_VALUE(i), "round %d, tag %d read %d", round, i, plc_tag_get_int32(tags[i], 0));
+            }
+        }
+    }
+
+    CHECK(num_full > 0, "no read was refused");
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        plc_tag_destroy(tags[i]);
+    }
+}
+
+
+/*
+ * Identical reads are let in even when the queue is full, they share the
+ * queued read's response.
+ */
+void test_coalesce(void)
+{
+    int32_t tags[NUM_TAGS];
+    char attrs[256];
+
+    snprintf(attrs, sizeof(attrs), QUEUE_TAG_ATTRS "&elem_count=4&name=TestDINTArray", "127.0.0.2", "coalesce");
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        tags[i] = plc_tag_create(attrs, TIMEOUT_MS);
+        CHECK(tags[i] >= 0, "unable to create tag %d, %s", i, plc_tag_decode_error(tags[i]));
+    }
+
+    for(int round=0; round < NUM_ROUNDS; round++) {
+        for(int i=0; i < NUM_TAGS; i++) {
+            int rc = plc_tag_read(tags[i], 0);
+
+            CHECK(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK, "round %d, read of tag %d was not accepted, %s", round, i, plc_tag_decode_error(rc));
+        }
+
+        for(int i=0; i < NUM_TAGS; i++) {
+            int rc = wait_for_status(tags[i], TIMEOUT_MS);
+
+            CHECK(rc == PLCTAG_STATUS_OK, "round %d, read of tag %d failed, %s", round, i, plc_tag_decode_error(rc));
+
+            for(int elem=0; elem < 4; elem++) {
+                CHECK(plc_tag_get_int32(tags[i], elem * 4) == SIM_DINT_VALUE(elem), "round %d, tag %d element %d read %d", round, i, elem, plc_tag_get_int32(tags[i], elem * 4));
+            }
+        }
+    }
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        plc_tag_destroy(tags[i]);
+    }
+}
+
+
+/*
+ * Blocking reads wait for room instead of failing.  Half the threads read
+ * the whole big array, which takes many fragments that must each find
+ * room in the queue.
+ */
+void test_block(void)
+{
+    pthread_t threads[NUM_THREADS];
+
+    for(intptr_t i=0; i < NUM_THREADS; i++) {
+        CHECK(pthread_create(&threads[i], NULL, block_thread, (void *)i) == 0, "unable to start thread %d", (int)i);
+    }
+
+    for(int i=0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+
+void *block_thread(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    int elems = (id % 2 ? SIM_BIG_ARRAY_ELEMS : 1);
+    int32_t tag = 0;
+    char attrs[256];
+
+    if(elems == 1) {
+        snprintf(attrs, sizeof(attrs), QUEUE_TAG_ATTRS "&elem_count=1&name=TestBigArray[%d]", "127.0.0.3", "block", id);
+    } else {
+        snprintf(attrs, sizeof(attrs), QUEUE_TAG_ATTRS "&elem_count=%d&name=TestBigArray", "127.0.0.3", "block", elems);
+    }
+
+    tag = plc_tag_create(attrs, TIMEOUT_MS);
+    CHECK(tag >= 0, "thread %d, unable to create tag, %s", id, plc_tag_decode_error(tag));
+
+    for(int round=0; round < NUM_ROUNDS; round++) {
+        int rc = plc_tag_read(tag, TIMEOUT_MS);
+
+        CHECK(rc == PLCTAG_STATUS_OK, "thread %d, round %d, read failed, %s", id, round, plc_tag_decode_error(rc));
+
+        if(elems == 1) {
+            CHECK(plc_tag_get_int32(tag, 0) == SIM_DINT_VALUE(id), "thread %d, round %d, read %d", id, round, plc_tag_get_int32(tag, 0));
+        } else {
+            for(int i=0; i < elems; i++) {
+                CHECK(plc_tag_get_int32(tag, i * 4) == SIM_DINT_VALUE(i), "thread %d, round %d, element %d read %d", id, round, i, plc_tag_get_int32(tag, i * 4));
+            }
+        }
+    }
+
+    plc_tag_destroy(tag);
+
+    return NULL;
+}
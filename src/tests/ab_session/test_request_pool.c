@@ -0,0 +1,106 @@
+/***************************************************************************
+ *   Copyright (C) 2018 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+/*
+ * Requests are recycled through a per-session pool.  Reads are aborted
+ * and tag handles destroyed while their requests are still in flight, so
+ * the requests go back to the pool and are handed out again before the
+ * old responses arrive.  Each tag reads a different element, so a stale
+ * response delivered to a recycled request shows up as a wrong value.
+ */
+
+#include <stdio.h>
+#include "../../lib/libplctag.h"
+#include "sim_util.h"
+
+#define NUM_TAGS (10)
+#define NUM_ROUNDS (100)
+#define TIMEOUT_MS (5000)
+
+static int32_t create_tag(int index);
+
+int main(int argc, char **argv)
+{
+    int32_t tags[NUM_TAGS];
+
+    CHECK(argc > 1, "usage: %s <path to lgx_sim>", argv[0]);
+    CHECK(sim_start(argv[1], NULL), "unable to start the simulator");
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        tags[i] = create_tag(i);
+    }
+
+    for(int round=0; round < NUM_ROUNDS; round++) {
+        int victim = round % NUM_TAGS;
+
+        for(int i=0; i < NUM_TAGS; i++) {
+            int rc = 0;
+
+            plc_tag_set_int32(tags[i], 0, 0);
+
+            rc = plc_tag_read(tags[i], 0);
+            CHECK(rc == PLCTAG_STATUS_PENDING || rc == PLCTAG_STATUS_OK, "round %d, read of tag %d failed to start, %s", round, i, plc_tag_decode_error(rc));
+        }
+
+        /* drop one read and one handle while their requests are out. */
+        plc_tag_abort(tags[victim]);
+
+        plc_tag_destroy(tags[(victim + 1) % NUM_TAGS]);
+        tags[(victim + 1) % NUM_TAGS] = create_tag((victim + 1) % NUM_TAGS);
+
+        for(int i=0; i < NUM_TAGS; i++) {
+            int rc = PLCTAG_STATUS_OK;
+
+            /* the aborted read and the new handle read again. */
+            if(i == victim || i == (victim + 1) % NUM_TAGS) {
+                plc_tag_set_int32(tags[i], 0, 0);
+                rc = plc_tag_read(tags[i], TIMEOUT_MS);
+            } else {
+                rc = wait_for_status(tags[i], TIMEOUT_MS);
+            }
+
+            CHECK(rc == PLCTAG_STATUS_OK, "round %d, read of tag %d failed, %s", round, i, plc_tag_decode_error(rc));
+            CHECK(plc_tag_get_int32(tags[i], 0) == SIM_DINT_VALUE(i), "round %d, tag %d read %d", round, i, plc_tag_get_int32(tags[i], 0));
+        }
+    }
+
+    for(int i=0; i < NUM_TAGS; i++) {
+        plc_tag_destroy(tags[i]);
+    }
+
+    sim_stop();
+
+    printf("All request pool tests passed.\n");
+
+    return 0;
+}
+
+
+int32_t create_tag(int index)
+{
+    char attrs[256];
+    int32_t tag = 0;
+
+    snprintf(attrs, sizeof(attrs), SIM_TAG_ATTRS "&elem_count=1&name=TestBigArray[%d]&max_packets_in_flight=4", index);
+
+    tag = plc_tag_create(attrs, TIMEOUT_MS);
+    CHECK(tag >= 0, "unable to create tag %d, %s", index, plc_tag_decode_error(tag));
+
+    return tag;
+}
@@ -8,6 +8,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
@@ -21,6 +22,7 @@
 #define BACKLOG     10  /* Passed to listen() */
 
 static int init_socket(int *sock);
+static int parse_args(int argc, char **argv);
 void *client_handler(void *pnewsock);
 
 
@@ -65,13 +67,45 @@ int init_socket(int *sock)
 
 
 
-int main(void)
+/*
+ * Options:
+ *
+ * --max-connection-size=<n> - refuse Forward Open requests for larger
+ *     connections, like a PLC with a smaller buffer.
+ *
+ * --drop-after=<n> - close each connection when its n-th connected request
+ *     comes in, without replying, like a PLC that goes away mid-request.
+ */
+int parse_args(int argc, char **argv)
+{
+    for(int i=1; i < argc; i++) {
+        if(strncmp(argv[i], "--max-connection-size=", strlen("--max-connection-size=")) == 0) {
+            max_connection_size = atoi(argv[i] + strlen("--max-connection-size="));
+        } else if(strncmp(argv[i], "--drop-after=", strlen("--drop-after=")) == 0) {
+            drop_after = atoi(argv[i] + strlen("--drop-after="));
+        } else {
+            fprintf(stderr, "Usage: %s [--max-connection-size=<bytes>] [--drop-after=<requests>]\n", argv[0]);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+
+
+
+int main(int argc, char **argv)
 {
     int sock;
     pthread_t thread;
     session_context *session = NULL;
     uint32_t session_handle = 1;
 
+    if(!parse_args(argc, argv)) {
+        return 1;
+    }
+
     if(!init_socket(&sock)) {
         log("init_socket() failed!\n");
         return 1;
@@ -93,8 +127,15 @@ int main(void)
         if (newsock == -1) {
             log("accept() failed!\n");
         } else {
+            int nodelay = 1;
+
             log("Got a connection from %s on port %d\n", inet_ntoa(client_addr.sin_addr), htons(client_addr.sin_port));
 
+            /* replies go out as soon as they are ready, the client may have several requests in flight. */
+            if(setsockopt(newsock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)) == -1) {
+                log("setsockopt() failed to set TCP_NODELAY!\n");
+            }
+
             /*
              * set up a new session.  We allocate it here to get rid of possible
              * threading race conditions.
@@ -19,6 +19,7 @@
 #define CIP_CMD_WRITE                ((uint8_t)0x4D)
 #define CIP_CMD_READ_FRAG            ((uint8_t)0x52)
 #define CIP_CMD_WRITE_FRAG           ((uint8_t)0x53)
+#define CIP_CMD_MULTI                ((uint8_t)0x0A)
 
 
 
@@ -26,6 +27,11 @@
 
 #define CIP_STATUS_OK               ((uint8_t)0)
 #define CIP_STATUS_FRAG             ((uint8_t)0x06)
+#define CIP_STATUS_PATH_UNKNOWN     ((uint8_t)0x05)
+#define CIP_STATUS_EMBEDDED_ERR     ((uint8_t)0x1E)
+#define CIP_STATUS_CONN_FAILURE     ((uint8_t)0x01)
+
+#define CIP_EXT_STATUS_BAD_CONN_SIZE ((uint16_t)0x0109)
 
 /* CPF Item Types */
 #define CPF_ITEM_NAI ((uint16_t)0x0000) /* NULL Address Item */
@@ -1,4 +1,5 @@
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -10,6 +11,8 @@
 
 
 static void print_buf(uint8_t *buf, size_t data_len);
+static ssize_t read_packet(session_context *session);
+static ssize_t send_reply(session_context *session, size_t size);
 static int process_packet(session_context *session);
 static void register_session(session_context *session);
 
@@ -20,6 +23,7 @@ static void handle_forward_close(session_context *session);
 static void process_connected_data(session_context *session);
 static void handle_cip_read(session_context *session);
 static void handle_cip_write(session_context *session);
+static void handle_cip_multi(session_context *session);
 
 static uint8_t *read_tag_path(uint8_t *buf, char **tag_name, int *item);
 
@@ -27,6 +31,9 @@ static uint8_t *read_tag_path(uint8_t *buf, char **tag_name, int *item);
 //static _Atomic uint32_t session_id;
 //static _Atomic uint32_t connection_id;
 
+int max_connection_size = 0;
+int drop_after = 0;
+
 
 
 void *session_handler(void *session_arg)
@@ -35,10 +42,10 @@ void *session_handler(void *session_arg)
     session_context *session = (session_context *)session_arg;
 
     while(continue_running) {
-        ssize_t rc = read(session->sock, session->buf, BUFFER_LEN);
+        ssize_t rc = read_packet(session);
 
-        if(rc < 0) {
-            log("read() failed!\n");
+        if(rc <= 0) {
+            log("read() failed or the client closed the connection!\n");
             break;
         }
 
@@ -60,6 +67,61 @@ void *session_handler(void *session_arg)
 }
 
 
+/*
+ * Read exactly one EIP packet.  A client that pipelines its requests can
+ * have several of them waiting in the socket.
+ */
+ssize_t read_packet(session_context *session)
+{
+    size_t amount = sizeof(eip_header);
+    size_t got = 0;
+
+    while(got < amount) {
+        ssize_t rc = read(session->sock, session->buf + got, amount - got);
+
+        if(rc < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(rc <= 0) {
+            return rc;
+        }
+
+        got += (size_t)rc;
+
+        /* now we know how big the whole packet is. */
+        if(got == sizeof(eip_header)) {
+            amount += ((eip_header *)session->buf)->length;
+
+            if(amount > BUFFER_LEN) {
+                log("read_packet() packet of %d bytes is too large!\n", (int)amount);
+                return -1;
+            }
+        }
+    }
+
+    return (ssize_t)got;
+}
+
+
+
+/*
+ * Send the reply in the session buffer, unless it is the reply to one
+ * service in a multiple service request.  That one is picked up from the
+ * buffer.
+ */
+ssize_t send_reply(session_context *session, size_t size)
+{
+    if(session->capture_reply) {
+        session->reply_len = size;
+        return (ssize_t)size;
+    }
+
+    return write(session->sock, session->buf, size);
+}
+
+
+
 int process_packet(session_context *session)
 {
     eip_header *header = (eip_header*)session->buf;
@@ -84,6 +146,13 @@ int process_packet(session_context *session)
         break;
 
     case EIP_CONNECTED_SEND:
+        session->connected_count++;
+
+        if(drop_after > 0 && session->connected_count == drop_after) {
+            log("process_packet() dropping the connection at connected request %d.\n", session->connected_count);
+            return 0;
+        }
+
         process_connected_data(session);
         break;
 
@@ -109,7 +178,7 @@ void register_session(session_context *session)
     log("register_session() sending response:\n");
     print_buf(session->buf, sizeof(*reg));
 
-    rc = write(session->sock, session->buf, sizeof(*reg));
+    rc = send_reply(session, sizeof(*reg));
     if(rc != sizeof(*reg)) {
         log("Amount written, %d, does not equal the response size, %d!\n", (int)rc, (int)sizeof(*reg));
     }
@@ -155,8 +224,6 @@ void handle_forward_open_ex(session_context *session)
         return;
     }
 
-    session->max_packet_size = req->orig_to_targ_conn_params_ex & 0xFFFF;
-
     memset(&resp, 0, sizeof(resp));
 
     resp.command = req->command;
@@ -173,6 +240,32 @@ void handle_forward_open_ex(session_context *session)
     resp.cpf_udi_item_length = (uint8_t*)(&resp + 1) - (uint8_t *)(&resp.resp_service_code);
 
     resp.resp_service_code = CIP_CMD_FORWARD_OPEN | CIP_CMD_RESPONSE;
+
+    /* act like a PLC that supports smaller connections, it tells the client what size to ask for. */
+    if(max_connection_size > 0 && (int)(req->orig_to_targ_conn_params_ex & 0xFFFF) > max_connection_size) {
+        uint8_t *ext_status = &resp.status_size + 1;
+
+        log("Requested packet size, %d, is larger than the supported size, %d.\n", (int)(req->orig_to_targ_conn_params_ex & 0xFFFF), max_connection_size);
+
+        resp.general_status = CIP_STATUS_CONN_FAILURE;
+        resp.status_size = 2;
+        ext_status[0] = (uint8_t)(CIP_EXT_STATUS_BAD_CONN_SIZE & 0xFF);
+        ext_status[1] = (uint8_t)(CIP_EXT_STATUS_BAD_CONN_SIZE >> 8);
+        ext_status[2] = (uint8_t)(max_connection_size & 0xFF);
+        ext_status[3] = (uint8_t)(max_connection_size >> 8);
+
+        memcpy(session->buf, &resp, sizeof(resp));
+
+        rc = send_reply(session, sizeof(resp));
+        if(rc != sizeof(resp)) {
+            log("Amount written, %d, does not equal the response size, %d!\n", (int)rc, (int)sizeof(resp));
+        }
+
+        return;
+    }
+
+    session->max_packet_size = req->orig_to_targ_conn_params_ex & 0xFFFF;
+
     resp.general_status = 0;
     resp.status_size = 0;
     /* make the connection ID global, seems that way on LGX??? */
@@ -194,7 +287,7 @@ void handle_forward_open_ex(session_context *session)
     log("handle_forward_open_ex() sending response:\n");
     print_buf(session->buf, sizeof(resp));
 
-    rc = write(session->sock, session->buf, sizeof(resp));
+    rc = send_reply(session, sizeof(resp));
     if(rc != sizeof(resp)) {
         log("Amount written, %d, does not equal the response size, %d!\n", (int)rc, (int)sizeof(resp));
     }
@@ -249,7 +342,7 @@ void handle_forward_close(session_context *session)
     log("handle_forward_close() sending response:\n");
     print_buf(session->buf, sizeof(resp) + (size_t)path_size);
 
-    rc = write(session->sock, session->buf, sizeof(resp) + (size_t)path_size);
+    rc = send_reply(session, sizeof(resp) + (size_t)path_size);
     if(rc != (int)(sizeof(resp) + (size_t)path_size)) {
         log("Amount written, %d, does not equal the response size, %d!\n", (int)rc, (int)(sizeof(resp) + (size_t)path_size));
     }
@@ -274,6 +367,10 @@ void process_connected_data(session_context *session)
         handle_cip_write(session);
         break;
 
+    case CIP_CMD_MULTI:
+        handle_cip_multi(session);
+        break;
+
 
     default:
         log("process_connected_data() unsupported service code %x!\n", header->service_code);
@@ -333,13 +430,14 @@ void handle_cip_read(session_context *session)
 
     tag = find_tag(tag_name);
 
-    free(tag_name);
-
     if(!tag) {
         log("tag %s not found!\n", tag_name);
+        free(tag_name);
         return;
     }
 
+    free(tag_name);
+
     /* read the number of elements to read */
     elem_count = (data[0]) + ((data[1]) << 8);
     data += 2;
@@ -363,7 +461,7 @@ void handle_cip_read(session_context *session)
 
     base_offset = (item_offset * tag->elem_size) + byte_offset;
 
-    log("reading %d elements of tag %s starting at offset %d.\n", elem_count, tag_name, base_offset);
+    log("reading %d elements of tag %s starting at offset %d.\n", elem_count, tag->name, base_offset);
 
     /* copy data into response */
     memcpy(session->buf, &resp, sizeof(resp));
@@ -403,7 +501,7 @@ void handle_cip_read(session_context *session)
     log("handle_cip_read() sending response:\n");
     print_buf(session->buf, (size_t)(data - session->buf));
 
-    rc = (int)write(session->sock, session->buf, (size_t)(data - session->buf));
+    rc = (int)send_reply(session, (size_t)(data - session->buf));
     if(rc != (int)(data - session->buf)) {
         log("Amount written, %d, does not equal the response size, %d!\n", (int)rc, (int)(data - session->buf));
     }
@@ -460,13 +558,14 @@ void handle_cip_write(session_context *session)
 
     tag = find_tag(tag_name);
 
-    free(tag_name);
-
     if(!tag) {
         log("tag %s not found!\n", tag_name);
+        free(tag_name);
         return;
     }
 
+    free(tag_name);
+
     /* check the data type. */
     if(data[0] != tag->data_type[0]) {
         log("tag data type not matching.  Expected %x but got %x!\n", tag->data_type[0], data[0]);
@@ -530,7 +629,7 @@ void handle_cip_write(session_context *session)
     log("handle_cip_write() sending response:\n");
     print_buf(session->buf, sizeof(resp));
 
-    rc = (int)write(session->sock, session->buf, sizeof(resp));
+    rc = (int)send_reply(session, sizeof(resp));
     if(rc != sizeof(resp)) {
         log("Amount written, %d, does not equal the response size, %d!\n", (int)rc, (int)(sizeof(resp)));
     }
@@ -541,6 +640,127 @@ void handle_cip_write(session_context *session)
 
 
 
+/*
+ * Run each service of a multiple service request as if it came on its
+ * own and put the replies together.  Each service gets an equal part of
+ * the connection size for its reply.
+ */
+void handle_cip_multi(session_context *session)
+{
+    connected_message *req = (connected_message *)(session->buf);
+    connected_message_cip_resp *resp = NULL;
+    session_context *sub = NULL;
+    uint8_t reply[BUFFER_LEN];
+    uint8_t *req_end = session->buf + sizeof(eip_header) + req->length;
+    uint8_t *req_count = NULL;
+    uint8_t *resp_count = NULL;
+    uint8_t *data = NULL;
+    int count = 0;
+    ssize_t rc = 0;
+
+    log("handle_cip_multi() got request:\n");
+    print_buf(session->buf, sizeof(eip_header) + req->length);
+
+    /* skip the service code and the path to the Message Router. */
+    req_count = (uint8_t*)(&(req->service_code)) + 1;
+    req_count += 1 + (*req_count * 2);
+
+    count = req_count[0] + (req_count[1] << 8);
+    if(count < 1 || req_count + 2 + (count * 2) > req_end) {
+        log("handle_cip_multi() bad request count %d!\n", count);
+        return;
+    }
+
+    sub = (session_context *)calloc(1, sizeof(*sub));
+    if(!sub) {
+        log("handle_cip_multi() unable to allocate session copy!\n");
+        return;
+    }
+
+    /* the reply has the same connected header. */
+    memcpy(reply, session->buf, sizeof(connected_message_cip_resp));
+    resp = (connected_message_cip_resp *)reply;
+    resp->cpf_cai_item_length = 4;
+    resp->cpf_targ_conn_id = session->connection_id_targ;
+    resp->service_code = CIP_CMD_MULTI | CIP_CMD_OK;
+    resp->reserved1 = 0;
+    resp->cip_status = CIP_STATUS_OK;
+    resp->cip_status_words = 0;
+
+    resp_count = (uint8_t *)(resp + 1);
+    resp_count[0] = (uint8_t)(count & 0xFF);
+    resp_count[1] = (uint8_t)(count >> 8);
+    data = resp_count + 2 + (count * 2);
+
+    for(int i=0; i < count; i++) {
+        int start = req_count[2 + (i * 2)] + (req_count[3 + (i * 2)] << 8);
+        int end = (i + 1 < count ? req_count[4 + (i * 2)] + (req_count[5 + (i * 2)] << 8) : (int)(req_end - req_count));
+        size_t service_len = (size_t)(end - start);
+        size_t header_len = sizeof(connected_message) - 1; /* up to the service code. */
+        int offset = (int)(data - resp_count);
+
+        resp_count[2 + (i * 2)] = (uint8_t)(offset & 0xFF);
+        resp_count[3 + (i * 2)] = (uint8_t)(offset >> 8);
+
+        if(start > end || req_count + end > req_end) {
+            log("handle_cip_multi() bad offset for service %d!\n", i);
+            free(sub);
+            return;
+        }
+
+        /* make it look like the service came on its own. */
+        *sub = *session;
+        memcpy(sub->buf, session->buf, header_len);
+        memcpy(sub->buf + header_len, req_count + start, service_len);
+        sub->buf_len = (uint16_t)(header_len + service_len);
+        ((connected_message *)sub->buf)->length = (uint16_t)(sub->buf_len - sizeof(eip_header));
+        sub->max_packet_size = (uint16_t)((session->max_packet_size - 2 - (count * 2)) / count - 4);
+        sub->capture_reply = 1;
+        sub->reply_len = 0;
+
+        process_connected_data(sub);
+
+        if(sub->reply_len > header_len) {
+            size_t reply_len = sub->reply_len - header_len;
+            uint8_t status = sub->buf[header_len + 2];
+
+            memcpy(data, sub->buf + header_len, reply_len);
+            data += reply_len;
+
+            if(status != CIP_STATUS_OK && status != CIP_STATUS_FRAG) {
+                resp->cip_status = CIP_STATUS_EMBEDDED_ERR;
+            }
+        } else {
+            /* the service failed without a reply. */
+            data[0] = (uint8_t)(req_count[start] | CIP_CMD_OK);
+            data[1] = 0;
+            data[2] = CIP_STATUS_PATH_UNKNOWN;
+            data[3] = 0;
+            data += 4;
+
+            resp->cip_status = CIP_STATUS_EMBEDDED_ERR;
+        }
+    }
+
+    free(sub);
+
+    resp->length = (uint16_t)(data - (uint8_t*)&(resp->interface_handle));
+    resp->cpf_cdi_item_length = (uint16_t)(data - (uint8_t*)(&(resp->cpf_conn_seq_num)));
+
+    memcpy(session->buf, reply, (size_t)(data - reply));
+
+    log("handle_cip_multi() sending response:\n");
+    print_buf(session->buf, (size_t)(data - reply));
+
+    rc = send_reply(session, (size_t)(data - reply));
+    if(rc != (ssize_t)(data - reply)) {
+        log("Amount written, %d, does not equal the response size, %d!\n", (int)rc, (int)(data - reply));
+    }
+}
+
+
+
+
 uint8_t *read_tag_path(uint8_t *buf, char **tag_name, int *item_offset)
 {
     /* read the length in words, convert to bytes. */
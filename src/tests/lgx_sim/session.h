@@ -20,8 +20,20 @@ typedef struct {
 
     uint8_t buf[BUFFER_LEN];
     uint16_t buf_len;
+
+    /* set while a service inside a multiple service request is run, the reply is left in buf. */
+    int capture_reply;
+    size_t reply_len;
+
+    /* connected requests seen on this connection. */
+    int connected_count;
 } session_context;
 
 
+/* largest connection size accepted by Forward Open, zero for no limit. */
+extern int max_connection_size;
+
+/* drop the connection at this connected request without replying, zero to never drop. */
+extern int drop_after;
 
 extern void *session_handler(void *session_arg);
@@ -61,6 +61,7 @@ struct refcount_t {
     int line_num;
     //cleanup_p cleaners;
     rc_cleanup_func cleanup_func;
+    rc_recycle_func recycle_func;
 
     /* FIXME - needed for alignment, this is a hack! */
     union {
@@ -91,6 +92,20 @@ static void refcount_cleanup(refcount_p rc);
  */
 //void *rc_alloc_impl(const char *func, int line_num, int data_size, int extra_arg_count, rc_cleanup_func cleaner_func, ...)
 void *rc_alloc_impl(const char *func, int line_num, int data_size, rc_cleanup_func cleaner_func)
+{
+    return rc_alloc_recyclable_impl(func, line_num, data_size, NULL, cleaner_func);
+}
+
+
+
+/*
+ * rc_alloc_recyclable
+ *
+ * Like rc_alloc, but when the count drops to zero the recycler is called
+ * first.  If it returns non-zero, it has kept the memory for reuse and the
+ * clean up function is not called.
+ */
+void *rc_alloc_recyclable_impl(const char *func, int line_num, int data_size, rc_recycle_func recycler_func, rc_cleanup_func cleaner_func)
 {
     refcount_p rc = NULL;
     //cleanup_p cleanup = NULL;
@@ -110,6 +125,7 @@ void *rc_alloc_impl(const char *func, int line_num, int data_size, rc_cleanup_fu
     rc->lock = LOCK_INIT;
 
     rc->cleanup_func = cleaner_func;
+    rc->recycle_func = recycler_func;
 
     /* store where we were called from for later. */
     rc->function_name = func;
@@ -239,6 +255,47 @@ void *rc_dec_impl(const char *func, int line_num, void *data)
 
 
 
+/*
+ * rc_recycle
+ *
+ * Only valid from within the recycler of the object, and only before the
+ * object can be seen by any other thread.  Instead of freeing the memory,
+ * the object is brought back with a count of one so that the recycler can
+ * keep it for reuse.  The reference returned belongs to whoever keeps the
+ * object.
+ */
+
+void *rc_recycle_impl(const char *func, int line_num, void *data)
+{
+    refcount_p rc = NULL;
+    void *result = NULL;
+
+    pdebug(DEBUG_SPEW,"Starting, called from %s:%d for %p",func, line_num, data);
+
+    if(!data) {
+        pdebug(DEBUG_WARN,"Null reference passed from %s:%d!", func, line_num);
+        return NULL;
+    }
+
+    rc = ((refcount_p)data) - 1;
+
+    spin_block(&rc->lock) {
+        if(rc->count == 0) {
+            rc->count = 1;
+            result = data;
+        }
+    }
+
+    if(!result) {
+        pdebug(DEBUG_WARN,"Only dead references can be recycled!  Called from %s:%d.", func, line_num);
+    }
+
+    return result;
+}
+
+
+
+
 void refcount_cleanup(refcount_p rc)
 {
     pdebug(DEBUG_INFO,"Starting");
@@ -247,6 +304,15 @@ void refcount_cleanup(refcount_p rc)
         return;
     }
 
+    /*
+     * the recycler may keep the memory for reuse.  If it does, another
+     * thread may already own the object, so rc must not be touched again.
+     */
+    if(rc->recycle_func && rc->recycle_func((void *)(rc+1))) {
+        pdebug(DEBUG_DETAIL,"Memory recycled.");
+        return;
+    }
+
     /* call the clean up function */
     rc->cleanup_func((void *)(rc+1));
 
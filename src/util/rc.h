@@ -23,13 +23,20 @@
 #include <platform.h>
 
 typedef void (*rc_cleanup_func)(void *);
+typedef int (*rc_recycle_func)(void *);
 
 #define rc_alloc(size, cleaner) rc_alloc_impl(__func__, __LINE__, size, cleaner)
 extern void *rc_alloc_impl(const char *func, int line_num, int size, rc_cleanup_func cleaner);
 
+#define rc_alloc_recyclable(size, recycler, cleaner) rc_alloc_recyclable_impl(__func__, __LINE__, size, recycler, cleaner)
+extern void *rc_alloc_recyclable_impl(const char *func, int line_num, int size, rc_recycle_func recycler, rc_cleanup_func cleaner);
+
 #define rc_inc(ref) rc_inc_impl(__func__, __LINE__, ref)
 extern void *rc_inc_impl(const char *func, int line_num, void *ref);
 
 #define rc_dec(ref) rc_dec_impl(__func__, __LINE__, ref)
 extern void *rc_dec_impl(const char *func, int line_num, void *ref);
 
+#define rc_recycle(ref) rc_recycle_impl(__func__, __LINE__, ref)
+extern void *rc_recycle_impl(const char *func, int line_num, void *ref);
+
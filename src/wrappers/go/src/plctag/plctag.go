@@ -70,6 +70,8 @@ const (
 	ERR_WINSOCK = C.PLCTAG_ERR_WINSOCK
 	ERR_WRITE = C.PLCTAG_ERR_WRITE
 	ERR_PARTIAL = C.PLCTAG_ERR_PARTIAL
+	ERR_BACKOFF = C.PLCTAG_ERR_BACKOFF
+	ERR_QUEUE_FULL = C.PLCTAG_ERR_QUEUE_FULL
 )
 
 func DecodeError(err int) string {
@@ -84,6 +86,13 @@ func Create(attrib_str string, timeout int) int32 {
 	return int32(result)
 }
 
+func Prewarm(attrib_str string, timeout int) int {
+	cattrib_str := C.CString(attrib_str)
+	result := C.plc_tag_prewarm(cattrib_str, C.int(timeout))
+	C.free(unsafe.Pointer(cattrib_str))
+	return int(result)
+}
+
 func Destroy(tag int32) int {
 	result := C.plc_tag_destroy(C.int32_t(tag))
 	return int(result)
@@ -124,6 +133,11 @@ func Write(tag int32, timeout int) int {
 	return int(result)
 }
 
+func GetQueueDepth(tag int32) int {
+	result := C.plc_tag_get_queue_depth(C.int32_t(tag))
+	return int(result)
+}
+
 func GetUint64(tag int32, offset int) uint64 {
 	result := C.plc_tag_get_uint64(C.int32_t(tag), C.int(offset))
 	return uint64(result)
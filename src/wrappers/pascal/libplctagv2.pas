@@ -57,6 +57,8 @@ const
   const PLCTAG_ERR_WINSOCK          = (-36);
   const PLCTAG_ERR_WRITE            = (-37);
   const PLCTAG_ERR_PARTIAL          = (-38);
+  const PLCTAG_ERR_BACKOFF          = (-39);
+  const PLCTAG_ERR_QUEUE_FULL       = (-40);
 
 
 
@@ -103,6 +105,20 @@ const
   function plc_tag_create(const attrib_str:PChar; timeout:cint):cint32; cdecl; external LibPLCTagLibName;
 
 
+  {*
+   * plc_tag_prewarm
+   *
+   * Open the connection to a PLC before any tags are created for it.  The
+   * attributes are the same as for a tag, less the tag name and data details.
+   * The connection is kept until the library shuts down.
+   *
+   * If timeout is zero, return PLCTAG_STATUS_PENDING right away, otherwise
+   * wait up to timeout milliseconds for the connection.
+   *}
+  //LIB_EXPORT int plc_tag_prewarm(const char *attrib_str, int timeout);
+  function plc_tag_prewarm(const attrib_str:PChar; timeout:cint):cint; cdecl; external LibPLCTagLibName;
+
+
   {*
    * plc_tag_lock
    *
@@ -200,6 +216,17 @@ const
   function plc_tag_write(tag:cint32; timeout:cint):cint; cdecl; external LibPLCTagLibName;
 
 
+  {*
+   * plc_tag_get_queue_depth
+   *
+   * Return the number of requests waiting to be sent on the connections
+   * the tag uses.  This can be used to slow down polling before the
+   * queues fill.
+   */
+  LIB_EXPORT int plc_tag_get_queue_depth(int32_t tag);}
+  function plc_tag_get_queue_depth(tag:cint32):cint; cdecl; external LibPLCTagLibName;
+
+
   {*
    * Tag data accessors.
    *}
@@ -98,6 +98,7 @@ lib = ctypes.cdll.LoadLibrary(library)
 
 plcTagDecodeError = defineStringFunc(lib.plc_tag_decode_error, [ctypes.c_int])
 plcTagCreate  = defineIntFunc(lib.plc_tag_create, [ctypes.c_char_p, ctypes.c_int])
+plcTagPrewarm = defineIntFunc(lib.plc_tag_prewarm, [ctypes.c_char_p, ctypes.c_int])
 plcTagLock    = defineIntFunc(lib.plc_tag_lock, [ctypes.c_int])
 plcTagUnlock  = defineIntFunc(lib.plc_tag_unlock, [ctypes.c_int])
 plcTagAbort   = defineIntFunc(lib.plc_tag_abort, [ctypes.c_int])
@@ -105,6 +106,7 @@ plcTagDestroy = defineIntFunc(lib.plc_tag_destroy, [ctypes.c_int])
 plcTagRead    = defineIntFunc(lib.plc_tag_read, [ctypes.c_int, ctypes.c_int])
 plcTagStatus  = defineIntFunc(lib.plc_tag_status, [ctypes.c_int])
 plcTagWrite   = defineIntFunc(lib.plc_tag_write, [ctypes.c_int, ctypes.c_int])
+plcTagGetQueueDepth = defineIntFunc(lib.plc_tag_get_queue_depth, [ctypes.c_int])
 
 
 # Create the tag data accessor functions below:
@@ -207,6 +209,15 @@ def plc_tag_create(attributeString, timeout):
     # print ("Creating tag with attributes '%s' and timeout %d" % (attributeString, timeout))
     return plcTagCreate(attributeString.encode(), timeout)
 
+# plc_tag_prewarm
+#
+# Open the connection to a PLC before any tags are created for it.  The
+# attributes are the same as for a tag, less the tag name and data details.
+# With a zero timeout, PLCTAG_STATUS_PENDING is returned right away.
+#
+def plc_tag_prewarm(attributeString, timeout):
+    return plcTagPrewarm(attributeString.encode(), timeout)
+
 # plc_tag_lock
 #
 # Lock the tag against use by other threads.  Because operations on a tag are
@@ -289,6 +300,14 @@ def plc_tag_status(tag):
 def plc_tag_write(tag, timeout):
     return plcTagWrite(tag, timeout)
 
+# plc_tag_get_queue_depth
+#
+# Return the number of requests waiting to be sent on the connections the
+# tag uses.  Use it to slow down polling before the queues fill.
+#
+def plc_tag_get_queue_depth(tag):
+    return plcTagGetQueueDepth(tag)
+
 
 # Tag data accessors follow:
 